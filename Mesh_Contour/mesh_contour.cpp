@@ -6,135 +6,261 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cmath>
-#include <unordered_map>
+#include <algorithm>
+#include <vector>
 #include <windows.h>
 
-namespace std{
-	template<> struct hash<ON_2dex> {
-		size_t operator() (const ON_2dex &data) const {
-			hash<long long int> h;
-			return h(static_cast<long long int>(data.j) * 4294967296LL + data.i);
+// mesh の face の辺に、両端の頂点番号の組で決まる通し番号を振った表。隣り合う face は同じ辺の番号を共有する。
+// 辺は (i, j) (i < j) の辞書順に並び、頂点 i から出る辺は vertex_edges[i] ～ vertex_edges[i + 1] - 1 の番号を持つ (CSR)。
+struct Mesh_ContourEdges {
+	void Build(const ON_Mesh &mesh) {
+		int vertex_count = mesh.VertexCount(), face_count = mesh.m_F.Count();
+		// 頂点毎に、番号の大きい側の端点を数えて並べる
+		vertex_edges.assign(vertex_count + 1, 0);
+		for (int fi = 0; fi < face_count; ++fi) {
+			const ON_MeshFace &f = mesh.m_F[fi];
+			for (int i = 0; i < 4; ++i) {
+				int vs = f.vi[i], ve = f.vi[(i + 1) & 3];
+				if (vs != ve) ++vertex_edges[std::min(vs, ve) + 1];
+			}
 		}
-	};
-}
-bool operator == (const ON_2dex &lhs, const ON_2dex &rhs){
-	return lhs.i == rhs.i && lhs.j == rhs.j;
-}
-
-// 指定された mesh の 各頂点に対応する height 値が 0 となる位置にコンターを生成し、 ON_Polyline の配列形式で出力する。
-void Mesh_CalculateContourPolylines(const ON_Mesh &mesh, ON_ClassArray<ON_Polyline> &contours, const double *height_array) {
-
-	ON_ClassArray<ON_3dPoint> intersect_points;
-	std::unordered_multimap<int, int> intersections;
-
-	{
-		std::unordered_map<ON_2dex, int> edge_cache;
-		ON_Interval hint;
-		int edgeline_ptidx[2];
-		// height がゼロと交わる face を走査し、その edge の height 0 となる交点を求め、交線を記録していく。
-		for (int j = 0; j < mesh.m_F.Count(); ++j) {
-			const ON_MeshFace &f = mesh.m_F[j];
-			int iter_cnt = 0;
+		for (int v = 0; v < vertex_count; ++v) vertex_edges[v + 1] += vertex_edges[v];
+		std::vector<int> ends(vertex_edges[vertex_count]), cursor(vertex_edges.begin(), vertex_edges.end() - 1);
+		for (int fi = 0; fi < face_count; ++fi) {
+			const ON_MeshFace &f = mesh.m_F[fi];
 			for (int i = 0; i < 4; ++i) {
 				int vs = f.vi[i], ve = f.vi[(i + 1) & 3];
-				if (vs == ve) continue;
-
-				double hs = height_array[vs], he = height_array[ve];
-				if (hs * he > 0) continue;
-				if (vs > ve) std::swap(vs, ve), std::swap(hs, he);
-
-				ON_2dex edge = { vs, ve };
-				auto iter = edge_cache.find(edge);
-				if (iter == edge_cache.end()) {
-					double t;
-					if (hs == he && hs == 0) t = 0.5;
-					else {
-						hint.m_t[0] = hs, hint.m_t[1] = he;
-						t = hint.NormalizedParameterAt(0);
-					}
-					iter = (edge_cache.insert(std::make_pair(edge, intersect_points.Count()))).first;
-					ON_3dPoint pt_s = mesh.Vertex(edge.i), pt_e = mesh.Vertex(edge.j);
-					ON_3dPoint pt = (1 - t) * pt_s + t * pt_e;
-					intersect_points.Append(pt);
-				}
+				if (vs != ve) ends[cursor[std::min(vs, ve)]++] = std::max(vs, ve);
+			}
+		}
+		// 頂点毎に重複を除いて辺の番号を振る
+		edges.clear();
+		for (int v = 0; v < vertex_count; ++v) {
+			auto b = ends.begin() + vertex_edges[v], e = ends.begin() + vertex_edges[v + 1];
+			std::sort(b, e);
+			vertex_edges[v] = static_cast<int>(edges.size());
+			for (auto it = b; it != e; ++it) {
+				if (it != b && *it == *(it - 1)) continue;
+				ON_2dex edge = { v, *it };
+				edges.push_back(edge);
+			}
+		}
+		vertex_edges[vertex_count] = static_cast<int>(edges.size());
 
-				edgeline_ptidx[iter_cnt++] = iter->second;
-				if (iter_cnt == 2) break; // Todo: 3つ以上ある場合
+		face_edges.resize(static_cast<size_t>(face_count) * 4);
+		for (int fi = 0; fi < face_count; ++fi) {
+			const ON_MeshFace &f = mesh.m_F[fi];
+			for (int i = 0; i < 4; ++i) {
+				int vs = f.vi[i], ve = f.vi[(i + 1) & 3];
+				face_edges[fi * 4 + i] = (vs != ve) ? Find(std::min(vs, ve), std::max(vs, ve)) : -1;
 			}
-			if (iter_cnt != 2) continue;
-			intersections.insert(std::make_pair(edgeline_ptidx[0], edgeline_ptidx[1]));
-			intersections.insert(std::make_pair(edgeline_ptidx[1], edgeline_ptidx[0]));
 		}
 	}
 
-#if 1
-	// edgelines を出来る限り繋いで Polyline として書き出す
-	while (intersections.size()) {
-		auto iter_b = intersections.begin();
-		int edgeline_ptidx[2] = { iter_b->first, iter_b->second };
-		intersections.erase(iter_b);
+	int Count() const {
+		return static_cast<int>(edges.size());
+	}
+	const ON_2dex &Edge(int e) const {
+		return edges[e];
+	}
+	// face fi の vi[i] と vi[(i + 1) & 3] を結ぶ辺の番号。両端が同じ頂点の時は -1。
+	int FaceEdge(int fi, int i) const {
+		return face_edges[fi * 4 + i];
+	}
+
+private:
+	int Find(int vs, int ve) const {
+		auto b = edges.begin() + vertex_edges[vs], e = edges.begin() + vertex_edges[vs + 1];
+		auto it = std::lower_bound(b, e, ve, [](const ON_2dex &edge, int j) { return edge.j < j; });
+		return static_cast<int>(it - edges.begin());
+	}
+
+	std::vector<ON_2dex> edges;
+	std::vector<int> vertex_edges;
+	std::vector<int> face_edges;
+};
+
+// コンターの計算の作業領域。同じ作業領域で繰り返し計算すると、2 回目以降は (出力の Polyline を除き) メモリを確保しない。
+struct Mesh_ContourWorkspace {
+	std::vector<int> slot_points;  // 辺 (と level) の枠毎の交点の番号。計算の合間は全て -1 にしておく
+	std::vector<int> edge_slots;   // 複数の level を求める時の、辺毎の枠の位置 (枠の番号 = edge_slots[辺] + level の番号)
+	std::vector<ON_3dPoint> points; // 交点
+	std::vector<int> point_levels;  // 交点毎の level の番号
+	std::vector<int> point_slots;   // 交点毎の枠の番号 (slot_points を戻すため)
+	std::vector<ON_2dex> segments;  // 交線 (両端の交点の番号)
+	std::vector<int> point_segments_offset, point_segments; // 交点毎の交線 (CSR)
+	std::vector<char> segment_used;
+	ON_SimpleArray<int> faces;      // Mesh_ContourIndex で見つけた face
+
+	void Clear() {
+		for (size_t p = 0; p < point_slots.size(); ++p) slot_points[point_slots[p]] = -1;
+		points.clear(), point_levels.clear(), point_slots.clear(), segments.clear();
+	}
+};
+
+// work.segments を出来る限り繋ぎ、Polyline として contours に追加し、作業領域を空に戻す。
+// contour_levels を指定すると、追加した Polyline 毎に始点の level の番号を contour_levels に追加する。
+static void Mesh_LinkContourSegments(Mesh_ContourWorkspace &work, ON_ClassArray<ON_Polyline> &contours, ON_SimpleArray<int> *contour_levels) {
+	const int point_count = static_cast<int>(work.points.size()), segment_count = static_cast<int>(work.segments.size());
+	const ON_2dex *segments = work.segments.data();
+	const ON_3dPoint *points = work.points.data();
+
+	// 交点毎に、その交点を端点とする交線を並べる
+	std::vector<int> &offset = work.point_segments_offset, &point_segments = work.point_segments;
+	offset.assign(point_count + 1, 0);
+	for (int s = 0; s < segment_count; ++s) ++offset[segments[s].i + 1], ++offset[segments[s].j + 1];
+	for (int p = 0; p < point_count; ++p) offset[p + 1] += offset[p];
+	point_segments.resize(segment_count * 2);
+	for (int s = 0; s < segment_count; ++s) point_segments[offset[segments[s].i]++] = s, point_segments[offset[segments[s].j]++] = s;
+	for (int p = point_count; p > 0; --p) offset[p] = offset[p - 1];
+	offset[0] = 0;
+	work.segment_used.assign(segment_count, 0);
+	char *used = work.segment_used.data();
+
+	// 交線を出来る限り繋いで Polyline として書き出す
+	for (int s0 = 0; s0 < segment_count; ++s0) {
+		if (used[s0]) continue;
+		used[s0] = 1;
+		int ptidx_pol0 = segments[s0].i;
+		int edgeline_ptidx[2] = { segments[s0].i, segments[s0].j };
 
 		ON_Polyline &pol = contours.AppendNew();
-		int ptidx_pol0 = edgeline_ptidx[0];
-		pol.Append(intersect_points[edgeline_ptidx[0]]);
-		pol.Append(intersect_points[edgeline_ptidx[1]]);
+		if (contour_levels) contour_levels->Append(work.point_levels[ptidx_pol0]);
+		pol.Append(points[edgeline_ptidx[0]]);
+		pol.Append(points[edgeline_ptidx[1]]);
 
 		// j = 0: 折れ線の終点側を延ばすループ、 j = 1: 折れ線の始点側を延ばすループ (折れ線の向きを反転させて同じ処理をする)
 		for (int j = 0; j < 2; ++j) {
 			for (;;) {
-				int ptidx_next = -1; // 次のセグメントの終点
-				auto iter_range = intersections.equal_range(edgeline_ptidx[1]);
-				std::vector<decltype(iter_b)> iters_to_remove; // 同じセグメントの向き違い(削除対象)
-				// 同じセグメントの向き違いと次のセグメントを探す
-				for (auto iter = iter_range.first; iter != iter_range.second; ++iter) {
-					if (iter->second == edgeline_ptidx[0]) {
-						iters_to_remove.push_back(iter);
-					}
-					else if (ptidx_next < 0) {
-						ptidx_next = iter->second;
-					}
-					else continue;
+				int ptidx_next = -1, seg_next = -1; // 次のセグメントの終点
+				// 同じセグメントの重複と次のセグメントを探す
+				int p = edgeline_ptidx[1];
+				for (int k = offset[p]; k < offset[p + 1]; ++k) {
+					int s = point_segments[k];
+					if (used[s]) continue;
+					int other = (segments[s].i == p) ? segments[s].j : segments[s].i;
+					// 同じセグメントの重複は使用済みにする。
+					if (other == edgeline_ptidx[0]) used[s] = 1;
+					else if (ptidx_next < 0) ptidx_next = other, seg_next = s;
 				}
-				// 同じセグメントの向き違いは削除する。
-				for (size_t i = 0; i < iters_to_remove.size(); ++i) intersections.erase(iters_to_remove[i]);
 
 				// 次のセグメントがあった場合は、セグメント情報を更新して折れ線を延ばす。
-				if (ptidx_next >= 0) {
-					pol.Append(intersect_points[ptidx_next]);
-					edgeline_ptidx[0] = edgeline_ptidx[1];
-					edgeline_ptidx[1] = ptidx_next;
-					auto iter_range = intersections.equal_range(edgeline_ptidx[0]);
-					for (auto iter = iter_range.first; iter != iter_range.second; ++iter) {
-						if (iter->second != edgeline_ptidx[1]) continue;
-						intersections.erase(iter);
-						break;
-					}
-				}
-				else break;
+				if (ptidx_next < 0) break;
+				used[seg_next] = 1;
+				pol.Append(points[ptidx_next]);
+				edgeline_ptidx[0] = edgeline_ptidx[1];
+				edgeline_ptidx[1] = ptidx_next;
 			}
 
-			if (j == 0 && pol.Count() > 0) {
-				iter_b = intersections.find(ptidx_pol0);
-				if (iter_b != intersections.end()) {
-					edgeline_ptidx[0] = ptidx_pol0;
-					edgeline_ptidx[1] = iter_b->second;
-					intersections.erase(iter_b);
-					pol.Reverse();
-					pol.Append(intersect_points[edgeline_ptidx[1]]);
+			if (j == 0) {
+				int seg_next = -1;
+				for (int k = offset[ptidx_pol0]; k < offset[ptidx_pol0 + 1] && seg_next < 0; ++k) {
+					if (!used[point_segments[k]]) seg_next = point_segments[k];
 				}
+				if (seg_next < 0) break;
+				used[seg_next] = 1;
+				edgeline_ptidx[0] = ptidx_pol0;
+				edgeline_ptidx[1] = (segments[seg_next].i == ptidx_pol0) ? segments[seg_next].j : segments[seg_next].i;
+				pol.Reverse();
+				pol.Append(points[edgeline_ptidx[1]]);
 			}
 		}
 	}
 
-#else
-	// edgelines 一切繋がずに Polyline として書き出す
-	for (auto iter = edgelines.begin(); iter != edgelines.end(); ++iter) {
-		ON_Polyline &pol = contours.AppendNew();
-		pol.Append(intersect_points[iter->first]);
-		pol.Append(intersect_points[iter->second]);
+	work.Clear();
+}
+
+// face fi の各辺で height が level となる交点を求め、face 内の交線を work.segments に追加する。
+// 交点は辺 (と level) の枠に番号を記録して、隣り合う face で共有する。
+// edge_slots が nullptr の時は辺の番号を枠の番号とし、それ以外は edge_slots[辺] + level_idx を枠の番号とする。
+static void Mesh_IntersectContourFace(const ON_Mesh &mesh, const Mesh_ContourEdges &edges, int fi, const double *height_array, double level, int level_idx, const int *edge_slots, Mesh_ContourWorkspace &work) {
+	const ON_MeshFace &f = mesh.m_F[fi];
+	ON_Interval hint;
+	int edgeline_ptidx[2];
+	int iter_cnt = 0;
+	for (int i = 0; i < 4; ++i) {
+		int e = edges.FaceEdge(fi, i);
+		if (e < 0) continue;
+		const ON_2dex &edge = edges.Edge(e);
+
+		double hs = height_array[edge.i] - level, he = height_array[edge.j] - level;
+		if ((hs > 0 && he > 0) || (hs < 0 && he < 0)) continue;
+
+		int slot = edge_slots ? edge_slots[e] + level_idx : e;
+		int ptidx = work.slot_points[slot];
+		if (ptidx < 0) {
+			double t;
+			if (hs == he && hs == 0) t = 0.5;
+			else {
+				hint.m_t[0] = hs, hint.m_t[1] = he;
+				t = hint.NormalizedParameterAt(0);
+			}
+			ptidx = work.slot_points[slot] = static_cast<int>(work.points.size());
+			ON_3dPoint pt_s = mesh.Vertex(edge.i), pt_e = mesh.Vertex(edge.j);
+			work.points.push_back((1 - t) * pt_s + t * pt_e);
+			work.point_levels.push_back(level_idx);
+			work.point_slots.push_back(slot);
+		}
+
+		edgeline_ptidx[iter_cnt++] = ptidx;
+		if (iter_cnt == 2) break; // Todo: 3つ以上ある場合
+	}
+	if (iter_cnt != 2) return;
+	ON_2dex segment = { edgeline_ptidx[0], edgeline_ptidx[1] };
+	work.segments.push_back(segment);
+}
+
+// 指定された mesh の 各頂点に対応する height 値が levels の各値となる位置にコンターを生成し、 ON_Polyline の配列形式で contours に追加する。
+// levels は昇順に並べておくこと。contour_levels を指定すると、追加した Polyline 毎に levels の番号を追加する。
+// face 毎に頂点の height の最小値・最大値から、その face を横切る level の範囲を二分探索で求めるため、
+// face の走査は level の数によらず 1 回で済む (face 数 + 交差数に比例)。
+// 交点は辺毎に、その辺を横切る level の数だけ枠を用意した配列で共有する。edges は mesh から作った表を渡す。
+void Mesh_CalculateContourPolylines(const ON_Mesh &mesh, const Mesh_ContourEdges &edges, Mesh_ContourWorkspace &work, ON_ClassArray<ON_Polyline> &contours, const double *height_array, const double *levels, int level_count, ON_SimpleArray<int> *contour_levels = nullptr) {
+	// 辺毎に、その辺と交わる level の範囲の枠を割り当てる
+	work.edge_slots.resize(edges.Count());
+	int slot_count = 0;
+	for (int e = 0; e < edges.Count(); ++e) {
+		double hs = height_array[edges.Edge(e).i], he = height_array[edges.Edge(e).j];
+		if (hs > he) std::swap(hs, he);
+		int k0 = static_cast<int>(std::lower_bound(levels, levels + level_count, hs) - levels);
+		int k1 = static_cast<int>(std::upper_bound(levels + k0, levels + level_count, he) - levels);
+		work.edge_slots[e] = slot_count - k0;
+		slot_count += k1 - k0;
+	}
+	if (static_cast<int>(work.slot_points.size()) < slot_count) work.slot_points.resize(slot_count, -1);
+
+	// height が level と交わる face を走査し、その edge の height が level となる交点を求め、交線を記録していく。
+	for (int j = 0; j < mesh.m_F.Count(); ++j) {
+		const ON_MeshFace &f = mesh.m_F[j];
+		double hmin = height_array[f.vi[0]], hmax = hmin;
+		for (int i = 1; i < 4; ++i) {
+			double h = height_array[f.vi[i]];
+			if (hmin > h) hmin = h;
+			if (hmax < h) hmax = h;
+		}
+		// hmin <= level <= hmax となる level だけが、この face と交わる
+		int k0 = static_cast<int>(std::lower_bound(levels, levels + level_count, hmin) - levels);
+		int k1 = static_cast<int>(std::upper_bound(levels + k0, levels + level_count, hmax) - levels);
+		for (int k = k0; k < k1; ++k) {
+			Mesh_IntersectContourFace(mesh, edges, j, height_array, levels[k], k, work.edge_slots.data(), work);
+		}
 	}
 
-#endif
+	Mesh_LinkContourSegments(work, contours, contour_levels);
+}
+
+// 辺の表と作業領域をその場で作る版。
+void Mesh_CalculateContourPolylines(const ON_Mesh &mesh, ON_ClassArray<ON_Polyline> &contours, const double *height_array, const double *levels, int level_count, ON_SimpleArray<int> *contour_levels = nullptr) {
+	Mesh_ContourEdges edges;
+	edges.Build(mesh);
+	Mesh_ContourWorkspace work;
+	Mesh_CalculateContourPolylines(mesh, edges, work, contours, height_array, levels, level_count, contour_levels);
+}
+
+// 指定された mesh の 各頂点に対応する height 値が 0 となる位置にコンターを生成し、 ON_Polyline の配列形式で出力する。
+void Mesh_CalculateContourPolylines(const ON_Mesh &mesh, ON_ClassArray<ON_Polyline> &contours, const double *height_array) {
+	const double level = 0;
+	Mesh_CalculateContourPolylines(mesh, contours, height_array, &level, 1);
 }
 
 // 指定された mesh の func_height の出力値(高さ)が 0 となる位置にコンターを生成し、 ON_Polyline の配列形式で出力する。
@@ -145,6 +271,141 @@ template <typename F> void Mesh_CalculateContourPolylines(const ON_Mesh &mesh, O
 	Mesh_CalculateContourPolylines(mesh, contours, height.Array());
 }
 
+// 指定された mesh の func_height の出力値(高さ)が levels (昇順) の各値となる位置にコンターを生成し、 ON_Polyline の配列形式で出力する。
+// 高さは頂点毎に 1 回だけ求める。
+template <typename F> void Mesh_CalculateContourPolylines(const ON_Mesh &mesh, ON_ClassArray<ON_Polyline> &contours, F &func_height, const double *levels, int level_count, ON_SimpleArray<int> *contour_levels = nullptr) {
+	ON_SimpleArray<double> height(mesh.VertexCount());
+	for (int i = 0; i < mesh.VertexCount(); ++i) height.Append(func_height(i));
+	Mesh_CalculateContourPolylines(mesh, contours, height.Array(), levels, level_count, contour_levels);
+}
+
+// 同じ mesh・同じ高さの関数で、任意の level のコンターを繰り返し求めるための索引。
+// face 毎の高さの区間 [hmin, hmax] を区間木 (中心で分割し、中心を含む区間を hmin 昇順・hmax 降順の 2 通りに並べて持つ) に入れておき、
+// level を含む区間の face だけを O(log n + 該当数) で取り出して交線を求める。構築は face 数を n として O(n log n)。
+// 区間は閉区間として扱うため、全 face を走査した場合と同じ face が対象になる。
+struct Mesh_ContourIndex {
+	Mesh_ContourIndex() : mesh(nullptr), root(-1) {}
+
+	void Build(const ON_Mesh &mesh_, const double *height_array) {
+		mesh = &mesh_;
+		edges.Build(mesh_);
+		height.Empty();
+		height.Append(mesh->VertexCount(), height_array);
+		int face_count = mesh->m_F.Count();
+		face_min.resize(face_count), face_max.resize(face_count);
+		std::vector<int> faces(face_count);
+		for (int j = 0; j < face_count; ++j) {
+			const ON_MeshFace &f = mesh->m_F[j];
+			double hmin = height_array[f.vi[0]], hmax = hmin;
+			for (int i = 1; i < 4; ++i) {
+				double h = height_array[f.vi[i]];
+				if (hmin > h) hmin = h;
+				if (hmax < h) hmax = h;
+			}
+			face_min[j] = hmin, face_max[j] = hmax;
+			faces[j] = j;
+		}
+		nodes.clear(), by_min.clear(), by_max.clear();
+		std::vector<double> mids;
+		root = BuildNode(faces, mids);
+	}
+
+	// func_height: 入力:頂点インデックス、出力:高さ となる関数。高さは頂点毎に 1 回だけ求める。
+	template <typename F> void Build(const ON_Mesh &mesh_, F &func_height) {
+		ON_SimpleArray<double> h(mesh_.VertexCount());
+		for (int i = 0; i < mesh_.VertexCount(); ++i) h.Append(func_height(i));
+		Build(mesh_, h.Array());
+	}
+
+	// hmin <= level <= hmax となる face の番号を faces に追加する (順不同)。
+	void FindFaces(double level, ON_SimpleArray<int> &faces) const {
+		for (int n = root; n >= 0;) {
+			const Node &nd = nodes[n];
+			if (level < nd.center) {
+				for (int i = nd.begin; i < nd.end && face_min[by_min[i]] <= level; ++i) faces.Append(by_min[i]);
+				n = nd.left;
+			} else if (level > nd.center) {
+				for (int i = nd.begin; i < nd.end && face_max[by_max[i]] >= level; ++i) faces.Append(by_max[i]);
+				n = nd.right;
+			} else {
+				faces.Append(nd.end - nd.begin, by_min.data() + nd.begin);
+				break;
+			}
+		}
+	}
+
+	// 高さが level となる位置にコンターを生成し、 ON_Polyline の配列形式で contours に追加する。
+	// 対象の face は番号順に処理するため、全 face を走査した場合と同じ結果になる。
+	// 作業領域を使い回すため、2 回目以降は (出力の Polyline を除き) メモリを確保しない。
+	void CalculateContourPolylines(double level, ON_ClassArray<ON_Polyline> &contours) {
+		CalculateContourPolylines(level, contours, work);
+	}
+	// 作業領域を指定する版。スレッド毎に作業領域を分ければ、同じ索引を並列に使える。
+	void CalculateContourPolylines(double level, ON_ClassArray<ON_Polyline> &contours, Mesh_ContourWorkspace &work_) const {
+		if (!mesh) return;
+		if (static_cast<int>(work_.slot_points.size()) < edges.Count()) work_.slot_points.resize(edges.Count(), -1);
+		ON_SimpleArray<int> &faces = work_.faces;
+		faces.SetCount(0);
+		FindFaces(level, faces);
+		std::sort(faces.Array(), faces.Array() + faces.Count());
+
+		for (int j = 0; j < faces.Count(); ++j) {
+			Mesh_IntersectContourFace(*mesh, edges, faces[j], height.Array(), level, 0, nullptr, work_);
+		}
+		Mesh_LinkContourSegments(work_, contours, nullptr);
+	}
+
+	int FaceCount() const {
+		return static_cast<int>(face_min.size());
+	}
+
+private:
+	struct Node {
+		double center;
+		int begin, end;  // by_min, by_max の中で、center を含む区間の face の範囲
+		int left, right; // 区間が全て center より小さい側・大きい側の子 (無い時は -1)
+	};
+
+	int BuildNode(std::vector<int> &faces, std::vector<double> &mids) {
+		if (faces.empty()) return -1;
+		// 区間の中点の中央値で分け、子の face 数を半分以下にする
+		mids.resize(faces.size());
+		for (size_t i = 0; i < faces.size(); ++i) mids[i] = (face_min[faces[i]] + face_max[faces[i]]) * 0.5;
+		std::nth_element(mids.begin(), mids.begin() + mids.size() / 2, mids.end());
+		double center = mids[mids.size() / 2];
+
+		std::vector<int> faces_l, faces_r;
+		int begin = static_cast<int>(by_min.size());
+		for (size_t i = 0; i < faces.size(); ++i) {
+			int fi = faces[i];
+			if (face_max[fi] < center) faces_l.push_back(fi);
+			else if (face_min[fi] > center) faces_r.push_back(fi);
+			else by_min.push_back(fi), by_max.push_back(fi);
+		}
+		int end = static_cast<int>(by_min.size());
+		std::sort(by_min.begin() + begin, by_min.end(), [this](int a, int b) { return face_min[a] < face_min[b]; });
+		std::sort(by_max.begin() + begin, by_max.end(), [this](int a, int b) { return face_max[a] > face_max[b]; });
+		std::vector<int>().swap(faces);
+
+		int n = static_cast<int>(nodes.size());
+		Node nd = { center, begin, end, -1, -1 };
+		nodes.push_back(nd);
+		int left = BuildNode(faces_l, mids);
+		int right = BuildNode(faces_r, mids);
+		nodes[n].left = left, nodes[n].right = right;
+		return n;
+	}
+
+	const ON_Mesh *mesh;
+	ON_SimpleArray<double> height;      // 頂点毎の高さ
+	Mesh_ContourEdges edges;
+	std::vector<double> face_min, face_max; // face 毎の高さの区間
+	std::vector<Node> nodes;
+	std::vector<int> by_min, by_max;    // node 毎に、hmin 昇順・hmax 降順に並べた face の番号
+	int root;
+	Mesh_ContourWorkspace work;
+};
+
 int main(int argc, char *argv[]){
 	if (argc < 2) return 0;
 	ON_Mesh mesh;
@@ -163,16 +424,65 @@ int main(int argc, char *argv[]){
 	::QueryPerformanceFrequency(&freq);
 	::QueryPerformanceCounter(&count1);
 
+	ON_SimpleArray<double> levels;
 	for (double t = 0; t <= 1; t += 0.125){
-		double y_sect = y_int.ParameterAt(t);
-		Mesh_CalculateContourPolylines(mesh, contours, [&](int vi){
-			return mesh.Vertex(vi).y - y_sect;
-		});
+		levels.Append(y_int.ParameterAt(t));
 	}
+	auto func_height = [&](int vi){
+		return mesh.Vertex(vi).y;
+	};
+	Mesh_CalculateContourPolylines(mesh, contours, func_height, levels.Array(), levels.Count());
 
 	::QueryPerformanceCounter(&count2);
 	std::printf("%f msec\n", static_cast<double>(count2.QuadPart - count1.QuadPart) * 1000.0 / static_cast<double>(freq.QuadPart));
 
+	// 索引を使った 1 level 毎の問い合わせと、全 face の走査の比較。face 数を変えて 1 level 当たりの時間を表示する。
+	{
+		auto elapsed_msec = [&](const LARGE_INTEGER &c1, const LARGE_INTEGER &c2) {
+			return static_cast<double>(c2.QuadPart - c1.QuadPart) * 1000.0 / static_cast<double>(freq.QuadPart);
+		};
+		const int query_count = 256;
+		ON_SimpleArray<double> query_levels(query_count);
+		for (int i = 0; i < query_count; ++i) query_levels.Append(y_int.ParameterAt((i + 0.5) / query_count));
+
+		std::printf("%10s %12s %16s %16s %12s\n", "faces", "build(ms)", "scan(us/level)", "index(us/level)", "faces/level");
+		for (int div = 8; div >= 1; div /= 2) {
+			ON_Mesh mesh_part(mesh);
+			mesh_part.m_F.SetCount(mesh.m_F.Count() / div);
+
+			::QueryPerformanceCounter(&count1);
+			Mesh_ContourIndex index;
+			index.Build(mesh_part, func_height);
+			::QueryPerformanceCounter(&count2);
+			double build_msec = elapsed_msec(count1, count2);
+
+			ON_SimpleArray<double> height(mesh_part.VertexCount());
+			for (int i = 0; i < mesh_part.VertexCount(); ++i) height.Append(func_height(i));
+			Mesh_ContourEdges edges;
+			edges.Build(mesh_part);
+			Mesh_ContourWorkspace work;
+			ON_ClassArray<ON_Polyline> contours_scan, contours_index;
+			::QueryPerformanceCounter(&count1);
+			for (int i = 0; i < query_count; ++i) Mesh_CalculateContourPolylines(mesh_part, edges, work, contours_scan, height.Array(), &query_levels[i], 1);
+			::QueryPerformanceCounter(&count2);
+			double scan_msec = elapsed_msec(count1, count2);
+
+			::QueryPerformanceCounter(&count1);
+			for (int i = 0; i < query_count; ++i) index.CalculateContourPolylines(query_levels[i], contours_index);
+			::QueryPerformanceCounter(&count2);
+			double index_msec = elapsed_msec(count1, count2);
+
+			size_t hit_faces = 0;
+			ON_SimpleArray<int> faces;
+			for (int i = 0; i < query_count; ++i) {
+				faces.SetCount(0);
+				index.FindFaces(query_levels[i], faces);
+				hit_faces += faces.Count();
+			}
+			std::printf("%10d %12.3f %16.2f %16.2f %12.1f\n", index.FaceCount(), build_msec, scan_msec * 1000.0 / query_count, index_msec * 1000.0 / query_count, static_cast<double>(hit_faces) / query_count);
+		}
+	}
+
 	ONX_Model_Object &obj_mesh = model.m_object_table.AppendNew();
 	obj_mesh.m_bDeleteObject = false;
 	obj_mesh.m_object = &mesh;
@@ -1,15 +1,15 @@
-/*
- * Polygon_RayTrace
- * Copylight (C) 2013 mocchi
- * mocchi_2003@yahoo.co.jp
- * License: Boost ver.1
- */
-
-#ifndef MONTE_CARLO_H_
-#define MONTE_CARLO_H_
-
-#include <stdint.h>
-double CalcHaltonSequence(int64_t index, int base);
-
-
-#endif // MONTE_CARLO_H_
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2013 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#ifndef MONTE_CARLO_H_
+#define MONTE_CARLO_H_
+
+#include <stdint.h>
+double CalcHaltonSequence(int64_t index, int base);
+
+
+#endif // MONTE_CARLO_H_
@@ -1,1277 +1,3438 @@
-/*
- * Polygon_RayTrace
- * Copylight (C) 2023 mocchi
- * mocchi_2003@yahoo.co.jp
- * License: Boost ver.1
- */
-
-#define USE_EMBREE
-
-#include <cstdio>
-#include <cmath>
-#include <algorithm>
-#include <chrono>
-
-#include "opennurbs.h"
-#include "thpool.h"
-#include "mist/thread.h"
-#include "nlohmann/json.hpp"
-#include "rply.h"
-#include "gd.h"
-
-#define TINYEXR_IMPLEMENTATION
-#define TINYEXR_USE_MINIZ 0
-#ifdef min
-#undef min
-#undef max
-#endif
-#include "tinyexr.h"
-
-#include "PhisicalProperties.h"
-#include "randomizer.h"
-#include "calc_duration.h"
-
-#include <windows.h>
-
-#define RAY_IOTA_PROGRESS 0.005
-#define TRACE_TERMINAL_LENGTH 10.0
-#define MAX_INTERSECTION_COUNT 5000
-
-#ifdef USE_EMBREE
-#include "embree3/rtcore.h"
-#endif
-
-//#define USE_COROUTINE
-
-#ifdef USE_COROUTINE
-#include "cppcoro/generator.hpp"
-#define SIMD_COUNT 8
-#endif
-
-float get_ieee754(ON__UINT8 p[4]){
-	return *reinterpret_cast<float *>(p);
-}
-
-// Ql: http://ja.wikipedia.org/wiki/Standard_Triangulated_Language
-bool ConvertFromBinarySTL(ON_SimpleArray<ON__UINT8> &stl, double scale, const ON_3dPoint &position, ON_Mesh &mesh){
-	mesh.Destroy();
-	if (stl.Count() < 84) return false;
-	ON__UINT32 num_facets =
-		static_cast<ON__UINT32>(stl[80]) + static_cast<ON__UINT32>(stl[81]) * 256 +
-		static_cast<ON__UINT32>(stl[82]) * 65536 + static_cast<ON__UINT32>(stl[83]) * 16777216;
-
-	if (stl.Count() < 84 + static_cast<int>(num_facets) * 50 - 2) return false;
-
-	mesh.DestroyDoublePrecisionVertices();
-	mesh.SetSinglePrecisionVerticesAsValid();
-	ON__UINT8 *p = stl.First() + 84;
-	for (ON__UINT32 i = 0; i < num_facets; ++i, p += 50){
-		int vcnt = mesh.m_V.Count();
-		mesh.m_FN.AppendNew().Set(get_ieee754(p   ), get_ieee754(p+ 4), get_ieee754(p+ 8));
-		mesh.m_FN.Last()->Unitize();
-		mesh.m_V.AppendNew().Set(get_ieee754(p+12), get_ieee754(p+16), get_ieee754(p+20));
-		mesh.m_V.AppendNew().Set(get_ieee754(p+24), get_ieee754(p+28), get_ieee754(p+32));
-		mesh.m_V.AppendNew().Set(get_ieee754(p+36), get_ieee754(p+40), get_ieee754(p+44));
-		mesh.SetTriangle(mesh.m_F.Count(), vcnt, vcnt+1, vcnt+2);
-	}
-	mesh.CombineIdenticalVertices();
-	for (int i = 0; i < mesh.m_V.Count(); ++i) {
-		mesh.m_V[i] *= scale;
-		mesh.m_V[i] += ON_3fPoint(position);
-	}
-	mesh.Compact();
-	return true;
-}
-
-bool ConvertFromPLY(const char *filename, double scale, const ON_3dPoint &position, ON_Mesh &mesh) {
-	bool rc = false;
-	auto ply = ply_open(filename, [](p_ply ply, const char *msg) { }, 0, nullptr);
-	if (!ply) return false;
-	if (!ply_read_header(ply)) goto END;
-	mesh.Destroy();
-	mesh.DestroyDoublePrecisionVertices();
-	mesh.SetSinglePrecisionVerticesAsValid();
-
-	{
-		auto add_vertex = [](p_ply_argument arg) {
-			void *pdata;
-			long xyz;
-			ply_get_argument_user_data(arg, &pdata, &xyz);
-			ON_Mesh *mesh = static_cast<ON_Mesh *>(pdata);
-			long index;
-			p_ply_element elm;
-			ply_get_argument_element(arg, &elm, &index);
-			mesh->m_V[index][xyz] = ply_get_argument_value(arg);
-			return 1;
-		};
-		long nvertices = ply_set_read_cb(ply, "vertex", "x", add_vertex, &mesh, 0);
-		ply_set_read_cb(ply, "vertex", "y", add_vertex, &mesh, 1);
-		ply_set_read_cb(ply, "vertex", "z", add_vertex, &mesh, 2);
-		mesh.m_V.SetCapacity(nvertices);
-		mesh.m_V.SetCount(nvertices);
-
-		auto add_face = [](p_ply_argument arg) {
-			void *pdata;
-			ply_get_argument_user_data(arg, &pdata, nullptr);
-			ON_Mesh *mesh = static_cast<ON_Mesh *>(pdata);
-			long index;
-			p_ply_element elm;
-			ply_get_argument_element(arg, &elm, &index);
-			long length, vi;
-			ply_get_argument_property(arg, nullptr, &length, &vi);
-			if (vi < 0) return 1;
-			mesh->m_F[index].vi[vi] = static_cast<int>(ply_get_argument_value(arg));
-			if (vi == 2) {
-				mesh->m_F[index].vi[3] = mesh->m_F[index].vi[2];
-			}
-			return 1;
-		};
-		long ntriangles = ply_set_read_cb(ply, "face", "vertex_indices", add_face, &mesh, 0);
-		mesh.m_F.SetCapacity(ntriangles);
-		mesh.m_F.SetCount(ntriangles);
-		if (!ply_read(ply)) goto END;
-	}
-	mesh.CombineIdenticalVertices();
-	mesh.ComputeVertexNormals();
-	for (int i = 0; i < mesh.m_V.Count(); ++i) {
-		mesh.m_V[i] *= scale;
-		mesh.m_V[i] += ON_3fPoint(position);
-	}
-	mesh.Compact();
-
-	rc = true;
-END:
-	ply_close(ply);
-	return true;
-}
-
-bool ReadFile(const char *filename, ON_SimpleArray<ON__UINT8> &data){
-	FILE *fp = std::fopen(filename, "rb");
-	if (!fp) return false;
-	std::fseek(fp, 0, SEEK_END);
-	data.SetCapacity(static_cast<int>(std::ftell(fp)));
-	data.SetCount(data.Capacity());
-	std::rewind(fp);
-	std::fread(data, 1, data.Count(), fp);
-	std::fclose(fp);
-	return true;
-}
-
-struct MeshRayIntersection{
-	std::unique_ptr<RTCIntersectContext> context;
-	RTCScene *scene;
-	ON_Mesh *mesh;
-
-	void Initialize(ON_Mesh *mesh_, RTCScene *scene_){
-		scene = scene_;
-		mesh = mesh_;
-		context.reset(new RTCIntersectContext());
-		rtcInitIntersectContext(context.get());
-	}
-
-	// vZ
-	struct Result {
-		ON_3dPoint pt;
-		int mesh_idx;
-		int face_idx;
-		double u, v;
-	};
-	bool RayIntersection(const ON_3dRay &ray, Result &result){
-
-		RTCRayHit rayhit;
-		rayhit.ray.org_x = ray.m_P.x;
-		rayhit.ray.org_y = ray.m_P.y;
-		rayhit.ray.org_z = ray.m_P.z;
-		rayhit.ray.dir_x = ray.m_V.x;
-		rayhit.ray.dir_y = ray.m_V.y;
-		rayhit.ray.dir_z = ray.m_V.z;
-		rayhit.ray.tnear = 0;
-		rayhit.ray.tfar = std::numeric_limits<float>::infinity();
-		rayhit.ray.mask = -1;
-		rayhit.ray.flags = 0;
-		rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
-		rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
-
-		rtcIntersect1(*scene, context.get(), &rayhit);
-
-		if (rayhit.hit.geomID != RTC_INVALID_GEOMETRY_ID){
-			result.mesh_idx = rayhit.hit.geomID;
-			result.face_idx = rayhit.hit.primID;
-			result.pt = ray.m_P + ray.m_V * rayhit.ray.tfar;
-			result.u = rayhit.hit.u;
-			result.v = rayhit.hit.v;
-			return true;
-		}else return false;
-	}
-
-	void RayIntersection8(const ON_3dRay rays[8], Result results[8]) {
-
-		RTCRayHit8 rayhit;
-		int valid[8];
-		for (int i = 0; i < 8; ++i) {
-			const ON_3dRay &ray = rays[i];
-			rayhit.ray.org_x[i] = ray.m_P.x;
-			rayhit.ray.org_y[i] = ray.m_P.y;
-			rayhit.ray.org_z[i] = ray.m_P.z;
-			rayhit.ray.dir_x[i] = ray.m_V.x;
-			rayhit.ray.dir_y[i] = ray.m_V.y;
-			rayhit.ray.dir_z[i] = ray.m_V.z;
-			rayhit.ray.tnear[i] = 0;
-			rayhit.ray.tfar[i] = std::numeric_limits<float>::infinity();
-			rayhit.ray.mask[i] = -1;
-			rayhit.ray.flags[i] = 0;
-			rayhit.hit.geomID[i] = RTC_INVALID_GEOMETRY_ID;
-			rayhit.hit.instID[0][i] = RTC_INVALID_GEOMETRY_ID;
-			valid[i] = ray.m_V.IsZero() ? 0 : -1;
-		}
-
-		rtcIntersect8(valid, *scene, context.get(), &rayhit);
-
-		for (int i = 0; i < 8; ++i) {
-			Result &result = results[i];
-			const ON_3dRay &ray = rays[i];
-			if (rayhit.hit.geomID[i] != RTC_INVALID_GEOMETRY_ID) {
-				result.mesh_idx = rayhit.hit.geomID[i];
-				result.face_idx = rayhit.hit.primID[i];
-				result.pt = ray.m_P + ray.m_V * rayhit.ray.tfar[i];
-				result.u = rayhit.hit.u[i];
-				result.v = rayhit.hit.v[i];
-			} else {
-				result.mesh_idx = result.face_idx = -1;
-			}
-		}
-	}
-
-
-};
-
-void read_3real(nlohmann::json &jarr, double *dest) {
-	if (jarr.is_array() && jarr.size() == 3) {
-		dest[0] = jarr[0];
-		dest[1] = jarr[1];
-		dest[2] = jarr[2];
-	} else {
-		dest[0] = dest[1] = dest[2] = 0;
-	}
-};
-
-struct Environment {
-	struct fRGB {
-		float r, g, b;
-	};
-	ON_ClassArray<fRGB> image;
-	int width, height;
-	ON_3dVector zenith, center, equator;
-	Environment(nlohmann::json &env) {
-		width = height = 0;
-		if (!env.is_object()) return;
-
-		read_3real(env["zenith_dir"], static_cast<double *>(zenith));
-		read_3real(env["center_dir"], static_cast<double *>(center));
-
-		equator = ON_CrossProduct(center, zenith);
-		zenith.Unitize();
-		center.Unitize();
-		equator.Unitize();
-		double multiplier = env["multiplier"];
-		LoadEXR(env["path"].get<std::string>().c_str(), multiplier);
-	}
-
-	const fRGB &operator ()(ON_3dVector &ray_dir) {
-		//                      Z:zenith
-		//         dr(dx,dy,dz)  |    X:center
-		//        (0,ty,dz) *-_  |   / 
-		//             _  +-:--~-+dz/
-		//              ~-: :    | /
-		//             u( :~*-_  |/
-		// Y:equator    --+----~-+--------
-		// YZ v[deg]񂵂ɁA X u[deg] 񂷂Ƃ dr ɂȂB
-		// (1) 2]̃xNg̒^2: dx^2 + dy^2 + dz^2
-		// (2) 1]̃xNg̒^2: ty^2 + dz^2
-		// (1) = (2) Aty^2 = dx^2 + dy^2 => ty = sqrt(dx^2 + dy^2)
-		// tan(v) = dz / ty
-		// tan(u) = dy / dx
-
-		double dz = ON_DotProduct(zenith, ray_dir);
-		double dy = ON_DotProduct(equator, ray_dir);
-		double dx = ON_DotProduct(center, ray_dir);
-		double ty = std::sqrt(dx * dx + dy * dy);
-
-		double v_rad = (ty < ON_ZERO_TOLERANCE) ? 0 : std::atan2(dz, ty);
-		double u_rad = (std::abs(dx) < ON_ZERO_TOLERANCE) ? 0 : std::atan2(dy, dx);
-
-		// u_rad : [-PI to PI], v_rad : [-PI/2 to PI/2]
-		// (0,0) ̂Ƃ㉺E, (X,PI/2) ̂Ƃ㒆
-		int px = (u_rad / (2.0 * ON_PI) + 0.5) * static_cast<double>(width);
-		if (px < 0) px = 0;
-		else if (px >= width) px = width;
-		int py = (-v_rad / ON_PI + 0.5) * static_cast<double>(height);
-		if (py < 0) py = 0;
-		else if (py >= height) py = height;
-		return (*this)(px, py);
-	}
-
-private:
-	fRGB &operator ()(int px, int py) {
-		return image[py*width + px];
-	}
-	fRGB &operator[] (size_t idx) {
-		return image[idx];
-	}
-
-	void resize(int width_, int height_) {
-		width = width_;
-		height = height_;
-		image.SetCapacity(width * height);
-		image.SetCount(image.Capacity());
-	}
-
-
-	void LoadEXR(const char *path_exr, double multiplier) {
-		if (!path_exr) return;
-		std::fprintf(stderr, "  %s\n", path_exr);
-		image.Empty();
-		ON_SimpleArray<uint8_t> exrdata;
-		{
-			std::unique_ptr<FILE, decltype(&std::fclose)> fp(std::fopen(path_exr, "rb"), std::fclose);
-			if (!fp.get()) return;
-			std::fseek(fp.get(), 0, SEEK_END);
-			exrdata.SetCapacity(std::ftell(fp.get()));
-			exrdata.SetCount(exrdata.Capacity());
-			std::fseek(fp.get(), 0, SEEK_SET);
-			std::fread(exrdata.First(), exrdata.Count(), 1, fp.get());
-		}
-
-		EXRVersion exr_version;
-		EXRImage exr_image;
-		EXRHeader exr_header;
-		const char *err = 0;
-		InitEXRHeader(&exr_header);
-		std::unique_ptr<EXRHeader, decltype(&::FreeEXRHeader)> deleter_exr_header(&exr_header, ::FreeEXRHeader);
-		InitEXRImage(&exr_image);
-		std::unique_ptr<EXRImage, decltype(&::FreeEXRImage)> deleter_exr_image(&exr_image, ::FreeEXRImage);
-
-		{
-			int ret = ParseEXRVersionFromMemory(&exr_version, exrdata, exrdata.Count());
-			if (ret != TINYEXR_SUCCESS) return;
-			// "Failed to open EXR file or read version info from EXR file."
-
-			if (exr_version.multipart || exr_version.non_image) return;
-			// "Loading multipart or DeepImage is not supported  in LoadEXR() API"
-		}
-
-		{
-			int ret = ParseEXRHeaderFromMemory(&exr_header, &exr_version, exrdata, exrdata.Count(), &err);
-			if (ret != TINYEXR_SUCCESS) return;
-		}
-
-		// Read HALF channel as FLOAT.
-		for (int i = 0; i < exr_header.num_channels; i++) {
-			if (exr_header.pixel_types[i] == TINYEXR_PIXELTYPE_HALF) {
-				exr_header.requested_pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT;
-			}
-		}
-
-		double xr, yr, xg, yg, xb, yb, xw, yw;
-		bool chromacity_predifined;
-		OpenEXR_ReadChromacity(exr_header, xr, yr, xg, yg, xb, yb, xw, yw, &chromacity_predifined);
-
-		{
-			int ret = LoadEXRImageFromMemory(&exr_image, &exr_header, exrdata, exrdata.Count(), &err);
-			if (ret != TINYEXR_SUCCESS) return;
-		}
-		this->resize(exr_image.width, exr_image.height);
-
-		// Get RGBA channel Index
-		int idxR = -1, idxG = -1, idxB = -1, idxA = -1;
-		for (int c = 0; c < exr_header.num_channels; c++) {
-			if (std::strcmp(exr_header.channels[c].name, "R") == 0) {
-				idxR = c;
-			}
-			else if (std::strcmp(exr_header.channels[c].name, "G") == 0) {
-				idxG = c;
-			}
-			else if (std::strcmp(exr_header.channels[c].name, "B") == 0) {
-				idxB = c;
-			}
-			else if (std::strcmp(exr_header.channels[c].name, "A") == 0) {
-				idxA = c;
-			}
-		}
-
-		if (exr_header.num_channels == 1) {
-			// Grayscale channel only.
-
-			if (exr_header.tiled) {
-				for (int it = 0; it < exr_image.num_tiles; it++) {
-					for (int j = 0; j < exr_header.tile_size_y; j++) {
-						for (int i = 0; i < exr_header.tile_size_x; i++) {
-							const int ii = exr_image.tiles[it].offset_x * exr_header.tile_size_x + i;
-							const int jj = exr_image.tiles[it].offset_y * exr_header.tile_size_y + j;
-							const int idx = ii + jj * exr_image.width;
-
-							// out of region check.
-							if (ii >= exr_image.width) continue;
-							if (jj >= exr_image.height) continue;
-
-							const int srcIdx = i + j * exr_header.tile_size_x;
-							unsigned char **src = exr_image.tiles[it].images;
-							float gray = reinterpret_cast<float **>(src)[0][srcIdx];
-							auto &rgb = (*this)(ii, jj);
-							rgb.r = rgb.g = rgb.b = gray;
-						}
-					}
-				}
-			}
-			else {
-				for (int i = 0; i < exr_image.width * exr_image.height; i++) {
-					auto &rgb = (*this)[i];
-					rgb.r = rgb.g = rgb.b = reinterpret_cast<float **>(exr_image.images)[0][i];
-				}
-			}
-		}
-		else {
-			if (idxR == -1 || idxG == -1 || idxB == -1) return;
-
-			if (exr_header.tiled) {
-				for (int it = 0; it < exr_image.num_tiles; it++) {
-					for (int j = 0; j < exr_header.tile_size_y; j++) {
-						for (int i = 0; i < exr_header.tile_size_x; i++) {
-							const int ii = exr_image.tiles[it].offset_x * exr_header.tile_size_x + i;
-							const int jj = exr_image.tiles[it].offset_y * exr_header.tile_size_y + j;
-							const int idx = ii + jj * exr_image.width;
-
-							// out of region check.
-							if (ii >= exr_image.width) continue;
-							if (jj >= exr_image.height) continue;
-
-							const int srcIdx = i + j * exr_header.tile_size_x;
-							unsigned char **src = exr_image.tiles[it].images;
-							auto &rgb = (*this)(ii, jj);
-							rgb.r = reinterpret_cast<float **>(src)[idxR][srcIdx];
-							rgb.g = reinterpret_cast<float **>(src)[idxG][srcIdx];
-							rgb.b = reinterpret_cast<float **>(src)[idxB][srcIdx];
-						}
-					}
-				}
-			}
-			else {
-				for (int i = 0; i < exr_image.width * exr_image.height; i++) {
-					auto &rgb = (*this)[i];
-					rgb.r = reinterpret_cast<float **>(exr_image.images)[idxR][i];
-					rgb.g = reinterpret_cast<float **>(exr_image.images)[idxG][i];
-					rgb.b = reinterpret_cast<float **>(exr_image.images)[idxB][i];
-				}
-			}
-		}
-
-		fRGB rgb_max = { 0,0,0 };
-		for (int i = 0; i < exr_image.width * exr_image.height; i++) {
-			auto &rgb = (*this)[i];
-			rgb.r *= multiplier;
-			rgb.g *= multiplier;
-			rgb.b *= multiplier;
-			if (rgb_max.r < rgb.r) rgb_max.r = rgb.r;
-			if (rgb_max.g < rgb.g) rgb_max.g = rgb.g;
-			if (rgb_max.b < rgb.b) rgb_max.b = rgb.b;
-		}
-		std::fprintf(stderr, "  rgb_max:(%f, %f, %f)\n", rgb_max.r, rgb_max.g, rgb_max.b);
-
-	}
-	bool OpenEXR_ReadChromacity(const EXRHeader &exr_header, double &xr, double &yr, double &xg, double &yg, double &xb, double &yb, double &xw, double &yw, bool *pchromacities_defined) {
-		bool rc = false;
-		const char *err = 0;
-
-		auto get_float = [](unsigned char *p) {
-			float v = *reinterpret_cast<float *>(p);
-			tinyexr::swap4(&v);
-			return v;
-		};
-
-		bool chromacities_defined = false;
-		for (int i = 0; i < exr_header.num_custom_attributes; ++i) {
-			EXRAttribute &attr = exr_header.custom_attributes[i];
-			if (std::strcmp(attr.name, "chromaticities") != 0) continue;
-			chromacities_defined = true;
-			// `gGfBAƉ
-			xr = get_float(attr.value);
-			yr = get_float(attr.value + 4);
-			xg = get_float(attr.value + 8);
-			yg = get_float(attr.value + 12);
-			xb = get_float(attr.value + 16);
-			yb = get_float(attr.value + 20);
-			xw = get_float(attr.value + 24);
-			yw = get_float(attr.value + 28);
-			break;
-		}
-		if (!chromacities_defined) {
-			// https://openexr.readthedocs.io/en/latest/TechnicalIntroduction.html
-			// Recommendations - RGB Color
-			xr = 0.6400, yr = 0.3300;
-			xg = 0.3000, yg = 0.6000;
-			xb = 0.1500, yb = 0.0600;
-			xw = 0.3127, yw = 0.3290;
-		}
-		if (pchromacities_defined) *pchromacities_defined = chromacities_defined;
-
-		rc = true;
-		return rc;
-	}
-};
-
-struct Cameras {
-	struct Camera {
-		enum ProjectionMode {
-			Parallel, Perspective
-		}proj_mode;
-		ON_3dPoint origin;
-		ON_3dVector eye, vert, horz;
-		ON_Plane pln;
-		int pixel_width, pixel_height;
-		double horz_range, vert_range;
-		double horz_pixelsize, vert_pixelsize;
-		int pass;
-		ON_String output_filename;
-
-		struct pixel_info {
-			ON_3dRay ray_init;
-			bool no_intersection;
-		};
-		ON_SimpleArray<pixel_info> pixel_info;
-		void IntersectionTest(MeshRayIntersection &mri) {
-			for (int iy = 0; iy < pixel_height; ++iy) {
-				for (int ix = 0; ix < pixel_width; ++ix) {
-					auto &pixel = pixel_info[iy * pixel_width + ix];
-					MeshRayIntersection::Result result;
-					pixel.no_intersection = !mri.RayIntersection(pixel.ray_init, result);
-				}
-			}
-		}
-	};
-	ON_ClassArray<Camera> cameras;
-	Cameras(nlohmann::json &j_cmrs) {
-		if (!j_cmrs.is_array()) return;
-
-		for (size_t i = 0; i < j_cmrs.size(); ++i) {
-			Camera &cmr = cameras.AppendNew();
-			auto &j_cmr = j_cmrs[i];
-
-			read_3real(j_cmr["origin"], static_cast<double *>(cmr.origin));
-			read_3real(j_cmr["eye_dir"], static_cast<double *>(cmr.eye));
-			read_3real(j_cmr["horz_dir"], static_cast<double *>(cmr.horz));
-			read_3real(j_cmr["vert_dir"], static_cast<double *>(cmr.vert));
-			int zero_count = (cmr.eye.IsZero() ? 1 : 0) + (cmr.horz.IsZero() ? 1 : 0) + (cmr.vert.IsZero() ? 1 : 0);
-			if (zero_count >= 2) {
-				// Todo G[bZ[W
-				continue;
-			}
-			// xNg2͉̎EnƂ3ڂ̎B܂Aꂼ꒼B
-			if (cmr.eye.IsZero()) {
-				cmr.eye = ON_CrossProduct(cmr.horz, cmr.vert);
-				cmr.horz = ON_CrossProduct(cmr.vert, cmr.eye);
-			} else if (cmr.horz.IsZero()) {
-				cmr.horz = ON_CrossProduct(cmr.vert, cmr.eye);
-				cmr.vert = ON_CrossProduct(cmr.eye, cmr.horz);
-			} else if (cmr.vert.IsZero()) {
-				cmr.vert = ON_CrossProduct(cmr.eye, cmr.horz);
-				cmr.horz = ON_CrossProduct(cmr.vert, cmr.eye);
-			} else {
-				// n̐ݒł悤ɂB
-				cmr.vert = ON_CrossProduct(cmr.eye, cmr.horz);
-				ON_3dVector h = ON_CrossProduct(cmr.vert, cmr.eye);
-				cmr.horz = (ON_DotProduct(cmr.horz, h) < 0) ? -h : h;
-			}
-			cmr.eye.Unitize();
-			cmr.horz.Unitize();
-			cmr.vert.Unitize();
-			cmr.pixel_width = j_cmr["pixel_width"];
-			cmr.pixel_height = j_cmr["pixel_height"];
-			cmr.horz_range = j_cmr["horz_range"];
-			cmr.vert_range = j_cmr["vert_range"];
-			cmr.output_filename = j_cmr["output_filename"].get<std::string>().c_str();
-			double far_ = j_cmr["far"];
-			cmr.pass = j_cmr["pass"];
-
-			if (j_cmr["projection_mode"] == "parallel") {
-				cmr.proj_mode = Camera::Parallel;
-				cmr.pln.CreateFromFrame(cmr.origin, cmr.horz, cmr.vert);
-			} else {
-				cmr.proj_mode = Camera::Perspective;
-				cmr.pln.CreateFromFrame(cmr.origin + cmr.eye * far_, cmr.horz, cmr.vert);
-			}
-
-			// J`ꂽ_ŏCm肷邽߁AꏏɐB
-			cmr.pixel_info.SetCapacity(cmr.pixel_width * cmr.pixel_height);
-			cmr.pixel_info.SetCount(cmr.pixel_info.Capacity());
-
-			cmr.horz_pixelsize = cmr.horz_range / static_cast<double>(cmr.pixel_width);
-			cmr.vert_pixelsize = cmr.vert_range / static_cast<double>(cmr.pixel_height);
-			for (int iy = 0; iy < cmr.pixel_height; ++iy) {
-				double v = static_cast<double>(iy * 2 - cmr.pixel_height) * cmr.vert_pixelsize;
-				for (int ix = 0; ix < cmr.pixel_width; ++ix) {
-					double u = static_cast<double>(ix * 2 - cmr.pixel_width) * cmr.horz_pixelsize;
-
-					auto &pixel = cmr.pixel_info[iy * cmr.pixel_width + ix];
-					switch (cmr.proj_mode) {
-						case Cameras::Camera::Parallel:
-						{
-							// se
-							pixel.ray_init.m_P = cmr.pln.PointAt(u, v);
-							pixel.ray_init.m_V = cmr.eye;
-							break;
-						}
-						case Cameras::Camera::Perspective:
-						{
-							// e
-							pixel.ray_init.m_P = cmr.origin;
-							pixel.ray_init.m_V = cmr.pln.PointAt(u, v) - pixel.ray_init.m_P;
-							pixel.ray_init.m_V.Unitize();
-							break;
-						}
-					}
-					pixel.no_intersection = false;
-				}
-			}
-		}
-	}
-};
-
-struct CommonInfo{
-	LightSources *light_src;
-	Materials *materials;
-	Environment *environment;
-	int cnt_10;
-	pthread_mutex_t mtx_read, mtx_write;
-
-	CommonInfo() {
-		::pthread_mutex_init(&mtx_read, 0);
-		::pthread_mutex_init(&mtx_write, 0);
-	}
-	~CommonInfo() {
-		::pthread_mutex_destroy(&mtx_read);
-		::pthread_mutex_destroy(&mtx_write);
-	}
-
-	// read
-	struct Scene {
-		ON_Mesh *mesh;
-		ON_3dPoint model_center;
-		double rough_radius;
-
-		RTCDevice device;
-		RTCScene scene;
-
-		static void errorFunction(void* userPtr, enum RTCError error, const char* str) {
-			std::printf("error %d: %s\n", error, str);
-		}
-
-		void Initialize(ON_Mesh *mesh_) {
-			mesh = mesh_;
-			ON_BoundingBox tbb;
-			mesh_->GetTightBoundingBox(tbb);
-			rough_radius = tbb.Diagonal().Length() * 0.5;
-			model_center = tbb.Center();
-
-			device = rtcNewDevice(0);
-			if (!device) {
-				std::printf("error %d: cannot create device\n", rtcGetDeviceError(0));
-				return;
-			}
-			rtcSetDeviceErrorFunction(device, errorFunction, 0);
-
-			scene = rtcNewScene(device);
-
-			RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
-			float* vertices = static_cast<float*>(
-				rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * sizeof(float), mesh_->VertexCount())
-				);
-			unsigned int* indices = static_cast<unsigned int*>(
-				rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(unsigned), mesh_->FaceCount())
-				);
-
-			for (int i = 0, i3 = 0; i < mesh_->VertexCount(); ++i, i3 += 3) {
-				ON_3dPoint &pt = mesh_->Vertex(i);
-				vertices[i3] = pt.x;
-				vertices[i3 + 1] = pt.y;
-				vertices[i3 + 2] = pt.z;
-			}
-			for (int i = 0, i3 = 0; i < mesh_->FaceCount(); ++i, i3 += 3) {
-				ON_MeshFace &f = mesh_->m_F[i];
-				indices[i3] = f.vi[0];
-				indices[i3 + 1] = f.vi[1];
-				indices[i3 + 2] = f.vi[2];
-			}
-
-			rtcCommitGeometry(geom);
-
-			rtcAttachGeometry(scene, geom);
-			rtcReleaseGeometry(geom);
-			rtcCommitScene(scene);
-		}
-		~Scene() {
-			if (!device) return;
-			rtcReleaseScene(scene);
-			rtcReleaseDevice(device);
-		}
-	}scene;
-
-	int ray_cursor;
-	ON_SimpleArray<unsigned int> *shapeidx2fidx;
-	ON_SimpleArray<int> *shape2matidx;
-	ON_SimpleArray<FaceNormalDirectionMode> *shape2fndm;
-
-	// write
-	ON_ClassArray<ON_ClassArray<ON_3dRay> > raies_last;
-	ON_ClassArray<ON_SimpleArray<double> > flux_last;
-	ON_ClassArray<ON_Polyline> traces;
-};
-
-#ifdef USE_COROUTINE
-cppcoro::generator<const int> RayTrace(const ON_3dRay &ray_init, double flux, ON_3dRay &ray_toits, ON_Mesh &cshape, MeshRayIntersection::Result &result, CommonInfo *ci, xorshift_rnd_32bit &rnd, ON_3dRay &ray_o, double power[3], ON_Polyline *trace, bool &error, uint64_t *durations, uint64_t *count, int &cnt) {
-	cnt = 0;
-#else
-int RayTrace(const ON_3dRay &ray_init, double flux, MeshRayIntersection &mri, CommonInfo *ci, xorshift_rnd_32bit &rnd, ON_3dRay &ray_o, double power[3], ON_Polyline *trace, bool &error, uint64_t *durations, uint64_t *count){
-	int cnt = 0;
-	MeshRayIntersection::Result result;
-	ON_Mesh &cshape = *mri.mesh;
-#endif
-	error = false;
-#ifdef USE_COROUTINE
-	ON_3dRay &ray = ray_toits;
-	ray = ray_init;
-#else
-	ON_3dRay ray = ray_init;
-#endif
-	if (trace) trace->Append(ray.m_P);
-	bool is_inside = false;
-	bool absorbed = false;
-
-
-	bool rc;
-	for (;;) {
-		
-#ifdef USE_COROUTINE
-		co_yield 1;
-		if (result.mesh_idx < 0 && result.face_idx < 0) break;
-#else
-		// 23000ms
-		{
-//			auto tic = calc_duration::tic(durations, count, 0, 0);
-			if (!(rc = mri.RayIntersection(ray, result))) break;
-		}
-#endif
-		++cnt;
-
-		// flat shading
-		// 1400ms
-//		auto tic2 = calc_duration::tic(durations, count, 1, 0);
-		ON_3dVector flat_nrm = cshape.m_FN[result.face_idx];
-//		tic2.toc();
-
-		// phong shading
-		// 4200ms
-		ON_3dVector phong_nrm;
-		{
-//			auto tic = calc_duration::tic(durations, count, 2, 0);
-			auto &face = cshape.m_F[result.face_idx];
-			double u = result.u, v = result.v;
-			phong_nrm =
-				cshape.m_N[face.vi[0]] * (1.0 - (u + v)) +
-				cshape.m_N[face.vi[1]] * u +
-				cshape.m_N[face.vi[2]] * v;
-			phong_nrm.Unitize();
-		}
-
-		// ʔԍ`ԍ擾
-		// 2900ms
-		int shape_idx, midx;
-		{
-//			auto tic = calc_duration::tic(durations, count, 3, 0);
-			shape_idx = static_cast<int>(
-				std::upper_bound(ci->shapeidx2fidx->First(),
-								 ci->shapeidx2fidx->Last() + 1, static_cast<unsigned int>(result.face_idx)) - ci->shapeidx2fidx->First()
-				) - 1;
-
-			midx = (*ci->shape2matidx)[shape_idx];
-
-			// ގ̎͋zWKp
-			if (is_inside) {
-				double dist = ray.m_P.DistanceTo(result.pt);
-				ci->materials->VolumeAttenuate(midx, 3, power, dist);
-			}
-
-		}
-
-		bool is_inside_prev = is_inside;
-		ON_3dVector emit_dir;
-		{
-			// 23800ms
-//			auto tic = calc_duration::tic(durations, count, 4, 0);
-			FaceNormalDirectionMode fndm = (*ci->shape2fndm)[shape_idx];
-			if (!ci->materials->CalcBSDF(midx, fndm, phong_nrm, ray.m_V, is_inside, rnd, 3, power, emit_dir)){
-				error = true;
-				break;
-			}
-		}
-		{
-//			auto tic = calc_duration::tic(durations, count, 5, 0);
-			// 2220ms
-			// ˂Ȃ̂ɓ˂ĂA܂́A߂Ȃ̂ɓ}ɂƂǂ܂P[X̃`FbNB
-			// phong_nrm  flat_nrm ̂ɂAȗ̑傫Ƃ diffuse Ő󂢊pxւ̔ˁAŋN₷B
-			if (ON_DotProduct(phong_nrm, flat_nrm) < 0) flat_nrm.Reverse();
-			// ̎_ flat_nrm  incident ƔΌɂȂĂB
-			if (!emit_dir.IsZero()) {
-				bool new_dir_is_reflection = (ON_DotProduct(flat_nrm, emit_dir) > 0);
-				if ((new_dir_is_reflection && (is_inside != is_inside_prev)) || (!new_dir_is_reflection && (is_inside == is_inside_prev))) {
-					error = true;
-					break;
-				}
-			}
-			ray.m_V = emit_dir;
-			if (ray.m_V.IsZero() || (power[0] == 0 && power[1] == 0 && power[2] == 0)) {
-				absorbed = true;
-				break;
-			}
-			if (trace) trace->Append(result.pt);
-			ray.m_P = ON_3dPoint(result.pt) + ray.m_V * RAY_IOTA_PROGRESS;
-			if (cnt >= MAX_INTERSECTION_COUNT) {
-				error = true;
-				break;
-			}
-		}
-	}
-
-	if (trace && !absorbed) trace->Append(ray.m_P + ray.m_V * TRACE_TERMINAL_LENGTH);
-	ray_o = ray;
-#ifndef USE_COROUTINE
-	return cnt;
-#endif
-}
-
-int main(int argc, char *argv[]){
-	if (argc == 1){
-		return 0;
-	}
-	nlohmann::json args_doc;
-	{
-		FILE *fp = std::fopen(argv[1], "rb");
-		std::fseek(fp, 0, SEEK_END);
-		ON_SimpleArray<char> settingfile(std::ftell(fp));
-		std::rewind(fp);
-		settingfile.SetCount(settingfile.Capacity());
-		std::fread(settingfile, 1, settingfile.Count(), fp);
-		std::fclose(fp);
-		args_doc = nlohmann::json::parse(settingfile.Array());
-	}
-
-	ON_ClassArray<ON_Mesh> shapes;
-	ON_SimpleArray<int> shape2matidx;
-	ON_SimpleArray<FaceNormalDirectionMode> shape2fndm;
-	// SẴbV̍
-	ON_Mesh cshape;
-
-	// ̖ʔԍ獇Ǒ`ԍ擾邽߂ɎgpB
-	ON_SimpleArray<unsigned int> shapeidx2fidx;
-
-	std::fprintf(stderr, "Reading shapes.\n");
-	auto &jshapes = args_doc["shapes"];
-	if (jshapes.is_array()){
-		for (size_t k = 0; k < jshapes.size(); ++k){
-			ON_Mesh &shape = shapes.AppendNew();
-			auto &jshape = jshapes[k];
-			std::string filename = jshape["filename"].get<std::string>();
-			if (filename[0] == '\0') continue;
-
-			auto &jscale = jshape["scale"];
-			double scale = jscale.is_number() ? static_cast<double>(jscale) : 1.0;
-			ON_3dPoint position;
-			read_3real(jshape["position"], position);
-
-			auto &jfacedir = jshape["face_direction"];
-			FaceNormalDirectionMode fndm = FaceNormalDirectionMode::AUTO;
-			if (jfacedir == "outer") {
-				fndm = FaceNormalDirectionMode::OUTER;
-			} else if (jfacedir == "inner") {
-				fndm = FaceNormalDirectionMode::INNER;
-			}
-			shape2fndm.Append(fndm);
-			std::fprintf(stderr, "  %s\n", filename.c_str());
-
-			if (std::strstr(filename.c_str(), ".3dm") != 0) {
-				ONX_Model model;
-				model.Read(filename.c_str());
-				for (int i = 0; i < model.m_object_table.Count(); ++i) {
-					const ON_Mesh *mesh = ON_Mesh::Cast(model.m_object_table[i].m_object);
-					if (!mesh) continue;
-					shape.Append(*mesh);
-
-					for (int i = 0; i < shape.m_V.Count(); ++i) {
-						shape.m_V[i] *= scale;
-						shape.m_V[i] += ON_3fPoint(position);
-					}
-				}
-				if (!shape.HasVertexNormals()) shape.ComputeVertexNormals();
-			} else if (std::strstr(filename.c_str(), ".ply") != 0) {
-				ConvertFromPLY(filename.c_str(), scale, position, shape);
-			} else if (std::strstr(filename.c_str(), ".stl") != 0){
-				ON_SimpleArray<ON__UINT8> data;
-				if (!ReadFile(filename.c_str(), data)) continue;
-				ConvertFromBinarySTL(data, scale, position, shape);
-				shape.ComputeVertexNormals();
-			}
-		}
-	}
-
-	std::fprintf(stderr, "Constructing tree.\n");
-	shapeidx2fidx.Append(0U);
-	for (int k = 0; k < shapes.Count(); ++k){
-		cshape.Append(shapes[k]);
-		shapeidx2fidx.Append(*shapeidx2fidx.Last() + shapes[k].FaceCount());
-	}
-
-	// ގ̒`
-	Materials mats(args_doc["materials"], jshapes, shape2matidx);
-//	double ref_index = 1.1;
-
-	// ̒`
-	std::fprintf(stderr, "Defining environment.\n");
-	Environment environment(args_doc["environment"]);
-
-	// f[^
-	std::fprintf(stderr, "Defining lightsource.\n");
-	LightSources light_src(args_doc["lightsources"]);
-
-	// J
-	std::fprintf(stderr, "Definig cameras.\n");
-	Cameras cameras(args_doc["cameras"]);
-
-	std::fprintf(stderr, "Raytracing.\n");
-
-	// ǐ
-	CommonInfo ci;
-	ci.light_src = &light_src;
-	ci.materials = &mats;
-	ci.environment = &environment;
-	ci.cnt_10 = light_src.RayCount() / 10;
-	ci.ray_cursor = 0;
-	ci.scene.Initialize(&cshape);
-	ci.shapeidx2fidx = &shapeidx2fidx;
-	ci.shape2matidx = &shape2matidx;
-	ci.shape2fndm = &shape2fndm;
-
-	{
-		ON_ClassArray<ON_ClassArray<ON_3dRay> > &raies_last = ci.raies_last;
-		raies_last.SetCapacity(light_src.LSCount());
-		raies_last.SetCount(light_src.LSCount());
-		ON_ClassArray<ON_SimpleArray<double> > &flux_last = ci.flux_last;
-		flux_last.SetCapacity(light_src.LSCount());
-		flux_last.SetCount(light_src.LSCount());
-		for (int i = 0; i < light_src.LSCount(); ++i){
-			raies_last[i].SetCapacity(light_src.RayCount(i));
-			raies_last[i].SetCount(raies_last[i].Capacity());
-			flux_last[i].SetCapacity(light_src.RayCount(i));
-			flux_last[i].SetCount(flux_last[i].Capacity());
-		}
-	}
-
-	// ̏AXbh̎擾
-	size_t threads_count = mist::get_cpu_num();
-//	size_t threads_count = 1;
-
-#define DURATION_NUMBER 7
-	struct Thread {
-		Thread() {}
-		// SẴJŋʂ̓e
-		int thread_idx, num_threads;
-		MeshRayIntersection *mri;
-		xorshift_rnd_32bit rnd;
-		Cameras::Camera *camera;
-		CommonInfo *ci;
-		uint64_t durations[DURATION_NUMBER], count[DURATION_NUMBER];
-#ifdef USE_COROUTINE
-		ON_3dRay ray_toitc[SIMD_COUNT];
-		MeshRayIntersection::Result results[SIMD_COUNT];
-#endif
-
-		// Jɏe
-		uint64_t total_intersect_cnt, total_error_cnt;
-		int progress_current, progress_total;
-		enum class OutputType {
-			LDR, HDR
-		}output_type;
-		union{
-			gdImagePtr ldr;
-			float *exr;
-		}img;
-		ON_ClassArray<ON_Polyline> pols;
-
-		struct pixel_accum_item {
-			double rgb[3];
-			int counter_per_pass_performed;
-		};
-		ON_SimpleArray<pixel_accum_item> pixel_accum;
-		void init() {
-			total_intersect_cnt = 0;
-			total_error_cnt = 0;
-			progress_total = camera->pass;
-			progress_current = 0;
-			pixel_accum.SetCapacity(camera->pixel_width * camera->pixel_height);
-			pixel_accum.SetCount(pixel_accum.Capacity());
-			pixel_accum.Zero();
-		}
-
-#ifdef USE_COROUTINE
-		cppcoro::generator<const int> execute(int coroutine_idx) {
-#else
-		void execute() {
-#endif
-			int count_per_pass = camera->pass;
-			int pixel_width = camera->pixel_width;
-			int pixel_height = camera->pixel_height;
-
-#ifdef USE_COROUTINE
-			for (int k = thread_idx; k < count_per_pass; k += num_threads*SIMD_COUNT) {
-#else
-			for (int k = thread_idx; k < count_per_pass; k += num_threads) {
-#endif
-				progress_current = k;
-				for (int iy = 0, pi_y = 0; iy < pixel_height; ++iy, pi_y += pixel_width) {
-					for (int ix = 0; ix < pixel_width; ++ix) {
-						int pixel_index = pi_y + ix;
-						auto &info = camera->pixel_info[pixel_index];
-						if (info.no_intersection) continue;
-						ON_3dRay ray_init = info.ray_init;
-#if 1
-						double inte, frac = std::modf(rnd()*65536.0, &inte);
-						inte /= 65536.0;
-						double ru = (inte - 0.5) * camera->horz_pixelsize;
-						double rv = (frac - 0.5) * camera->vert_pixelsize;
-
-						ON_Plane &pln = camera->pln;
-						ray_init.m_P += pln.xaxis * ru + pln.yaxis * rv;
-#endif
-
-						ON_3dRay ray_o;
-						double power[3] = { 1, 1, 1 };
-						ON_Polyline pol;
-						bool error = false;
-						// 51200ms
-						{
-#ifdef USE_COROUTINE
-							int cnt;
-							auto rt = RayTrace(info.ray_init, 1.0, ray_toitc[coroutine_idx], *(mri->mesh), results[coroutine_idx], ci, rnd, ray_o, power, nullptr, error, durations, count, cnt);
-							for (auto iter = rt.begin(); iter != rt.end(); ++iter) {
-								co_yield *iter;
-							}
-#else
-							int cnt = RayTrace(ray_init, 1.0, *mri, ci, rnd, ray_o, power, nullptr, error, durations, count);
-#endif
-
-							if (error) {
-								++total_error_cnt;
-								continue;
-							}
-
-							total_intersect_cnt += cnt;
-						}
-
-						{
-							auto &accum = pixel_accum[pixel_index];
-							auto env_rgb = (*ci->environment)(ray_o.m_V);
-							accum.rgb[0] += env_rgb.r * power[0];
-							accum.rgb[1] += env_rgb.g * power[1];
-							accum.rgb[2] += env_rgb.b * power[2];
-							++accum.counter_per_pass_performed;
-						}
-					}
-				}
-			}
-
-			update_image();
-
-			progress_current = progress_total;
-		}
-		void update_image() {
-			int pixel_width = camera->pixel_width;
-			int pixel_height = camera->pixel_height;
-			for (int iy = 0, pi_y = 0; iy < pixel_height; ++iy, pi_y += pixel_width) {
-				for (int ix = 0; ix < pixel_width; ++ix) {
-					int pixel_index = pi_y + ix;
-					auto &info = camera->pixel_info[pixel_index];
-					double rgb[3];
-					if (info.no_intersection) {
-						auto env_rgb = (*ci->environment)(info.ray_init.m_V);
-						rgb[0] = env_rgb.r;
-						rgb[1] = env_rgb.g;
-						rgb[2] = env_rgb.b;
-					} else {
-						auto &accum = pixel_accum[iy * pixel_width + ix];
-						double inv_cppp = 1.0 / static_cast<double>(accum.counter_per_pass_performed);
-						for (int h = 0; h < 3; ++h) {
-							rgb[h] = accum.rgb[h] * inv_cppp;
-						}
-					}
-					if (output_type == OutputType::LDR) {
-						for (int h = 0; h < 3; ++h) {
-							rgb[h] = std::pow(rgb[h], 1 / 2.2) * 255.0;
-							if (rgb[h] >= 255.0) rgb[h] = 255;
-						}
-						img.ldr->tpixels[pixel_height - iy - 1][pixel_width - ix - 1] = gdTrueColor(static_cast<int>(rgb[0]), static_cast<int>(rgb[1]), static_cast<int>(rgb[2]));
-					} else {
-						float *p = &img.exr[((pixel_height - iy - 1)*pixel_width + (pixel_width - ix - 1)) * 4];
-						for (int h = 0; h < 3; ++h) {
-							p[h] = static_cast<float>(rgb[h]);
-						}
-					}
-				}
-			}
-		}
-	};
-
-	std::printf("start\n");
-	auto c1 = std::chrono::system_clock::now();
-	xorshift_rnd_32bit rnd;
-	rnd.init(444, 2531);
-	ON_ClassArray<Thread> threads;
-	MeshRayIntersection mri;
-	mri.Initialize(&cshape, &ci.scene.scene);
-	for (int i = 0; i < threads_count; ++i) {
-		Thread &th = threads.AppendNew();
-		th.thread_idx = i;
-		th.num_threads = threads_count;
-		th.mri = &mri;
-		th.rnd.init(static_cast<int>(rnd() * 10000000.0) + 1234, static_cast<int>(rnd() * 10000000.0) + 1234);
-		th.ci = &ci;
-		for (int h = 0; h < DURATION_NUMBER; ++h) th.durations[h] = 0;
-	}
-
-	std::unique_ptr<thpool_, decltype(&thpool_destroy)> thpool(thpool_init(threads_count), thpool_destroy);
-
-#ifdef USE_COROUTINE
-	struct col_item {
-		cppcoro::generator<const int> instance;
-		cppcoro::generator<const int>::iterator iter;
-		bool started;
-		col_item() : started(false) {}
-		bool next() {
-			if (!started) {
-				iter = instance.begin();
-				started = true;
-				return true;
-			} else if (iter != instance.end()) {
-				++iter;
-				return true;
-			}
-			return false;
-		}
-		double value() {
-			*iter;
-		}
-	};
-#endif
-
-	for (int j = 0; j < cameras.cameras.Count(); ++j){
-		auto &cmr = cameras.cameras[j];
-		std::vector<float> exr;
-		Thread::OutputType ot;
-		gdImagePtr ldr = nullptr;
-		if (cmr.output_filename.Right(4) == ".exr") {
-			ot = Thread::OutputType::HDR;
-			exr.resize(cmr.pixel_width * cmr.pixel_height * 4);
-		} else {
-			ot = Thread::OutputType::LDR;
-			ldr = gdImageCreateTrueColor(cmr.pixel_width, cmr.pixel_height);
-		}
-
-		std::printf("camera # %d\n", j + 1);
-
-		// ʂՓ˔肵āAՓ˂ȂƂwiƂĊm肳
-		cmr.IntersectionTest(mri);
-
-		// {vZ
-		for (int i = 0; i < threads_count; ++i) {
-			Thread &th = threads[i];
-
-			th.output_type = ot;
-			th.camera = &cameras.cameras[j];
-			if (ot == Thread::OutputType::HDR) {
-				th.img.exr = exr.data();
-			} else {
-				th.img.ldr = ldr;
-			}
-			th.init();
-			::thpool_add_work(thpool.get(), [](void *arg) {
-#ifdef USE_COROUTINE
-				Thread &th = *static_cast<Thread *>(arg);
-				col_item cols[SIMD_COUNT];
-				for (size_t i = 0; i < SIMD_COUNT; ++i) {
-					cols[i].instance = th.execute(i);
-				}
-
-				for (;;) {
-					bool end_all = true;
-					for (size_t i = 0; i < SIMD_COUNT; ++i) {
-						auto &itm = cols[i];
-						bool end_this = !itm.next();
-						if (end_this) th.ray_toitc[i].m_V.Zero();
-						end_all &= end_this;
-					}
-					if (end_all) break;
-
-//					auto tic = calc_duration::tic(th.durations, th.count, 0, 0);
-					MeshRayIntersection &mri = *th.mri;
-					mri.RayIntersection8(th.ray_toitc, th.results);
-				}
-#else
-				static_cast<Thread *>(arg)->execute();
-#endif
-			}, &th);
-		}
-		for (;;) {
-			uint64_t progress_current = 0, progress_total = 0;
-			for (int i = 0; i < threads.Count(); ++i) {
-				auto &th = threads[i];
-				progress_current += th.progress_current;
-				progress_total += th.progress_total;
-			}
-			if (progress_total > 0) {
-				double ratio = static_cast<double>(progress_current) * 100.0 / static_cast<double>(progress_total);
-				std::printf("%lld / %lld (%5.1f %%)\n", progress_current, progress_total, ratio);
-				std::fflush(stdout);
-				if (progress_current == progress_total) break;
-			}
-			::sleep(2);
-		}
-		::thpool_wait(thpool.get());
-		if (ldr != nullptr) {
-			::gdImageFile(ldr, cmr.output_filename);
-			::gdImageDestroy(ldr);
-		} else if (exr.size()) {
-			const char *err;
-			SaveEXR(exr.data(), cmr.pixel_width, cmr.pixel_height, 4, 0, cmr.output_filename, &err);
-		}
-	}
-
-	uint64_t total_durations[DURATION_NUMBER] = { 0 };
-	uint64_t total_intersect_cnt = 0, total_error_cnt = 0;
-	for (int i = 0; i < threads_count; ++i) {
-		Thread &th = threads[i];
-		total_intersect_cnt += th.total_intersect_cnt;
-		total_error_cnt += th.total_error_cnt;
-		for (int h = 0; h < DURATION_NUMBER; ++h) total_durations[h] += th.durations[h];
-	}
-	std::printf("total_intersection:%lld\n", total_intersect_cnt);
-	std::printf("total_error:%lld\n", total_error_cnt);
-	std::printf("total_durations:\n");
-	LARGE_INTEGER freq;
-	::QueryPerformanceFrequency(&freq);
-	double coef = 1000.0 / static_cast<double>(freq.QuadPart);
-	for (int h = 0; h < DURATION_NUMBER; ++h) {
-		std::printf("  [%d]:%f msec.\n", h, static_cast<double>(total_durations[h]) * coef);
-	}
-
-	auto c2 = std::chrono::system_clock::now();
-	std::printf("%f msec.\n", static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(c2 - c1).count()) / 1000.0);
-	std::getchar();
-	return 0;
-}
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#define USE_EMBREE
+
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+#include "opennurbs.h"
+#include "nlohmann/json.hpp"
+#include "rply.h"
+#include "gd.h"
+
+#define TINYEXR_IMPLEMENTATION
+#define TINYEXR_USE_MINIZ 0
+// EXR の圧縮・展開をスキャンラインのブロック単位で並列に行う
+#define TINYEXR_USE_THREAD 1
+#ifdef min
+#undef min
+#undef max
+#endif
+#include "tinyexr.h"
+
+#include "PhisicalProperties.h"
+#include "randomizer.h"
+#include "profiler.h"
+#include "telemetry.h"
+#include "taskpool.h"
+#include "exr_output.h"
+#include "denoise.h"
+#include "pathcapture.h"
+#include "tessellate.h"
+#include "decimate.h"
+#include "outofcore.h"
+#include "pathguide.h"
+#include "tonemap.h"
+
+#include <windows.h>
+
+#define RAY_IOTA_PROGRESS 0.005
+#define TRACE_TERMINAL_LENGTH 10.0
+#define MAX_INTERSECTION_COUNT 5000
+
+#ifdef USE_EMBREE
+#include "embree3/rtcore.h"
+#endif
+
+//#define USE_COROUTINE
+
+#ifdef USE_COROUTINE
+#include "cppcoro/generator.hpp"
+#define SIMD_COUNT 8
+#endif
+
+float get_ieee754(ON__UINT8 p[4]){
+	return *reinterpret_cast<float *>(p);
+}
+
+// 参考文献: http://ja.wikipedia.org/wiki/Standard_Triangulated_Language
+bool ConvertFromBinarySTL(ON_SimpleArray<ON__UINT8> &stl, double scale, const ON_3dPoint &position, ON_Mesh &mesh){
+	mesh.Destroy();
+	if (stl.Count() < 84) return false;
+	ON__UINT32 num_facets =
+		static_cast<ON__UINT32>(stl[80]) + static_cast<ON__UINT32>(stl[81]) * 256 +
+		static_cast<ON__UINT32>(stl[82]) * 65536 + static_cast<ON__UINT32>(stl[83]) * 16777216;
+
+	if (stl.Count() < 84 + static_cast<int>(num_facets) * 50 - 2) return false;
+
+	mesh.DestroyDoublePrecisionVertices();
+	mesh.SetSinglePrecisionVerticesAsValid();
+	ON__UINT8 *p = stl.First() + 84;
+	for (ON__UINT32 i = 0; i < num_facets; ++i, p += 50){
+		int vcnt = mesh.m_V.Count();
+		mesh.m_FN.AppendNew().Set(get_ieee754(p   ), get_ieee754(p+ 4), get_ieee754(p+ 8));
+		mesh.m_FN.Last()->Unitize();
+		mesh.m_V.AppendNew().Set(get_ieee754(p+12), get_ieee754(p+16), get_ieee754(p+20));
+		mesh.m_V.AppendNew().Set(get_ieee754(p+24), get_ieee754(p+28), get_ieee754(p+32));
+		mesh.m_V.AppendNew().Set(get_ieee754(p+36), get_ieee754(p+40), get_ieee754(p+44));
+		mesh.SetTriangle(mesh.m_F.Count(), vcnt, vcnt+1, vcnt+2);
+	}
+	mesh.CombineIdenticalVertices();
+	for (int i = 0; i < mesh.m_V.Count(); ++i) {
+		mesh.m_V[i] *= scale;
+		mesh.m_V[i] += ON_3fPoint(position);
+	}
+	mesh.Compact();
+	return true;
+}
+
+bool ConvertFromPLY(const char *filename, double scale, const ON_3dPoint &position, ON_Mesh &mesh) {
+	bool rc = false;
+	auto ply = ply_open(filename, [](p_ply ply, const char *msg) { }, 0, nullptr);
+	if (!ply) return false;
+	if (!ply_read_header(ply)) goto END;
+	mesh.Destroy();
+	mesh.DestroyDoublePrecisionVertices();
+	mesh.SetSinglePrecisionVerticesAsValid();
+
+	{
+		auto add_vertex = [](p_ply_argument arg) {
+			void *pdata;
+			long xyz;
+			ply_get_argument_user_data(arg, &pdata, &xyz);
+			ON_Mesh *mesh = static_cast<ON_Mesh *>(pdata);
+			long index;
+			p_ply_element elm;
+			ply_get_argument_element(arg, &elm, &index);
+			mesh->m_V[index][xyz] = ply_get_argument_value(arg);
+			return 1;
+		};
+		long nvertices = ply_set_read_cb(ply, "vertex", "x", add_vertex, &mesh, 0);
+		ply_set_read_cb(ply, "vertex", "y", add_vertex, &mesh, 1);
+		ply_set_read_cb(ply, "vertex", "z", add_vertex, &mesh, 2);
+		mesh.m_V.SetCapacity(nvertices);
+		mesh.m_V.SetCount(nvertices);
+
+		auto add_face = [](p_ply_argument arg) {
+			void *pdata;
+			ply_get_argument_user_data(arg, &pdata, nullptr);
+			ON_Mesh *mesh = static_cast<ON_Mesh *>(pdata);
+			long index;
+			p_ply_element elm;
+			ply_get_argument_element(arg, &elm, &index);
+			long length, vi;
+			ply_get_argument_property(arg, nullptr, &length, &vi);
+			if (vi < 0) return 1;
+			mesh->m_F[index].vi[vi] = static_cast<int>(ply_get_argument_value(arg));
+			if (vi == 2) {
+				mesh->m_F[index].vi[3] = mesh->m_F[index].vi[2];
+			}
+			return 1;
+		};
+		long ntriangles = ply_set_read_cb(ply, "face", "vertex_indices", add_face, &mesh, 0);
+		mesh.m_F.SetCapacity(ntriangles);
+		mesh.m_F.SetCount(ntriangles);
+		if (!ply_read(ply)) goto END;
+	}
+	mesh.CombineIdenticalVertices();
+	mesh.ComputeVertexNormals();
+	for (int i = 0; i < mesh.m_V.Count(); ++i) {
+		mesh.m_V[i] *= scale;
+		mesh.m_V[i] += ON_3fPoint(position);
+	}
+	mesh.Compact();
+
+	rc = true;
+END:
+	ply_close(ply);
+	return true;
+}
+
+bool ReadFile(const char *filename, ON_SimpleArray<ON__UINT8> &data){
+	FILE *fp = std::fopen(filename, "rb");
+	if (!fp) return false;
+	std::fseek(fp, 0, SEEK_END);
+	data.SetCapacity(static_cast<int>(std::ftell(fp)));
+	data.SetCount(data.Capacity());
+	std::rewind(fp);
+	std::fread(data, 1, data.Count(), fp);
+	std::fclose(fp);
+	return true;
+}
+
+// 光線追跡の内側で使う単精度のレイ。16 byte 境界に揃え、Embree の RTCRay の先頭と同じ並びにする。
+// 倍精度が必要なのは交点から RAY_IOTA_PROGRESS だけ進めるところだけなので、そこでは PointAt で倍精度に戻す。
+struct alignas(16) RayF {
+	float org[3], tnear;
+	float dir[3], tfar;
+	void Set(const ON_3dPoint &p, const ON_3dVector &v) {
+		org[0] = static_cast<float>(p.x), org[1] = static_cast<float>(p.y), org[2] = static_cast<float>(p.z);
+		dir[0] = static_cast<float>(v.x), dir[1] = static_cast<float>(v.y), dir[2] = static_cast<float>(v.z);
+		tnear = 0;
+		tfar = std::numeric_limits<float>::infinity();
+	}
+	void SetNull() {
+		dir[0] = dir[1] = dir[2] = 0;
+	}
+	bool IsNull() const {
+		return dir[0] == 0 && dir[1] == 0 && dir[2] == 0;
+	}
+	ON_3dPoint Origin() const {
+		return ON_3dPoint(org[0], org[1], org[2]);
+	}
+	ON_3dVector Direction() const {
+		return ON_3dVector(dir[0], dir[1], dir[2]);
+	}
+	ON_3dPoint PointAt(double t) const {
+		return ON_3dPoint(org[0] + dir[0] * t, org[1] + dir[1] * t, org[2] + dir[2] * t);
+	}
+};
+
+// 8 本分のレイを成分毎に並べたもの (SoA)。RTCRay8 にそのまま写せる。
+struct alignas(32) RayBatch8 {
+	float org_x[8], org_y[8], org_z[8], tnear[8];
+	float dir_x[8], dir_y[8], dir_z[8], tfar[8];
+	int valid[8]; ///< -1: 有効、0: 無効 (dir がゼロ)
+	void Set(int i, const RayF &ray) {
+		org_x[i] = ray.org[0], org_y[i] = ray.org[1], org_z[i] = ray.org[2], tnear[i] = ray.tnear;
+		dir_x[i] = ray.dir[0], dir_y[i] = ray.dir[1], dir_z[i] = ray.dir[2], tfar[i] = ray.tfar;
+		valid[i] = ray.IsNull() ? 0 : -1;
+	}
+	void Set(const RayF rays[8]) {
+		for (int i = 0; i < 8; ++i) Set(i, rays[i]);
+	}
+	void SetNull(int i) {
+		valid[i] = 0;
+		org_x[i] = org_y[i] = org_z[i] = tnear[i] = 0;
+		dir_x[i] = dir_y[i] = dir_z[i] = 0;
+		tfar[i] = -std::numeric_limits<float>::infinity();
+	}
+	void CopyTo(RTCRay8 &ray8) const {
+		for (int i = 0; i < 8; ++i) {
+			ray8.org_x[i] = org_x[i], ray8.org_y[i] = org_y[i], ray8.org_z[i] = org_z[i], ray8.tnear[i] = tnear[i];
+			ray8.dir_x[i] = dir_x[i], ray8.dir_y[i] = dir_y[i], ray8.dir_z[i] = dir_z[i], ray8.tfar[i] = tfar[i];
+			ray8.mask[i] = -1;
+			ray8.flags[i] = 0;
+		}
+	}
+};
+
+struct MeshRayIntersection{
+	std::unique_ptr<RTCIntersectContext> context;
+	RTCScene *scene;
+	ON_Mesh *mesh;
+	const ON_SimpleArray<unsigned int> *shapeidx2fidx;
+	OutOfCoreScene *ooc; // 空でない時は Embree の代わりにブリックファイルで判定する
+
+	MeshRayIntersection() : scene(nullptr), mesh(nullptr), shapeidx2fidx(nullptr), ooc(nullptr) {}
+
+	// BVH は形状毎の Geometry で作るため、primID は形状内の面番号になる。shapeidx2fidx で合成後の面番号に直す。
+	void Initialize(ON_Mesh *mesh_, RTCScene *scene_, const ON_SimpleArray<unsigned int> *shapeidx2fidx_){
+		scene = scene_;
+		mesh = mesh_;
+		shapeidx2fidx = shapeidx2fidx_;
+		context.reset(new RTCIntersectContext());
+		rtcInitIntersectContext(context.get());
+	}
+
+	// 計算結果。交点は RayF::PointAt(t) で倍精度で求める。
+	struct alignas(16) Result {
+		float t, u, v;
+		int mesh_idx;
+		int face_idx; ///< ooc の時は形状内の面番号
+		float n[3], fn[3]; ///< ooc の時だけ使う
+	};
+	static void FromHit(const OutOfCoreScene::Hit &hit, Result &result) {
+		result.t = hit.t, result.u = hit.u, result.v = hit.v;
+		result.mesh_idx = hit.shape_idx, result.face_idx = hit.face_idx;
+		for (int a = 0; a < 3; ++a) result.n[a] = hit.n[a], result.fn[a] = hit.fn[a];
+	}
+	bool RayIntersection(const RayF &ray, Result &result){
+		if (ooc) {
+			OutOfCoreScene::Hit hit;
+			if (!ooc->Intersect(ray.org, ray.dir, ray.tnear, ray.tfar, hit)) return false;
+			FromHit(hit, result);
+			return true;
+		}
+
+		RTCRayHit rayhit;
+		rayhit.ray.org_x = ray.org[0];
+		rayhit.ray.org_y = ray.org[1];
+		rayhit.ray.org_z = ray.org[2];
+		rayhit.ray.dir_x = ray.dir[0];
+		rayhit.ray.dir_y = ray.dir[1];
+		rayhit.ray.dir_z = ray.dir[2];
+		rayhit.ray.tnear = ray.tnear;
+		rayhit.ray.tfar = ray.tfar;
+		rayhit.ray.mask = -1;
+		rayhit.ray.flags = 0;
+		rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+		rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+
+		rtcIntersect1(*scene, context.get(), &rayhit);
+
+		if (rayhit.hit.geomID != RTC_INVALID_GEOMETRY_ID){
+			result.mesh_idx = rayhit.hit.geomID;
+			result.face_idx = (*shapeidx2fidx)[rayhit.hit.geomID] + rayhit.hit.primID;
+			result.t = rayhit.ray.tfar;
+			result.u = rayhit.hit.u;
+			result.v = rayhit.hit.v;
+			return true;
+		}else return false;
+	}
+	bool RayIntersection(const ON_3dRay &ray, Result &result) {
+		RayF rf;
+		rf.Set(ray.m_P, ray.m_V);
+		return RayIntersection(rf, result);
+	}
+
+	// dir がゼロのレイは判定しない (mesh_idx, face_idx は -1)。
+	void RayIntersection8(const RayF rays[8], Result results[8]) {
+		if (ooc) {
+			// 有効なレイを詰めてまとめて判定し、同じブリックを通るレイで割り当てを共有する
+			float orgs[8 * 3], dirs[8 * 3], tnears[8], tfars[8];
+			int lanes[8], count = 0;
+			for (int i = 0; i < 8; ++i) {
+				results[i].mesh_idx = results[i].face_idx = -1;
+				if (rays[i].IsNull()) continue;
+				for (int a = 0; a < 3; ++a) orgs[count * 3 + a] = rays[i].org[a], dirs[count * 3 + a] = rays[i].dir[a];
+				tnears[count] = rays[i].tnear, tfars[count] = rays[i].tfar;
+				lanes[count++] = i;
+			}
+			OutOfCoreScene::Hit hits[8];
+			bool found[8];
+			ooc->IntersectBatch(orgs, dirs, count, hits, found, false, tnears, tfars);
+			for (int k = 0; k < count; ++k) {
+				if (found[k]) FromHit(hits[k], results[lanes[k]]);
+			}
+			return;
+		}
+
+		RTCRayHit8 rayhit;
+		RayBatch8 batch;
+		batch.Set(rays);
+		batch.CopyTo(rayhit.ray);
+		for (int i = 0; i < 8; ++i) {
+			rayhit.hit.geomID[i] = RTC_INVALID_GEOMETRY_ID;
+			rayhit.hit.instID[0][i] = RTC_INVALID_GEOMETRY_ID;
+		}
+
+		rtcIntersect8(batch.valid, *scene, context.get(), &rayhit);
+
+		for (int i = 0; i < 8; ++i) {
+			Result &result = results[i];
+			if (rayhit.hit.geomID[i] != RTC_INVALID_GEOMETRY_ID) {
+				result.mesh_idx = rayhit.hit.geomID[i];
+				result.face_idx = (*shapeidx2fidx)[rayhit.hit.geomID[i]] + rayhit.hit.primID[i];
+				result.t = rayhit.ray.tfar[i];
+				result.u = rayhit.hit.u[i];
+				result.v = rayhit.hit.v[i];
+			} else {
+				result.mesh_idx = result.face_idx = -1;
+			}
+		}
+	}
+
+	// 8 本のレイが何かに当たるかどうかだけを判定する。valid でないレーンの hits は false。
+	void RayOccluded8(const RayBatch8 &batch, bool hits[8]) {
+		if (ooc) {
+			float orgs[8 * 3], dirs[8 * 3], tnears[8], tfars[8];
+			int lanes[8], count = 0;
+			for (int i = 0; i < 8; ++i) {
+				hits[i] = false;
+				if (!batch.valid[i]) continue;
+				orgs[count * 3] = batch.org_x[i], orgs[count * 3 + 1] = batch.org_y[i], orgs[count * 3 + 2] = batch.org_z[i];
+				dirs[count * 3] = batch.dir_x[i], dirs[count * 3 + 1] = batch.dir_y[i], dirs[count * 3 + 2] = batch.dir_z[i];
+				tnears[count] = batch.tnear[i], tfars[count] = batch.tfar[i];
+				lanes[count++] = i;
+			}
+			OutOfCoreScene::Hit results[8];
+			bool found[8];
+			ooc->IntersectBatch(orgs, dirs, count, results, found, true, tnears, tfars);
+			for (int k = 0; k < count; ++k) hits[lanes[k]] = found[k];
+			return;
+		}
+		RTCRay8 ray8;
+		batch.CopyTo(ray8);
+
+		rtcOccluded8(batch.valid, *scene, context.get(), &ray8);
+
+		// 当たったレイは tfar が -inf になる
+		for (int i = 0; i < 8; ++i) {
+			hits[i] = batch.valid[i] && ray8.tfar[i] < 0;
+		}
+	}
+
+	// 衝突した面の面法線と、頂点法線を補間した法線
+	void Normals(const Result &result, ON_3dVector &flat_nrm, ON_3dVector &phong_nrm) const {
+		if (ooc) {
+			flat_nrm.Set(result.fn[0], result.fn[1], result.fn[2]);
+			phong_nrm.Set(result.n[0], result.n[1], result.n[2]);
+			return;
+		}
+		flat_nrm = mesh->m_FN[result.face_idx];
+		auto &face = mesh->m_F[result.face_idx];
+		double u = result.u, v = result.v;
+		phong_nrm =
+			mesh->m_N[face.vi[0]] * (1.0 - (u + v)) +
+			mesh->m_N[face.vi[1]] * u +
+			mesh->m_N[face.vi[2]] * v;
+		phong_nrm.Unitize();
+	}
+};
+
+void read_3real(nlohmann::json &jarr, double *dest) {
+	if (jarr.is_array() && jarr.size() == 3) {
+		dest[0] = jarr[0];
+		dest[1] = jarr[1];
+		dest[2] = jarr[2];
+	} else {
+		dest[0] = dest[1] = dest[2] = 0;
+	}
+};
+
+// 3 要素の配列の時だけ dest を書き換え、true を返す。省略した項目を元の値のまま残す時に使う。
+bool read_3real_if_present(nlohmann::json &jarr, double *dest) {
+	if (!jarr.is_array() || jarr.size() != 3) return false;
+	dest[0] = jarr[0];
+	dest[1] = jarr[1];
+	dest[2] = jarr[2];
+	return true;
+}
+
+struct Environment {
+	struct fRGB {
+		float r, g, b;
+	};
+	// 画素は半精度で持つ。multiplier を掛けると半精度の範囲を越えることがあるので、倍率は引く時に掛ける。
+	// 半精度の範囲 (65504) を越える画素 (太陽など) は単精度で peaks に持ち、r を PEAK_MARK、g, b を peaks の番号にする。
+	struct hRGB {
+		uint16_t r, g, b;
+	};
+	static const uint16_t PEAK_MARK = 0x7c00; ///< 半精度の +inf。ToHalf は inf を返さないので画素の値とは重ならない
+	std::vector<hRGB> image;
+	std::vector<fRGB> peaks;
+	float scale;
+	const float *half_table;
+	int width, height;
+	ON_3dVector zenith, center, equator;
+	Environment(nlohmann::json &env, TaskPool *pool = nullptr) {
+		width = height = 0;
+		scale = 1;
+		half_table = HalfTable();
+		if (!env.is_object()) return;
+
+		read_3real(env["zenith_dir"], static_cast<double *>(zenith));
+		read_3real(env["center_dir"], static_cast<double *>(center));
+
+		equator = ON_CrossProduct(center, zenith);
+		zenith.Unitize();
+		center.Unitize();
+		equator.Unitize();
+		double multiplier = env["multiplier"];
+		LoadEXR(env["path"].get<std::string>().c_str(), multiplier, pool);
+	}
+
+	fRGB operator ()(ON_3dVector &ray_dir) const {
+		//                      Z:zenith
+		//         dr(dx,dy,dz)  |    X:center
+		//        (0,ty,dz) *-_  |   / 
+		//             _  +-:--~-+dz/
+		//              ~-: :    | /
+		//             u( :~*-_  |/
+		// Y:equator    --+----~-+--------
+		// Y軸をZ軸で v[deg]回した後に、 X軸で u[deg] 回すしたときに dr になる。
+		// (1) 2回回転後のベクトルの長さ^2: dx^2 + dy^2 + dz^2
+		// (2) 1回回転後のベクトルの長さ^2: ty^2 + dz^2
+		// (1) = (2) より、ty^2 = dx^2 + dy^2 => ty = sqrt(dx^2 + dy^2)
+		// tan(v) = dz / ty
+		// tan(u) = dy / dx
+
+		double dz = ON_DotProduct(zenith, ray_dir);
+		double dy = ON_DotProduct(equator, ray_dir);
+		double dx = ON_DotProduct(center, ray_dir);
+		double ty = std::sqrt(dx * dx + dy * dy);
+
+		double v_rad = (ty < ON_ZERO_TOLERANCE) ? 0 : std::atan2(dz, ty);
+		double u_rad = (std::abs(dx) < ON_ZERO_TOLERANCE) ? 0 : std::atan2(dy, dx);
+
+		// u_rad : [-PI to PI], v_rad : [-PI/2 to PI/2]
+		// (0,0) のとき上下左右中央, (X,PI/2) のとき上中央
+		int px = (u_rad / (2.0 * ON_PI) + 0.5) * static_cast<double>(width);
+		if (px < 0) px = 0;
+		else if (px >= width) px = width - 1;
+		int py = (-v_rad / ON_PI + 0.5) * static_cast<double>(height);
+		if (py < 0) py = 0;
+		else if (py >= height) py = height - 1;
+		if (image.empty()) {
+			fRGB black = { 0, 0, 0 };
+			return black;
+		}
+		const hRGB &h = image[static_cast<size_t>(py) * width + px];
+		if (h.r == PEAK_MARK) {
+			const fRGB &p = peaks[h.g | (static_cast<size_t>(h.b) << 16)];
+			fRGB rgb = { p.r * scale, p.g * scale, p.b * scale };
+			return rgb;
+		}
+		fRGB rgb = { half_table[h.r] * scale, half_table[h.g] * scale, half_table[h.b] * scale };
+		return rgb;
+	}
+
+private:
+	// 半精度のビット列から単精度への表 (全スレッドで共有)
+	static const float *HalfTable() {
+		static const std::vector<float> table = []() {
+			std::vector<float> t(65536);
+			for (int i = 0; i < 65536; ++i) {
+				tinyexr::FP16 h;
+				h.u = static_cast<unsigned short>(i);
+				t[i] = tinyexr::half_to_float(h).f;
+			}
+			return t;
+		}();
+		return table.data();
+	}
+	static uint16_t ToHalf(float v) {
+		// 負の値 (色域の変換で出る) と NaN は 0 に、半精度の最大値を越える値は最大値にする
+		if (!(v > 0)) return 0;
+		tinyexr::FP32 f;
+		f.f = std::min(v, 65504.0f);
+		return tinyexr::float_to_half_full(f).u;
+	}
+
+	void resize(int width_, int height_) {
+		width = width_;
+		height = height_;
+		image.assign(static_cast<size_t>(width) * height, hRGB());
+	}
+
+	// ファイルを割り当てて tinyexr に直接渡し、展開はブロック単位で並列に行う (TINYEXR_USE_THREAD)。
+	// チャンネルは元の型のまま受け取り、色域の変換と最大値の集計、半精度への変換を pool で行う。
+	void LoadEXR(const char *path_exr, double multiplier, TaskPool *pool) {
+		if (!path_exr) return;
+		PROFILE_ZONE("load_environment");
+		std::fprintf(stderr, "  %s\n", path_exr);
+		image.clear();
+		peaks.clear();
+		MappedFile file;
+		MappedView view;
+		if (!file.Open(path_exr) || !file.Map(0, static_cast<size_t>(file.Size()), view)) {
+			std::fprintf(stderr, "cannot open %s\n", path_exr);
+			return;
+		}
+		struct ViewGuard {
+			MappedView &view;
+			~ViewGuard() {
+				MappedFile::Unmap(view);
+			}
+		} view_guard = { view };
+		const unsigned char *exrdata = static_cast<const unsigned char *>(view.ptr);
+		size_t exrsize = static_cast<size_t>(file.Size());
+
+		EXRVersion exr_version;
+		EXRImage exr_image;
+		EXRHeader exr_header;
+		const char *err = 0;
+		InitEXRHeader(&exr_header);
+		std::unique_ptr<EXRHeader, decltype(&::FreeEXRHeader)> deleter_exr_header(&exr_header, ::FreeEXRHeader);
+		InitEXRImage(&exr_image);
+		std::unique_ptr<EXRImage, decltype(&::FreeEXRImage)> deleter_exr_image(&exr_image, ::FreeEXRImage);
+
+		{
+			int ret = ParseEXRVersionFromMemory(&exr_version, exrdata, exrsize);
+			if (ret != TINYEXR_SUCCESS) return;
+			// "Failed to open EXR file or read version info from EXR file."
+
+			if (exr_version.multipart || exr_version.non_image) return;
+			// "Loading multipart or DeepImage is not supported  in LoadEXR() API"
+		}
+
+		{
+			int ret = ParseEXRHeaderFromMemory(&exr_header, &exr_version, exrdata, exrsize, &err);
+			if (ret != TINYEXR_SUCCESS) return;
+		}
+
+		double xr, yr, xg, yg, xb, yb, xw, yw;
+		bool chromacity_predifined;
+		OpenEXR_ReadChromacity(exr_header, xr, yr, xg, yg, xb, yb, xw, yw, &chromacity_predifined);
+		// 原色が指定されている時は、出力と同じ Rec.709 の原色に変換する
+		double to_rec709[9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+		if (chromacity_predifined && exr_header.num_channels != 1) {
+			if (!ChromaticityMatrix(xr, yr, xg, yg, xb, yb, xw, yw, to_rec709)) {
+				std::fprintf(stderr, "  invalid chromaticities, assuming Rec.709.\n");
+			}
+		}
+
+		{
+			int ret = LoadEXRImageFromMemory(&exr_image, &exr_header, exrdata, exrsize, &err);
+			if (ret != TINYEXR_SUCCESS) return;
+		}
+
+		// Get RGB channel Index
+		int idx[3] = { -1, -1, -1 };
+		for (int c = 0; c < exr_header.num_channels; c++) {
+			if (std::strcmp(exr_header.channels[c].name, "R") == 0) {
+				idx[0] = c;
+			}
+			else if (std::strcmp(exr_header.channels[c].name, "G") == 0) {
+				idx[1] = c;
+			}
+			else if (std::strcmp(exr_header.channels[c].name, "B") == 0) {
+				idx[2] = c;
+			}
+		}
+		if (exr_header.num_channels == 1) {
+			// Grayscale channel only.
+			idx[0] = idx[1] = idx[2] = 0;
+		}
+		else if (idx[0] == -1 || idx[1] == -1 || idx[2] == -1) return;
+		this->resize(exr_image.width, exr_image.height);
+		scale = static_cast<float>(multiplier);
+
+		// 画素の値を単精度で取り出す
+		const int *types = exr_header.requested_pixel_types;
+		const float *table = half_table;
+		auto fetch = [types, table](unsigned char **images, int c, size_t i) -> float {
+			switch (types[c]) {
+			case TINYEXR_PIXELTYPE_HALF: return table[reinterpret_cast<const uint16_t *>(images[c])[i]];
+			case TINYEXR_PIXELTYPE_FLOAT: return reinterpret_cast<const float *>(images[c])[i];
+			default: return static_cast<float>(reinterpret_cast<const unsigned int *>(images[c])[i]);
+			}
+		};
+		// 色域を変換した値
+		auto convert = [&to_rec709, &fetch, &idx](unsigned char **images, size_t src_idx, float v[3]) {
+			float src[3] = { fetch(images, idx[0], src_idx), fetch(images, idx[1], src_idx), fetch(images, idx[2], src_idx) };
+			for (int k = 0; k < 3; ++k) {
+				v[k] = static_cast<float>(to_rec709[k * 3] * src[0] + to_rec709[k * 3 + 1] * src[1] + to_rec709[k * 3 + 2] * src[2]);
+			}
+		};
+
+		// タイル、または 16 行毎に並列に処理する。f(images, src_idx, dst_idx) を区切り内の全画素について呼ぶ。
+		const int ROWS = 16;
+		int blocks = exr_header.tiled ? exr_image.num_tiles : (height + ROWS - 1) / ROWS;
+		auto for_each_texel = [&](int b, const auto &f) {
+			if (exr_header.tiled) {
+				const EXRTile &tile = exr_image.tiles[b];
+				for (int j = 0; j < exr_header.tile_size_y; j++) {
+					const int jj = tile.offset_y * exr_header.tile_size_y + j;
+					// out of region check.
+					if (jj >= height) break;
+					for (int i = 0; i < exr_header.tile_size_x; i++) {
+						const int ii = tile.offset_x * exr_header.tile_size_x + i;
+						if (ii >= width) break;
+						f(tile.images, i + j * exr_header.tile_size_x, static_cast<size_t>(jj) * width + ii);
+					}
+				}
+			}
+			else {
+				size_t i0 = static_cast<size_t>(b) * ROWS * width, i1 = static_cast<size_t>(std::min((b + 1) * ROWS, height)) * width;
+				for (size_t i = i0; i < i1; ++i) f(exr_image.images, i, i);
+			}
+		};
+
+		// 1 巡目: 最大値 (有限の値のみ) と、半精度の範囲を越える画素の数を区切り毎に集計してからまとめる
+		auto is_peak = [](const float v[3]) {
+			return v[0] > 65504.0f || v[1] > 65504.0f || v[2] > 65504.0f;
+		};
+		std::vector<fRGB> block_max(blocks, fRGB{ 0, 0, 0 });
+		std::vector<size_t> block_peaks(blocks + 1, 0);
+		ParallelFor(pool, 0, blocks, [&](int b) {
+			float *mx = &block_max[b].r;
+			size_t &count = block_peaks[b + 1];
+			for_each_texel(b, [&](unsigned char **images, size_t src_idx, size_t) {
+				float v[3];
+				convert(images, src_idx, v);
+				for (int k = 0; k < 3; ++k) {
+					if (v[k] <= std::numeric_limits<float>::max() && mx[k] < v[k]) mx[k] = v[k];
+				}
+				if (is_peak(v)) ++count;
+			});
+		});
+		fRGB rgb_max = { 0,0,0 };
+		for (const fRGB &mx : block_max) {
+			if (rgb_max.r < mx.r) rgb_max.r = mx.r;
+			if (rgb_max.g < mx.g) rgb_max.g = mx.g;
+			if (rgb_max.b < mx.b) rgb_max.b = mx.b;
+		}
+		std::fprintf(stderr, "  rgb_max:(%f, %f, %f)\n", rgb_max.r * scale, rgb_max.g * scale, rgb_max.b * scale);
+		// 区切り毎の peaks の開始位置
+		for (int b = 0; b < blocks; ++b) block_peaks[b + 1] += block_peaks[b];
+		if (block_peaks[blocks] > 0xffffffffu) {
+			std::fprintf(stderr, "  too many texels above the half float range.\n");
+			image.clear();
+			return;
+		}
+		peaks.resize(block_peaks[blocks]);
+		if (peaks.size()) std::fprintf(stderr, "  %llu texels above the half float range are kept in single precision.\n", static_cast<unsigned long long>(peaks.size()));
+
+		// 2 巡目: 半精度、または peaks に格納する。無限大は有限の最大値に切り詰める。
+		float peak = std::max(rgb_max.r, std::max(rgb_max.g, rgb_max.b));
+		std::vector<size_t> block_clipped(blocks, 0);
+		ParallelFor(pool, 0, blocks, [&](int b) {
+			size_t &clipped = block_clipped[b];
+			size_t next = block_peaks[b];
+			for_each_texel(b, [&](unsigned char **images, size_t src_idx, size_t dst_idx) {
+				float v[3];
+				convert(images, src_idx, v);
+				hRGB &dst = image[dst_idx];
+				if (is_peak(v)) {
+					fRGB &p = peaks[next];
+					float *pv = &p.r;
+					for (int k = 0; k < 3; ++k) {
+						if (v[k] > std::numeric_limits<float>::max()) ++clipped, v[k] = peak;
+						pv[k] = (v[k] > 0) ? v[k] : 0.0f;
+					}
+					dst.r = PEAK_MARK, dst.g = static_cast<uint16_t>(next & 0xffff), dst.b = static_cast<uint16_t>(next >> 16);
+					++next;
+					return;
+				}
+				dst.r = ToHalf(v[0]), dst.g = ToHalf(v[1]), dst.b = ToHalf(v[2]);
+			});
+		});
+		size_t clipped = 0;
+		for (size_t c : block_clipped) clipped += c;
+		if (clipped > 0) std::fprintf(stderr, "  warning: %llu texel values are infinite and were clipped.\n", static_cast<unsigned long long>(clipped));
+	}
+	bool OpenEXR_ReadChromacity(const EXRHeader &exr_header, double &xr, double &yr, double &xg, double &yg, double &xb, double &yb, double &xw, double &yw, bool *pchromacities_defined) {
+		bool rc = false;
+		const char *err = 0;
+
+		auto get_float = [](unsigned char *p) {
+			float v = *reinterpret_cast<float *>(p);
+			tinyexr::swap4(&v);
+			return v;
+		};
+
+		bool chromacities_defined = false;
+		for (int i = 0; i < exr_header.num_custom_attributes; ++i) {
+			EXRAttribute &attr = exr_header.custom_attributes[i];
+			if (std::strcmp(attr.name, "chromaticities") != 0) continue;
+			chromacities_defined = true;
+			// 内部形式をリトルエンディアンと仮定
+			xr = get_float(attr.value);
+			yr = get_float(attr.value + 4);
+			xg = get_float(attr.value + 8);
+			yg = get_float(attr.value + 12);
+			xb = get_float(attr.value + 16);
+			yb = get_float(attr.value + 20);
+			xw = get_float(attr.value + 24);
+			yw = get_float(attr.value + 28);
+			break;
+		}
+		if (!chromacities_defined) {
+			// https://openexr.readthedocs.io/en/latest/TechnicalIntroduction.html
+			// Recommendations - RGB Color
+			xr = 0.6400, yr = 0.3300;
+			xg = 0.3000, yg = 0.6000;
+			xb = 0.1500, yb = 0.0600;
+			xw = 0.3127, yw = 0.3290;
+		}
+		if (pchromacities_defined) *pchromacities_defined = chromacities_defined;
+
+		rc = true;
+		return rc;
+	}
+
+	// 原色と白色点の色度から RGB -> XYZ の行列 (行優先) を作る。
+	static bool RgbToXyz(double xr, double yr, double xg, double yg, double xb, double yb, double xw, double yw, double m[9]) {
+		if (yr == 0 || yg == 0 || yb == 0 || yw == 0) return false;
+		double p[9] = {
+			xr / yr, xg / yg, xb / yb,
+			1, 1, 1,
+			(1 - xr - yr) / yr, (1 - xg - yg) / yg, (1 - xb - yb) / yb };
+		double pinv[9];
+		if (!Inverse33(p, pinv)) return false;
+		double w[3] = { xw / yw, 1, (1 - xw - yw) / yw };
+		for (int k = 0; k < 3; ++k) {
+			double s = pinv[k * 3] * w[0] + pinv[k * 3 + 1] * w[1] + pinv[k * 3 + 2] * w[2];
+			for (int r = 0; r < 3; ++r) m[r * 3 + k] = p[r * 3 + k] * s;
+		}
+		return true;
+	}
+	// 原色 (xr, yr)... の RGB から Rec.709 (D65) の RGB への行列。白色点が違う時は Bradford 変換で合わせる。
+	static bool ChromaticityMatrix(double xr, double yr, double xg, double yg, double xb, double yb, double xw, double yw, double m[9]) {
+		static const double bradford[9] = {
+			0.8951, 0.2664, -0.1614,
+			-0.7502, 1.7135, 0.0367,
+			0.0389, -0.0685, 1.0296 };
+		const double xw709 = 0.3127, yw709 = 0.3290;
+		double src[9], dst[9], dst_inv[9], bradford_inv[9];
+		if (!RgbToXyz(xr, yr, xg, yg, xb, yb, xw, yw, src)) return false;
+		RgbToXyz(0.6400, 0.3300, 0.3000, 0.6000, 0.1500, 0.0600, xw709, yw709, dst);
+		Inverse33(dst, dst_inv);
+		Inverse33(bradford, bradford_inv);
+		// 錐体応答の比で白色点を合わせる
+		double ws[3] = { xw / yw, 1, (1 - xw - yw) / yw }, wd[3] = { xw709 / yw709, 1, (1 - xw709 - yw709) / yw709 };
+		double scale[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+		for (int k = 0; k < 3; ++k) {
+			double cs = bradford[k * 3] * ws[0] + bradford[k * 3 + 1] * ws[1] + bradford[k * 3 + 2] * ws[2];
+			double cd = bradford[k * 3] * wd[0] + bradford[k * 3 + 1] * wd[1] + bradford[k * 3 + 2] * wd[2];
+			if (cs == 0) return false;
+			scale[k * 4] = cd / cs;
+		}
+		double t0[9], t1[9], t2[9];
+		Multiply33(scale, bradford, t0);
+		Multiply33(bradford_inv, t0, t1);
+		Multiply33(t1, src, t2);
+		Multiply33(dst_inv, t2, m);
+		return true;
+	}
+	static void Multiply33(const double a[9], const double b[9], double out[9]) {
+		for (int r = 0; r < 3; ++r) {
+			for (int c = 0; c < 3; ++c) out[r * 3 + c] = a[r * 3] * b[c] + a[r * 3 + 1] * b[3 + c] + a[r * 3 + 2] * b[6 + c];
+		}
+	}
+	static bool Inverse33(const double m[9], double out[9]) {
+		double det = m[0] * (m[4] * m[8] - m[5] * m[7]) - m[1] * (m[3] * m[8] - m[5] * m[6]) + m[2] * (m[3] * m[7] - m[4] * m[6]);
+		if (std::abs(det) < 1e-12) return false;
+		double inv = 1.0 / det;
+		out[0] = (m[4] * m[8] - m[5] * m[7]) * inv, out[1] = (m[2] * m[7] - m[1] * m[8]) * inv, out[2] = (m[1] * m[5] - m[2] * m[4]) * inv;
+		out[3] = (m[5] * m[6] - m[3] * m[8]) * inv, out[4] = (m[0] * m[8] - m[2] * m[6]) * inv, out[5] = (m[2] * m[3] - m[0] * m[5]) * inv;
+		out[6] = (m[3] * m[7] - m[4] * m[6]) * inv, out[7] = (m[1] * m[6] - m[0] * m[7]) * inv, out[8] = (m[0] * m[4] - m[1] * m[3]) * inv;
+		return true;
+	}
+};
+
+// EXR に追加で書き出すレイヤー
+enum AovFlag {
+	AOV_SAMPLES = 1,  ///< 画素毎の有効なサンプル数
+	AOV_VARIANCE = 2, ///< 輝度の平均値の分散
+	AOV_ALBEDO = 4,   ///< 最初の衝突点の反射率
+	AOV_NORMAL = 8,   ///< 最初の衝突点の法線 (phong)
+	AOV_DEPTH = 16,   ///< 最初の衝突点までの距離
+	AOV_SHAPE_ID = 32 ///< 最初の衝突点の形状番号
+};
+
+// 例: "aovs": ["samples", "variance", "albedo", "normal", "depth", "shape_id"]
+unsigned int ParseAovs(nlohmann::json &jaovs) {
+	unsigned int aovs = 0;
+	if (!jaovs.is_array()) return aovs;
+	for (size_t i = 0; i < jaovs.size(); ++i) {
+		if (!jaovs[i].is_string()) continue;
+		std::string name = jaovs[i].get<std::string>();
+		if (name == "samples") aovs |= AOV_SAMPLES;
+		else if (name == "variance") aovs |= AOV_VARIANCE;
+		else if (name == "albedo") aovs |= AOV_ALBEDO;
+		else if (name == "normal") aovs |= AOV_NORMAL;
+		else if (name == "depth") aovs |= AOV_DEPTH;
+		else if (name == "shape_id") aovs |= AOV_SHAPE_ID;
+		else std::fprintf(stderr, "unknown aov \"%s\".\n", name.c_str());
+	}
+	return aovs;
+}
+
+// 段階的な描画。タイル毎に step_passes パスずつ計算し、全タイルを一巡させながら interval_sec 毎にプレビューを書き出す。
+// 例: "progressive": { "interval_sec": 5, "step_passes": 4, "preview_filename": "preview.png", "roi": [100, 80, 300, 200], "roi_pass_scale": 4 }
+// roi は出力画像上の画素の範囲 [x0, y0, x1, y1) で、掛かるタイルを各巡の先頭で計算し、パス数を roi_pass_scale 倍にする。
+struct ProgressiveOptions {
+	bool enabled;
+	double interval_sec;
+	int step_passes;
+	ON_String preview_filename; ///< 省略時は出力ファイル名の拡張子の前に _preview を付ける
+	int roi[4];
+	int roi_pass_scale;
+	ProgressiveOptions() : enabled(false), interval_sec(5.0), step_passes(1), roi_pass_scale(1) {
+		roi[0] = roi[1] = roi[2] = roi[3] = 0;
+	}
+	bool HasRoi() const {
+		return roi[0] < roi[2] && roi[1] < roi[3];
+	}
+	void Parse(nlohmann::json &jprog, const ON_String &output_filename) {
+		if (!jprog.is_object()) return;
+		enabled = true;
+		if (jprog["interval_sec"].is_number()) interval_sec = jprog["interval_sec"];
+		if (jprog["step_passes"].is_number()) step_passes = std::max(jprog["step_passes"].get<int>(), 1);
+		if (jprog["roi_pass_scale"].is_number()) roi_pass_scale = std::max(jprog["roi_pass_scale"].get<int>(), 1);
+		auto &jroi = jprog["roi"];
+		if (jroi.is_array() && jroi.size() == 4) {
+			for (int h = 0; h < 4; ++h) roi[h] = jroi[h].is_number() ? jroi[h].get<int>() : 0;
+		}
+		if (jprog["preview_filename"].is_string()) {
+			preview_filename = jprog["preview_filename"].get<std::string>().c_str();
+		} else {
+			const char *s = static_cast<const char *>(output_filename);
+			const char *dot = std::strrchr(s, '.');
+			size_t stem = dot ? static_cast<size_t>(dot - s) : std::strlen(s);
+			preview_filename = (std::string(s, stem) + "_preview" + (s + stem)).c_str();
+		}
+	}
+};
+
+struct Cameras {
+	struct Camera {
+		enum ProjectionMode {
+			Parallel, Perspective
+		}proj_mode;
+		ON_3dPoint origin;
+		ON_3dVector eye, vert, horz;
+		ON_Plane pln;
+		double far_;
+		int pixel_width, pixel_height;
+		double horz_range, vert_range;
+		double horz_pixelsize, vert_pixelsize;
+		int pass;
+		ON_String output_filename;
+		unsigned int aovs; ///< 出力する AOV (AOV_* の組み合わせ)。EXR 出力の時のみ有効。
+		bool denoise;      ///< 書き出す前に最初の衝突点の特徴量を使って雑音を除去する
+		DenoiseOptions denoise_opt;
+		ProgressiveOptions progressive;
+		ToneMapOptions tonemap; ///< 8 bit の画像に書き出す時の階調の圧縮
+		double time_budget_sec; ///< 0 より大きい時は pass の代わりに、この時間が経つまでパスを重ねる
+
+		// 軸ベクトルが2つの時は右手系として3つ目の軸を作る。また、それぞれ直交させる。
+		bool NormalizeAxes() {
+			int zero_count = (eye.IsZero() ? 1 : 0) + (horz.IsZero() ? 1 : 0) + (vert.IsZero() ? 1 : 0);
+			if (zero_count >= 2) return false;
+			if (eye.IsZero()) {
+				eye = ON_CrossProduct(horz, vert);
+				horz = ON_CrossProduct(vert, eye);
+			} else if (horz.IsZero()) {
+				horz = ON_CrossProduct(vert, eye);
+				vert = ON_CrossProduct(eye, horz);
+			} else if (vert.IsZero()) {
+				vert = ON_CrossProduct(eye, horz);
+				horz = ON_CrossProduct(vert, eye);
+			} else {
+				// 左手系の設定もできるようにする。
+				vert = ON_CrossProduct(eye, horz);
+				ON_3dVector h = ON_CrossProduct(vert, eye);
+				horz = (ON_DotProduct(horz, h) < 0) ? -h : h;
+			}
+			eye.Unitize();
+			horz.Unitize();
+			vert.Unitize();
+			return true;
+		}
+		// 投影面を origin, 軸ベクトル, far_ から作り直す。
+		void UpdatePlane() {
+			if (proj_mode == Parallel) pln.CreateFromFrame(origin, horz, vert);
+			else pln.CreateFromFrame(origin + eye * far_, horz, vert);
+		}
+
+		// 画素数・範囲から画素の大きさを求め、coverage を確保し直す。
+		void UpdatePixelSize() {
+			horz_pixelsize = horz_range / static_cast<double>(pixel_width);
+			vert_pixelsize = vert_range / static_cast<double>(pixel_height);
+			coverage_words_per_row = (pixel_width + 63) / 64;
+			coverage.assign(static_cast<size_t>(coverage_words_per_row) * pixel_height, 0);
+		}
+
+		// 画素の初期レイ (画素内でずらす前)。画素毎に保持せず、必要な時に作る。
+		ON_3dRay RayInit(int ix, int iy) const {
+			double u = static_cast<double>(ix * 2 - pixel_width) * horz_pixelsize;
+			double v = static_cast<double>(iy * 2 - pixel_height) * vert_pixelsize;
+			ON_3dRay ray_init;
+			if (proj_mode == Parallel) {
+				// 平行投影
+				ray_init.m_P = pln.PointAt(u, v);
+				ray_init.m_V = eye;
+			} else {
+				// 透視投影
+				ray_init.m_P = origin;
+				ray_init.m_V = pln.PointAt(u, v) - ray_init.m_P;
+				ray_init.m_V.Unitize();
+			}
+			return ray_init;
+		}
+		ON_3dRay RayInit(int pixel_index) const {
+			return RayInit(pixel_index % pixel_width, pixel_index / pixel_width);
+		}
+
+		// 初期レイが形状に当たる画素を 1 画素 1 bit で持つ。行毎に 64 bit 単位で揃え、行の異なるタスクが同じ語に書かないようにする。
+		std::vector<uint64_t> coverage;
+		int coverage_words_per_row;
+		bool Covered(int pixel_index) const {
+			int ix = pixel_index % pixel_width, iy = pixel_index / pixel_width;
+			return (coverage[iy * coverage_words_per_row + (ix >> 6)] >> (ix & 63)) & 1;
+		}
+		void SetCovered(int pixel_index, bool covered) {
+			int ix = pixel_index % pixel_width, iy = pixel_index / pixel_width;
+			uint64_t &word = coverage[iy * coverage_words_per_row + (ix >> 6)];
+			uint64_t bit = static_cast<uint64_t>(1) << (ix & 63);
+			word = covered ? (word | bit) : (word & ~bit);
+		}
+
+		// 一回通り衝突判定して、衝突しない画素を背景として確定させる。
+		// 8x8 画素の塊毎に、1 行 8 本の初期レイをその場で作って rtcOccluded8 でまとめて判定する。塊の行毎に pool で並列に処理する。
+		// ブリックファイルの時は塊の行 (8 行分) のレイをまとめて判定し、同じブリックを通るレイを一度に処理する。
+		void IntersectionTest(MeshRayIntersection &mri, TaskPool &pool) {
+			PROFILE_ZONE("intersection_test");
+			int blocks_x = (pixel_width + 7) / 8, blocks_y = (pixel_height + 7) / 8;
+			if (mri.ooc) {
+				pool.ParallelFor(0, blocks_y, [&](int by) {
+					int y0 = by * 8, count = (std::min(y0 + 8, pixel_height) - y0) * pixel_width;
+					std::vector<float> orgs(count * 3), dirs(count * 3);
+					for (int i = 0; i < count; ++i) {
+						ON_3dRay ray = RayInit(i % pixel_width, y0 + i / pixel_width);
+						RayF rf;
+						rf.Set(ray.m_P, ray.m_V);
+						for (int a = 0; a < 3; ++a) orgs[i * 3 + a] = rf.org[a], dirs[i * 3 + a] = rf.dir[a];
+					}
+					std::vector<OutOfCoreScene::Hit> results(count);
+					std::unique_ptr<bool[]> hits(new bool[count]);
+					mri.ooc->IntersectBatch(orgs.data(), dirs.data(), count, results.data(), hits.get(), true);
+					for (int i = 0; i < count; ++i) SetCovered(y0 * pixel_width + i, hits[i]);
+				});
+				return;
+			}
+			pool.ParallelFor(0, blocks_y, [&](int by) {
+				RayBatch8 batch;
+				bool hits[8];
+				int y1 = std::min(by * 8 + 8, pixel_height);
+				for (int iy = by * 8; iy < y1; ++iy) {
+					uint64_t *row = &coverage[iy * coverage_words_per_row];
+					for (int bx = 0; bx < blocks_x; ++bx) {
+						int x0 = bx * 8;
+						for (int i = 0; i < 8; ++i) {
+							if (x0 + i < pixel_width) {
+								ON_3dRay ray = RayInit(x0 + i, iy);
+								RayF rf;
+								rf.Set(ray.m_P, ray.m_V);
+								batch.Set(i, rf);
+							} else {
+								batch.SetNull(i);
+							}
+						}
+						mri.RayOccluded8(batch, hits);
+						uint64_t bits = 0;
+						for (int i = 0; i < 8 && x0 + i < pixel_width; ++i) {
+							if (hits[i]) bits |= static_cast<uint64_t>(1) << i;
+						}
+						int shift = x0 & 63;
+						uint64_t &word = row[x0 >> 6];
+						word = (word & ~(static_cast<uint64_t>(0xff) << shift)) | (bits << shift);
+					}
+				}
+			});
+		}
+	};
+	ON_ClassArray<Camera> cameras;
+	Cameras(nlohmann::json &j_cmrs) {
+		if (!j_cmrs.is_array()) return;
+
+		for (size_t i = 0; i < j_cmrs.size(); ++i) {
+			Camera &cmr = cameras.AppendNew();
+			auto &j_cmr = j_cmrs[i];
+
+			read_3real(j_cmr["origin"], static_cast<double *>(cmr.origin));
+			read_3real(j_cmr["eye_dir"], static_cast<double *>(cmr.eye));
+			read_3real(j_cmr["horz_dir"], static_cast<double *>(cmr.horz));
+			read_3real(j_cmr["vert_dir"], static_cast<double *>(cmr.vert));
+			if (!cmr.NormalizeAxes()) {
+				// Todo エラーメッセージ
+				continue;
+			}
+			cmr.pixel_width = j_cmr["pixel_width"];
+			cmr.pixel_height = j_cmr["pixel_height"];
+			cmr.horz_range = j_cmr["horz_range"];
+			cmr.vert_range = j_cmr["vert_range"];
+			cmr.output_filename = j_cmr["output_filename"].get<std::string>().c_str();
+			cmr.far_ = j_cmr["far"];
+			cmr.pass = j_cmr["pass"].is_number() ? j_cmr["pass"].get<int>() : 0;
+			cmr.aovs = ParseAovs(j_cmr["aovs"]);
+			if (cmr.aovs && cmr.output_filename.Right(4) != ".exr") {
+				std::fprintf(stderr, "aovs are ignored for %s (EXR only).\n", static_cast<const char *>(cmr.output_filename));
+				cmr.aovs = 0;
+			}
+			// "denoise": true または雑音除去のパラメータ
+			auto &jden = j_cmr["denoise"];
+			cmr.denoise = (jden.is_boolean() && jden.get<bool>()) || jden.is_object();
+			cmr.denoise_opt.Parse(jden);
+			cmr.progressive.Parse(j_cmr["progressive"], cmr.output_filename);
+			cmr.tonemap.Parse(j_cmr["tone_mapping"]);
+			cmr.time_budget_sec = j_cmr["time_budget_sec"].is_number() ? j_cmr["time_budget_sec"].get<double>() : 0.0;
+
+			cmr.proj_mode = (j_cmr["projection_mode"] == "parallel") ? Camera::Parallel : Camera::Perspective;
+			cmr.UpdatePlane();
+
+			cmr.UpdatePixelSize();
+		}
+	}
+};
+
+// 例: "russian_roulette": { "min_depth": 5, "max_survival": 0.95 }
+// min_depth 回目以降の衝突で、重みの最大値 (max_survival が上限) を生存確率として経路を打ち切る。
+struct RouletteOptions {
+	bool enabled;
+	int min_depth;
+	double max_survival;
+	RouletteOptions() : enabled(false), min_depth(5), max_survival(0.95) {}
+	void Parse(nlohmann::json &jrr) {
+		if (!jrr.is_object()) return;
+		enabled = true;
+		if (jrr["min_depth"].is_number()) min_depth = std::max(jrr["min_depth"].get<int>(), 1);
+		if (jrr["max_survival"].is_number()) max_survival = std::min(std::max(jrr["max_survival"].get<double>(), 0.01), 1.0);
+	}
+};
+
+struct CommonInfo{
+	LightSources *light_src;
+	Materials *materials;
+	Environment *environment;
+	RouletteOptions roulette;
+	PathGuide *guide; ///< "path_guiding" が無い時は nullptr
+	int cnt_10;
+
+	// read
+	struct Scene {
+		ON_Mesh *mesh;
+		ON_3dPoint model_center;
+		double rough_radius;
+
+		RTCDevice device;
+		RTCScene scene;
+		Scene() : device(nullptr), scene(nullptr) {}
+
+		static void errorFunction(void* userPtr, enum RTCError error, const char* str) {
+			std::printf("error %d: %s\n", error, str);
+		}
+
+		// 形状毎に 1 つの Geometry を作り、geomID を形状番号にする。
+		// shapeidx2fidx / shapeidx2vidx は mesh_ 内の形状毎の面・頂点の開始位置 (末尾に総数)。
+		// animated が true の形状は動くものとして再構築ではなく refit で更新し、シーンは形状毎の BVH をまとめる 2 段の構成にする。
+		// BVH の構築は Embree 自身のスレッドではなく pool のワーカーが rtcJoinCommitScene で参加して行う。
+		// NUMA ノード指定のタスクから呼んだ時は、そのノードのワーカーだけで構築する。
+		void Initialize(ON_Mesh *mesh_, const ON_SimpleArray<unsigned int> &shapeidx2fidx, const ON_SimpleArray<unsigned int> &shapeidx2vidx, const std::vector<bool> &animated, TaskPool &pool) {
+			PROFILE_ZONE("build_bvh");
+			mesh = mesh_;
+			ON_BoundingBox tbb;
+			mesh_->GetTightBoundingBox(tbb);
+			rough_radius = tbb.Diagonal().Length() * 0.5;
+			model_center = tbb.Center();
+
+			char config[64];
+			int builders = pool.LocalWorkerCount();
+			std::snprintf(config, sizeof(config), "threads=1,user_threads=%d", builders);
+			device = rtcNewDevice(config);
+			if (!device) {
+				std::printf("error %d: cannot create device\n", rtcGetDeviceError(0));
+				return;
+			}
+			rtcSetDeviceErrorFunction(device, errorFunction, 0);
+
+			scene = rtcNewScene(device);
+			if (std::find(animated.begin(), animated.end(), true) != animated.end()) {
+				rtcSetSceneFlags(scene, RTC_SCENE_FLAG_DYNAMIC);
+			}
+
+			for (int k = 0; k + 1 < shapeidx2fidx.Count(); ++k) {
+				unsigned int f0 = shapeidx2fidx[k], f1 = shapeidx2fidx[k + 1];
+				unsigned int v0 = shapeidx2vidx[k], v1 = shapeidx2vidx[k + 1];
+				if (f0 == f1) continue;
+				RTCGeometry geom = rtcNewGeometry(device, RTC_GEOMETRY_TYPE_TRIANGLE);
+				if (k < static_cast<int>(animated.size()) && animated[k]) {
+					rtcSetGeometryBuildQuality(geom, RTC_BUILD_QUALITY_REFIT);
+				}
+				rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 3 * sizeof(float), v1 - v0);
+				unsigned int* indices = static_cast<unsigned int*>(
+					rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(unsigned), f1 - f0)
+					);
+				CopyVertices(geom, v0, v1);
+				for (unsigned int i = f0, i3 = 0; i < f1; ++i, i3 += 3) {
+					ON_MeshFace &f = mesh_->m_F[i];
+					indices[i3] = f.vi[0] - v0;
+					indices[i3 + 1] = f.vi[1] - v0;
+					indices[i3 + 2] = f.vi[2] - v0;
+				}
+				rtcCommitGeometry(geom);
+				rtcAttachGeometryByID(scene, geom, k);
+				rtcReleaseGeometry(geom);
+			}
+			Commit(pool);
+		}
+
+		// mesh の頂点 [v0, v1) を geom の頂点バッファに写す。
+		void CopyVertices(RTCGeometry geom, unsigned int v0, unsigned int v1) {
+			float *vertices = static_cast<float *>(rtcGetGeometryBufferData(geom, RTC_BUFFER_TYPE_VERTEX, 0));
+			for (unsigned int i = v0, i3 = 0; i < v1; ++i, i3 += 3) {
+				const ON_3fPoint &pt = mesh->m_V[i];
+				vertices[i3] = pt.x;
+				vertices[i3 + 1] = pt.y;
+				vertices[i3 + 2] = pt.z;
+			}
+		}
+
+		// 形状 shape_idx の頂点を mesh から写し直す。Commit を呼ぶまで BVH には反映されない。
+		void UpdateShape(int shape_idx, unsigned int v0, unsigned int v1) {
+			RTCGeometry geom = rtcGetGeometry(scene, shape_idx);
+			if (!geom) return;
+			CopyVertices(geom, v0, v1);
+			rtcUpdateGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0);
+			rtcCommitGeometry(geom);
+		}
+
+		// 変更された Geometry の BVH だけを作り直し、上位の BVH を組み直す。
+		void Commit(TaskPool &pool) {
+			pool.ParallelFor(0, pool.LocalWorkerCount(), [this](int) {
+				rtcJoinCommitScene(scene);
+			});
+		}
+		~Scene() {
+			if (!device) return;
+			rtcReleaseScene(scene);
+			rtcReleaseDevice(device);
+		}
+	}scene;
+
+	int ray_cursor;
+	ON_SimpleArray<unsigned int> *shapeidx2fidx;
+	ON_SimpleArray<int> *shape2matidx;
+	ON_SimpleArray<FaceNormalDirectionMode> *shape2fndm;
+
+	// write
+	ON_ClassArray<ON_ClassArray<ON_3dRay> > raies_last;
+	ON_ClassArray<ON_SimpleArray<double> > flux_last;
+};
+
+// 経路案内の学習で覚えておく拡散反射の頂点
+struct GuideVertex {
+	int leaf;
+	double dir[3];
+	double pdf;        ///< 方向を選んだ確率密度
+	double throughput; ///< 頂点で反射した後の重みの輝度
+};
+const int GUIDE_MAX_VERTICES = 16;
+
+// 最初の衝突点の情報 (AOV 用)
+struct FirstHit {
+	bool valid;
+	ON_3dVector normal;
+	double albedo[3];
+	double depth;
+	int shape_idx;
+};
+
+#ifdef USE_COROUTINE
+cppcoro::generator<const int> RayTrace(const ON_3dRay &ray_init, double flux, RayF &ray_toits, const MeshRayIntersection &mri, MeshRayIntersection::Result &result, CommonInfo *ci, xorshift_rnd_32bit &rnd, RayF &ray_o, double power[3], PathTrace *trace, FirstHit *first_hit, TraceError &error, int &cnt) {
+	cnt = 0;
+#else
+int RayTrace(const ON_3dRay &ray_init, double flux, MeshRayIntersection &mri, CommonInfo *ci, xorshift_rnd_32bit &rnd, RayF &ray_o, double power[3], PathTrace *trace, FirstHit *first_hit, TraceError &error){
+	int cnt = 0;
+	MeshRayIntersection::Result result;
+#endif
+	error = TraceError::NONE;
+	if (first_hit) first_hit->valid = false;
+	// 経路の状態は単精度で持ち、交点と次の始点だけを倍精度で求める
+#ifdef USE_COROUTINE
+	RayF &ray = ray_toits;
+#else
+	RayF ray;
+#endif
+	ray.Set(ray_init.m_P, ray_init.m_V);
+	if (trace) trace->Append(ray.org[0], ray.org[1], ray.org[2], -1, power);
+	bool is_inside = false;
+	bool absorbed = false;
+	// 経路案内の学習中は、拡散反射した頂点を覚えておき、経路の終わりに届いた放射輝度を記録する
+	PathGuide *guide = ci->guide;
+	GuideVertex guide_vertices[GUIDE_MAX_VERTICES];
+	int guide_count = 0;
+
+
+	bool rc;
+	for (;;) {
+		
+#ifdef USE_COROUTINE
+		co_yield 1;
+		if (result.mesh_idx < 0 && result.face_idx < 0) break;
+#else
+		// 23000ms
+		{
+			PROFILE_ZONE("intersect");
+			if (!(rc = mri.RayIntersection(ray, result))) break;
+		}
+#endif
+		++cnt;
+		ON_3dPoint hit_pt = ray.PointAt(result.t);
+		ON_3dVector incident = ray.Direction();
+
+		// flat shading: 1400ms
+		// phong shading: 4200ms
+		ON_3dVector flat_nrm, phong_nrm;
+		{
+			PROFILE_ZONE("normal_interp");
+			mri.Normals(result, flat_nrm, phong_nrm);
+		}
+
+		// 形状番号は geomID そのもの
+		int shape_idx, midx;
+		{
+			PROFILE_ZONE("material_lookup");
+			shape_idx = result.mesh_idx;
+
+			midx = (*ci->shape2matidx)[shape_idx];
+			if (first_hit && cnt == 1) {
+				first_hit->valid = true;
+				first_hit->normal = phong_nrm;
+				first_hit->depth = ray.Origin().DistanceTo(hit_pt);
+				first_hit->shape_idx = shape_idx;
+				if (!ci->materials->Albedo(midx, 3, first_hit->albedo)) first_hit->albedo[0] = first_hit->albedo[1] = first_hit->albedo[2] = 0;
+			}
+
+			// 材質内部の時は吸収係数を適用
+			if (is_inside) {
+				double dist = ray.Origin().DistanceTo(hit_pt);
+				ci->materials->VolumeAttenuate(midx, 3, power, dist);
+			}
+
+		}
+
+		bool is_inside_prev = is_inside;
+		ON_3dVector emit_dir;
+		{
+			// 23800ms
+			PROFILE_ZONE("bsdf");
+			FaceNormalDirectionMode fndm = (*ci->shape2fndm)[shape_idx];
+			GuidedSample guided;
+			int leaf = -1;
+			if (guide) {
+				double pos[3] = { hit_pt.x, hit_pt.y, hit_pt.z };
+				leaf = guide->LeafAt(pos);
+				guided.dist = guide->Distribution(leaf);
+				guided.fraction = guide->Options().fraction;
+			}
+			if (!ci->materials->CalcBSDF(midx, fndm, phong_nrm, incident, is_inside, rnd, 3, power, emit_dir, guide ? &guided : nullptr)){
+				error = TraceError::BSDF;
+				break;
+			}
+			if (guide && guide->Training() && guided.diffuse && guided.pdf > 0 && guide_count < GUIDE_MAX_VERTICES && !emit_dir.IsZero()) {
+				GuideVertex &gv = guide_vertices[guide_count];
+				gv.leaf = leaf;
+				gv.dir[0] = emit_dir.x, gv.dir[1] = emit_dir.y, gv.dir[2] = emit_dir.z;
+				gv.pdf = guided.pdf;
+				gv.throughput = 0.2126 * power[0] + 0.7152 * power[1] + 0.0722 * power[2];
+				if (gv.throughput > 0) ++guide_count;
+			}
+		}
+		{
+			PROFILE_ZONE("validate");
+			// 2220ms
+			// 反射なのに突き抜けている、または、透過なのに同じ媒質内にとどまるケースのチェック。
+			// phong_nrm と flat_nrm のずれにより、曲率の大きいところや diffuse で浅い角度への反射、等で起きやすい。
+			if (ON_DotProduct(phong_nrm, flat_nrm) < 0) flat_nrm.Reverse();
+			// この時点で flat_nrm は incident と反対向きになっている。
+			if (!emit_dir.IsZero()) {
+				bool new_dir_is_reflection = (ON_DotProduct(flat_nrm, emit_dir) > 0);
+				if ((new_dir_is_reflection && (is_inside != is_inside_prev)) || (!new_dir_is_reflection && (is_inside == is_inside_prev))) {
+					error = TraceError::SIDE_MISMATCH;
+					break;
+				}
+			}
+			if (emit_dir.IsZero() || (power[0] == 0 && power[1] == 0 && power[2] == 0)) {
+				ray.Set(ray.Origin(), emit_dir);
+				absorbed = true;
+				break;
+			}
+			if (trace) trace->Append(hit_pt.x, hit_pt.y, hit_pt.z, midx, power);
+			// ロシアンルーレット。打ち切った経路は寄与を 0 とし、生き残った経路の重みを生存確率で割るので偏りは出ない。
+			if (ci->roulette.enabled && cnt >= ci->roulette.min_depth) {
+				double survival = std::min(std::max(std::max(power[0], power[1]), power[2]), ci->roulette.max_survival);
+				if (rnd() >= survival) {
+					power[0] = power[1] = power[2] = 0;
+					ray.Set(ray.Origin(), emit_dir);
+					absorbed = true;
+					break;
+				}
+				for (int h = 0; h < 3; ++h) power[h] /= survival;
+			}
+			// 面から少し離すところは倍精度で計算してから単精度に戻す
+			ray.Set(hit_pt + emit_dir * RAY_IOTA_PROGRESS, emit_dir);
+			if (cnt >= MAX_INTERSECTION_COUNT) {
+				error = TraceError::MAX_INTERSECTION;
+				break;
+			}
+		}
+	}
+
+	if (trace && !absorbed) {
+		ON_3dPoint end = ray.PointAt(TRACE_TERMINAL_LENGTH);
+		trace->Append(end.x, end.y, end.z, -1, power);
+	}
+	if (guide_count > 0 && error == TraceError::NONE) {
+		// 頂点の後ろの重みは (最後の重み / 頂点までの重み) なので、頂点に届いた放射輝度は輝度の比で求める
+		double radiance = 0;
+		if (!absorbed) {
+			ON_3dVector dir = ray.Direction();
+			auto env_rgb = (*ci->environment)(dir);
+			radiance = 0.2126 * env_rgb.r * power[0] + 0.7152 * env_rgb.g * power[1] + 0.0722 * env_rgb.b * power[2];
+		}
+		for (int i = 0; i < guide_count; ++i) {
+			const GuideVertex &gv = guide_vertices[i];
+			guide->Record(gv.leaf, gv.dir, radiance / gv.throughput / gv.pdf);
+		}
+	}
+	ray_o = ray;
+#ifndef USE_COROUTINE
+	return cnt;
+#endif
+}
+
+bool ReadSettings(const char *filename, nlohmann::json &args_doc) {
+	ON_SimpleArray<ON__UINT8> settingfile;
+	if (!ReadFile(filename, settingfile)) {
+		std::fprintf(stderr, "cannot open %s\n", filename);
+		return false;
+	}
+	settingfile.Append(0);
+	args_doc = nlohmann::json::parse(reinterpret_cast<const char *>(settingfile.Array()));
+	return true;
+}
+
+// コマンドラインから "--threads N" を取り除いて N を返す。指定が無ければ 0。
+int TakeThreadsOption(int &argc, char *argv[]) {
+	int threads_count = 0;
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--threads") != 0 || i + 1 >= argc) continue;
+		threads_count = std::atoi(argv[i + 1]);
+		for (int k = i + 2; k < argc; ++k) argv[k - 2] = argv[k];
+		argc -= 2;
+		break;
+	}
+	return threads_count;
+}
+
+// 分散描画での担当範囲。タイル番号を count で割った余りが index のタイルだけを描画する。
+// 乱数の種はタイルとパスで決まるため、全ての担当分を合わせると 1 プロセスで描画した結果と一致する。
+struct Shard {
+	int index, count;
+	bool enabled; ///< --shard が指定された時 true。画像の代わりに累積値をファイルに書き出す。
+	Shard() : index(0), count(1), enabled(false) {}
+	bool Owns(int tile_idx) const {
+		return tile_idx % count == index;
+	}
+	bool IsPartial() const {
+		return count > 1;
+	}
+};
+
+// コマンドラインから "--shard i/N" を取り除いて shard に設定する。書式が不正な時は false。
+bool TakeShardOption(int &argc, char *argv[], Shard &shard) {
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--shard") != 0) continue;
+		int index = -1, count = 0;
+		if (i + 1 >= argc || std::sscanf(argv[i + 1], "%d/%d", &index, &count) != 2 || count < 1 || index < 0 || index >= count) {
+			std::fprintf(stderr, "--shard must be i/N (0 <= i < N).\n");
+			return false;
+		}
+		shard.index = index, shard.count = count;
+		shard.enabled = true;
+		for (int k = i + 2; k < argc; ++k) argv[k - 2] = argv[k];
+		argc -= 2;
+		break;
+	}
+	return true;
+}
+
+// スレッド数はコマンドラインの --threads、設定ファイルの "threads"、ハードウェアのスレッド数の順に優先する。
+// "numa" が指定された時は、ワーカーを NUMA ノード毎に分けて配置する ("nodes" が 0 か省略時は全ノード)。
+std::unique_ptr<TaskPool> CreateTaskPool(nlohmann::json &args_doc, int threads_option) {
+	int threads_count = 0, numa_nodes = 0;
+	bool pin_threads = false;
+	if (args_doc["threads"].is_number()) threads_count = args_doc["threads"];
+	if (threads_option > 0) threads_count = threads_option;
+	if (args_doc["pin_threads"].is_boolean()) pin_threads = args_doc["pin_threads"];
+	auto &jnuma = args_doc["numa"];
+	if (jnuma.is_object()) {
+		numa_nodes = TaskPool::NumaNodeCount();
+		int nodes = jnuma["nodes"].is_number() ? jnuma["nodes"].get<int>() : 0;
+		if (nodes > 0 && nodes < numa_nodes) numa_nodes = nodes;
+	}
+	return std::unique_ptr<TaskPool>(new TaskPool(threads_count, pin_threads, numa_nodes));
+}
+
+// "numa" の "replicate" が true の時、シーンを NUMA ノード毎に複製する
+bool NumaReplicateEnabled(nlohmann::json &args_doc) {
+	auto &jnuma = args_doc["numa"];
+	return jnuma.is_object() && jnuma["replicate"].is_boolean() && jnuma["replicate"];
+}
+
+// 形状ファイル 1 つ分を読み込む。.3dm の Brep・曲面は tess の設定でメッシュにする。
+bool LoadShape(const std::string &filename, double scale, const ON_3dPoint &position, const TessellateOptions &tess, TaskPool &pool, ON_Mesh &shape) {
+	if (std::strstr(filename.c_str(), ".3dm") != 0) {
+		if (!Load3dmMesh(filename.c_str(), tess, pool, shape)) return false;
+		for (int i = 0; i < shape.m_V.Count(); ++i) {
+			shape.m_V[i] *= scale;
+			shape.m_V[i] += ON_3fPoint(position);
+		}
+		if (!shape.HasVertexNormals()) shape.ComputeVertexNormals();
+		return true;
+	} else if (std::strstr(filename.c_str(), ".ply") != 0) {
+		return ConvertFromPLY(filename.c_str(), scale, position, shape);
+	} else if (std::strstr(filename.c_str(), ".stl") != 0){
+		ON_SimpleArray<ON__UINT8> data;
+		if (!ReadFile(filename.c_str(), data)) return false;
+		if (!ConvertFromBinarySTL(data, scale, position, shape)) return false;
+		shape.ComputeVertexNormals();
+		return true;
+	}
+	return false;
+}
+
+// 形状の外接球が画面上で覆う画素数 (カメラ毎の最大値)。
+// どれかのカメラが外接球の中にある時は大きさを決められないので負を返す。
+double ProjectedPixelArea(const ON_Mesh &shape, const Cameras &cameras) {
+	ON_BoundingBox bb = shape.BoundingBox();
+	if (!bb.IsValid()) return 0;
+	ON_3dPoint center = bb.Center();
+	double r = 0.5 * bb.Diagonal().Length();
+	double area = 0;
+	for (int j = 0; j < cameras.cameras.Count(); ++j) {
+		const Cameras::Camera &cmr = cameras.cameras[j];
+		// 隣の画素の初期レイとの間隔は投影面上で 2 * pixelsize
+		double rh, rv;
+		if (cmr.proj_mode == Cameras::Camera::Parallel) {
+			rh = r / (2.0 * cmr.horz_pixelsize), rv = r / (2.0 * cmr.vert_pixelsize);
+		} else {
+			ON_3dVector to_center = center - cmr.origin;
+			double d = to_center.Length();
+			if (d <= r) return -1.0;
+			if (ON_DotProduct(to_center, cmr.eye) < -r) continue; // カメラの後ろ
+			double t = r / std::sqrt(d * d - r * r) * cmr.far_;
+			rh = t / (2.0 * cmr.horz_pixelsize), rv = t / (2.0 * cmr.vert_pixelsize);
+		}
+		double pixels = static_cast<double>(cmr.pixel_width) * cmr.pixel_height;
+		area = std::max(area, std::min(ON_PI * rh * rv, pixels));
+	}
+	return area;
+}
+
+// 読み込んだシーン一式
+// 複数フレームの動画。例:
+// "frames": {
+//   "count": 24,
+//   "shapes": [ { "index": 1, "keys": [ { "frame": 0 }, { "frame": 23, "translation": [10, 0, 0], "rotation_axis": [0, 0, 1], "rotation_deg": 90, "rotation_center": [0, 0, 0] } ] } ],
+//   "cameras": [ { "index": 0, "keys": [ { "frame": 0 }, { "frame": 23, "origin": [0, -100, 20], "eye_dir": [0, 1, 0] } ] } ]
+// }
+// 形状は読み込んだ位置からの剛体変換 (rotation_center 周りに回転した後に平行移動) で動かす。
+// カメラのキーで省略した項目は "cameras" の値を使う。キーの間は線形に補間し、最初と最後のキーの外側はその値のままにする。
+// 出力ファイル名には拡張子の前に _0000 形式のフレーム番号を付ける。
+struct Animation {
+	struct ShapeKey {
+		int frame;
+		ON_3dVector translation, rotation_axis;
+		double rotation_deg;
+		ON_3dPoint rotation_center;
+		ON_Xform Xform() const {
+			ON_Xform rot, tr;
+			if (rotation_axis.IsZero() || rotation_deg == 0) rot.Identity();
+			else rot.Rotation(rotation_deg * ON_PI / 180.0, rotation_axis, rotation_center);
+			tr.Translation(translation);
+			return tr * rot;
+		}
+	};
+	struct CameraKey {
+		int frame;
+		ON_3dPoint origin;
+		ON_3dVector eye, horz, vert;
+	};
+	struct ShapeTrack {
+		int index;
+		std::vector<ShapeKey> keys;
+	};
+	struct CameraTrack {
+		int index;
+		std::vector<CameraKey> keys;
+	};
+	int frame_count; ///< 0 の時は動画ではない
+	std::vector<ShapeTrack> shape_tracks;
+	std::vector<CameraTrack> camera_tracks;
+	std::vector<ON_Xform> shape_xforms;   ///< 現在の形状毎の変換
+	std::vector<ON_String> base_filenames; ///< カメラ毎のフレーム番号を付ける前の出力ファイル名
+	int frame;                             ///< 現在のフレーム番号 (ApplyFrame で設定)
+
+	Animation() : frame_count(0), frame(0) {}
+
+	bool Enabled() const {
+		return frame_count > 0;
+	}
+
+	// キーで動かす形状には true を入れる。
+	std::vector<bool> AnimatedShapes(int shape_count) const {
+		std::vector<bool> animated(shape_count, false);
+		for (size_t i = 0; i < shape_tracks.size(); ++i) animated[shape_tracks[i].index] = true;
+		return animated;
+	}
+
+	bool Parse(nlohmann::json &jframes, int shape_count, const Cameras &cameras) {
+		if (!jframes.is_object()) return true;
+		if (!jframes["count"].is_number() || jframes["count"].get<int>() <= 0) {
+			std::fprintf(stderr, "frames: count must be a positive number.\n");
+			return false;
+		}
+		frame_count = jframes["count"];
+		shape_xforms.assign(shape_count, ON_Xform(1));
+
+		auto &jshapes = jframes["shapes"];
+		for (size_t i = 0; jshapes.is_array() && i < jshapes.size(); ++i) {
+			auto &jtrack = jshapes[i];
+			ShapeTrack track;
+			track.index = jtrack["index"].is_number() ? jtrack["index"].get<int>() : -1;
+			if (track.index < 0 || track.index >= shape_count) {
+				std::fprintf(stderr, "frames: shape index %d is out of range.\n", track.index);
+				return false;
+			}
+			auto &jkeys = jtrack["keys"];
+			for (size_t k = 0; jkeys.is_array() && k < jkeys.size(); ++k) {
+				auto &jkey = jkeys[k];
+				ShapeKey key;
+				key.frame = jkey["frame"].is_number() ? jkey["frame"].get<int>() : 0;
+				key.translation = ON_3dVector(0, 0, 0);
+				key.rotation_axis = ON_3dVector(0, 0, 0);
+				key.rotation_center = ON_3dPoint(0, 0, 0);
+				read_3real(jkey["translation"], static_cast<double *>(key.translation));
+				read_3real(jkey["rotation_axis"], static_cast<double *>(key.rotation_axis));
+				read_3real(jkey["rotation_center"], static_cast<double *>(key.rotation_center));
+				key.rotation_deg = jkey["rotation_deg"].is_number() ? jkey["rotation_deg"].get<double>() : 0.0;
+				track.keys.push_back(key);
+			}
+			if (track.keys.empty()) continue;
+			std::sort(track.keys.begin(), track.keys.end(), [](const ShapeKey &a, const ShapeKey &b) { return a.frame < b.frame; });
+			shape_tracks.push_back(track);
+		}
+
+		auto &jcameras = jframes["cameras"];
+		for (size_t i = 0; jcameras.is_array() && i < jcameras.size(); ++i) {
+			auto &jtrack = jcameras[i];
+			CameraTrack track;
+			track.index = jtrack["index"].is_number() ? jtrack["index"].get<int>() : -1;
+			if (track.index < 0 || track.index >= cameras.cameras.Count()) {
+				std::fprintf(stderr, "frames: camera index %d is out of range.\n", track.index);
+				return false;
+			}
+			const Cameras::Camera &cmr = cameras.cameras[track.index];
+			auto &jkeys = jtrack["keys"];
+			for (size_t k = 0; jkeys.is_array() && k < jkeys.size(); ++k) {
+				auto &jkey = jkeys[k];
+				CameraKey key;
+				key.frame = jkey["frame"].is_number() ? jkey["frame"].get<int>() : 0;
+				key.origin = cmr.origin, key.eye = cmr.eye, key.horz = cmr.horz, key.vert = cmr.vert;
+				read_3real_if_present(jkey["origin"], static_cast<double *>(key.origin));
+				read_3real_if_present(jkey["eye_dir"], static_cast<double *>(key.eye));
+				read_3real_if_present(jkey["horz_dir"], static_cast<double *>(key.horz));
+				read_3real_if_present(jkey["vert_dir"], static_cast<double *>(key.vert));
+				// 軸を正規化できないキーは補間前に弾き、正規化した軸を持たせる
+				Cameras::Camera axes;
+				axes.eye = key.eye, axes.horz = key.horz, axes.vert = key.vert;
+				if (!axes.NormalizeAxes()) {
+					std::fprintf(stderr, "frames: camera # %d, frame %d: invalid camera axes.\n", track.index + 1, key.frame);
+					return false;
+				}
+				key.eye = axes.eye, key.horz = axes.horz, key.vert = axes.vert;
+				track.keys.push_back(key);
+			}
+			if (track.keys.empty()) continue;
+			std::sort(track.keys.begin(), track.keys.end(), [](const CameraKey &a, const CameraKey &b) { return a.frame < b.frame; });
+			camera_tracks.push_back(track);
+		}
+
+		for (int j = 0; j < cameras.cameras.Count(); ++j) base_filenames.push_back(cameras.cameras[j].output_filename);
+		return true;
+	}
+
+	// frame を挟む 2 つのキーと、その間の比率 t を求める。
+	template <typename K> static void Bracket(const std::vector<K> &keys, int frame, const K *&a, const K *&b, double &t) {
+		size_t n = 1;
+		while (n < keys.size() && keys[n].frame <= frame) ++n;
+		a = &keys[n - 1];
+		b = (n < keys.size()) ? &keys[n] : a;
+		t = (b->frame > a->frame && frame > a->frame) ? static_cast<double>(frame - a->frame) / (b->frame - a->frame) : 0.0;
+	}
+
+	static ON_Xform ShapeXform(const ShapeTrack &track, int frame) {
+		const ShapeKey *a, *b;
+		double t;
+		Bracket(track.keys, frame, a, b, t);
+		ShapeKey key = *a;
+		key.translation = a->translation * (1.0 - t) + b->translation * t;
+		key.rotation_center = a->rotation_center * (1.0 - t) + b->rotation_center * t;
+		key.rotation_deg = a->rotation_deg * (1.0 - t) + b->rotation_deg * t;
+		// 回転軸はキー同士で向きが揃っていることを前提に補間する
+		ON_3dVector axis = a->rotation_axis * (1.0 - t) + b->rotation_axis * t;
+		if (!axis.IsZero()) key.rotation_axis = axis;
+		return key.Xform();
+	}
+
+	static void PlaceCamera(const CameraTrack &track, int frame, Cameras::Camera &cmr) {
+		const CameraKey *a, *b;
+		double t;
+		Bracket(track.keys, frame, a, b, t);
+		cmr.origin = a->origin * (1.0 - t) + b->origin * t;
+		cmr.eye = a->eye * (1.0 - t) + b->eye * t;
+		cmr.horz = a->horz * (1.0 - t) + b->horz * t;
+		cmr.vert = a->vert * (1.0 - t) + b->vert * t;
+		if (!cmr.NormalizeAxes()) {
+			cmr.eye = a->eye, cmr.horz = a->horz, cmr.vert = a->vert;
+		}
+		cmr.UpdatePlane();
+	}
+
+	// 拡張子の前にフレーム番号を付ける。
+	static ON_String FrameFilename(const ON_String &base, int frame) {
+		const char *s = static_cast<const char *>(base);
+		const char *dot = std::strrchr(s, '.');
+		const char *slash = std::max(std::strrchr(s, '/'), std::strrchr(s, '\\'));
+		size_t stem = (dot && dot > slash) ? static_cast<size_t>(dot - s) : std::strlen(s);
+		char num[16];
+		std::snprintf(num, sizeof(num), "_%04d", frame);
+		return ON_String((std::string(s, stem) + num + (s + stem)).c_str());
+	}
+};
+
+struct SceneData {
+	ON_ClassArray<ON_Mesh> shapes;
+	ON_SimpleArray<int> shape2matidx;
+	ON_SimpleArray<FaceNormalDirectionMode> shape2fndm;
+	// 全てのメッシュの合成
+	ON_Mesh cshape;
+
+	// 合成後の面番号から合成前の形状番号を取得するために使用する。
+	ON_SimpleArray<unsigned int> shapeidx2fidx;
+	// 形状毎の合成後の頂点の開始位置。動画で形状を動かす時に使用する。
+	ON_SimpleArray<unsigned int> shapeidx2vidx;
+	Animation animation;
+
+	std::unique_ptr<Materials> mats;
+	std::unique_ptr<Environment> environment;
+	std::unique_ptr<LightSources> light_src;
+	std::unique_ptr<Cameras> cameras;
+	CommonInfo ci;
+	MeshRayIntersection mri;
+	// "out_of_core" の時のブリックファイル。この時 shapes, cshape は空のまま。
+	std::unique_ptr<OutOfCoreScene> ooc;
+	// "path_guiding" の時の学習した分布。NUMA ノードの複製でも共有する。
+	std::unique_ptr<PathGuide> guide;
+	// 経路の記録 ("path_capture")。リングバッファはワーカー毎。
+	PathCapture path_capture;
+
+	// NUMA ノード毎に複製した読み取り専用のデータ。描画中はワーカーのノードの複製を参照する。
+	struct Replica {
+		ON_Mesh cshape;
+		std::unique_ptr<Materials> mats;
+		std::unique_ptr<Environment> environment;
+		CommonInfo ci;
+		MeshRayIntersection mri;
+	};
+	std::vector<std::unique_ptr<Replica> > replicas;
+
+	// 描画で参照するデータ一式
+	struct View {
+		MeshRayIntersection *mri;
+		CommonInfo *ci;
+	};
+	View GetView(int node) {
+		View v;
+		if (node >= 0 && node < static_cast<int>(replicas.size())) {
+			v.mri = &replicas[node]->mri, v.ci = &replicas[node]->ci;
+		} else {
+			v.mri = &mri, v.ci = &ci;
+		}
+		return v;
+	}
+};
+
+// 形状ファイル、材質の BSDF の表、環境光はそれぞれ独立しているので、pool 上で並行して読み込む。
+void LoadScene(nlohmann::json &args_doc, SceneData &sd, TaskPool &pool) {
+	auto &jshapes = args_doc["shapes"];
+	auto &jmats = args_doc["materials"];
+	auto &jenv = args_doc["environment"];
+
+	// 形状毎の設定は json への同時アクセスを避けるため、先にメインスレッドで取り出しておく。
+	struct ShapeSource {
+		std::string filename;
+		double scale;
+		ON_3dPoint position;
+		TessellateOptions tess;
+		TriangleBudget budget;
+	};
+	std::vector<ShapeSource> sources;
+	TessellateOptions tess_default;
+	tess_default.Parse(args_doc["tessellation"]);
+	TriangleBudget budget_default;
+	budget_default.Parse(args_doc["triangle_budget"]);
+	if (jshapes.is_array()){
+		for (size_t k = 0; k < jshapes.size(); ++k){
+			sd.shapes.AppendNew();
+			auto &jshape = jshapes[k];
+
+			auto &jfacedir = jshape["face_direction"];
+			FaceNormalDirectionMode fndm = FaceNormalDirectionMode::AUTO;
+			if (jfacedir == "outer") {
+				fndm = FaceNormalDirectionMode::OUTER;
+			} else if (jfacedir == "inner") {
+				fndm = FaceNormalDirectionMode::INNER;
+			}
+			sd.shape2fndm.Append(fndm);
+
+			ShapeSource src;
+			src.filename = jshape["filename"].get<std::string>();
+			auto &jscale = jshape["scale"];
+			src.scale = jscale.is_number() ? static_cast<double>(jscale) : 1.0;
+			read_3real(jshape["position"], src.position);
+			src.tess = tess_default;
+			src.tess.Parse(jshape["tessellation"]);
+			src.budget = budget_default;
+			src.budget.Parse(jshape["triangle_budget"]);
+			sources.push_back(src);
+		}
+	}
+
+	// 材質の定義
+	auto mats_future = pool.Submit([&]() {
+		sd.mats.reset(new Materials(jmats, jshapes, sd.shape2matidx, &pool));
+	});
+
+	// 環境光の定義
+	std::fprintf(stderr, "Defining environment.\n");
+	auto env_future = pool.Submit([&]() {
+		sd.environment.reset(new Environment(jenv, &pool));
+	});
+
+	// 光源データ
+	std::fprintf(stderr, "Defining lightsource.\n");
+	sd.light_src.reset(new LightSources(args_doc["lightsources"]));
+
+	// カメラ
+	std::fprintf(stderr, "Definig cameras.\n");
+	sd.cameras.reset(new Cameras(args_doc["cameras"]));
+	if (!sd.animation.Parse(args_doc["frames"], sd.shapes.Count(), *sd.cameras)) {
+		std::fprintf(stderr, "frames are ignored.\n");
+		sd.animation = Animation();
+	}
+	OutOfCoreOptions ooc_opt;
+	ooc_opt.Parse(args_doc["out_of_core"]);
+	if (ooc_opt.Enabled() && sd.animation.Enabled()) {
+		// ブリックファイルの形状は動かせない
+		std::fprintf(stderr, "frames are ignored in out_of_core mode.\n");
+		sd.animation = Animation();
+	}
+
+	std::fprintf(stderr, "Reading shapes.\n");
+	{
+		PROFILE_ZONE("load_shapes");
+		for (size_t k = 0; k < sources.size(); ++k) {
+			if (sources[k].filename.size()) std::fprintf(stderr, "  %s\n", sources[k].filename.c_str());
+		}
+		auto load_shape = [&](int k, ON_Mesh &shape) {
+			const ShapeSource &src = sources[k];
+			if (src.filename.empty()) return false;
+			if (!LoadShape(src.filename, src.scale, src.position, src.tess, pool, shape)) return false;
+			if (!src.budget.enabled) return true;
+			// 動画ではカメラ・形状が動くので、画面上の大きさは使わず max_triangles だけで減らす
+			int64_t triangles = TriangleCount(shape);
+			int64_t target = src.budget.Target(triangles, sd.animation.Enabled() ? -1.0 : ProjectedPixelArea(shape, *sd.cameras));
+			if (target >= triangles) return true;
+			if (DecimateMesh(shape, target, src.budget, pool)) {
+				std::fprintf(stderr, "  %s: %lld -> %lld triangles\n", src.filename.c_str(), static_cast<long long>(triangles), static_cast<long long>(TriangleCount(shape)));
+			} else {
+				std::fprintf(stderr, "  %s: decimation failed, keeping %lld triangles\n", src.filename.c_str(), static_cast<long long>(triangles));
+			}
+			return true;
+		};
+		if (ooc_opt.Enabled()) {
+			// 形状を 1 つずつ読み込んでブリックファイルに書き出し、主記憶には残さない。
+			// 形状の設定が変わっていなければ前回のファイルを使う。画面上の大きさで減らす時はカメラも結果に影響する。
+			std::string source = jshapes.dump() + args_doc["tessellation"].dump() + args_doc["triangle_budget"].dump();
+			if (std::any_of(sources.begin(), sources.end(), [](const ShapeSource &src) { return src.budget.enabled; })) source += args_doc["cameras"].dump();
+			uint64_t source_key = MeshCache::ContentHash(source.data(), source.size(), pool);
+			sd.ooc.reset(new OutOfCoreScene());
+			if (!OutOfCoreScene::Build(ooc_opt, static_cast<int>(sources.size()), source_key, load_shape, pool) || !sd.ooc->Open(ooc_opt, source_key)) {
+				std::fprintf(stderr, "out_of_core: cannot use %s, loading shapes in memory.\n", ooc_opt.path.c_str());
+				sd.ooc.reset();
+			}
+		}
+		if (!sd.ooc) {
+			pool.ParallelFor(0, static_cast<int>(sources.size()), [&](int k) {
+				load_shape(k, sd.shapes[k]);
+			});
+		}
+	}
+
+	std::fprintf(stderr, "Constructing tree.\n");
+	sd.shapeidx2fidx.Append(0U);
+	sd.shapeidx2vidx.Append(0U);
+	for (int k = 0; k < sd.shapes.Count(); ++k){
+		sd.cshape.Append(sd.shapes[k]);
+		sd.shapeidx2fidx.Append(*sd.shapeidx2fidx.Last() + sd.shapes[k].FaceCount());
+		sd.shapeidx2vidx.Append(*sd.shapeidx2vidx.Last() + sd.shapes[k].VertexCount());
+	}
+
+	CommonInfo &ci = sd.ci;
+	ci.scene.Initialize(&sd.cshape, sd.shapeidx2fidx, sd.shapeidx2vidx, sd.animation.AnimatedShapes(sd.shapes.Count()), pool);
+	if (sd.ooc) {
+		float bmin[3], bmax[3];
+		sd.ooc->Bounds(bmin, bmax);
+		ON_BoundingBox bb(ON_3dPoint(bmin[0], bmin[1], bmin[2]), ON_3dPoint(bmax[0], bmax[1], bmax[2]));
+		ci.scene.rough_radius = bb.Diagonal().Length() * 0.5;
+		ci.scene.model_center = bb.Center();
+	}
+
+	mats_future.get();
+	env_future.get();
+
+	LightSources &light_src = *sd.light_src;
+	ci.light_src = sd.light_src.get();
+	ci.materials = sd.mats.get();
+	ci.environment = sd.environment.get();
+	ci.roulette.Parse(args_doc["russian_roulette"]);
+	{
+		PathGuideOptions guide_opt;
+		guide_opt.Parse(args_doc["path_guiding"]);
+		if (guide_opt.enabled) {
+			const ON_3dPoint &c = ci.scene.model_center;
+			double r = ci.scene.rough_radius;
+			double bmin[3] = { c.x - r, c.y - r, c.z - r }, bmax[3] = { c.x + r, c.y + r, c.z + r };
+			// 保存した分布が同じシーンのものか確かめるため、放射輝度に影響する設定のハッシュを渡す
+			std::string source = args_doc["shapes"].dump() + args_doc["tessellation"].dump() + args_doc["triangle_budget"].dump() +
+				args_doc["materials"].dump() + args_doc["environment"].dump() + args_doc["lightsources"].dump();
+			uint64_t scene_key = MeshCache::ContentHash(source.data(), source.size(), pool);
+			sd.guide.reset(new PathGuide(guide_opt));
+			sd.guide->Reset(bmin, bmax, scene_key);
+			// 読み込めない時は学習し直す
+			if (!guide_opt.load.empty()) sd.guide->Load(guide_opt.load.c_str());
+		}
+	}
+	ci.guide = sd.guide.get();
+	ci.cnt_10 = light_src.RayCount() / 10;
+	ci.ray_cursor = 0;
+	ci.shapeidx2fidx = &sd.shapeidx2fidx;
+	ci.shape2matidx = &sd.shape2matidx;
+	ci.shape2fndm = &sd.shape2fndm;
+
+	{
+		ON_ClassArray<ON_ClassArray<ON_3dRay> > &raies_last = ci.raies_last;
+		raies_last.SetCapacity(light_src.LSCount());
+		raies_last.SetCount(light_src.LSCount());
+		ON_ClassArray<ON_SimpleArray<double> > &flux_last = ci.flux_last;
+		flux_last.SetCapacity(light_src.LSCount());
+		flux_last.SetCount(light_src.LSCount());
+		for (int i = 0; i < light_src.LSCount(); ++i){
+			raies_last[i].SetCapacity(light_src.RayCount(i));
+			raies_last[i].SetCount(raies_last[i].Capacity());
+			flux_last[i].SetCapacity(light_src.RayCount(i));
+			flux_last[i].SetCount(flux_last[i].Capacity());
+		}
+	}
+	sd.mri.Initialize(&sd.cshape, &ci.scene.scene, &sd.shapeidx2fidx);
+	sd.mri.ooc = sd.ooc.get();
+}
+
+// 形状・BVH・環境マップ・材質の表を pool の NUMA ノード毎に複製する。
+// 複製はそのノードのワーカー上で行うため、メモリは first-touch でそのノードに確保される。
+void ReplicateScene(nlohmann::json &args_doc, SceneData &sd, TaskPool &pool) {
+	PROFILE_ZONE("replicate_scene");
+	sd.replicas.clear();
+	if (pool.NodeCount() <= 1) return;
+	if (sd.ooc) {
+		// ブリックファイルはページキャッシュを全ノードで共有する
+		std::fprintf(stderr, "NUMA replication is not used in out_of_core mode.\n");
+		return;
+	}
+	std::fprintf(stderr, "Replicating scene for %d NUMA nodes.\n", pool.NodeCount());
+	auto &jshapes = args_doc["shapes"];
+	auto &jmats = args_doc["materials"];
+	sd.replicas.resize(pool.NodeCount());
+	std::vector<std::future<void> > futures;
+	for (int node = 0; node < pool.NodeCount(); ++node) {
+		futures.push_back(pool.SubmitOnNode(node, [&sd, &pool, &jshapes, &jmats, node]() {
+			std::unique_ptr<SceneData::Replica> r(new SceneData::Replica());
+			r->cshape = sd.cshape;
+			r->environment.reset(new Environment(*sd.environment));
+			ON_SimpleArray<int> shape2matidx;
+			r->mats.reset(new Materials(jmats, jshapes, shape2matidx, &pool));
+			r->ci.scene.Initialize(&r->cshape, sd.shapeidx2fidx, sd.shapeidx2vidx, sd.animation.AnimatedShapes(sd.shapes.Count()), pool);
+
+			CommonInfo &ci = r->ci;
+			ci.light_src = sd.ci.light_src;
+			ci.materials = r->mats.get();
+			ci.environment = r->environment.get();
+			ci.roulette = sd.ci.roulette;
+			ci.guide = sd.ci.guide;
+			ci.cnt_10 = sd.ci.cnt_10;
+			ci.ray_cursor = 0;
+			ci.shapeidx2fidx = sd.ci.shapeidx2fidx;
+			ci.shape2matidx = sd.ci.shape2matidx;
+			ci.shape2fndm = sd.ci.shape2fndm;
+			r->mri.Initialize(&r->cshape, &ci.scene.scene, &sd.shapeidx2fidx);
+			sd.replicas[node] = std::move(r);
+		}));
+	}
+	for (size_t i = 0; i < futures.size(); ++i) futures[i].get();
+}
+
+// 読み込んだ位置の形状 src を xf で動かし、合成後のメッシュ dst の頂点 v0・面 f0 からの範囲に書き込む。
+void PlaceShape(const ON_Mesh &src, const ON_Xform &xf, ON_Mesh &dst, unsigned int v0, unsigned int f0) {
+	for (int i = 0; i < src.m_V.Count(); ++i) {
+		dst.m_V[v0 + i] = xf * ON_3dPoint(src.m_V[i]);
+	}
+	if (src.m_N.Count() == src.m_V.Count() && dst.m_N.Count() == dst.m_V.Count()) {
+		for (int i = 0; i < src.m_N.Count(); ++i) dst.m_N[v0 + i] = xf * ON_3dVector(src.m_N[i]);
+	}
+	if (src.m_FN.Count() == src.m_F.Count() && dst.m_FN.Count() == dst.m_F.Count()) {
+		for (int i = 0; i < src.m_FN.Count(); ++i) dst.m_FN[f0 + i] = xf * ON_3dVector(src.m_FN[i]);
+	}
+	dst.InvalidateBoundingBoxes();
+}
+
+// frame の位置に形状とカメラを動かす。前のフレームから変換が変わった形状だけ頂点を書き換えて refit する。
+// NUMA ノード毎の複製も、そのノードのワーカーで同じように更新する。
+void ApplyFrame(SceneData &sd, int frame, TaskPool &pool) {
+	PROFILE_ZONE("apply_frame");
+	Animation &anim = sd.animation;
+	std::vector<int> moved;
+	for (size_t i = 0; i < anim.shape_tracks.size(); ++i) {
+		const Animation::ShapeTrack &track = anim.shape_tracks[i];
+		ON_Xform xf = Animation::ShapeXform(track, frame);
+		ON_Xform &cur = anim.shape_xforms[track.index];
+		if (std::memcmp(&xf, &cur, sizeof(ON_Xform)) == 0) continue;
+		cur = xf;
+		moved.push_back(track.index);
+	}
+
+	if (moved.size()) {
+		auto update = [&sd, &moved, &pool](ON_Mesh &cshape, CommonInfo::Scene &scene) {
+			pool.ParallelFor(0, static_cast<int>(moved.size()), [&](int m) {
+				int k = moved[m];
+				PlaceShape(sd.shapes[k], sd.animation.shape_xforms[k], cshape, sd.shapeidx2vidx[k], sd.shapeidx2fidx[k]);
+			});
+			for (size_t m = 0; m < moved.size(); ++m) {
+				int k = moved[m];
+				scene.UpdateShape(k, sd.shapeidx2vidx[k], sd.shapeidx2vidx[k + 1]);
+			}
+			scene.Commit(pool);
+		};
+		update(sd.cshape, sd.ci.scene);
+		std::vector<std::future<void> > futures;
+		for (int node = 0; node < static_cast<int>(sd.replicas.size()); ++node) {
+			SceneData::Replica *r = sd.replicas[node].get();
+			futures.push_back(pool.SubmitOnNode(node, [r, &update]() {
+				update(r->cshape, r->ci.scene);
+			}));
+		}
+		for (size_t i = 0; i < futures.size(); ++i) futures[i].get();
+	}
+
+	anim.frame = frame;
+	ON_ClassArray<Cameras::Camera> &cameras = sd.cameras->cameras;
+	for (size_t i = 0; i < anim.camera_tracks.size(); ++i) {
+		Animation::PlaceCamera(anim.camera_tracks[i], frame, cameras[anim.camera_tracks[i].index]);
+	}
+	for (int j = 0; j < cameras.Count(); ++j) {
+		cameras[j].output_filename = Animation::FrameFilename(anim.base_filenames[j], frame);
+	}
+}
+
+#ifdef USE_COROUTINE
+struct col_item {
+	cppcoro::generator<const int> instance;
+	cppcoro::generator<const int>::iterator iter;
+	bool started;
+	col_item() : started(false) {}
+	bool next() {
+		if (!started) {
+			iter = instance.begin();
+			started = true;
+			return true;
+		} else if (iter != instance.end()) {
+			++iter;
+			return true;
+		}
+		return false;
+	}
+	double value() {
+		*iter;
+	}
+};
+#endif
+
+#define TILE_SIZE 32
+// 段階的な描画でない時に 1 つのタスクで計算するパス数。続きは共有キューに回し、タイル間の偏りを均す。
+#define TILE_PASS_CHUNK 8
+
+// カメラ 1 台分の描画。画像を TILE_SIZE 四方のタイルに分け、タイル毎に数パスずつ描画するタスクにする。
+// 乱数の種はカメラ・タイル・パス毎に決めるため、スレッド数や実行順によらず同じ画像になる。
+struct CameraRender {
+	Cameras::Camera *camera;
+	int camera_idx;
+	SceneData *sd;
+	RenderTelemetry *telemetry;
+	int tiles_x, tiles_y;
+	std::atomic<int> tiles_remaining;
+
+	struct pixel_accum_item {
+		double rgb[3];
+		int counter_per_pass_performed;
+	};
+	ON_SimpleArray<pixel_accum_item> pixel_accum;
+
+	// AOV 用の累積値。カメラで AOV が指定された時のみ確保する。
+	struct aov_accum_item {
+		double lum_sq;    ///< 輝度の二乗和 (分散用)
+		double albedo[3];
+		double normal[3];
+		double depth;
+		int shape;        ///< 最初のサンプルが当たった形状の番号 + 1 (0 は未設定)
+	};
+	ON_SimpleArray<aov_accum_item> aov_accum;
+
+	// このプロセスで描画するタイルの番号。段階的な描画で ROI がある時は ROI に掛かるタイルを先に並べる。
+	std::vector<int> tiles;
+	// 段階的な描画の時のみ使う。タイル毎に、一巡毎に書き写したプレビュー用の累積値と、その排他制御。
+	ON_SimpleArray<pixel_accum_item> preview_accum;
+	std::unique_ptr<std::mutex[]> preview_locks;
+	std::atomic<bool> preview_pending;
+	std::chrono::steady_clock::time_point last_preview;
+	// 時間指定の描画の締め切り (steady_clock の値。0 はまだ始まっていない)。
+	// 締め切りを過ぎると、各タイルは計算中のパスを終えたところで止める。
+	std::atomic<int64_t> deadline_ticks;
+	bool Budgeted() const {
+		return camera->time_budget_sec > 0;
+	}
+	// 締め切りはカメラの最初のタイルが動き出した時から数える。2 回目以降は何もしない。
+	void StartBudget() {
+		if (deadline_ticks.load(std::memory_order_relaxed) != 0) return;
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(camera->time_budget_sec));
+		int64_t expected = 0;
+		deadline_ticks.compare_exchange_strong(expected, static_cast<int64_t>(deadline.time_since_epoch().count()));
+	}
+	// pass_end までのパスを計算したタイルに続きがあるか
+	bool TileHasMore(int tile_idx, int pass_end) const {
+		if (Budgeted()) return static_cast<int64_t>(std::chrono::steady_clock::now().time_since_epoch().count()) < deadline_ticks.load(std::memory_order_relaxed);
+		return pass_end < TilePasses(tile_idx);
+	}
+
+	void init(Cameras::Camera *camera_, int camera_idx_, SceneData *sd_, const Shard &shard = Shard()) {
+		camera = camera_, camera_idx = camera_idx_, sd = sd_;
+		telemetry = nullptr;
+		tiles_x = (camera->pixel_width + TILE_SIZE - 1) / TILE_SIZE;
+		tiles_y = (camera->pixel_height + TILE_SIZE - 1) / TILE_SIZE;
+		tiles.clear();
+		for (int t = 0; t < tiles_x * tiles_y; ++t) {
+			if (shard.Owns(t)) tiles.push_back(t);
+		}
+		if (camera->progressive.enabled) {
+			std::stable_partition(tiles.begin(), tiles.end(), [this](int t) { return InRoi(t); });
+		}
+		tiles_remaining = TileCount();
+		deadline_ticks = 0;
+		pixel_accum.SetCapacity(camera->pixel_width * camera->pixel_height);
+		pixel_accum.SetCount(pixel_accum.Capacity());
+		pixel_accum.Zero();
+		if ((camera->aovs & ~AOV_SAMPLES) || camera->denoise) {
+			aov_accum.SetCapacity(pixel_accum.Count());
+			aov_accum.SetCount(aov_accum.Capacity());
+			aov_accum.Zero();
+		}
+		preview_pending = false;
+		last_preview = std::chrono::steady_clock::now();
+		if (camera->progressive.enabled) {
+			preview_accum.SetCapacity(pixel_accum.Count());
+			preview_accum.SetCount(preview_accum.Capacity());
+			preview_accum.Zero();
+			preview_locks.reset(new std::mutex[tiles_x * tiles_y]);
+		}
+	}
+	int TileCount() const {
+		return static_cast<int>(tiles.size());
+	}
+
+	// タイルが ROI に掛かるか。ROI は出力画像 (上下左右が反転) の座標で指定する。
+	bool InRoi(int tile_idx) const {
+		const ProgressiveOptions &prog = camera->progressive;
+		if (!prog.enabled || !prog.HasRoi()) return false;
+		int x0 = (tile_idx % tiles_x) * TILE_SIZE, y0 = (tile_idx / tiles_x) * TILE_SIZE;
+		int x1 = x0 + TILE_SIZE, y1 = y0 + TILE_SIZE;
+		int rx0 = camera->pixel_width - prog.roi[2], rx1 = camera->pixel_width - prog.roi[0];
+		int ry0 = camera->pixel_height - prog.roi[3], ry1 = camera->pixel_height - prog.roi[1];
+		return x0 < rx1 && rx0 < x1 && y0 < ry1 && ry0 < y1;
+	}
+	// タイルのパス数と一度に計算するパス数。段階的な描画でない時は TILE_PASS_CHUNK パスずつ計算する。
+	int TilePasses(int tile_idx) const {
+		return InRoi(tile_idx) ? camera->pass * camera->progressive.roi_pass_scale : camera->pass;
+	}
+	int TileStep(int tile_idx) const {
+		if (!camera->progressive.enabled) return Budgeted() ? 1 : TILE_PASS_CHUNK;
+		return InRoi(tile_idx) ? camera->progressive.step_passes * camera->progressive.roi_pass_scale : camera->progressive.step_passes;
+	}
+	// 全タイルの作業単位 (パス) の数。時間指定の時は事前に分からないため -1。
+	int64_t TotalUnits() const {
+		if (Budgeted()) return -1;
+		int64_t units = 0;
+		for (int t : tiles) units += TilePasses(t);
+		return units;
+	}
+
+	// タイル内の画素について f(pixel_index) を呼ぶ。
+	template <typename F> void ForEachTilePixel(int tile_idx, const F &f) const {
+		int x0 = (tile_idx % tiles_x) * TILE_SIZE, y0 = (tile_idx / tiles_x) * TILE_SIZE;
+		int x1 = std::min(x0 + TILE_SIZE, camera->pixel_width), y1 = std::min(y0 + TILE_SIZE, camera->pixel_height);
+		for (int iy = y0; iy < y1; ++iy) {
+			for (int ix = x0; ix < x1; ++ix) f(iy * camera->pixel_width + ix);
+		}
+	}
+	// 一巡分を計算し終えたタイルの累積値をプレビュー用に書き写す。
+	void PublishTile(int tile_idx) {
+		std::lock_guard<std::mutex> lock(preview_locks[tile_idx]);
+		ForEachTilePixel(tile_idx, [this](int pi) { preview_accum[pi] = pixel_accum[pi]; });
+	}
+	// 描画中のプレビュー用の累積値を dst に写す。ワーカーはタイル毎のロックを書き写す間しか待たない。
+	void SnapshotPreview(CameraRender &dst) {
+		dst.camera = camera, dst.camera_idx = camera_idx, dst.sd = sd;
+		dst.pixel_accum.SetCapacity(pixel_accum.Count());
+		dst.pixel_accum.SetCount(pixel_accum.Count());
+		dst.pixel_accum.Zero();
+		for (int t : tiles) {
+			std::lock_guard<std::mutex> lock(preview_locks[t]);
+			ForEachTilePixel(t, [this, &dst](int pi) { dst.pixel_accum[pi] = preview_accum[pi]; });
+		}
+	}
+
+	static uint64_t splitmix64(uint64_t x) {
+		x += 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+	void SeedRandom(xorshift_rnd_32bit &rnd, int tile_idx, int pass) const {
+		uint64_t key = splitmix64((static_cast<uint64_t>(camera_idx) << 48) ^ (static_cast<uint64_t>(tile_idx) << 24) ^ static_cast<uint64_t>(pass));
+		rnd.init(key | 1, splitmix64(key) | 1);
+	}
+
+	// 画素内でずらした初期光線
+	ON_3dRay JitteredRay(int pixel_index, xorshift_rnd_32bit &rnd) const {
+		ON_3dRay ray_init = camera->RayInit(pixel_index);
+		double inte, frac = std::modf(rnd()*65536.0, &inte);
+		inte /= 65536.0;
+		double ru = (inte - 0.5) * camera->horz_pixelsize;
+		double rv = (frac - 0.5) * camera->vert_pixelsize;
+
+		ON_Plane &pln = camera->pln;
+		ray_init.m_P += pln.xaxis * ru + pln.yaxis * rv;
+		return ray_init;
+	}
+
+	void Accumulate(CommonInfo *ci, int pixel_index, const RayF &ray_o, const double power[3], const FirstHit &first_hit) {
+		PROFILE_ZONE("env_lookup");
+		auto &accum = pixel_accum[pixel_index];
+		ON_3dVector dir = ray_o.Direction();
+		auto env_rgb = (*ci->environment)(dir);
+		double rgb[3] = { env_rgb.r * power[0], env_rgb.g * power[1], env_rgb.b * power[2] };
+		accum.rgb[0] += rgb[0];
+		accum.rgb[1] += rgb[1];
+		accum.rgb[2] += rgb[2];
+		++accum.counter_per_pass_performed;
+		if (aov_accum.Count() == 0) return;
+		auto &aov = aov_accum[pixel_index];
+		double lum = Luminance(rgb);
+		aov.lum_sq += lum * lum;
+		if (first_hit.valid) {
+			for (int h = 0; h < 3; ++h) {
+				aov.albedo[h] += first_hit.albedo[h];
+				aov.normal[h] += first_hit.normal[h];
+			}
+			aov.depth += first_hit.depth;
+			if (aov.shape == 0) aov.shape = first_hit.shape_idx + 1;
+		}
+	}
+	static inline double Luminance(const double rgb[3]) {
+		return 0.2126 * rgb[0] + 0.7152 * rgb[1] + 0.0722 * rgb[2];
+	}
+	// 経路を記録する時だけ trace を記録先にする
+	PathTrace *CaptureTarget(PathTrace &trace, int pixel_index, int pass) const {
+		PathCapture &capture = sd->path_capture;
+		if (!capture.Sample(camera_idx, pixel_index, pass)) return nullptr;
+		trace.Begin(&capture.ring(TaskPool::WorkerIndex()), camera_idx, pixel_index, pass);
+		return &trace;
+	}
+	// AOV が必要な時だけ最初の衝突点を記録する
+	FirstHit *FirstHitTarget(FirstHit &first_hit) const {
+		first_hit.valid = false;
+		return (aov_accum.Count() > 0) ? &first_hit : nullptr;
+	}
+
+#ifdef USE_COROUTINE
+	cppcoro::generator<const int> TracePixels(SceneData::View view, int x0, int y0, int x1, int y1, int pass, int coroutine_idx, xorshift_rnd_32bit &rnd, RenderTelemetry::Slot &stats, RayF &ray_toitc, MeshRayIntersection::Result &result) {
+		int tile_width = x1 - x0, count = tile_width * (y1 - y0);
+		for (int i = coroutine_idx; i < count; i += SIMD_COUNT) {
+			int pixel_index = (y0 + i / tile_width) * camera->pixel_width + x0 + i % tile_width;
+			if (!camera->Covered(pixel_index)) continue;
+			ON_3dRay ray_init = JitteredRay(pixel_index, rnd);
+			RayF ray_o;
+			double power[3] = { 1, 1, 1 };
+			TraceError error = TraceError::NONE;
+			FirstHit first_hit;
+			int cnt;
+			PathTrace trace;
+			auto rt = RayTrace(ray_init, 1.0, ray_toitc, *view.mri, result, view.ci, rnd, ray_o, power, CaptureTarget(trace, pixel_index, pass), FirstHitTarget(first_hit), error, cnt);
+			for (auto iter = rt.begin(); iter != rt.end(); ++iter) {
+				co_yield *iter;
+			}
+			stats.RecordPath(cnt, error);
+			if (error != TraceError::NONE) continue;
+			Accumulate(view.ci, pixel_index, ray_o, power, first_hit);
+		}
+	}
+#else
+	void TracePixel(const SceneData::View &view, int pixel_index, int pass, xorshift_rnd_32bit &rnd, RenderTelemetry::Slot &stats) {
+		if (!camera->Covered(pixel_index)) return;
+		PROFILE_SAMPLED_ZONE("path");
+		ON_3dRay ray_init = JitteredRay(pixel_index, rnd);
+
+		RayF ray_o;
+		double power[3] = { 1, 1, 1 };
+		TraceError error = TraceError::NONE;
+		FirstHit first_hit;
+		PathTrace trace;
+		int cnt = RayTrace(ray_init, 1.0, *view.mri, view.ci, rnd, ray_o, power, CaptureTarget(trace, pixel_index, pass), FirstHitTarget(first_hit), error);
+		stats.RecordPath(cnt, error);
+		if (error != TraceError::NONE) return;
+		Accumulate(view.ci, pixel_index, ray_o, power, first_hit);
+	}
+#endif
+
+	// タイルのパス [pass_begin, pass_end) を計算する。パス毎に乱数を初期化するため、区切り方によらず結果は同じ。
+	void RenderTile(int tile_idx, int pass_begin, int pass_end) {
+		PROFILE_ZONE("tile");
+		telemetry->Begin();
+		if (Budgeted()) StartBudget();
+		RenderTelemetry::Slot &stats = telemetry->slot(TaskPool::WorkerIndex());
+		SceneData::View view = sd->GetView(TaskPool::WorkerNode());
+		int pixel_width = camera->pixel_width;
+		int x0 = (tile_idx % tiles_x) * TILE_SIZE, y0 = (tile_idx / tiles_x) * TILE_SIZE;
+		int x1 = std::min(x0 + TILE_SIZE, pixel_width), y1 = std::min(y0 + TILE_SIZE, camera->pixel_height);
+		xorshift_rnd_32bit rnd;
+#ifdef USE_COROUTINE
+		RayF ray_toitc[SIMD_COUNT];
+		MeshRayIntersection::Result results[SIMD_COUNT];
+#endif
+		for (int k = pass_begin; k < pass_end; ++k) {
+			SeedRandom(rnd, tile_idx, k);
+#ifdef USE_COROUTINE
+			col_item cols[SIMD_COUNT];
+			for (int i = 0; i < SIMD_COUNT; ++i) {
+				cols[i].instance = TracePixels(view, x0, y0, x1, y1, k, i, rnd, stats, ray_toitc[i], results[i]);
+			}
+			for (;;) {
+				bool end_all = true;
+				for (int i = 0; i < SIMD_COUNT; ++i) {
+					bool end_this = !cols[i].next();
+					if (end_this) ray_toitc[i].SetNull();
+					end_all &= end_this;
+				}
+				if (end_all) break;
+				view.mri->RayIntersection8(ray_toitc, results);
+			}
+#else
+			for (int iy = y0; iy < y1; ++iy) {
+				for (int ix = x0; ix < x1; ++ix) {
+					TracePixel(view, iy * pixel_width + ix, k, rnd, stats);
+				}
+			}
+#endif
+			telemetry->UnitDone();
+		}
+		if (preview_locks) PublishTile(tile_idx);
+	}
+};
+
+// 累積値から出力用の画像 (上下左右反転済み) を作る。layers[0] がカラー (RGB) で、カメラで指定された AOV が続く。
+// カメラで雑音除去が指定された時は、特徴量を使ってカラーの雑音を除去する。どちらも pool があれば行の帯毎に並列に行う。
+// I/O スレッドから呼んだ時は帯を共有キューの先頭に入れるので、描画中でも残りのタイルを待たずに終わる。
+void ResolveImage(Cameras::Camera &cmr, Environment &environment, const CameraRender &cr, std::vector<ImageLayer> &layers, TaskPool *pool = nullptr) {
+	int pixel_width = cmr.pixel_width;
+	int pixel_height = cmr.pixel_height;
+	size_t pixel_count = static_cast<size_t>(pixel_width) * pixel_height;
+	layers.clear();
+	layers.push_back(ImageLayer("color", "R,G,B", pixel_count));
+	std::vector<float> &color = layers[0].pixels;
+	std::vector<float> samples;
+	if (cmr.aovs & AOV_SAMPLES) samples.assign(pixel_count, 0.0f);
+	bool has_features = (cr.aov_accum.Count() > 0);
+	FeatureBuffers fb;
+	if (has_features) fb.Allocate(pixel_width, pixel_height);
+
+	// 16 行の帯毎に並列に処理する。出力先の画素は帯毎に重ならない。
+	const int ROWS = 16;
+	ParallelFor(pool, 0, (pixel_height + ROWS - 1) / ROWS, [&](int band) {
+		int y1 = std::min((band + 1) * ROWS, pixel_height);
+		for (int iy = band * ROWS, pi_y = iy * pixel_width; iy < y1; ++iy, pi_y += pixel_width) {
+			for (int ix = 0; ix < pixel_width; ++ix) {
+				int pixel_index = pi_y + ix;
+				size_t dst = static_cast<size_t>(pixel_height - iy - 1) * pixel_width + (pixel_width - ix - 1);
+				double rgb[3];
+				if (!cmr.Covered(pixel_index)) {
+					ON_3dVector dir = cmr.RayInit(ix, iy).m_V;
+					auto env_rgb = environment(dir);
+					rgb[0] = env_rgb.r;
+					rgb[1] = env_rgb.g;
+					rgb[2] = env_rgb.b;
+				} else {
+					auto &accum = cr.pixel_accum[pixel_index];
+					int n = accum.counter_per_pass_performed;
+					double inv_cppp = (n > 0) ? 1.0 / static_cast<double>(n) : 0.0;
+					for (int h = 0; h < 3; ++h) {
+						rgb[h] = accum.rgb[h] * inv_cppp;
+					}
+					if (samples.size()) samples[dst] = static_cast<float>(n);
+					if (has_features && n > 0) {
+						auto &aov = cr.aov_accum[pixel_index];
+						fb.mask[dst] = 1;
+						if (n > 1) {
+							// 標本分散をサンプル数で割り、平均値の分散にする
+							double mean = CameraRender::Luminance(rgb);
+							double var = (aov.lum_sq - mean * mean * n) / static_cast<double>(n - 1);
+							fb.variance[dst] = static_cast<float>(std::max(var, 0.0) / n);
+						}
+						for (int h = 0; h < 3; ++h) {
+							fb.albedo[dst * 3 + h] = static_cast<float>(aov.albedo[h] * inv_cppp);
+							fb.normal[dst * 3 + h] = static_cast<float>(aov.normal[h] * inv_cppp);
+						}
+						fb.depth[dst] = static_cast<float>(aov.depth * inv_cppp);
+					}
+				}
+				for (int h = 0; h < 3; ++h) {
+					color[dst * 3 + h] = static_cast<float>(rgb[h]);
+				}
+			}
+		}
+	});
+
+	if (cmr.denoise && has_features) DenoiseImage(color, fb, cmr.denoise_opt, pool);
+
+	if (samples.size()) {
+		layers.push_back(ImageLayer("samples", "Y", 0, true));
+		layers.back().pixels.swap(samples);
+	}
+	if (!has_features) return;
+	if (cmr.aovs & AOV_VARIANCE) {
+		layers.push_back(ImageLayer("variance", "Y", 0));
+		layers.back().pixels.swap(fb.variance);
+	}
+	if (cmr.aovs & AOV_ALBEDO) {
+		layers.push_back(ImageLayer("albedo", "R,G,B", 0));
+		layers.back().pixels.swap(fb.albedo);
+	}
+	if (cmr.aovs & AOV_NORMAL) {
+		layers.push_back(ImageLayer("normal", "X,Y,Z", 0));
+		layers.back().pixels.swap(fb.normal);
+	}
+	if (cmr.aovs & AOV_DEPTH) {
+		layers.push_back(ImageLayer("depth", "Z", 0));
+		layers.back().pixels.swap(fb.depth);
+	}
+	if (cmr.aovs & AOV_SHAPE_ID) {
+		// 形状番号は平均できないため、最初のサンプルが当たった形状とする。背景は -1。
+		ImageLayer id("shape_id", "Y", pixel_count, true);
+		for (int iy = 0, pi_y = 0; iy < pixel_height; ++iy, pi_y += pixel_width) {
+			for (int ix = 0; ix < pixel_width; ++ix) {
+				size_t dst = static_cast<size_t>(pixel_height - iy - 1) * pixel_width + (pixel_width - ix - 1);
+				id.pixels[dst] = static_cast<float>(cr.aov_accum[pi_y + ix].shape - 1);
+			}
+		}
+		layers.push_back(id);
+	}
+}
+
+// EXR 以外は 8 bit の sRGB に変換して gd で書き出す (pool があれば並列に変換する)。
+void WriteImage(const ON_String &filename, Cameras::Camera &cmr, const std::vector<ImageLayer> &layers, const ExrOptions &exr_opt, TaskPool *pool = nullptr) {
+	PROFILE_ZONE("write_image");
+	if (filename.Right(4) == ".exr") {
+		WriteEXR(filename, cmr.pixel_width, cmr.pixel_height, layers, exr_opt);
+		return;
+	}
+	gdImagePtr ldr = gdImageCreateTrueColor(cmr.pixel_width, cmr.pixel_height);
+	ToneMapToRGB8(layers[0].pixels.data(), cmr.pixel_width, cmr.pixel_height, cmr.tonemap, ldr->tpixels, pool);
+	::gdImageFile(ldr, filename);
+	::gdImageDestroy(ldr);
+}
+void WriteImage(Cameras::Camera &cmr, const std::vector<ImageLayer> &layers, const ExrOptions &exr_opt, TaskPool *pool = nullptr) {
+	WriteImage(cmr.output_filename, cmr, layers, exr_opt, pool);
+}
+
+// 分散描画の累積値ファイル。ヘッダーに続けて、背景画素のフラグ、pixel_accum、(あれば) aov_accum をそのまま並べる。
+// frame は動画のフレーム番号で、動画でない時は -1。
+struct AccumFileHeader {
+	char magic[8];
+	int32_t camera_idx, frame, pixel_width, pixel_height, pass;
+	int32_t shard_index, shard_count;
+	uint32_t aovs;
+	int32_t aov_accum_count;
+	uint32_t pixel_item_size, aov_item_size;
+};
+static const char ACCUM_FILE_MAGIC[8] = { 'P', 'R', 'T', 'A', 'C', 'C', '0', '2' };
+
+std::string AccumFilename(const Cameras::Camera &cmr, const Shard &shard) {
+	char suffix[64];
+	std::snprintf(suffix, sizeof(suffix), ".shard%d-%d.acc", shard.index, shard.count);
+	return std::string(static_cast<const char *>(cmr.output_filename)) + suffix;
+}
+
+bool WriteAccumulation(const CameraRender &cr, const Shard &shard, int frame, const char *filename) {
+	PROFILE_ZONE("write_accumulation");
+	const Cameras::Camera &cmr = *cr.camera;
+	AccumFileHeader h;
+	std::memcpy(h.magic, ACCUM_FILE_MAGIC, sizeof(h.magic));
+	h.camera_idx = cr.camera_idx;
+	h.frame = frame;
+	h.pixel_width = cmr.pixel_width, h.pixel_height = cmr.pixel_height, h.pass = cmr.pass;
+	h.shard_index = shard.index, h.shard_count = shard.count;
+	h.aovs = cmr.aovs;
+	h.aov_accum_count = cr.aov_accum.Count();
+	h.pixel_item_size = sizeof(CameraRender::pixel_accum_item), h.aov_item_size = sizeof(CameraRender::aov_accum_item);
+
+	std::vector<uint8_t> no_intersection(static_cast<size_t>(cmr.pixel_width) * cmr.pixel_height);
+	for (size_t i = 0; i < no_intersection.size(); ++i) no_intersection[i] = cmr.Covered(static_cast<int>(i)) ? 0 : 1;
+
+	std::unique_ptr<FILE, decltype(&std::fclose)> fp(std::fopen(filename, "wb"), std::fclose);
+	if (!fp) {
+		std::fprintf(stderr, "cannot open %s\n", filename);
+		return false;
+	}
+	bool ok = std::fwrite(&h, sizeof(h), 1, fp.get()) == 1;
+	ok = ok && std::fwrite(no_intersection.data(), 1, no_intersection.size(), fp.get()) == no_intersection.size();
+	ok = ok && std::fwrite(cr.pixel_accum.Array(), sizeof(CameraRender::pixel_accum_item), cr.pixel_accum.Count(), fp.get()) == static_cast<size_t>(cr.pixel_accum.Count());
+	if (cr.aov_accum.Count() > 0) {
+		ok = ok && std::fwrite(cr.aov_accum.Array(), sizeof(CameraRender::aov_accum_item), cr.aov_accum.Count(), fp.get()) == static_cast<size_t>(cr.aov_accum.Count());
+	}
+	if (!ok) std::fprintf(stderr, "cannot write %s\n", filename);
+	return ok;
+}
+
+// 累積値ファイルを読み、cr の累積値に加える。cr は h のカメラで init 済みであること。
+// 背景画素のフラグはカメラの coverage に設定する。
+bool AddAccumulation(FILE *fp, const AccumFileHeader &h, CameraRender &cr) {
+	Cameras::Camera &cmr = *cr.camera;
+	std::vector<uint8_t> no_intersection(static_cast<size_t>(cmr.pixel_width) * cmr.pixel_height);
+	if (std::fread(no_intersection.data(), 1, no_intersection.size(), fp) != no_intersection.size()) return false;
+	for (size_t i = 0; i < no_intersection.size(); ++i) cmr.SetCovered(static_cast<int>(i), no_intersection[i] == 0);
+
+	std::vector<CameraRender::pixel_accum_item> accum(cr.pixel_accum.Count());
+	if (std::fread(accum.data(), sizeof(CameraRender::pixel_accum_item), accum.size(), fp) != accum.size()) return false;
+	for (size_t i = 0; i < accum.size(); ++i) {
+		auto &dst = cr.pixel_accum[static_cast<int>(i)];
+		for (int k = 0; k < 3; ++k) dst.rgb[k] += accum[i].rgb[k];
+		dst.counter_per_pass_performed += accum[i].counter_per_pass_performed;
+	}
+	if (h.aov_accum_count > 0) {
+		std::vector<CameraRender::aov_accum_item> aov(h.aov_accum_count);
+		if (std::fread(aov.data(), sizeof(CameraRender::aov_accum_item), aov.size(), fp) != aov.size()) return false;
+		for (size_t i = 0; i < aov.size(); ++i) {
+			auto &dst = cr.aov_accum[static_cast<int>(i)];
+			dst.lum_sq += aov[i].lum_sq;
+			for (int k = 0; k < 3; ++k) {
+				dst.albedo[k] += aov[i].albedo[k];
+				dst.normal[k] += aov[i].normal[k];
+			}
+			dst.depth += aov[i].depth;
+			if (dst.shape == 0) dst.shape = aov[i].shape;
+		}
+	}
+	return true;
+}
+
+// 描画が終わったカメラの画像を受け取る。layers[0] がカラー (RGB)。I/O スレッドから呼ばれる。
+typedef std::function<void(int camera_idx, std::vector<ImageLayer> &layers)> ImageHandler;
+
+// 描画が終わったカメラの累積値を受け取る。I/O スレッドから呼ばれる。
+typedef std::function<void(CameraRender &cr)> RenderHandler;
+
+// 累積値から画像を作って on_image に渡す
+RenderHandler ResolveTo(SceneData &sd, TaskPool &pool, ImageHandler on_image) {
+	return [&sd, &pool, on_image](CameraRender &cr) {
+		std::vector<ImageLayer> layers;
+		{
+			PROFILE_ZONE("resolve_image");
+			ResolveImage(*cr.camera, *sd.environment, cr, layers, &pool);
+		}
+		on_image(cr.camera_idx, layers);
+	};
+}
+
+// camera_indices のカメラを 1 つのジョブグラフとして描画する。
+// 全カメラのタイルをまとめて投入するため、ワーカーは前のカメラの完了を待たずに次のカメラのタイルへ進む。
+// 各カメラの最後のタイルが終わると、on_done を I/O スレッドで呼び、画像の作成や書き出しを描画と並行させる。
+// shard が指定された時は担当のタイルだけを描画する。
+void RenderCameras(SceneData &sd, const std::vector<int> &camera_indices, TaskPool &pool, SerialQueue &io, FILE *telemetry_out, double telemetry_interval, const RenderHandler &on_done, std::vector<RenderTelemetry::Totals> &totals, const Shard &shard = Shard()) {
+	PROFILE_ZONE("render");
+	size_t ncam = camera_indices.size();
+	totals.resize(ncam);
+
+	// 一回通り衝突判定して、衝突しないところを背景として確定させる
+	for (size_t c = 0; c < ncam; ++c) {
+		sd.cameras->cameras[camera_indices[c]].IntersectionTest(sd.mri, pool);
+	}
+
+	std::vector<std::unique_ptr<CameraRender> > crs(ncam);
+	std::vector<std::unique_ptr<RenderTelemetry> > telemetries(ncam);
+	int total_tiles = 0;
+	for (size_t c = 0; c < ncam; ++c) {
+		int j = camera_indices[c];
+		auto &cmr = sd.cameras->cameras[j];
+		crs[c].reset(new CameraRender());
+		crs[c]->init(&cmr, j, &sd, shard);
+		if (crs[c]->TileCount() == 0) {
+			// 担当のタイルが無い (分散描画で画像が小さい) 時は空の累積値をそのまま渡す
+			CameraRender *cr = crs[c].get();
+			io.Post([cr, &on_done]() { on_done(*cr); });
+			continue;
+		}
+		telemetries[c].reset(new RenderTelemetry(telemetry_out, j, pool.Count(), cmr.pass, crs[c]->TileCount(), telemetry_interval, crs[c]->TotalUnits()));
+		if (crs[c]->Budgeted()) telemetries[c]->SetTimeBudget(cmr.time_budget_sec);
+		crs[c]->telemetry = telemetries[c].get();
+		total_tiles += crs[c]->TileCount();
+	}
+
+	// 経路案内の学習。全カメラのタイルを 1, 2, 4, ... パスずつ計算し、反復毎に分布を作り直す。
+	// 学習中のパスもそのまま画像に足し、本計算は続きのパスから始める。時間指定のカメラは学習も含めて締め切りを数える。
+	int guide_passes = 0;
+	if (sd.guide && !sd.guide->Trained() && total_tiles > 0) {
+		PROFILE_ZONE("guide_training");
+		std::vector<std::pair<CameraRender *, int> > jobs;
+		for (size_t c = 0; c < ncam; ++c) {
+			for (int t : crs[c]->tiles) jobs.push_back(std::make_pair(crs[c].get(), t));
+		}
+		int training_passes = sd.guide->Options().training_passes;
+		for (int n = 1; guide_passes < training_passes; n *= 2) {
+			int pass_begin = guide_passes, pass_end = std::min(guide_passes + n, training_passes);
+			sd.guide->BeginIteration();
+			pool.ParallelFor(0, static_cast<int>(jobs.size()), [&jobs, pass_begin, pass_end](int i) {
+				CameraRender *cr = jobs[i].first;
+				int t = jobs[i].second;
+				cr->RenderTile(t, pass_begin, cr->Budgeted() ? pass_end : std::min(pass_end, cr->TilePasses(t)));
+			});
+			sd.guide->EndIteration(pass_end - pass_begin);
+			guide_passes = pass_end;
+		}
+	}
+
+	// 本計算
+	// タイル毎に TileStep パスずつ計算し、続きは共有キューの末尾に回す。
+	// 時間指定のカメラは締め切りまでパスを重ね、全タイルが止まった時点で telemetry に完了を伝える。
+	TaskPool::Latch tiles_done(total_tiles);
+	std::function<void(CameraRender *, int, int)> run_tile = [&pool, &io, &on_done, &tiles_done, &run_tile](CameraRender *cr, int t, int pass_begin) {
+		int pass_end = pass_begin + cr->TileStep(t);
+		if (!cr->Budgeted()) pass_end = std::min(pass_end, cr->TilePasses(t));
+		cr->RenderTile(t, pass_begin, pass_end);
+		if (cr->TileHasMore(t, pass_end)) {
+			pool.SpawnShared([&run_tile, cr, t, pass_end]() { run_tile(cr, t, pass_end); });
+			return;
+		}
+		if (cr->tiles_remaining.fetch_sub(1) == 1) {
+			if (cr->Budgeted()) cr->telemetry->Finish();
+			io.Post([cr, &on_done]() { on_done(*cr); });
+		}
+		tiles_done.CountDown();
+	};
+	for (size_t c = 0; c < ncam; ++c) {
+		CameraRender *cr = crs[c].get();
+		for (int t : cr->tiles) {
+			pool.Spawn([&run_tile, cr, t, guide_passes]() { run_tile(cr, t, guide_passes); });
+		}
+	}
+
+	// 段階的な描画のプレビューは、専用のスレッドが間隔を見て I/O スレッドに書き出させる
+	bool progressive = false;
+	for (size_t c = 0; c < ncam; ++c) progressive |= (telemetries[c] && crs[c]->camera->progressive.enabled);
+	std::mutex preview_mtx;
+	std::condition_variable preview_cv;
+	bool preview_stop = false;
+	std::thread preview_thread;
+	if (progressive) {
+		preview_thread = std::thread([&]() {
+			std::unique_lock<std::mutex> lock(preview_mtx);
+			while (!preview_cv.wait_for(lock, std::chrono::milliseconds(100), [&]() { return preview_stop; })) {
+				auto now = std::chrono::steady_clock::now();
+				for (size_t c = 0; c < ncam; ++c) {
+					CameraRender *cr = crs[c].get();
+					const ProgressiveOptions &prog = cr->camera->progressive;
+					if (!telemetries[c] || !prog.enabled || cr->tiles_remaining.load() == 0) continue;
+					if (std::chrono::duration<double>(now - cr->last_preview).count() < prog.interval_sec) continue;
+					// 前のプレビューを書き出し中の時は飛ばす
+					if (cr->preview_pending.exchange(true)) continue;
+					cr->last_preview = now;
+					io.Post([cr, &sd, &pool]() {
+						PROFILE_ZONE("preview");
+						CameraRender snapshot;
+						cr->SnapshotPreview(snapshot);
+						std::vector<ImageLayer> layers;
+						ResolveImage(*cr->camera, *sd.environment, snapshot, layers, &pool);
+						WriteImage(cr->camera->progressive.preview_filename, *cr->camera, layers, ExrOptions(), &pool);
+						cr->preview_pending = false;
+					});
+				}
+			}
+		});
+	}
+	for (size_t c = 0; c < ncam; ++c) {
+		if (!telemetries[c]) {
+			totals[c] = RenderTelemetry::Totals();
+			continue;
+		}
+		RenderTelemetry &telemetry = *telemetries[c];
+		telemetry.WaitForCompletion();
+		telemetry.EmitSummary();
+		telemetry.Sum(totals[c]);
+	}
+	pool.Wait(tiles_done);
+	if (preview_thread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(preview_mtx);
+			preview_stop = true;
+		}
+		preview_cv.notify_all();
+		preview_thread.join();
+	}
+	io.Drain();
+}
+
+// 性能測定。乱数の種とパス数を固定してサンプルシーンを描画し、
+// 併せて主要な処理単体の速度を測って JSON で出力する。
+// 使い方: Polygon_RayTrace --bench <設定ファイル> <出力ファイル> [パス数] [--threads N]
+int RunBenchmark(int argc, char *argv[], int threads_option) {
+	if (argc < 2) {
+		std::fprintf(stderr, "usage: Polygon_RayTrace --bench <settings.json> <report.json> [passes] [--threads N]\n");
+		return 1;
+	}
+	int passes = (argc >= 3) ? std::atoi(argv[2]) : 8;
+	if (passes <= 0) passes = 1;
+
+	nlohmann::json args_doc;
+	if (!ReadSettings(argv[0], args_doc)) return 1;
+
+	auto now = []() {
+		return std::chrono::steady_clock::now();
+	};
+	auto msec = [](std::chrono::steady_clock::time_point t1, std::chrono::steady_clock::time_point t2) {
+		return std::chrono::duration<double, std::milli>(t2 - t1).count();
+	};
+	// 乱数による単位ベクトル
+	auto random_dir = [](xorshift_rnd_32bit &rnd) {
+		double z = rnd() * 2.0 - 1.0, phi = rnd() * 2.0 * ON_PI;
+		double r = std::sqrt(std::max(0.0, 1.0 - z * z));
+		return ON_3dVector(r * std::cos(phi), r * std::sin(phi), z);
+	};
+
+	std::unique_ptr<TaskPool> pool = CreateTaskPool(args_doc, threads_option);
+	nlohmann::json report;
+	report["settings"] = argv[0];
+	report["threads"] = pool->Count();
+	report["passes"] = passes;
+	nlohmann::json micro;
+
+	// PLY ローダー
+	{
+		nlohmann::json jply = nlohmann::json::array();
+		auto &jshapes = args_doc["shapes"];
+		for (size_t k = 0; jshapes.is_array() && k < jshapes.size(); ++k) {
+			std::string filename = jshapes[k]["filename"].get<std::string>();
+			if (std::strstr(filename.c_str(), ".ply") == 0) continue;
+			ON_Mesh mesh;
+			auto t1 = now();
+			bool rc = ConvertFromPLY(filename.c_str(), 1.0, ON_3dPoint::Origin, mesh);
+			auto t2 = now();
+			nlohmann::json j;
+			j["filename"] = filename;
+			j["loaded"] = rc;
+			j["triangles"] = mesh.FaceCount();
+			j["vertices"] = mesh.VertexCount();
+			j["msec"] = msec(t1, t2);
+			j["triangles_per_sec"] = mesh.FaceCount() / (msec(t1, t2) * 0.001);
+			jply.push_back(j);
+		}
+		micro["ply_loader"] = jply;
+	}
+
+	SceneData sd;
+	{
+		auto t1 = now();
+		LoadScene(args_doc, sd, *pool);
+		if (NumaReplicateEnabled(args_doc)) ReplicateScene(args_doc, sd, *pool);
+		auto t2 = now();
+		report["load_scene_msec"] = msec(t1, t2);
+		report["triangles"] = sd.ooc ? static_cast<int64_t>(sd.ooc->TriangleCount()) : static_cast<int64_t>(sd.cshape.FaceCount());
+	}
+
+	// BSDF_Sampler::create (材質の定義時にまとめて作られるため、材質一式の構築時間で測る)
+	{
+		ON_SimpleArray<int> shape2matidx;
+		auto t1 = now();
+		Materials mats(args_doc["materials"], args_doc["shapes"], shape2matidx);
+		auto t2 = now();
+		Materials mats_mt(args_doc["materials"], args_doc["shapes"], shape2matidx, pool.get());
+		auto t3 = now();
+		nlohmann::json j;
+		j["materials"] = mats.Count();
+		j["msec"] = msec(t1, t2);
+		j["msec_parallel"] = msec(t2, t3);
+		micro["bsdf_sampler_create"] = j;
+	}
+
+	// CalcBSDF (形状に割り当てられた材質毎)
+	{
+		const int N = 1 << 18;
+		nlohmann::json jbsdf = nlohmann::json::array();
+		ON_SimpleArray<int> midxs;
+		for (int k = 0; k < sd.shape2matidx.Count(); ++k) {
+			int midx = sd.shape2matidx[k];
+			if (midx >= 0 && midxs.Search(midx) < 0) midxs.Append(midx);
+		}
+		for (int m = 0; m < midxs.Count(); ++m) {
+			xorshift_rnd_32bit rnd;
+			rnd.init(444, 2531);
+			int failed = 0;
+			double sum = 0;
+			auto t1 = now();
+			for (int i = 0; i < N; ++i) {
+				ON_3dVector nrm(0, 0, 1), incident = random_dir(rnd), emit_dir;
+				bool in_medium = false;
+				double power[3] = { 1, 1, 1 };
+				if (!sd.mats->CalcBSDF(midxs[m], FaceNormalDirectionMode::AUTO, nrm, incident, in_medium, rnd, 3, power, emit_dir)) ++failed;
+				sum += power[0] + emit_dir.z;
+			}
+			auto t2 = now();
+			nlohmann::json j;
+			j["material"] = midxs[m];
+			j["calls"] = N;
+			j["failed"] = failed;
+			j["msec"] = msec(t1, t2);
+			j["calls_per_sec"] = N / (msec(t1, t2) * 0.001);
+			j["checksum"] = sum / N;
+			jbsdf.push_back(j);
+		}
+		micro["calc_bsdf"] = jbsdf;
+	}
+
+	// RayIntersection (カメラからの一次光線と、モデル中心からの無作為な方向の光線)
+	{
+		const int N = 1 << 20;
+		nlohmann::json jisect;
+		xorshift_rnd_32bit rnd;
+		rnd.init(444, 2531);
+		MeshRayIntersection::Result result;
+		if (sd.cameras->cameras.Count() > 0) {
+			auto &cmr = sd.cameras->cameras[0];
+			int pixels = cmr.pixel_width * cmr.pixel_height;
+			int hits = 0;
+			auto t1 = now();
+			for (int i = 0; i < N; ++i) {
+				if (sd.mri.RayIntersection(cmr.RayInit(i % pixels), result)) ++hits;
+			}
+			auto t2 = now();
+			nlohmann::json j;
+			j["rays"] = N;
+			j["hits"] = hits;
+			j["msec"] = msec(t1, t2);
+			j["rays_per_sec"] = N / (msec(t1, t2) * 0.001);
+			jisect["coherent"] = j;
+		}
+		{
+			int hits = 0;
+			auto t1 = now();
+			for (int i = 0; i < N; ++i) {
+				ON_3dRay ray;
+				ray.m_P = sd.ci.scene.model_center;
+				ray.m_V = random_dir(rnd);
+				if (sd.mri.RayIntersection(ray, result)) ++hits;
+			}
+			auto t2 = now();
+			nlohmann::json j;
+			j["rays"] = N;
+			j["hits"] = hits;
+			j["msec"] = msec(t1, t2);
+			j["rays_per_sec"] = N / (msec(t1, t2) * 0.001);
+			jisect["incoherent"] = j;
+		}
+		micro["ray_intersection"] = jisect;
+	}
+
+	// 環境マップの参照
+	{
+		const int N = 1 << 22;
+		xorshift_rnd_32bit rnd;
+		rnd.init(444, 2531);
+		double sum = 0;
+		auto t1 = now();
+		for (int i = 0; i < N; ++i) {
+			ON_3dVector dir = random_dir(rnd);
+			auto rgb = (*sd.environment)(dir);
+			sum += rgb.r + rgb.g + rgb.b;
+		}
+		auto t2 = now();
+		nlohmann::json j;
+		j["lookups"] = N;
+		j["msec"] = msec(t1, t2);
+		j["lookups_per_sec"] = N / (msec(t1, t2) * 0.001);
+		j["checksum"] = sum / N;
+		micro["environment_lookup"] = j;
+	}
+	report["micro"] = micro;
+
+	// サンプルシーンの描画 (画像は書き出さない)
+	SerialQueue io;
+	int camera_count = sd.cameras->cameras.Count();
+	// 結果の比較用に画素値の平均を出す
+	std::vector<double> means(camera_count * 3, 0.0);
+	ImageHandler mean_of_image = [&means](int j, std::vector<ImageLayer> &layers) {
+		const std::vector<float> &rgb = layers[0].pixels;
+		size_t pixels = rgb.size() / 3;
+		double mean[3] = { 0, 0, 0 };
+		for (size_t i = 0; i < pixels; ++i) {
+			for (int h = 0; h < 3; ++h) mean[h] += rgb[i * 3 + h];
+		}
+		for (int h = 0; h < 3; ++h) means[j * 3 + h] = (pixels > 0) ? mean[h] / pixels : 0.0;
+	};
+	double sequential_msec = 0;
+	{
+		nlohmann::json jcmrs = nlohmann::json::array();
+		for (int j = 0; j < camera_count; ++j) {
+			auto &cmr = sd.cameras->cameras[j];
+			// 計測はパス数で揃えるので、時間指定は使わない
+			if (cmr.time_budget_sec > 0 || cmr.pass <= 0 || cmr.pass > passes) cmr.pass = passes;
+			cmr.time_budget_sec = 0;
+			std::vector<RenderTelemetry::Totals> totals_list;
+			auto t1 = now();
+			RenderCameras(sd, std::vector<int>(1, j), *pool, io, nullptr, 0, ResolveTo(sd, *pool, mean_of_image), totals_list);
+			auto t2 = now();
+			sequential_msec += msec(t1, t2);
+			RenderTelemetry::Totals &totals = totals_list[0];
+
+			nlohmann::json jc;
+			jc["camera"] = j;
+			jc["width"] = cmr.pixel_width;
+			jc["height"] = cmr.pixel_height;
+			jc["passes"] = cmr.pass;
+			jc["msec"] = msec(t1, t2);
+			jc["paths"] = totals.paths;
+			jc["intersections"] = totals.intersections;
+			jc["errors"] = totals.ErrorCount();
+			jc["rays_per_sec"] = totals.intersections / (msec(t1, t2) * 0.001);
+			jc["paths_per_sec"] = totals.paths / (msec(t1, t2) * 0.001);
+			jc["mean_rgb"] = { means[j * 3], means[j * 3 + 1], means[j * 3 + 2] };
+			jcmrs.push_back(jc);
+			std::fprintf(stderr, "camera # %d: %f msec.\n", j + 1, msec(t1, t2));
+		}
+		report["render"] = jcmrs;
+	}
+	// 全カメラをまとめて描画した時の時間 (カメラ毎に描画した時の合計との比較用)
+	{
+		std::vector<int> all_cameras;
+		for (int j = 0; j < camera_count; ++j) all_cameras.push_back(j);
+		std::vector<RenderTelemetry::Totals> totals_list;
+		auto t1 = now();
+		RenderCameras(sd, all_cameras, *pool, io, nullptr, 0, ResolveTo(sd, *pool, mean_of_image), totals_list);
+		auto t2 = now();
+		uint64_t intersections = 0;
+		for (size_t c = 0; c < totals_list.size(); ++c) intersections += totals_list[c].intersections;
+		nlohmann::json jall;
+		jall["msec"] = msec(t1, t2);
+		jall["sequential_msec"] = sequential_msec;
+		jall["rays_per_sec"] = intersections / (msec(t1, t2) * 0.001);
+		report["render_all"] = jall;
+		std::fprintf(stderr, "all cameras: %f msec.\n", msec(t1, t2));
+	}
+
+	// 雑音除去の効果。1 台目のカメラを passes パスで描いた画像を参照とし、
+	// その 1/8 のパス数で描いた画像の、雑音除去の前後の RMSE を比べる。
+	if (camera_count > 0) {
+		auto &cmr = sd.cameras->cameras[0];
+		bool denoise_saved = cmr.denoise;
+		int pass_saved = cmr.pass;
+		auto capture = [](std::vector<float> &dst) {
+			return ImageHandler([&dst](int, std::vector<ImageLayer> &layers) { dst.swap(layers[0].pixels); });
+		};
+		auto rmse = [](const std::vector<float> &a, const std::vector<float> &b) {
+			double sum = 0;
+			for (size_t i = 0; i < a.size(); ++i) sum += (a[i] - b[i]) * (a[i] - b[i]);
+			return a.size() ? std::sqrt(sum / a.size()) : 0.0;
+		};
+		std::vector<float> reference, noisy, denoised;
+		std::vector<RenderTelemetry::Totals> totals_list;
+		int low_passes = std::max(1, passes / 8);
+		cmr.denoise = false, cmr.pass = passes;
+		RenderCameras(sd, std::vector<int>(1, 0), *pool, io, nullptr, 0, ResolveTo(sd, *pool, capture(reference)), totals_list);
+		cmr.pass = low_passes;
+		auto t1 = now();
+		RenderCameras(sd, std::vector<int>(1, 0), *pool, io, nullptr, 0, ResolveTo(sd, *pool, capture(noisy)), totals_list);
+		auto t2 = now();
+		cmr.denoise = true;
+		RenderCameras(sd, std::vector<int>(1, 0), *pool, io, nullptr, 0, ResolveTo(sd, *pool, capture(denoised)), totals_list);
+		auto t3 = now();
+		cmr.denoise = denoise_saved, cmr.pass = pass_saved;
+
+		nlohmann::json jden;
+		jden["reference_passes"] = passes;
+		jden["passes"] = low_passes;
+		jden["msec"] = msec(t1, t2);
+		jden["denoised_msec"] = msec(t2, t3);
+		jden["rmse"] = rmse(noisy, reference);
+		jden["denoised_rmse"] = rmse(denoised, reference);
+		report["denoise"] = jden;
+		std::fprintf(stderr, "denoise: rmse %f -> %f.\n", jden["rmse"].get<double>(), jden["denoised_rmse"].get<double>());
+	}
+
+	// 使う NUMA ノード数を 1 から全ノードまで増やした時の描画速度。
+	// それぞれノード毎に複製したシーンで 1 台目のカメラを描画する。
+	int numa_node_count = TaskPool::NumaNodeCount();
+	if (numa_node_count > 1 && sd.cameras->cameras.Count() > 0) {
+		nlohmann::json jnuma = nlohmann::json::array();
+		double base_rays_per_sec = 0;
+		for (int n = 1; n <= numa_node_count; ++n) {
+			TaskPool numa_pool(0, false, n);
+			auto t1 = now();
+			ReplicateScene(args_doc, sd, numa_pool);
+			auto t2 = now();
+			std::vector<RenderTelemetry::Totals> totals_list;
+			RenderCameras(sd, std::vector<int>(1, 0), numa_pool, io, nullptr, 0, ResolveTo(sd, numa_pool, mean_of_image), totals_list);
+			auto t3 = now();
+			RenderTelemetry::Totals &totals = totals_list[0];
+			double rays_per_sec = totals.intersections / (msec(t2, t3) * 0.001);
+			if (n == 1) base_rays_per_sec = rays_per_sec;
+			nlohmann::json jn;
+			jn["nodes"] = n;
+			jn["threads"] = numa_pool.Count();
+			jn["replicate_msec"] = msec(t1, t2);
+			jn["render_msec"] = msec(t2, t3);
+			jn["rays_per_sec"] = rays_per_sec;
+			jn["speedup"] = (base_rays_per_sec > 0) ? rays_per_sec / base_rays_per_sec : 0.0;
+			jnuma.push_back(jn);
+			std::fprintf(stderr, "numa nodes %d: %f msec.\n", n, msec(t2, t3));
+		}
+		sd.replicas.clear();
+		report["numa_scaling"] = jnuma;
+	}
+
+	std::unique_ptr<FILE, decltype(&std::fclose)> fp(std::fopen(argv[1], "wb"), std::fclose);
+	if (!fp.get()) {
+		std::fprintf(stderr, "cannot open %s\n", argv[1]);
+		return 1;
+	}
+	std::string s = report.dump(1, '\t');
+	std::fwrite(s.c_str(), 1, s.size(), fp.get());
+	std::fprintf(fp.get(), "\n");
+	return 0;
+}
+
+// 分散描画の結果をまとめる。--shard i/N で書き出した累積値ファイルを足し合わせ、カメラの出力ファイルに書き出す。
+// 動画の累積値ファイルはフレーム毎にまとめ、フレーム番号を付けた出力ファイルに書き出す。
+// 各画素は 1 つのシャードでしか描画されないため、足し合わせた結果は 1 プロセスで描画した場合と一致する。
+// 使い方: Polygon_RayTrace --merge <設定ファイル> <累積値ファイル>...
+int RunMerge(int argc, char *argv[], int threads_option) {
+	if (argc < 2) {
+		std::fprintf(stderr, "usage: Polygon_RayTrace --merge <settings.json> <shard.acc>...\n");
+		return 1;
+	}
+	nlohmann::json args_doc;
+	if (!ReadSettings(argv[0], args_doc)) return 1;
+	ExrOptions exr_opt;
+	if (!exr_opt.Parse(args_doc["exr"])) return 1;
+
+	std::unique_ptr<TaskPool> pool = CreateTaskPool(args_doc, threads_option);
+	SceneData sd;
+	sd.environment.reset(new Environment(args_doc["environment"], pool.get()));
+	sd.cameras.reset(new Cameras(args_doc["cameras"]));
+	int camera_count = sd.cameras->cameras.Count();
+	// 動画の時は背景の向きを合わせるため、フレーム毎にカメラを動かしてから画像を作る (形状は読み込まない)
+	int shape_count = args_doc["shapes"].is_array() ? static_cast<int>(args_doc["shapes"].size()) : 0;
+	if (!sd.animation.Parse(args_doc["frames"], shape_count, *sd.cameras)) return 1;
+
+	// ヘッダーを先に読み、フレーム毎にまとめる (動画では各シャードがフレーム毎に累積値ファイルを書き出す)
+	struct Input {
+		const char *filename;
+		AccumFileHeader h;
+	};
+	std::vector<Input> inputs;
+	for (int f = 1; f < argc; ++f) {
+		Input in;
+		in.filename = argv[f];
+		std::unique_ptr<FILE, decltype(&std::fclose)> fp(std::fopen(in.filename, "rb"), std::fclose);
+		if (!fp) {
+			std::fprintf(stderr, "cannot open %s\n", in.filename);
+			return 1;
+		}
+		AccumFileHeader &h = in.h;
+		if (std::fread(&h, sizeof(h), 1, fp.get()) != 1 || std::memcmp(h.magic, ACCUM_FILE_MAGIC, sizeof(h.magic)) != 0 ||
+			h.pixel_item_size != sizeof(CameraRender::pixel_accum_item) || h.aov_item_size != sizeof(CameraRender::aov_accum_item)) {
+			std::fprintf(stderr, "%s is not an accumulation file.\n", in.filename);
+			return 1;
+		}
+		if (h.camera_idx < 0 || h.camera_idx >= camera_count) {
+			std::fprintf(stderr, "%s: camera # %d is not defined in %s.\n", in.filename, h.camera_idx + 1, argv[0]);
+			return 1;
+		}
+		inputs.push_back(in);
+	}
+	std::stable_sort(inputs.begin(), inputs.end(), [](const Input &a, const Input &b) { return a.h.frame < b.h.frame; });
+
+	// フレーム番号を付ける前の出力ファイル名
+	std::vector<ON_String> base_filenames(camera_count);
+	for (int j = 0; j < camera_count; ++j) base_filenames[j] = sd.cameras->cameras[j].output_filename;
+
+	int result = 0;
+	for (size_t g0 = 0, g1; g0 < inputs.size(); g0 = g1) {
+		int frame = inputs[g0].h.frame;
+		for (g1 = g0; g1 < inputs.size() && inputs[g1].h.frame == frame; ++g1);
+		if (frame >= 0) {
+			for (size_t i = 0; i < sd.animation.camera_tracks.size(); ++i) {
+				const Animation::CameraTrack &track = sd.animation.camera_tracks[i];
+				Animation::PlaceCamera(track, frame, sd.cameras->cameras[track.index]);
+			}
+		}
+
+		std::vector<std::unique_ptr<CameraRender> > crs(camera_count);
+		std::vector<std::vector<char> > shards_seen(camera_count);
+		for (size_t f = g0; f < g1; ++f) {
+			const char *filename = inputs[f].filename;
+			const AccumFileHeader &h = inputs[f].h;
+			std::unique_ptr<FILE, decltype(&std::fclose)> fp(std::fopen(filename, "rb"), std::fclose);
+			if (!fp || std::fseek(fp.get(), sizeof(h), SEEK_SET) != 0) {
+				std::fprintf(stderr, "cannot open %s\n", filename);
+				return 1;
+			}
+			Cameras::Camera &cmr = sd.cameras->cameras[h.camera_idx];
+			cmr.aovs = h.aovs;
+			std::unique_ptr<CameraRender> &cr = crs[h.camera_idx];
+			if (!cr) {
+				cr.reset(new CameraRender());
+				cr->init(&cmr, h.camera_idx, &sd);
+				shards_seen[h.camera_idx].assign(h.shard_count, 0);
+			}
+			std::vector<char> &seen = shards_seen[h.camera_idx];
+			if (h.pixel_width != cmr.pixel_width || h.pixel_height != cmr.pixel_height || h.pass != cmr.pass ||
+				h.shard_count != static_cast<int>(seen.size()) || h.aov_accum_count != cr->aov_accum.Count()) {
+				std::fprintf(stderr, "%s does not match camera # %d or the other shards.\n", filename, h.camera_idx + 1);
+				return 1;
+			}
+			if (h.shard_index < 0 || h.shard_index >= h.shard_count || seen[h.shard_index]) {
+				std::fprintf(stderr, "%s: shard %d/%d is invalid or duplicated.\n", filename, h.shard_index, h.shard_count);
+				return 1;
+			}
+			seen[h.shard_index] = 1;
+			if (!AddAccumulation(fp.get(), h, *cr)) {
+				std::fprintf(stderr, "cannot read %s\n", filename);
+				return 1;
+			}
+		}
+
+		for (int j = 0; j < camera_count; ++j) {
+			if (!crs[j]) continue;
+			int missing = static_cast<int>(std::count(shards_seen[j].begin(), shards_seen[j].end(), 0));
+			if (missing > 0) {
+				if (frame >= 0) std::fprintf(stderr, "camera # %d, frame %d: %d of %d shards are missing.\n", j + 1, frame, missing, static_cast<int>(shards_seen[j].size()));
+				else std::fprintf(stderr, "camera # %d: %d of %d shards are missing.\n", j + 1, missing, static_cast<int>(shards_seen[j].size()));
+				result = 1;
+				continue;
+			}
+			Cameras::Camera &cmr = sd.cameras->cameras[j];
+			ON_String filename = (frame >= 0) ? Animation::FrameFilename(base_filenames[j], frame) : base_filenames[j];
+			std::vector<ImageLayer> layers;
+			ResolveImage(cmr, *sd.environment, *crs[j], layers, pool.get());
+			WriteImage(filename, cmr, layers, exr_opt, pool.get());
+			std::fprintf(stderr, "camera # %d: %s written.\n", j + 1, static_cast<const char *>(filename));
+		}
+	}
+	return result;
+}
+
+// 1 行読み込む。改行は含めない。EOF で何も読めなかった時は false を返す。
+bool ReadLine(FILE *fp, std::string &line) {
+	line.clear();
+	int c;
+	while ((c = std::fgetc(fp)) != EOF) {
+		if (c == '\n') return true;
+		if (c != '\r') line.push_back(static_cast<char>(c));
+	}
+	return !line.empty();
+}
+
+void EmitServerEvent(FILE *out, nlohmann::json &j) {
+	std::string s = j.dump();
+	std::fprintf(out, "%s\n", s.c_str());
+	std::fflush(out);
+}
+
+// ジョブのカメラの変更を適用する。省略した項目は設定ファイル (動画ならそのフレーム) の値のまま。
+bool ApplyCameraJob(nlohmann::json &jcmr, Cameras::Camera &cmr, std::string &message) {
+	read_3real_if_present(jcmr["origin"], static_cast<double *>(cmr.origin));
+	read_3real_if_present(jcmr["eye_dir"], static_cast<double *>(cmr.eye));
+	read_3real_if_present(jcmr["horz_dir"], static_cast<double *>(cmr.horz));
+	read_3real_if_present(jcmr["vert_dir"], static_cast<double *>(cmr.vert));
+	if (!cmr.NormalizeAxes()) {
+		message = "invalid camera axes";
+		return false;
+	}
+	if (jcmr["far"].is_number()) cmr.far_ = jcmr["far"];
+	cmr.UpdatePlane();
+	if (jcmr["pixel_width"].is_number()) cmr.pixel_width = jcmr["pixel_width"];
+	if (jcmr["pixel_height"].is_number()) cmr.pixel_height = jcmr["pixel_height"];
+	if (jcmr["horz_range"].is_number()) cmr.horz_range = jcmr["horz_range"];
+	if (jcmr["vert_range"].is_number()) cmr.vert_range = jcmr["vert_range"];
+	if (cmr.pixel_width <= 0 || cmr.pixel_height <= 0) {
+		message = "invalid pixel size";
+		return false;
+	}
+	cmr.UpdatePixelSize();
+	if (jcmr["pass"].is_number()) cmr.pass = jcmr["pass"];
+	if (jcmr["time_budget_sec"].is_number()) cmr.time_budget_sec = jcmr["time_budget_sec"];
+	if (jcmr["output_filename"].is_string()) cmr.output_filename = jcmr["output_filename"].get<std::string>().c_str();
+	return true;
+}
+
+// 描画サーバー (--serve)。シーン・BVH・材質の表を一度だけ作り、標準入力から 1 行 1 ジョブの JSON を受け付ける。
+// 例: {"id": "a", "frame": 3, "cameras": [{"index": 0, "origin": [0, -100, 20], "pass": 64, "output_filename": "a.exr"}]}
+//     {"command": "quit"}
+// "cameras" を省略すると全カメラを設定のまま描画する。カメラの変更はそのジョブの間だけ有効。
+// "frame" は動画の時のみ有効で、形状とカメラ (キーで動かすもの) の位置は次に "frame" を指定するまでそのまま残る。
+// 応答は標準出力に JSON Lines で出力し、ジョブ毎に job_start, 画像毎に image, 最後に job_done (失敗時は error) を返す。
+// 描画中の進捗は telemetry_out に出力する (telemetry の path を指定しなければ標準出力)。
+int RunServer(SceneData &sd, TaskPool &pool, FILE *telemetry_out, double telemetry_interval, const ExrOptions &exr_opt) {
+	FILE *out = stdout;
+	std::fprintf(stderr, "Waiting for jobs.\n");
+	{
+		nlohmann::json j;
+		j["event"] = "ready";
+		j["cameras"] = sd.cameras->cameras.Count();
+		j["frames"] = sd.animation.frame_count;
+		EmitServerEvent(out, j);
+	}
+
+	SerialQueue io;
+	std::string line;
+	while (ReadLine(stdin, line)) {
+		if (line.empty()) continue;
+		nlohmann::json jjob = nlohmann::json::parse(line, nullptr, false);
+		nlohmann::json jid;
+		auto emit_error = [out, &jid](const std::string &message) {
+			nlohmann::json j;
+			j["event"] = "error";
+			j["id"] = jid;
+			j["message"] = message;
+			EmitServerEvent(out, j);
+		};
+		if (jjob.is_discarded() || !jjob.is_object()) {
+			emit_error("cannot parse the job");
+			continue;
+		}
+		jid = jjob["id"];
+		if (jjob["command"] == "quit") break;
+
+		if (jjob["frame"].is_number()) {
+			int frame = jjob["frame"];
+			if (!sd.animation.Enabled() || frame < 0 || frame >= sd.animation.frame_count) {
+				emit_error("frame is out of range");
+				continue;
+			}
+			ApplyFrame(sd, frame, pool);
+		}
+
+		// ジョブ毎のカメラの変更は終わったら戻す。フレームを動かした後に保存するため、形状とカメラは同じフレームのまま残る。
+		ON_ClassArray<Cameras::Camera> saved = sd.cameras->cameras;
+		ON_ClassArray<Cameras::Camera> &cameras = sd.cameras->cameras;
+		std::vector<int> camera_indices;
+		std::string message;
+		bool ok = true;
+		auto &jcmrs = jjob["cameras"];
+		if (jcmrs.is_array()) {
+			for (size_t i = 0; ok && i < jcmrs.size(); ++i) {
+				auto &jcmr = jcmrs[i];
+				int j = jcmr["index"].is_number() ? jcmr["index"].get<int>() : -1;
+				if (j < 0 || j >= cameras.Count()) {
+					ok = false, message = "camera index is out of range";
+					break;
+				}
+				ok = ApplyCameraJob(jcmr, cameras[j], message);
+				camera_indices.push_back(j);
+			}
+		} else {
+			for (int j = 0; j < cameras.Count(); ++j) camera_indices.push_back(j);
+		}
+		if (!ok) {
+			sd.cameras->cameras = saved;
+			emit_error(message);
+			continue;
+		}
+
+		{
+			nlohmann::json j;
+			j["event"] = "job_start";
+			j["id"] = jid;
+			j["cameras"] = camera_indices;
+			EmitServerEvent(out, j);
+		}
+		auto c1 = std::chrono::steady_clock::now();
+		RenderHandler on_done = ResolveTo(sd, pool, [&sd, &pool, &exr_opt, out, &jid](int j, std::vector<ImageLayer> &layers) {
+			Cameras::Camera &cmr = sd.cameras->cameras[j];
+			WriteImage(cmr, layers, exr_opt, &pool);
+			nlohmann::json jimg;
+			jimg["event"] = "image";
+			jimg["id"] = jid;
+			jimg["camera"] = j;
+			jimg["path"] = static_cast<const char *>(cmr.output_filename);
+			EmitServerEvent(out, jimg);
+		});
+		std::vector<RenderTelemetry::Totals> totals_list;
+		RenderCameras(sd, camera_indices, pool, io, telemetry_out, telemetry_interval, on_done, totals_list);
+		uint64_t intersections = 0, errors = 0;
+		for (size_t c = 0; c < totals_list.size(); ++c) {
+			intersections += totals_list[c].intersections;
+			errors += totals_list[c].ErrorCount();
+		}
+		sd.cameras->cameras = saved;
+
+		nlohmann::json j;
+		j["event"] = "job_done";
+		j["id"] = jid;
+		j["intersections"] = intersections;
+		j["errors"] = errors;
+		j["elapsed_sec"] = std::chrono::duration<double>(std::chrono::steady_clock::now() - c1).count();
+		EmitServerEvent(out, j);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]){
+	int threads_option = TakeThreadsOption(argc, argv);
+	if (argc == 1){
+		return 0;
+	}
+	if (std::strcmp(argv[1], "--bench") == 0) {
+		return RunBenchmark(argc - 2, argv + 2, threads_option);
+	}
+	if (std::strcmp(argv[1], "--merge") == 0) {
+		return RunMerge(argc - 2, argv + 2, threads_option);
+	}
+	// --paths-to-3dm <paths.bin> <out.3dm>: path_capture の記録をポリラインにする
+	if (std::strcmp(argv[1], "--paths-to-3dm") == 0) {
+		if (argc != 4) {
+			std::fprintf(stderr, "usage: Polygon_RayTrace --paths-to-3dm <paths.bin> <out.3dm>\n");
+			return 1;
+		}
+		return PathCapture::ConvertTo3dm(argv[2], argv[3]) ? 0 : 1;
+	}
+	// --serve <settings.json>: 読み込んだシーンを保持したまま、標準入力からジョブを受け付ける
+	bool serve = (std::strcmp(argv[1], "--serve") == 0);
+	if (serve) {
+		--argc, ++argv;
+		if (argc == 1) return 1;
+	}
+	Shard shard;
+	if (!TakeShardOption(argc, argv, shard)) return 1;
+	nlohmann::json args_doc;
+	if (!ReadSettings(argv[1], args_doc)) return 1;
+
+	// プロファイラの設定
+	std::string profile_json, profile_trace;
+	bool profile_enabled = false;
+	{
+		auto &jprof = args_doc["profile"];
+		int sampling_interval = 16;
+		size_t trace_events = 0;
+		// "profile" が無い時や "enabled": false の時は計測も出力もしない
+		profile_enabled = jprof.is_object() && !(jprof["enabled"].is_boolean() && !jprof["enabled"].get<bool>());
+		if (profile_enabled) {
+			if (jprof["json"].is_string()) profile_json = jprof["json"].get<std::string>();
+			if (jprof["trace"].is_string()) {
+				profile_trace = jprof["trace"].get<std::string>();
+				trace_events = 100000;
+			}
+			if (jprof["sampling_interval"].is_number()) sampling_interval = jprof["sampling_interval"];
+			if (jprof["trace_events"].is_number()) trace_events = jprof["trace_events"];
+			Profiler::Start(sampling_interval, trace_events);
+		}
+	}
+
+	// 進捗・統計情報の出力先 (JSON Lines)。指定が無ければ標準出力。
+	std::unique_ptr<FILE, decltype(&std::fclose)> telemetry_fp(nullptr, std::fclose);
+	double telemetry_interval = 2.0;
+	{
+		auto &jtel = args_doc["telemetry"];
+		if (jtel.is_object()) {
+			if (jtel["path"].is_string()) telemetry_fp.reset(std::fopen(jtel["path"].get<std::string>().c_str(), "wb"));
+			if (jtel["interval_sec"].is_number()) telemetry_interval = jtel["interval_sec"];
+		}
+	}
+	FILE *telemetry_out = telemetry_fp.get() ? telemetry_fp.get() : stdout;
+
+	// HDR (EXR) 出力の画素形式と圧縮方式
+	ExrOptions exr_opt;
+	if (!exr_opt.Parse(args_doc["exr"])) return 1;
+
+	// 読み込みから描画まで同じスレッドプールを使う
+	std::unique_ptr<TaskPool> pool = CreateTaskPool(args_doc, threads_option);
+	std::fprintf(stderr, "%d threads.\n", pool->Count());
+
+	SceneData sd;
+	LoadScene(args_doc, sd, *pool);
+	if (NumaReplicateEnabled(args_doc)) ReplicateScene(args_doc, sd, *pool);
+	if (!sd.path_capture.Open(args_doc["path_capture"], pool->Count())) return 1;
+
+	if (serve) {
+		int result = RunServer(sd, *pool, telemetry_out, telemetry_interval, exr_opt);
+#ifdef USE_PROFILER
+		if (profile_json.size()) Profiler::DumpJSON(profile_json.c_str());
+		if (profile_trace.size()) Profiler::DumpChromeTrace(profile_trace.c_str());
+#endif
+		return result;
+	}
+
+	std::fprintf(stderr, "Raytracing.\n");
+
+	std::printf("start\n");
+	auto c1 = std::chrono::system_clock::now();
+
+	// 画像の作成と書き出しは I/O スレッドで描画と並行して行う
+	SerialQueue io;
+	std::vector<int> all_cameras;
+	for (int j = 0; j < sd.cameras->cameras.Count(); ++j) all_cameras.push_back(j);
+	std::vector<RenderTelemetry::Totals> totals_list;
+	RenderHandler on_done;
+	if (shard.enabled) {
+		// 分散描画では画像の代わりに累積値を書き出し、後で --merge でまとめる
+		std::fprintf(stderr, "shard %d/%d.\n", shard.index, shard.count);
+		on_done = [&shard, &sd](CameraRender &cr) {
+			std::string filename = AccumFilename(*cr.camera, shard);
+			WriteAccumulation(cr, shard, sd.animation.Enabled() ? sd.animation.frame : -1, filename.c_str());
+			std::fprintf(stderr, "camera # %d: %s written.\n", cr.camera_idx + 1, filename.c_str());
+		};
+	} else {
+		on_done = ResolveTo(sd, *pool, [&sd, &pool, &exr_opt](int j, std::vector<ImageLayer> &layers) {
+			WriteImage(sd.cameras->cameras[j], layers, exr_opt, pool.get());
+			std::fprintf(stderr, "camera # %d written.\n", j + 1);
+		});
+	}
+	uint64_t total_intersect_cnt = 0, total_error_cnt = 0;
+	// 動画の時はフレーム毎に形状とカメラを動かしてから全カメラを描画する
+	int frame_count = sd.animation.Enabled() ? sd.animation.frame_count : 1;
+	for (int frame = 0; frame < frame_count; ++frame) {
+		if (sd.animation.Enabled()) {
+			std::fprintf(stderr, "frame %d/%d.\n", frame + 1, frame_count);
+			ApplyFrame(sd, frame, *pool);
+		}
+		RenderCameras(sd, all_cameras, *pool, io, telemetry_out, telemetry_interval, on_done, totals_list, shard);
+		for (size_t c = 0; c < totals_list.size(); ++c) {
+			total_intersect_cnt += totals_list[c].intersections;
+			total_error_cnt += totals_list[c].ErrorCount();
+		}
+	}
+
+	std::printf("total_intersection:%lld\n", total_intersect_cnt);
+	std::printf("total_error:%lld\n", total_error_cnt);
+	if (sd.ooc) sd.ooc->PrintStats();
+	if (sd.guide && !sd.guide->Options().save.empty()) sd.guide->Save(sd.guide->Options().save.c_str());
+
+#ifdef USE_PROFILER
+	// 標準出力は結果の出力に使うため、集計は標準エラーに出す
+	if (profile_enabled) Profiler::PrintSummary(stderr);
+	if (profile_json.size()) Profiler::DumpJSON(profile_json.c_str());
+	if (profile_trace.size()) Profiler::DumpChromeTrace(profile_trace.c_str());
+#endif
+
+	auto c2 = std::chrono::system_clock::now();
+	std::printf("%f msec.\n", static_cast<double>(std::chrono::duration_cast<std::chrono::microseconds>(c2 - c1).count()) / 1000.0);
+	return 0;
+}
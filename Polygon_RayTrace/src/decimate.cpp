@@ -0,0 +1,187 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#include "decimate.h"
+
+#include <cstdio>
+#include <algorithm>
+#include <vector>
+
+#include "opennurbs.h"
+#include "mist/facet.h"
+#include "taskpool.h"
+#include "tessellate.h"
+#include "profiler.h"
+
+TriangleBudget::TriangleBudget() : enabled(false), max_triangles(0), triangles_per_pixel(2.0), min_triangles(500), crease_angle_deg(30.0) {
+}
+
+void TriangleBudget::Parse(nlohmann::json &jbud) {
+	if (!jbud.is_object()) return;
+	enabled = true;
+	if (jbud["max_triangles"].is_number()) max_triangles = jbud["max_triangles"];
+	if (jbud["triangles_per_pixel"].is_number()) triangles_per_pixel = jbud["triangles_per_pixel"];
+	if (jbud["min_triangles"].is_number()) min_triangles = jbud["min_triangles"];
+	if (jbud["crease_angle_deg"].is_number()) crease_angle_deg = jbud["crease_angle_deg"];
+	if (jbud["cache_dir"].is_string()) cache_dir = jbud["cache_dir"].get<std::string>();
+}
+
+int64_t TriangleBudget::Target(int64_t triangles, double pixel_area) const {
+	int64_t target = triangles;
+	if (max_triangles > 0) target = std::min(target, max_triangles);
+	if (triangles_per_pixel > 0 && pixel_area >= 0) {
+		int64_t screen = static_cast<int64_t>(pixel_area * triangles_per_pixel);
+		target = std::min(target, std::max(screen, min_triangles));
+	}
+	return target;
+}
+
+int64_t TriangleCount(const ON_Mesh &mesh) {
+	int64_t count = 0;
+	for (int i = 0; i < mesh.m_F.Count(); ++i) count += mesh.m_F[i].IsQuad() ? 2 : 1;
+	return count;
+}
+
+namespace {
+
+typedef mist::facet_list<float> FacetList;
+
+void ToFacets(const ON_Mesh &mesh, FacetList &facets) {
+	facets.reserve(static_cast<size_t>(TriangleCount(mesh)));
+	auto point = [&mesh](int vi) {
+		const ON_3fPoint &p = mesh.m_V[vi];
+		return FacetList::vector_type(p.x, p.y, p.z);
+	};
+	for (int i = 0; i < mesh.m_F.Count(); ++i) {
+		const ON_MeshFace &f = mesh.m_F[i];
+		facets.push_back(FacetList::facet_type(point(f.vi[0]), point(f.vi[1]), point(f.vi[2])));
+		if (f.IsQuad()) facets.push_back(FacetList::facet_type(point(f.vi[0]), point(f.vi[2]), point(f.vi[3])));
+	}
+}
+
+// 頂点を共有した三角形のみのメッシュに頂点法線を付ける。
+// 頂点の周りの面を、法線のなす角が crease_angle_deg 以内のもの同士で面積で重み付けして平均し、
+// 平均した法線が異なる面の間 (折れ目) では頂点を複製して分ける。
+void ComputeCreaseNormals(ON_Mesh &mesh, double crease_angle_deg) {
+	int nv = mesh.m_V.Count(), nf = mesh.m_F.Count();
+	// 面の法線 (長さは面積の 2 倍) と単位法線
+	std::vector<ON_3dVector> fn(nf), fu(nf);
+	// 頂点毎の隣接面 (CSR)
+	std::vector<int> offset(nv + 1, 0), incident(static_cast<size_t>(nf) * 3);
+	for (int i = 0; i < nf; ++i) {
+		const ON_MeshFace &f = mesh.m_F[i];
+		ON_3dPoint p0(mesh.m_V[f.vi[0]]), p1(mesh.m_V[f.vi[1]]), p2(mesh.m_V[f.vi[2]]);
+		fn[i] = ON_CrossProduct(p1 - p0, p2 - p0);
+		fu[i] = fn[i];
+		if (!fu[i].Unitize()) fu[i] = ON_3dVector(0, 0, 0);
+		for (int k = 0; k < 3; ++k) ++offset[f.vi[k] + 1];
+	}
+	for (int v = 0; v < nv; ++v) offset[v + 1] += offset[v];
+	{
+		std::vector<int> cursor(offset.begin(), offset.end() - 1);
+		for (int i = 0; i < nf; ++i) {
+			for (int k = 0; k < 3; ++k) incident[cursor[mesh.m_F[i].vi[k]]++] = i;
+		}
+	}
+
+	double cos_tol = std::cos(std::min(std::max(crease_angle_deg, 0.0), 180.0) * ON_PI / 180.0);
+	ON_3fPointArray V(nv);
+	ON_3fVectorArray N(nv);
+	std::vector<int> corner(static_cast<size_t>(nf) * 3, -1);
+	for (int v = 0; v < nv; ++v) {
+		int first = V.Count();
+		for (int a = offset[v]; a < offset[v + 1]; ++a) {
+			int i = incident[a];
+			ON_3dVector n(0, 0, 0), smooth(0, 0, 0);
+			for (int b = offset[v]; b < offset[v + 1]; ++b) {
+				int j = incident[b];
+				smooth += fn[j];
+				if (ON_DotProduct(fu[i], fu[j]) >= cos_tol) n += fn[j];
+			}
+			// 面積の無い面はどの面とも折れ目になるので、周り全体の平均を使う
+			if (!n.Unitize()) {
+				n = smooth;
+				n.Unitize();
+			}
+			ON_3fVector n3f(n);
+			int idx = -1;
+			for (int c = first; c < V.Count(); ++c) {
+				if (N[c] == n3f) {
+					idx = c;
+					break;
+				}
+			}
+			if (idx < 0) {
+				idx = V.Count();
+				V.Append(mesh.m_V[v]);
+				N.Append(n3f);
+			}
+			const ON_MeshFace &f = mesh.m_F[i];
+			for (int k = 0; k < 3; ++k) {
+				if (f.vi[k] == v) corner[static_cast<size_t>(i) * 3 + k] = idx;
+			}
+		}
+	}
+	for (int i = 0; i < nf; ++i) {
+		ON_MeshFace &f = mesh.m_F[i];
+		f.vi[0] = corner[static_cast<size_t>(i) * 3], f.vi[1] = corner[static_cast<size_t>(i) * 3 + 1], f.vi[2] = f.vi[3] = corner[static_cast<size_t>(i) * 3 + 2];
+	}
+	mesh.m_V = V;
+	mesh.m_N = N;
+	mesh.InvalidateBoundingBoxes();
+}
+
+// 頂点を共有した形に戻す。元の頂点法線は捨て、面から作り直す。
+bool FromFacets(const FacetList &facets, double eps, double crease_angle_deg, ON_Mesh &mesh) {
+	std::vector<mist::vector3<float> > vertices;
+	std::vector<mist::vector3<int> > faces;
+	if (!mist::convert_to_vertex_face_list(facets, vertices, faces, eps)) return false;
+	ON_Mesh out(static_cast<int>(faces.size()), static_cast<int>(vertices.size()), false, false);
+	for (size_t i = 0; i < vertices.size(); ++i) out.m_V.Append(ON_3fPoint(vertices[i].x, vertices[i].y, vertices[i].z));
+	for (size_t i = 0; i < faces.size(); ++i) {
+		ON_MeshFace &f = out.m_F.AppendNew();
+		f.vi[0] = faces[i].x, f.vi[1] = faces[i].y, f.vi[2] = f.vi[3] = faces[i].z;
+	}
+	ComputeCreaseNormals(out, crease_angle_deg);
+	mesh = out;
+	return true;
+}
+
+}
+
+bool DecimateMesh(ON_Mesh &mesh, int64_t target, const TriangleBudget &budget, TaskPool &pool) {
+	PROFILE_ZONE("decimate");
+	const std::string &cache_dir = budget.cache_dir;
+	std::string cache_path;
+	uint64_t key = 0;
+	if (!cache_dir.empty()) {
+		key = MeshCache::ContentHash(mesh.m_V.Array(), sizeof(ON_3fPoint) * mesh.m_V.Count(), pool);
+		uint64_t fkey = MeshCache::ContentHash(mesh.m_F.Array(), sizeof(ON_MeshFace) * mesh.m_F.Count(), pool);
+		key = MeshCache::Mix(key, &fkey, sizeof(fkey));
+		key = MeshCache::Mix(key, &target, sizeof(target));
+		key = MeshCache::Mix(key, &budget.crease_angle_deg, sizeof(budget.crease_angle_deg));
+		cache_path = MeshCache::Path(cache_dir, key, ".dec.mesh");
+		ON_Mesh cached;
+		if (MeshCache::Read(cache_path, key, cached)) {
+			mesh = cached;
+			return true;
+		}
+	}
+
+	// 同じ頂点とみなす距離は、形状の大きさに対する比で決める
+	ON_BoundingBox bb = mesh.BoundingBox();
+	double eps = std::max(bb.Diagonal().Length() * 1e-7, 1e-12);
+	FacetList facets;
+	ToFacets(mesh, facets);
+	if (!mist::surface_simplification(facets, static_cast<size_t>(std::max<int64_t>(target, 1)), true, 0.0, eps)) return false;
+	ON_Mesh decimated;
+	if (!FromFacets(facets, eps, budget.crease_angle_deg, decimated)) return false;
+	mesh = decimated;
+
+	if (!cache_path.empty()) MeshCache::Write(cache_path, key, mesh);
+	return true;
+}
@@ -0,0 +1,42 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#ifndef DECIMATE_H_
+#define DECIMATE_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "nlohmann/json.hpp"
+
+class ON_Mesh;
+struct TaskPool;
+
+// 読み込み時に形状の三角形数を減らす設定。設定ファイルの "triangle_budget" で指定し、形状毎の "triangle_budget" で上書きできる。
+// 例: "triangle_budget": { "max_triangles": 200000, "triangles_per_pixel": 2, "min_triangles": 500, "crease_angle_deg": 30, "cache_dir": "mesh_cache" }
+struct TriangleBudget {
+	bool enabled;
+	int64_t max_triangles;      ///< 形状 1 つの三角形数の上限。0 以下の時は上限なし
+	double triangles_per_pixel; ///< 画面上で覆う 1 画素あたりの三角形数。0 以下の時は画面上の大きさで減らさない
+	int64_t min_triangles;      ///< 画面上の大きさから決める数の下限
+	double crease_angle_deg;    ///< 減らした後の頂点法線を作る時、面の法線がこれより大きく折れる辺は滑らかにしない
+	std::string cache_dir;      ///< 空でない時、減らした結果を元のメッシュのハッシュで保存・再利用する
+	TriangleBudget();
+	void Parse(nlohmann::json &jbud);
+	// 減らした後の三角形数。pixel_area は形状が画面上で覆う画素数で、負の時は画面上の大きさを使わない。
+	int64_t Target(int64_t triangles, double pixel_area) const;
+};
+
+// 四角形は 2 つに数える
+int64_t TriangleCount(const ON_Mesh &mesh);
+
+// mist::surface_simplification で mesh の三角形を target 個まで減らし、頂点法線を作り直す。
+// budget.crease_angle_deg を越えて折れる辺では頂点を分け、角を丸めない。
+// 失敗した時は mesh を変えずに false を返す。
+bool DecimateMesh(ON_Mesh &mesh, int64_t target, const TriangleBudget &budget, TaskPool &pool);
+
+#endif // DECIMATE_H_
@@ -0,0 +1,165 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#include "denoise.h"
+
+#include <cmath>
+#include <algorithm>
+
+#include "taskpool.h"
+#include "profiler.h"
+
+void FeatureBuffers::Allocate(int width_, int height_) {
+	width = width_, height = height_;
+	size_t n = static_cast<size_t>(width) * height;
+	mask.assign(n, 0);
+	albedo.assign(n * 3, 0.0f);
+	normal.assign(n * 3, 0.0f);
+	depth.assign(n, 0.0f);
+	variance.assign(n, 0.0f);
+}
+
+DenoiseOptions::DenoiseOptions() : iterations(5), sigma_color(4.0), sigma_normal(0.1), sigma_depth(0.05), sigma_albedo(0.1) {
+}
+
+void DenoiseOptions::Parse(nlohmann::json &jden) {
+	if (!jden.is_object()) return;
+	if (jden["iterations"].is_number()) iterations = jden["iterations"];
+	if (jden["sigma_color"].is_number()) sigma_color = jden["sigma_color"];
+	if (jden["sigma_normal"].is_number()) sigma_normal = jden["sigma_normal"];
+	if (jden["sigma_depth"].is_number()) sigma_depth = jden["sigma_depth"];
+	if (jden["sigma_albedo"].is_number()) sigma_albedo = jden["sigma_albedo"];
+}
+
+namespace {
+
+const int BAND_ROWS = 16;
+const float ALBEDO_EPS = 1e-3f;
+// B3 スプライン
+const float KERNEL[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+
+inline float Luminance(const float *rgb) {
+	return 0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2];
+}
+
+struct ATrousPass {
+	const FeatureBuffers &fb;
+	const DenoiseOptions &opt;
+	const float *irr_in, *var_in;
+	float *irr_out, *var_out;
+	int step;
+
+	// 3x3 のガウシアンでぼかした分散。1 画素の分散は当てにならないため、輝度の重みにはこちらを使う。
+	float BlurredVariance(int x, int y) const {
+		static const float k3[3] = { 0.25f, 0.5f, 0.25f };
+		float sum = 0, wsum = 0;
+		for (int dy = -1; dy <= 1; ++dy) {
+			int yy = y + dy;
+			if (yy < 0 || yy >= fb.height) continue;
+			for (int dx = -1; dx <= 1; ++dx) {
+				int xx = x + dx;
+				if (xx < 0 || xx >= fb.width) continue;
+				size_t q = static_cast<size_t>(yy) * fb.width + xx;
+				if (!fb.mask[q]) continue;
+				float w = k3[dx + 1] * k3[dy + 1];
+				sum += w * var_in[q];
+				wsum += w;
+			}
+		}
+		return (wsum > 0) ? sum / wsum : 0.0f;
+	}
+
+	void Row(int y) const {
+		int width = fb.width;
+		float inv_sigma_n = static_cast<float>(1.0 / opt.sigma_normal);
+		float inv_sigma_a2 = static_cast<float>(1.0 / (opt.sigma_albedo * opt.sigma_albedo));
+		for (int x = 0; x < width; ++x) {
+			size_t p = static_cast<size_t>(y) * width + x;
+			if (!fb.mask[p]) {
+				for (int h = 0; h < 3; ++h) irr_out[p * 3 + h] = irr_in[p * 3 + h];
+				var_out[p] = var_in[p];
+				continue;
+			}
+			const float *np = &fb.normal[p * 3], *ap = &fb.albedo[p * 3];
+			float zp = fb.depth[p];
+			float lp = Luminance(&irr_in[p * 3]);
+			float inv_sigma_l = 1.0f / (static_cast<float>(opt.sigma_color) * std::sqrt(BlurredVariance(x, y)) + 1e-6f);
+			float inv_sigma_z = 1.0f / (static_cast<float>(opt.sigma_depth) * step * std::max(zp, 1e-6f));
+
+			float wsum = 0, vsum = 0, csum[3] = { 0, 0, 0 };
+			for (int dy = -2; dy <= 2; ++dy) {
+				int yy = y + dy * step;
+				if (yy < 0 || yy >= fb.height) continue;
+				for (int dx = -2; dx <= 2; ++dx) {
+					int xx = x + dx * step;
+					if (xx < 0 || xx >= width) continue;
+					size_t q = static_cast<size_t>(yy) * width + xx;
+					if (!fb.mask[q]) continue;
+					const float *nq = &fb.normal[q * 3], *aq = &fb.albedo[q * 3];
+					float dn = 1.0f - (np[0] * nq[0] + np[1] * nq[1] + np[2] * nq[2]);
+					float da = (ap[0] - aq[0]) * (ap[0] - aq[0]) + (ap[1] - aq[1]) * (ap[1] - aq[1]) + (ap[2] - aq[2]) * (ap[2] - aq[2]);
+					float e = std::fabs(lp - Luminance(&irr_in[q * 3])) * inv_sigma_l
+						+ std::max(dn, 0.0f) * inv_sigma_n
+						+ std::fabs(zp - fb.depth[q]) * inv_sigma_z
+						+ da * inv_sigma_a2;
+					float w = KERNEL[dx + 2] * KERNEL[dy + 2] * std::exp(-e);
+					wsum += w;
+					vsum += w * w * var_in[q];
+					for (int h = 0; h < 3; ++h) csum[h] += w * irr_in[q * 3 + h];
+				}
+			}
+			// 中心の画素は必ず加わるため wsum > 0
+			float inv_w = 1.0f / wsum;
+			for (int h = 0; h < 3; ++h) irr_out[p * 3 + h] = csum[h] * inv_w;
+			var_out[p] = vsum * inv_w * inv_w;
+		}
+	}
+};
+
+}
+
+void DenoiseImage(std::vector<float> &rgb, const FeatureBuffers &fb, const DenoiseOptions &opt, TaskPool *pool) {
+	PROFILE_ZONE("denoise");
+	size_t n = static_cast<size_t>(fb.width) * fb.height;
+	int bands = (fb.height + BAND_ROWS - 1) / BAND_ROWS;
+
+	// 反射率で割って照度にする
+	std::vector<float> irr[2], var[2];
+	irr[0].resize(n * 3), irr[1].resize(n * 3);
+	var[0].resize(n), var[1].resize(n);
+	ParallelFor(pool, 0, bands, [&](int b) {
+		size_t p0 = static_cast<size_t>(b) * BAND_ROWS * fb.width, p1 = std::min(p0 + static_cast<size_t>(BAND_ROWS) * fb.width, n);
+		for (size_t p = p0; p < p1; ++p) {
+			float la = 0;
+			for (int h = 0; h < 3; ++h) {
+				float a = fb.mask[p] ? std::max(fb.albedo[p * 3 + h], ALBEDO_EPS) : 1.0f;
+				irr[0][p * 3 + h] = rgb[p * 3 + h] / a;
+				la += a / 3.0f;
+			}
+			var[0][p] = fb.variance[p] / (la * la);
+		}
+	});
+
+	int cur = 0;
+	for (int it = 0; it < opt.iterations; ++it) {
+		ATrousPass pass = { fb, opt, irr[cur].data(), var[cur].data(), irr[1 - cur].data(), var[1 - cur].data(), 1 << it };
+		ParallelFor(pool, 0, bands, [&](int b) {
+			int y1 = std::min((b + 1) * BAND_ROWS, fb.height);
+			for (int y = b * BAND_ROWS; y < y1; ++y) pass.Row(y);
+		});
+		cur = 1 - cur;
+	}
+
+	// 反射率を掛け直す
+	ParallelFor(pool, 0, bands, [&](int b) {
+		size_t p0 = static_cast<size_t>(b) * BAND_ROWS * fb.width, p1 = std::min(p0 + static_cast<size_t>(BAND_ROWS) * fb.width, n);
+		for (size_t p = p0; p < p1; ++p) {
+			if (!fb.mask[p]) continue;
+			for (int h = 0; h < 3; ++h) rgb[p * 3 + h] = irr[cur][p * 3 + h] * std::max(fb.albedo[p * 3 + h], ALBEDO_EPS);
+		}
+	});
+}
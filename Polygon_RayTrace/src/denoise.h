@@ -0,0 +1,45 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#ifndef DENOISE_H_
+#define DENOISE_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+struct TaskPool;
+
+// 最初の衝突点の特徴量。画素の並びは出力画像と同じ。
+struct FeatureBuffers {
+	int width, height;
+	std::vector<uint8_t> mask;   ///< 1: 形状に衝突した画素 (フィルタの対象)、0: 背景
+	std::vector<float> albedo;   ///< RGB
+	std::vector<float> normal;   ///< XYZ
+	std::vector<float> depth;    ///< カメラからの距離
+	std::vector<float> variance; ///< 輝度の平均値の分散
+	void Allocate(int width_, int height_);
+};
+
+// 例: "denoise": { "iterations": 5, "sigma_color": 4.0, "sigma_normal": 0.1, "sigma_depth": 0.05, "sigma_albedo": 0.1 }
+struct DenoiseOptions {
+	int iterations;      ///< a-trous の段数。i 段目は 2^i 画素おきに参照する。
+	double sigma_color;  ///< 輝度差の許容幅 (標準偏差に対する倍率)
+	double sigma_normal; ///< 法線の差の許容幅
+	double sigma_depth;  ///< 距離の差の許容幅 (距離とステップ幅に対する比)
+	double sigma_albedo; ///< 反射率の差の許容幅
+	DenoiseOptions();
+	void Parse(nlohmann::json &jden);
+};
+
+// Edge-avoiding a-trous wavelet (Dammertz et al. 2010) による雑音除去。
+// 色は反射率で割った値 (照度) をぼかしてから反射率を掛け直し、輝度の重みは分散で正規化する (SVGF と同様)。
+// 行の帯毎に pool で並列に処理する。pool が nullptr の時は呼び出し元のスレッドで処理する。
+void DenoiseImage(std::vector<float> &rgb, const FeatureBuffers &fb, const DenoiseOptions &opt, TaskPool *pool);
+
+#endif // DENOISE_H_
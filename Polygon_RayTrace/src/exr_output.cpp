@@ -0,0 +1,133 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#include "exr_output.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "tinyexr.h"
+
+ImageLayer::ImageLayer(const char *name_, const char *channel_names, size_t pixel_count, bool force_float_) : name(name_), force_float(force_float_) {
+	// channel_names はカンマ区切り
+	for (const char *p = channel_names; *p; ) {
+		const char *e = std::strchr(p, ',');
+		if (!e) e = p + std::strlen(p);
+		channels.push_back(std::string(p, e));
+		p = *e ? e + 1 : e;
+	}
+	pixels.assign(pixel_count * channels.size(), 0.0f);
+}
+
+ExrOptions::ExrOptions() : pixel_type(TINYEXR_PIXELTYPE_HALF), compression(TINYEXR_COMPRESSIONTYPE_ZIP) {
+}
+
+bool ExrOptions::Parse(nlohmann::json &jexr) {
+	if (!jexr.is_object()) return true;
+	bool ok = true;
+	if (jexr["pixel_type"].is_string()) {
+		std::string pt = jexr["pixel_type"].get<std::string>();
+		if (pt == "half") pixel_type = TINYEXR_PIXELTYPE_HALF;
+		else if (pt == "float") pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+		else {
+			std::fprintf(stderr, "exr: unknown pixel_type \"%s\".\n", pt.c_str());
+			ok = false;
+		}
+	}
+	if (jexr["compression"].is_string()) {
+		std::string c = jexr["compression"].get<std::string>();
+		if (c == "none") compression = TINYEXR_COMPRESSIONTYPE_NONE;
+		else if (c == "rle") compression = TINYEXR_COMPRESSIONTYPE_RLE;
+		else if (c == "zips") compression = TINYEXR_COMPRESSIONTYPE_ZIPS;
+		else if (c == "zip") compression = TINYEXR_COMPRESSIONTYPE_ZIP;
+		else if (c == "piz") compression = TINYEXR_COMPRESSIONTYPE_PIZ;
+		else {
+			std::fprintf(stderr, "exr: unknown compression \"%s\".\n", c.c_str());
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+namespace {
+
+// tinyexr に渡す 1 パート分のヘッダーと画像。チャンネルはチャンネル名の昇順に並べ、平面 (planar) 形式に直す。
+struct ExrPart {
+	std::vector<EXRChannelInfo> channel_infos;
+	std::vector<int> pixel_types, requested_pixel_types;
+	std::vector<std::vector<float> > planes;
+	std::vector<unsigned char *> plane_ptrs;
+	EXRHeader header;
+	EXRImage image;
+
+	void Set(const ImageLayer &layer, int width, int height, const ExrOptions &opt, bool multipart) {
+		int nch = static_cast<int>(layer.channels.size());
+		size_t pixel_count = static_cast<size_t>(width) * height;
+		std::vector<int> order(nch);
+		for (int c = 0; c < nch; ++c) order[c] = c;
+		std::sort(order.begin(), order.end(), [&layer](int a, int b) { return layer.channels[a] < layer.channels[b]; });
+
+		channel_infos.resize(nch);
+		pixel_types.assign(nch, TINYEXR_PIXELTYPE_FLOAT);
+		requested_pixel_types.assign(nch, layer.force_float ? TINYEXR_PIXELTYPE_FLOAT : opt.pixel_type);
+		planes.resize(nch);
+		plane_ptrs.resize(nch);
+		for (int c = 0; c < nch; ++c) {
+			int src = order[c];
+			std::memset(&channel_infos[c], 0, sizeof(EXRChannelInfo));
+			std::strncpy(channel_infos[c].name, layer.channels[src].c_str(), 255);
+			std::vector<float> &plane = planes[c];
+			plane.resize(pixel_count);
+			for (size_t i = 0; i < pixel_count; ++i) plane[i] = layer.pixels[i * nch + src];
+			plane_ptrs[c] = reinterpret_cast<unsigned char *>(plane.data());
+		}
+
+		InitEXRHeader(&header);
+		header.num_channels = nch;
+		header.channels = channel_infos.data();
+		header.pixel_types = pixel_types.data();
+		header.requested_pixel_types = requested_pixel_types.data();
+		header.compression_type = opt.compression;
+		if (multipart) EXRSetNameAttr(&header, layer.name.c_str());
+
+		InitEXRImage(&image);
+		image.num_channels = nch;
+		image.images = plane_ptrs.data();
+		image.width = width;
+		image.height = height;
+	}
+};
+
+}
+
+bool WriteEXR(const char *filename, int width, int height, const std::vector<ImageLayer> &layers, const ExrOptions &opt) {
+	if (layers.empty()) return false;
+	bool multipart = (layers.size() > 1);
+	std::vector<ExrPart> parts(layers.size());
+	std::vector<EXRImage> images(layers.size());
+	std::vector<const EXRHeader *> headers(layers.size());
+	for (size_t i = 0; i < layers.size(); ++i) {
+		parts[i].Set(layers[i], width, height, opt, multipart);
+		images[i] = parts[i].image;
+		headers[i] = &parts[i].header;
+	}
+
+	const char *err = nullptr;
+	int ret;
+	if (multipart) {
+		ret = SaveEXRMultipartImageToFile(images.data(), headers.data(), static_cast<unsigned int>(layers.size()), filename, &err);
+	} else {
+		ret = SaveEXRImageToFile(&images[0], headers[0], filename, &err);
+	}
+	if (ret != TINYEXR_SUCCESS) {
+		std::fprintf(stderr, "exr: cannot write %s (%s).\n", filename, err ? err : "unknown error");
+		if (err) FreeEXRErrorMessage(err);
+		return false;
+	}
+	return true;
+}
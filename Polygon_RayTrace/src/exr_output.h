@@ -0,0 +1,39 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#ifndef EXR_OUTPUT_H_
+#define EXR_OUTPUT_H_
+
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+// 出力する画像の 1 レイヤー分。画素は上の行から順に、チャンネルを交互に並べる。
+struct ImageLayer {
+	std::string name;                  ///< マルチパート EXR のパート名
+	std::vector<std::string> channels; ///< チャンネル名 ("R", "G", "B" 等)
+	std::vector<float> pixels;         ///< width * height * channels.size()
+	bool force_float;                  ///< true の時は pixel_type の設定によらず float で書き出す (サンプル数等)
+	ImageLayer() : force_float(false) {}
+	ImageLayer(const char *name_, const char *channel_names, size_t pixel_count, bool force_float_ = false);
+};
+
+// EXR 書き出しの設定。設定ファイルの "exr" で指定する。
+struct ExrOptions {
+	int pixel_type;  ///< TINYEXR_PIXELTYPE_HALF / TINYEXR_PIXELTYPE_FLOAT
+	int compression; ///< TINYEXR_COMPRESSIONTYPE_*
+	ExrOptions();
+	// 例: "exr": { "pixel_type": "half", "compression": "piz" }
+	bool Parse(nlohmann::json &jexr);
+};
+
+// layers[0] をカラーとし、2 つ目以降のレイヤーがあれば同じファイルにマルチパートで書き出す。
+// 圧縮はスキャンラインのブロック単位で並列に行う。
+bool WriteEXR(const char *filename, int width, int height, const std::vector<ImageLayer> &layers, const ExrOptions &opt);
+
+#endif // EXR_OUTPUT_H_
@@ -0,0 +1,760 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#include "outofcore.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "opennurbs.h"
+#include "taskpool.h"
+#include "profiler.h"
+
+OutOfCoreOptions::OutOfCoreOptions() : brick_triangles(65536), resident_mb(4096.0), rebuild(false) {
+}
+
+void OutOfCoreOptions::Parse(nlohmann::json &jooc) {
+	if (!jooc.is_object() || !jooc["path"].is_string()) return;
+	path = jooc["path"].get<std::string>();
+	if (jooc["brick_triangles"].is_number()) brick_triangles = std::max(jooc["brick_triangles"].get<int>(), 16);
+	if (jooc["resident_mb"].is_number()) resident_mb = std::max(jooc["resident_mb"].get<double>(), 1.0);
+	if (jooc["rebuild"].is_boolean()) rebuild = jooc["rebuild"];
+}
+
+namespace {
+
+size_t AllocationGranularity() {
+#if defined(_WIN32)
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwAllocationGranularity;
+#else
+	return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+}
+
+}
+
+MappedFile::MappedFile() :
+#if defined(_WIN32)
+	file(INVALID_HANDLE_VALUE), mapping(nullptr),
+#else
+	fd(-1),
+#endif
+	size(0), writable(false) {
+}
+
+MappedFile::~MappedFile() {
+	Close();
+}
+
+bool MappedFile::Open(const char *path, uint64_t create_size) {
+	Close();
+	writable = (create_size != 0);
+#if defined(_WIN32)
+	file = CreateFileA(path, writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, FILE_SHARE_READ, nullptr, writable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	if (writable) {
+		size = create_size;
+	} else {
+		LARGE_INTEGER li;
+		if (!GetFileSizeEx(file, &li)) {
+			Close();
+			return false;
+		}
+		size = static_cast<uint64_t>(li.QuadPart);
+	}
+	if (size == 0) {
+		Close();
+		return false;
+	}
+	// 作る時はこの大きさまでファイルが伸びる
+	mapping = CreateFileMappingA(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+	if (!mapping) {
+		Close();
+		return false;
+	}
+#else
+	fd = ::open(path, writable ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDONLY, 0644);
+	if (fd < 0) return false;
+	if (writable) {
+		if (::ftruncate(fd, static_cast<off_t>(create_size)) != 0) {
+			Close();
+			return false;
+		}
+		size = create_size;
+	} else {
+		struct stat st;
+		if (::fstat(fd, &st) != 0) {
+			Close();
+			return false;
+		}
+		size = static_cast<uint64_t>(st.st_size);
+	}
+#endif
+	return true;
+}
+
+void MappedFile::Close() {
+#if defined(_WIN32)
+	if (mapping) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	mapping = nullptr, file = INVALID_HANDLE_VALUE;
+#else
+	if (fd >= 0) ::close(fd);
+	fd = -1;
+#endif
+	size = 0;
+}
+
+bool MappedFile::Map(uint64_t offset, size_t length, MappedView &view) const {
+	static const size_t granularity = AllocationGranularity();
+	if (length == 0 || offset + length > size) return false;
+	uint64_t aligned = offset - offset % granularity;
+	size_t map_length = static_cast<size_t>(offset - aligned) + length;
+#if defined(_WIN32)
+	void *base = MapViewOfFile(mapping, writable ? (FILE_MAP_READ | FILE_MAP_WRITE) : FILE_MAP_READ, static_cast<DWORD>(aligned >> 32), static_cast<DWORD>(aligned), map_length);
+	if (!base) return false;
+#else
+	void *base = ::mmap(nullptr, map_length, writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, static_cast<off_t>(aligned));
+	if (base == MAP_FAILED) return false;
+#endif
+	view.base = base;
+	view.length = map_length;
+	view.ptr = static_cast<char *>(base) + (offset - aligned);
+	return true;
+}
+
+void MappedFile::Unmap(MappedView &view) {
+	if (!view.base) return;
+#if defined(_WIN32)
+	UnmapViewOfFile(view.base);
+#else
+	::munmap(view.base, view.length);
+#endif
+	view = MappedView();
+}
+
+void MappedFile::Prefetch(const MappedView &view) {
+	if (!view.base) return;
+#if defined(_WIN32)
+	WIN32_MEMORY_RANGE_ENTRY range;
+	range.VirtualAddress = view.base;
+	range.NumberOfBytes = view.length;
+	PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+	::madvise(view.base, view.length, MADV_WILLNEED);
+#endif
+}
+
+void MappedFile::Flush(const MappedView &view) {
+	if (!view.base) return;
+#if defined(_WIN32)
+	FlushViewOfFile(view.base, view.length);
+#else
+	::msync(view.base, view.length, MS_SYNC);
+#endif
+}
+
+namespace {
+
+const char BRICK_FILE_MAGIC[8] = { 'P', 'R', 'T', 'B', 'R', 'I', 'C', 'K' };
+const uint32_t BRICK_FILE_VERSION = 1;
+const uint64_t REGION_ALIGN = 1 << 16;
+const int LEAF_TRIANGLES = 4;
+const int HISTOGRAM_GRID = 64;
+const size_t STREAM_CHUNK = 1 << 16;
+
+struct BrickFileHeader {
+	char magic[8];
+	uint32_t version, brick_count;
+	uint64_t source_key;
+	uint64_t triangle_count;
+	uint64_t table_offset, tris_offset, nodes_offset;
+	uint32_t triangle_size, node_size;
+	uint32_t brick_triangles, reserved;
+};
+
+inline uint64_t AlignUp(uint64_t x) {
+	return (x + REGION_ALIGN - 1) / REGION_ALIGN * REGION_ALIGN;
+}
+
+struct Box {
+	float bmin[3], bmax[3];
+	Box() {
+		for (int a = 0; a < 3; ++a) bmin[a] = std::numeric_limits<float>::max(), bmax[a] = -std::numeric_limits<float>::max();
+	}
+	void Add(const float p[3]) {
+		for (int a = 0; a < 3; ++a) bmin[a] = std::min(bmin[a], p[a]), bmax[a] = std::max(bmax[a], p[a]);
+	}
+	void Add(const Box &b) {
+		for (int a = 0; a < 3; ++a) bmin[a] = std::min(bmin[a], b.bmin[a]), bmax[a] = std::max(bmax[a], b.bmax[a]);
+	}
+	int LongestAxis() const {
+		float e[3] = { bmax[0] - bmin[0], bmax[1] - bmin[1], bmax[2] - bmin[2] };
+		return (e[0] >= e[1] && e[0] >= e[2]) ? 0 : (e[1] >= e[2]) ? 1 : 2;
+	}
+};
+
+inline void TriangleBounds(const BrickTriangle &t, Box &b) {
+	b = Box();
+	for (int k = 0; k < 3; ++k) b.Add(t.v[k]);
+}
+
+// items[0, count) の BVH を nodes に深さ優先で書き出す。葉の要素数は leaf_size 以下で、要素は items の中で並べ替える。
+// 中央値で分けるので、leaf_size が 2 以上なら節の数は max(count, 1) を超えない。
+template <typename T, typename BoundsF> struct BVHBuilder {
+	T *items;
+	BrickNode *nodes;
+	int leaf_size;
+	const BoundsF &bounds;
+	int node_count;
+
+	BVHBuilder(T *items_, BrickNode *nodes_, int leaf_size_, const BoundsF &bounds_) : items(items_), nodes(nodes_), leaf_size(leaf_size_), bounds(bounds_), node_count(0) {}
+
+	float Center(const T &item, int axis) const {
+		Box b;
+		bounds(item, b);
+		return b.bmin[axis] + b.bmax[axis];
+	}
+
+	int Build(int begin, int end) {
+		int idx = node_count++;
+		Box box, cbox;
+		for (int i = begin; i < end; ++i) {
+			Box b;
+			bounds(items[i], b);
+			box.Add(b);
+			float c[3] = { b.bmin[0] + b.bmax[0], b.bmin[1] + b.bmax[1], b.bmin[2] + b.bmax[2] };
+			cbox.Add(c);
+		}
+		BrickNode &node = nodes[idx];
+		for (int a = 0; a < 3; ++a) node.bmin[a] = box.bmin[a], node.bmax[a] = box.bmax[a];
+		if (end - begin <= leaf_size) {
+			node.offset = begin, node.count = end - begin;
+			return idx;
+		}
+		int axis = cbox.LongestAxis(), mid = begin + (end - begin) / 2;
+		std::nth_element(items + begin, items + mid, items + end, [this, axis](const T &a, const T &b) { return Center(a, axis) < Center(b, axis); });
+		node.count = 0;
+		Build(begin, mid);
+		int right = Build(mid, end);
+		nodes[idx].offset = right;
+		return idx;
+	}
+};
+
+template <typename T, typename BoundsF> int BuildBVH(T *items, int count, int leaf_size, BrickNode *nodes, const BoundsF &bounds) {
+	BVHBuilder<T, BoundsF> builder(items, nodes, leaf_size, bounds);
+	builder.Build(0, count);
+	return builder.node_count;
+}
+
+inline bool RayBox(const float bmin[3], const float bmax[3], const float org[3], const float inv[3], float tnear, float tfar, float &tentry) {
+	float t0 = tnear, t1 = tfar;
+	for (int a = 0; a < 3; ++a) {
+		float ta = (bmin[a] - org[a]) * inv[a], tb = (bmax[a] - org[a]) * inv[a];
+		if (ta > tb) std::swap(ta, tb);
+		t0 = std::max(t0, ta), t1 = std::min(t1, tb);
+		if (t0 > t1) return false;
+	}
+	tentry = t0;
+	return true;
+}
+
+// Moller-Trumbore。u, v は Embree と同じく v[1], v[2] の重み。
+inline bool RayTriangle(const BrickTriangle &tri, const float org[3], const float dir[3], float tnear, float tfar, float &t, float &u, float &v) {
+	const float *p0 = tri.v[0], *p1 = tri.v[1], *p2 = tri.v[2];
+	float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+	float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+	float pv[3] = { dir[1] * e2[2] - dir[2] * e2[1], dir[2] * e2[0] - dir[0] * e2[2], dir[0] * e2[1] - dir[1] * e2[0] };
+	float det = e1[0] * pv[0] + e1[1] * pv[1] + e1[2] * pv[2];
+	if (det == 0) return false;
+	float inv_det = 1.0f / det;
+	float tv[3] = { org[0] - p0[0], org[1] - p0[1], org[2] - p0[2] };
+	u = (tv[0] * pv[0] + tv[1] * pv[1] + tv[2] * pv[2]) * inv_det;
+	if (u < 0 || u > 1) return false;
+	float qv[3] = { tv[1] * e1[2] - tv[2] * e1[1], tv[2] * e1[0] - tv[0] * e1[2], tv[0] * e1[1] - tv[1] * e1[0] };
+	v = (dir[0] * qv[0] + dir[1] * qv[1] + dir[2] * qv[2]) * inv_det;
+	if (v < 0 || u + v > 1) return false;
+	t = (e2[0] * qv[0] + e2[1] * qv[1] + e2[2] * qv[2]) * inv_det;
+	return t > tnear && t < tfar;
+}
+
+// 一時ファイルの三角形を先頭から STREAM_CHUNK 個ずつ f に渡す
+template <typename F> bool StreamTriangles(FILE *fp, const F &f) {
+	std::rewind(fp);
+	std::vector<BrickTriangle> buf(STREAM_CHUNK);
+	size_t n;
+	while ((n = std::fread(buf.data(), sizeof(BrickTriangle), buf.size(), fp)) > 0) f(buf.data(), n);
+	return !std::ferror(fp);
+}
+
+struct CellBox {
+	int lo[3], hi[3];
+};
+
+// 重心の格子毎の三角形数から、三角形数が limit 以下になるまで格子の箱を三角形数の中央で分ける
+void Partition(const std::vector<uint64_t> &cells, const CellBox &box, uint64_t limit, std::vector<CellBox> &out, std::vector<uint64_t> &out_counts) {
+	const int G = HISTOGRAM_GRID;
+	int axis = 0;
+	for (int a = 1; a < 3; ++a) if (box.hi[a] - box.lo[a] > box.hi[axis] - box.lo[axis]) axis = a;
+	std::vector<uint64_t> slab(box.hi[axis] - box.lo[axis], 0);
+	uint64_t n = 0;
+	for (int z = box.lo[2]; z < box.hi[2]; ++z) {
+		for (int y = box.lo[1]; y < box.hi[1]; ++y) {
+			for (int x = box.lo[0]; x < box.hi[0]; ++x) {
+				uint64_t c = cells[(static_cast<size_t>(z) * G + y) * G + x];
+				int p[3] = { x, y, z };
+				slab[p[axis] - box.lo[axis]] += c;
+				n += c;
+			}
+		}
+	}
+	if (n == 0) return;
+	if (n <= limit || slab.size() <= 1) {
+		out.push_back(box);
+		out_counts.push_back(n);
+		return;
+	}
+	size_t split = 1;
+	for (uint64_t sum = slab[0]; split + 1 < slab.size() && sum * 2 < n; ++split) sum += slab[split];
+	CellBox left = box, right = box;
+	left.hi[axis] = right.lo[axis] = box.lo[axis] + static_cast<int>(split);
+	Partition(cells, left, limit, out, out_counts);
+	Partition(cells, right, limit, out, out_counts);
+}
+
+}
+
+OutOfCoreScene::OutOfCoreScene() : tris_region(0), nodes_region(0), resident_bytes(0), budget_bytes(0), tick(0), page_ins(0), evictions(0) {
+}
+
+OutOfCoreScene::~OutOfCoreScene() {
+	Close();
+}
+
+bool OutOfCoreScene::Build(const OutOfCoreOptions &opt, int shape_count, uint64_t source_key, const std::function<bool(int, ON_Mesh &)> &load, TaskPool &pool) {
+	PROFILE_ZONE("build_bricks");
+	if (!opt.rebuild) {
+		OutOfCoreScene existing;
+		if (existing.Open(opt, source_key)) {
+			std::fprintf(stderr, "out_of_core: using %s (%d bricks).\n", opt.path.c_str(), existing.BrickCount());
+			return true;
+		}
+	}
+	std::fprintf(stderr, "out_of_core: building %s.\n", opt.path.c_str());
+
+	// 1. 形状を 1 つずつ読み込み、三角形を一時ファイルに書き出す
+	std::string tmp_path = opt.path + ".tmp";
+	std::unique_ptr<FILE, decltype(&std::fclose)> tmp(std::fopen(tmp_path.c_str(), "w+b"), std::fclose);
+	if (!tmp) {
+		std::fprintf(stderr, "out_of_core: cannot open %s\n", tmp_path.c_str());
+		return false;
+	}
+	Box scene_box;
+	uint64_t total = 0;
+	std::vector<BrickTriangle> buf;
+	for (int k = 0; k < shape_count; ++k) {
+		ON_Mesh shape;
+		if (!load(k, shape)) continue;
+		if (!shape.HasFaceNormals()) shape.ComputeFaceNormals();
+		if (!shape.HasVertexNormals()) shape.ComputeVertexNormals();
+		buf.clear();
+		for (int f = 0; f < shape.m_F.Count(); ++f) {
+			const ON_MeshFace &face = shape.m_F[f];
+			const int tri[2][3] = { { face.vi[0], face.vi[1], face.vi[2] }, { face.vi[0], face.vi[2], face.vi[3] } };
+			for (int t = 0; t < (face.IsQuad() ? 2 : 1); ++t) {
+				BrickTriangle bt;
+				for (int j = 0; j < 3; ++j) {
+					const ON_3fPoint &p = shape.m_V[tri[t][j]];
+					const ON_3fVector &n = shape.m_N[tri[t][j]];
+					bt.v[j][0] = p.x, bt.v[j][1] = p.y, bt.v[j][2] = p.z;
+					bt.n[j][0] = n.x, bt.n[j][1] = n.y, bt.n[j][2] = n.z;
+					scene_box.Add(bt.v[j]);
+				}
+				const ON_3fVector &fn = shape.m_FN[f];
+				bt.fn[0] = fn.x, bt.fn[1] = fn.y, bt.fn[2] = fn.z;
+				bt.shape_idx = k, bt.face_idx = f, bt.reserved = 0;
+				buf.push_back(bt);
+			}
+		}
+		if (std::fwrite(buf.data(), sizeof(BrickTriangle), buf.size(), tmp.get()) != buf.size()) {
+			std::fprintf(stderr, "out_of_core: cannot write %s\n", tmp_path.c_str());
+			return false;
+		}
+		total += buf.size();
+	}
+	if (total == 0) {
+		std::fprintf(stderr, "out_of_core: no triangles.\n");
+		tmp.reset();
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+
+	// 2. 重心の格子毎に三角形を数え、三角形数が brick_triangles 程度になるよう格子をブリックに分ける
+	const int G = HISTOGRAM_GRID;
+	float inv_ext[3];
+	for (int a = 0; a < 3; ++a) {
+		float ext = scene_box.bmax[a] - scene_box.bmin[a];
+		inv_ext[a] = (ext > 0) ? G / ext : 0.0f;
+	}
+	auto cell_of = [&](const BrickTriangle &t) {
+		int c[3];
+		for (int a = 0; a < 3; ++a) {
+			float centroid = (t.v[0][a] + t.v[1][a] + t.v[2][a]) / 3.0f;
+			c[a] = std::min(std::max(static_cast<int>((centroid - scene_box.bmin[a]) * inv_ext[a]), 0), G - 1);
+		}
+		return (static_cast<size_t>(c[2]) * G + c[1]) * G + c[0];
+	};
+	std::vector<uint64_t> cells(static_cast<size_t>(G) * G * G, 0);
+	StreamTriangles(tmp.get(), [&](const BrickTriangle *tris, size_t n) {
+		for (size_t i = 0; i < n; ++i) ++cells[cell_of(tris[i])];
+	});
+	std::vector<CellBox> boxes;
+	std::vector<uint64_t> counts;
+	CellBox whole = { { 0, 0, 0 }, { G, G, G } };
+	Partition(cells, whole, static_cast<uint64_t>(opt.brick_triangles), boxes, counts);
+	std::vector<int32_t> cell_brick(cells.size(), -1);
+	for (size_t b = 0; b < boxes.size(); ++b) {
+		const CellBox &box = boxes[b];
+		for (int z = box.lo[2]; z < box.hi[2]; ++z)
+			for (int y = box.lo[1]; y < box.hi[1]; ++y)
+				for (int x = box.lo[0]; x < box.hi[0]; ++x) cell_brick[(static_cast<size_t>(z) * G + y) * G + x] = static_cast<int32_t>(b);
+	}
+
+	std::vector<BrickInfo> bricks(boxes.size());
+	uint64_t tri_offset = 0, node_offset = 0;
+	for (size_t b = 0; b < bricks.size(); ++b) {
+		bricks[b].tri_offset = tri_offset, bricks[b].tri_count = static_cast<uint32_t>(counts[b]);
+		bricks[b].node_offset = node_offset, bricks[b].node_count = 0;
+		tri_offset += counts[b];
+		node_offset += std::max<uint64_t>(counts[b], 1);
+	}
+
+	// 3. ファイルを割り当て、三角形をブリック毎の位置に書き込む
+	BrickFileHeader h;
+	std::memset(&h, 0, sizeof(h));
+	std::memcpy(h.magic, BRICK_FILE_MAGIC, sizeof(h.magic));
+	h.version = BRICK_FILE_VERSION;
+	h.brick_count = static_cast<uint32_t>(bricks.size());
+	h.source_key = source_key;
+	h.triangle_count = total;
+	h.table_offset = sizeof(BrickFileHeader);
+	h.tris_offset = AlignUp(h.table_offset + sizeof(BrickInfo) * bricks.size());
+	h.nodes_offset = AlignUp(h.tris_offset + sizeof(BrickTriangle) * total);
+	h.triangle_size = sizeof(BrickTriangle), h.node_size = sizeof(BrickNode);
+	h.brick_triangles = static_cast<uint32_t>(opt.brick_triangles);
+	uint64_t file_size = h.nodes_offset + sizeof(BrickNode) * node_offset;
+
+	MappedFile out;
+	MappedView head_view, tris_view, nodes_view;
+	if (!out.Open(opt.path.c_str(), file_size) || !out.Map(0, static_cast<size_t>(h.tris_offset), head_view) ||
+		!out.Map(h.tris_offset, static_cast<size_t>(sizeof(BrickTriangle) * total), tris_view) || !out.Map(h.nodes_offset, static_cast<size_t>(sizeof(BrickNode) * node_offset), nodes_view)) {
+		std::fprintf(stderr, "out_of_core: cannot create %s\n", opt.path.c_str());
+		return false;
+	}
+	BrickTriangle *tris = static_cast<BrickTriangle *>(tris_view.ptr);
+	BrickNode *nodes = static_cast<BrickNode *>(nodes_view.ptr);
+	std::vector<uint64_t> cursor(bricks.size());
+	for (size_t b = 0; b < bricks.size(); ++b) cursor[b] = bricks[b].tri_offset;
+	StreamTriangles(tmp.get(), [&](const BrickTriangle *src, size_t n) {
+		for (size_t i = 0; i < n; ++i) tris[cursor[cell_brick[cell_of(src[i])]]++] = src[i];
+	});
+	tmp.reset();
+	std::remove(tmp_path.c_str());
+
+	// 4. ブリック毎に BVH を作る
+	pool.ParallelFor(0, static_cast<int>(bricks.size()), [&](int b) {
+		BrickInfo &bi = bricks[b];
+		BrickTriangle *bt = tris + bi.tri_offset;
+		bi.node_count = static_cast<uint32_t>(BuildBVH(bt, static_cast<int>(bi.tri_count), LEAF_TRIANGLES, nodes + bi.node_offset, TriangleBounds));
+		const BrickNode &root = nodes[bi.node_offset];
+		for (int a = 0; a < 3; ++a) bi.bmin[a] = root.bmin[a], bi.bmax[a] = root.bmax[a];
+	});
+
+	char *head = static_cast<char *>(head_view.ptr);
+	std::memcpy(head, &h, sizeof(h));
+	std::memcpy(head + h.table_offset, bricks.data(), sizeof(BrickInfo) * bricks.size());
+	MappedFile::Flush(tris_view);
+	MappedFile::Flush(nodes_view);
+	MappedFile::Flush(head_view);
+	MappedFile::Unmap(tris_view);
+	MappedFile::Unmap(nodes_view);
+	MappedFile::Unmap(head_view);
+	out.Close();
+	std::fprintf(stderr, "out_of_core: %llu triangles in %d bricks.\n", static_cast<unsigned long long>(total), static_cast<int>(bricks.size()));
+	return true;
+}
+
+bool OutOfCoreScene::Open(const OutOfCoreOptions &opt, uint64_t source_key) {
+	Close();
+	if (!file.Open(opt.path.c_str())) return false;
+	BrickFileHeader h;
+	MappedView view;
+	if (file.Size() < sizeof(h) || !file.Map(0, sizeof(h), view)) {
+		file.Close();
+		return false;
+	}
+	std::memcpy(&h, view.ptr, sizeof(h));
+	MappedFile::Unmap(view);
+	// 形状の設定や分け方が変わった時は作り直させる
+	if (std::memcmp(h.magic, BRICK_FILE_MAGIC, sizeof(h.magic)) != 0 || h.version != BRICK_FILE_VERSION || h.source_key != source_key ||
+		h.brick_triangles != static_cast<uint32_t>(opt.brick_triangles) || h.triangle_size != sizeof(BrickTriangle) || h.node_size != sizeof(BrickNode) || h.brick_count == 0 ||
+		!file.Map(h.table_offset, sizeof(BrickInfo) * h.brick_count, view)) {
+		file.Close();
+		return false;
+	}
+	bricks.resize(h.brick_count);
+	std::memcpy(bricks.data(), view.ptr, sizeof(BrickInfo) * h.brick_count);
+	MappedFile::Unmap(view);
+	tris_region = h.tris_offset, nodes_region = h.nodes_offset;
+
+	slots.reset(new Slot[bricks.size()]);
+	resident_list.clear();
+	resident_bytes = 0;
+	budget_bytes = static_cast<uint64_t>(opt.resident_mb * 1024.0 * 1024.0);
+	tick = 0, page_ins = 0, evictions = 0;
+
+	// ブリック間の BVH は葉にブリックを 1 つずつ入れる
+	int count = static_cast<int>(bricks.size());
+	top_items.resize(count);
+	for (int b = 0; b < count; ++b) top_items[b] = b;
+	top_nodes.resize(count * 2 - 1);
+	auto brick_bounds = [this](int b, Box &box) {
+		for (int a = 0; a < 3; ++a) box.bmin[a] = bricks[b].bmin[a], box.bmax[a] = bricks[b].bmax[a];
+	};
+	top_nodes.resize(BuildBVH(top_items.data(), count, 1, top_nodes.data(), brick_bounds));
+	return true;
+}
+
+void OutOfCoreScene::Close() {
+	for (size_t b = 0; slots && b < bricks.size(); ++b) {
+		MappedFile::Unmap(slots[b].tris_view);
+		MappedFile::Unmap(slots[b].nodes_view);
+	}
+	slots.reset();
+	bricks.clear();
+	top_nodes.clear();
+	top_items.clear();
+	resident_list.clear();
+	resident_bytes = 0;
+	file.Close();
+}
+
+uint64_t OutOfCoreScene::TriangleCount() const {
+	uint64_t count = 0;
+	for (size_t b = 0; b < bricks.size(); ++b) count += bricks[b].tri_count;
+	return count;
+}
+
+void OutOfCoreScene::Bounds(float bmin[3], float bmax[3]) const {
+	for (int a = 0; a < 3; ++a) bmin[a] = top_nodes[0].bmin[a], bmax[a] = top_nodes[0].bmax[a];
+}
+
+void OutOfCoreScene::PrintStats() const {
+	std::fprintf(stderr, "out_of_core: %d bricks, %llu page-ins, %llu evictions, %.1f MB resident.\n", BrickCount(),
+		static_cast<unsigned long long>(page_ins.load()), static_cast<unsigned long long>(evictions.load()), resident_bytes / (1024.0 * 1024.0));
+}
+
+// 割り当て済みの時はロックを取らずに使用中の数を増やす。取り外す側は resident を下ろしてから pins を確かめるので、
+// どちらの順に進んでも、使用中のブリックが取り外されることはない。
+void OutOfCoreScene::Pin(int b) {
+	Slot &s = slots[b];
+	s.pins.fetch_add(1);
+	if (s.resident.load()) {
+		// 割り当て済みの時は共有のカウンタを進めず、最後の割り当て時点の値を記録する (LRU の粒度は割り当て 1 回分)
+		s.last_use.store(tick.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		return;
+	}
+	s.pins.fetch_sub(1);
+	PageIn(b);
+}
+
+void OutOfCoreScene::Unpin(int b) {
+	slots[b].pins.fetch_sub(1);
+}
+
+void OutOfCoreScene::PageIn(int b) {
+	std::lock_guard<std::mutex> lock(mtx);
+	Slot &s = slots[b];
+	if (!s.resident.load()) {
+		const BrickInfo &bi = bricks[b];
+		bool ok = file.Map(tris_region + bi.tri_offset * sizeof(BrickTriangle), bi.tri_count * sizeof(BrickTriangle), s.tris_view) &&
+			file.Map(nodes_region + bi.node_offset * sizeof(BrickNode), bi.node_count * sizeof(BrickNode), s.nodes_view);
+		if (!ok) {
+			std::fprintf(stderr, "out_of_core: cannot map brick %d.\n", b);
+			std::abort();
+		}
+		MappedFile::Prefetch(s.tris_view);
+		MappedFile::Prefetch(s.nodes_view);
+		s.tris = static_cast<const BrickTriangle *>(s.tris_view.ptr);
+		s.nodes = static_cast<const BrickNode *>(s.nodes_view.ptr);
+		resident_bytes += s.tris_view.length + s.nodes_view.length;
+		resident_list.push_back(b);
+		page_ins.fetch_add(1, std::memory_order_relaxed);
+		s.pins.fetch_add(1);
+		s.resident.store(true);
+		EvictOverBudget();
+	} else {
+		s.pins.fetch_add(1);
+	}
+	s.last_use.store(tick.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// 使用中でないブリックのうち、最後に使ってから最も時間の経ったものから外す。mtx を取ってから呼ぶ。
+void OutOfCoreScene::EvictOverBudget() {
+	while (resident_bytes > budget_bytes) {
+		size_t victim = resident_list.size();
+		uint64_t oldest = std::numeric_limits<uint64_t>::max();
+		for (size_t i = 0; i < resident_list.size(); ++i) {
+			const Slot &s = slots[resident_list[i]];
+			if (s.pins.load() != 0) continue;
+			uint64_t last_use = s.last_use.load(std::memory_order_relaxed);
+			if (last_use < oldest) oldest = last_use, victim = i;
+		}
+		if (victim == resident_list.size()) break; // 全て使用中の時は上限を超えたままにする
+		Slot &s = slots[resident_list[victim]];
+		s.resident.store(false);
+		if (s.pins.load() != 0) {
+			// Pin と競合した
+			s.resident.store(true);
+			continue;
+		}
+		resident_bytes -= s.tris_view.length + s.nodes_view.length;
+		MappedFile::Unmap(s.tris_view);
+		MappedFile::Unmap(s.nodes_view);
+		s.tris = nullptr, s.nodes = nullptr;
+		resident_list[victim] = resident_list.back();
+		resident_list.pop_back();
+		evictions.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void OutOfCoreScene::CollectBricks(const float org[3], const float dir[3], float tnear, float tfar, std::vector<std::pair<float, int> > &out) const {
+	out.clear();
+	float inv[3] = { 1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2] };
+	int stack[64], sp = 0;
+	stack[sp++] = 0;
+	while (sp > 0) {
+		const BrickNode &node = top_nodes[stack[--sp]];
+		float tentry;
+		if (!RayBox(node.bmin, node.bmax, org, inv, tnear, tfar, tentry)) continue;
+		if (node.count) {
+			for (int i = 0; i < node.count; ++i) out.push_back(std::make_pair(tentry, top_items[node.offset + i]));
+		} else {
+			stack[sp++] = node.offset;
+			stack[sp++] = static_cast<int>(&node - top_nodes.data()) + 1;
+		}
+	}
+	std::sort(out.begin(), out.end());
+}
+
+bool OutOfCoreScene::IntersectBrick(int b, const float org[3], const float dir[3], float tnear, Hit &hit, bool any_hit) const {
+	const Slot &s = slots[b];
+	float inv[3] = { 1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2] };
+	int stack[64], sp = 0;
+	stack[sp++] = 0;
+	const BrickTriangle *best = nullptr;
+	while (sp > 0) {
+		const BrickNode &node = s.nodes[stack[--sp]];
+		float tentry;
+		if (!RayBox(node.bmin, node.bmax, org, inv, tnear, hit.t, tentry)) continue;
+		if (node.count) {
+			for (int i = 0; i < node.count; ++i) {
+				const BrickTriangle &tri = s.tris[node.offset + i];
+				float t, u, v;
+				if (!RayTriangle(tri, org, dir, tnear, hit.t, t, u, v)) continue;
+				hit.t = t, hit.u = u, hit.v = v;
+				best = &tri;
+				if (any_hit) break;
+			}
+			if (any_hit && best) break;
+		} else {
+			stack[sp++] = node.offset;
+			stack[sp++] = static_cast<int>(&node - s.nodes) + 1;
+		}
+	}
+	if (!best) return false;
+	// 法線はブリックを使っている間に取り出しておく
+	hit.shape_idx = best->shape_idx, hit.face_idx = best->face_idx;
+	float w[3] = { 1.0f - (hit.u + hit.v), hit.u, hit.v };
+	float len = 0;
+	for (int a = 0; a < 3; ++a) {
+		hit.n[a] = best->n[0][a] * w[0] + best->n[1][a] * w[1] + best->n[2][a] * w[2];
+		hit.fn[a] = best->fn[a];
+		len += hit.n[a] * hit.n[a];
+	}
+	if (len > 0) {
+		len = 1.0f / std::sqrt(len);
+		for (int a = 0; a < 3; ++a) hit.n[a] *= len;
+	}
+	return true;
+}
+
+bool OutOfCoreScene::Intersect(const float org[3], const float dir[3], float tnear, float tfar, Hit &hit) {
+	thread_local std::vector<std::pair<float, int> > candidates;
+	CollectBricks(org, dir, tnear, tfar, candidates);
+	hit.t = tfar;
+	bool found = false;
+	for (size_t i = 0; i < candidates.size(); ++i) {
+		if (candidates[i].first > hit.t) break;
+		int b = candidates[i].second;
+		Pin(b);
+		found |= IntersectBrick(b, org, dir, tnear, hit, false);
+		Unpin(b);
+	}
+	return found;
+}
+
+void OutOfCoreScene::IntersectBatch(const float *orgs, const float *dirs, int count, Hit *results, bool *hits, bool occluded_only, const float *tnears, const float *tfars) {
+	PROFILE_ZONE("ooc_batch");
+	// 反射・影のレイは 8 本ずつ頻繁に呼ぶので、作業領域はスレッド毎に使い回す
+	thread_local std::vector<std::vector<std::pair<float, int> > > candidates;
+	thread_local std::vector<size_t> cursor;
+	thread_local std::vector<std::pair<int, int> > queue;
+	if (candidates.size() < static_cast<size_t>(count)) candidates.resize(count);
+	cursor.assign(count, 0);
+	for (int i = 0; i < count; ++i) {
+		results[i].t = tfars ? tfars[i] : std::numeric_limits<float>::infinity();
+		hits[i] = false;
+		CollectBricks(orgs + i * 3, dirs + i * 3, tnears ? tnears[i] : 0.0f, results[i].t, candidates[i]);
+	}
+	// 各レイが次に調べるブリックを並べ、同じブリックを調べるレイをまとめて判定する。全てのレイが終わるまで繰り返す。
+	for (;;) {
+		queue.clear();
+		for (int i = 0; i < count; ++i) {
+			if (occluded_only && hits[i]) continue;
+			if (cursor[i] < candidates[i].size() && candidates[i][cursor[i]].first <= results[i].t) queue.push_back(std::make_pair(candidates[i][cursor[i]].second, i));
+		}
+		if (queue.empty()) break;
+		std::sort(queue.begin(), queue.end());
+		for (size_t q = 0; q < queue.size();) {
+			int b = queue[q].first;
+			Pin(b);
+			for (; q < queue.size() && queue[q].first == b; ++q) {
+				int i = queue[q].second;
+				if (IntersectBrick(b, orgs + i * 3, dirs + i * 3, tnears ? tnears[i] : 0.0f, results[i], occluded_only)) hits[i] = true;
+				++cursor[i];
+			}
+			Unpin(b);
+		}
+	}
+}
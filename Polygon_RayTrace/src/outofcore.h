@@ -0,0 +1,170 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#ifndef OUTOFCORE_H_
+#define OUTOFCORE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+
+#include "nlohmann/json.hpp"
+
+class ON_Mesh;
+struct TaskPool;
+
+// 主記憶に載らないシーンを扱うための設定。設定ファイルの "out_of_core" で指定する。
+// 例: "out_of_core": { "path": "scene.bricks", "brick_triangles": 65536, "resident_mb": 8192, "rebuild": false }
+struct OutOfCoreOptions {
+	std::string path;    ///< ブリックファイル。空の時は使わない
+	int brick_triangles; ///< ブリック 1 つの三角形数の目安
+	double resident_mb;  ///< 同時に割り当てておくブリックの大きさの上限
+	bool rebuild;        ///< true の時は、形状の設定が同じでもブリックファイルを作り直す
+	OutOfCoreOptions();
+	bool Enabled() const {
+		return !path.empty();
+	}
+	void Parse(nlohmann::json &jooc);
+};
+
+// ファイルの一部を割り当てる。開始位置は OS の割り当て単位に揃えて開き、ptr が要求した位置を指す。
+struct MappedView {
+	void *base;
+	size_t length;
+	void *ptr;
+	MappedView() : base(nullptr), length(0), ptr(nullptr) {}
+};
+
+struct MappedFile {
+	MappedFile();
+	~MappedFile();
+	// create_size が 0 でない時は、その大きさで作り直して読み書きできるように開く。
+	bool Open(const char *path, uint64_t create_size = 0);
+	void Close();
+	uint64_t Size() const {
+		return size;
+	}
+	bool Map(uint64_t offset, size_t length, MappedView &view) const;
+	static void Unmap(MappedView &view);
+	// 割り当てた範囲を先読みさせる
+	static void Prefetch(const MappedView &view);
+	// 書き込んだ内容をファイルに反映する
+	static void Flush(const MappedView &view);
+
+private:
+#if defined(_WIN32)
+	void *file, *mapping;
+#else
+	int fd;
+#endif
+	uint64_t size;
+	bool writable;
+};
+
+// ブリックに入れる三角形 1 つ分。頂点・頂点法線・面法線と、元の形状番号・形状内の面番号を持つ。
+struct BrickTriangle {
+	float v[3][3];
+	float n[3][3];
+	float fn[3];
+	int32_t shape_idx, face_idx;
+	int32_t reserved;
+};
+
+// ブリック内・ブリック間の BVH の節。子は深さ優先で並べ、左の子は次の節になる。
+struct BrickNode {
+	float bmin[3];
+	int32_t offset; ///< 葉: 最初の要素の番号、内部: 右の子の節の番号
+	float bmax[3];
+	int32_t count;  ///< 葉: 要素数、内部: 0
+};
+
+// 形状を空間的にブリックに分け、ブリック毎に三角形と BVH をまとめてメモリマップしたファイルに置く。
+// ブリックはレイが届いた時に割り当て (page-in)、割り当てた大きさが resident_mb を超えると、
+// 使用中でないもののうち最後に使ってから最も時間の経ったものを外す (LRU)。
+// ブリック間の BVH とブリックの一覧だけを常に主記憶に置く。
+// 割り当て済みのブリックの判定はロックを取らない。割り当てと取り外しだけが全体のロックを取るので、
+// resident_mb は描画中に反射・影のレイが通るブリック (作業集合) が収まる大きさにすること。収まらない時は割り当てが繰り返されて遅くなる。
+// 描画中の反射のレイは、USE_COROUTINE の時は 8 経路分ずつ IntersectBatch で、そうでない時は 1 本ずつ Intersect で判定する。
+// タイル全体の同じ深さのレイをまとめて並べ替える処理 (wavefront) は行わないので、それより大きな単位での割り当ての共有は期待できない。
+struct OutOfCoreScene {
+	// 衝突判定の結果。法線は衝突した時点でブリックから取り出しておく。
+	struct Hit {
+		float t, u, v;
+		int shape_idx, face_idx;
+		float n[3];  ///< 頂点法線を補間した法線 (正規化済み)
+		float fn[3]; ///< 面法線
+	};
+
+	OutOfCoreScene();
+	~OutOfCoreScene();
+
+	// 形状を 1 つずつ load で読み込んでブリックファイルを作る。一時ファイルを経由するので、全形状が同時に主記憶に載ることはない。
+	// source_key は形状の設定のハッシュで、同じ key のファイルが既にあれば作り直さない。
+	static bool Build(const OutOfCoreOptions &opt, int shape_count, uint64_t source_key, const std::function<bool(int, ON_Mesh &)> &load, TaskPool &pool);
+	bool Open(const OutOfCoreOptions &opt, uint64_t source_key);
+	void Close();
+
+	// レイを 1 本ずつ判定する。ブリックは手前から順に割り当てて判定する。
+	bool Intersect(const float org[3], const float dir[3], float tnear, float tfar, Hit &hit);
+	// 複数のレイをまとめて判定する。各レイが次に調べるブリックでレイを並べ替え、ブリック毎に 1 回だけ割り当てて判定する。
+	// hits[i] が false のレイは何にも当たらない。occluded_only が true の時は最も近い交点を求めない。
+	// tnears, tfars が nullptr の時は [0, ∞) を調べる。
+	void IntersectBatch(const float *orgs, const float *dirs, int count, Hit *results, bool *hits, bool occluded_only, const float *tnears = nullptr, const float *tfars = nullptr);
+
+	uint64_t TriangleCount() const;
+	int BrickCount() const {
+		return static_cast<int>(bricks.size());
+	}
+	// 全ブリックを囲む箱
+	void Bounds(float bmin[3], float bmax[3]) const;
+	// 割り当て・取り外しの回数を出力する
+	void PrintStats() const;
+
+	struct BrickInfo {
+		float bmin[3], bmax[3];
+		uint64_t tri_offset;  ///< 三角形領域の先頭からの三角形番号
+		uint64_t node_offset; ///< 節領域の先頭からの節番号
+		uint32_t tri_count, node_count;
+	};
+
+private:
+	struct Slot {
+		std::atomic<int> pins;
+		std::atomic<bool> resident;
+		std::atomic<uint64_t> last_use;
+		MappedView tris_view, nodes_view; // mtx で保護
+		const BrickTriangle *tris;
+		const BrickNode *nodes;
+		Slot() : pins(0), resident(false), last_use(0), tris(nullptr), nodes(nullptr) {}
+	};
+
+	void Pin(int b);
+	void Unpin(int b);
+	void PageIn(int b);
+	void EvictOverBudget();
+	// ブリック b の中で [tnear, hit.t) の最も近い交点を探す。Pin 済みであること。
+	bool IntersectBrick(int b, const float org[3], const float dir[3], float tnear, Hit &hit, bool any_hit) const;
+	// ブリック間の BVH を辿り、レイが通るブリックを入り口の距離の昇順に並べる。
+	void CollectBricks(const float org[3], const float dir[3], float tnear, float tfar, std::vector<std::pair<float, int> > &out) const;
+
+	MappedFile file;
+	uint64_t tris_region, nodes_region;
+	std::vector<BrickInfo> bricks;
+	std::vector<BrickNode> top_nodes;
+	std::vector<int> top_items;
+	std::unique_ptr<Slot[]> slots;
+	std::mutex mtx;
+	std::vector<int> resident_list; // mtx で保護
+	uint64_t resident_bytes, budget_bytes; // mtx で保護
+	std::atomic<uint64_t> tick, page_ins, evictions;
+};
+
+#endif // OUTOFCORE_H_
@@ -0,0 +1,204 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#include "pathcapture.h"
+
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+
+#include "opennurbs.h"
+
+namespace {
+
+const char CAPTURE_FILE_MAGIC[8] = { 'P', 'R', 'T', 'P', 'A', 'T', 'H', '1' };
+
+struct CaptureFileHeader {
+	char magic[8];
+	uint32_t record_size;
+	uint32_t ring_count;
+};
+// 書き出し毎に、リング番号と記録数の後に記録を続ける
+struct CaptureChunkHeader {
+	uint32_t ring;
+	uint32_t count;
+};
+
+uint64_t splitmix64(uint64_t x) {
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+}
+
+PathCapture::PathCapture() : fp(nullptr), num_rings(0), threshold(0), flush_interval_ms(50), stop(false) {
+}
+
+PathCapture::~PathCapture() {
+	Close();
+}
+
+bool PathCapture::Open(nlohmann::json &jcap, int num_rings_) {
+	if (!jcap.is_object() || !jcap["path"].is_string()) return true;
+	std::string path = jcap["path"].get<std::string>();
+	double rate = jcap["rate"].is_number() ? jcap["rate"].get<double>() : 0.001;
+	uint64_t buffer_records = jcap["buffer_records"].is_number() ? jcap["buffer_records"].get<uint64_t>() : 65536;
+	if (jcap["flush_interval_ms"].is_number()) flush_interval_ms = std::max(jcap["flush_interval_ms"].get<int>(), 1);
+
+	fp = std::fopen(path.c_str(), "wb");
+	if (!fp) {
+		std::fprintf(stderr, "path_capture: cannot open %s\n", path.c_str());
+		return false;
+	}
+	rate = std::min(std::max(rate, 0.0), 1.0);
+	threshold = (rate >= 1.0) ? ~static_cast<uint64_t>(0) : static_cast<uint64_t>(rate * 18446744073709551616.0);
+
+	uint64_t size = 1;
+	while (size < buffer_records) size <<= 1;
+	num_rings = num_rings_;
+	rings.reset(new Ring[num_rings]);
+	for (int i = 0; i < num_rings; ++i) {
+		rings[i].records.reset(new PathRecord[size]);
+		rings[i].mask = size - 1;
+	}
+
+	CaptureFileHeader h;
+	std::memcpy(h.magic, CAPTURE_FILE_MAGIC, sizeof(h.magic));
+	h.record_size = sizeof(PathRecord);
+	h.ring_count = static_cast<uint32_t>(num_rings);
+	std::fwrite(&h, sizeof(h), 1, fp);
+
+	stop = false;
+	flusher = std::thread([this]() { FlushMain(); });
+	return true;
+}
+
+void PathCapture::Close() {
+	if (!fp) return;
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	cv.notify_all();
+	flusher.join();
+	Flush();
+	uint64_t dropped = DroppedCount();
+	if (dropped) std::fprintf(stderr, "path_capture: %llu records dropped (buffer full).\n", static_cast<unsigned long long>(dropped));
+	std::fclose(fp);
+	fp = nullptr;
+}
+
+bool PathCapture::Sample(int camera, int pixel, int pass) const {
+	if (!fp) return false;
+	uint64_t key = (static_cast<uint64_t>(camera) << 56) ^ (static_cast<uint64_t>(static_cast<uint32_t>(pass)) << 32) ^ static_cast<uint32_t>(pixel);
+	return threshold == ~static_cast<uint64_t>(0) || splitmix64(key) < threshold;
+}
+
+uint64_t PathCapture::DroppedCount() const {
+	uint64_t dropped = 0;
+	for (int i = 0; i < num_rings; ++i) dropped += rings[i].dropped.load(std::memory_order_relaxed);
+	return dropped;
+}
+
+void PathCapture::FlushMain() {
+	std::unique_lock<std::mutex> lock(mtx);
+	while (!cv.wait_for(lock, std::chrono::milliseconds(flush_interval_ms), [this]() { return stop; })) {
+		lock.unlock();
+		Flush();
+		lock.lock();
+	}
+}
+
+// 各リングの溜まっている分を書き出す。書き出し用スレッド (終了時は Close を呼んだスレッド) のみが呼ぶ。
+void PathCapture::Flush() {
+	for (int i = 0; i < num_rings; ++i) {
+		Ring &r = rings[i];
+		uint64_t t = r.tail.load(std::memory_order_relaxed);
+		uint64_t h = r.head.load(std::memory_order_acquire);
+		if (h == t) continue;
+		CaptureChunkHeader ch = { static_cast<uint32_t>(i), static_cast<uint32_t>(h - t) };
+		std::fwrite(&ch, sizeof(ch), 1, fp);
+		uint64_t begin = t & r.mask, end = h & r.mask;
+		if (begin < end) {
+			std::fwrite(&r.records[begin], sizeof(PathRecord), end - begin, fp);
+		} else {
+			std::fwrite(&r.records[begin], sizeof(PathRecord), r.mask + 1 - begin, fp);
+			std::fwrite(&r.records[0], sizeof(PathRecord), end, fp);
+		}
+		r.tail.store(h, std::memory_order_release);
+	}
+	std::fflush(fp);
+}
+
+bool PathCapture::ConvertTo3dm(const char *capture_filename, const char *model_filename) {
+	std::unique_ptr<FILE, decltype(&std::fclose)> in(std::fopen(capture_filename, "rb"), std::fclose);
+	if (!in) {
+		std::fprintf(stderr, "cannot open %s\n", capture_filename);
+		return false;
+	}
+	CaptureFileHeader h;
+	if (std::fread(&h, sizeof(h), 1, in.get()) != 1 || std::memcmp(h.magic, CAPTURE_FILE_MAGIC, sizeof(h.magic)) != 0 || h.record_size != sizeof(PathRecord)) {
+		std::fprintf(stderr, "%s is not a path capture file.\n", capture_filename);
+		return false;
+	}
+
+	ONX_Model model;
+	int path_count = 0;
+	// リング毎に書きかけの経路を持ち、次の経路の始点が来たら確定する
+	struct Building {
+		ON_Polyline pl;
+		PathRecord first;
+	};
+	std::vector<Building> building(h.ring_count);
+	auto finish = [&model, &path_count](Building &b) {
+		if (b.pl.Count() >= 2) {
+			ONX_Model_Object &mo = model.m_object_table.AppendNew();
+			mo.m_object = new ON_PolylineCurve(b.pl);
+			mo.m_bDeleteObject = true;
+			char name[64];
+			std::snprintf(name, sizeof(name), "camera %u pixel %u pass %u", b.first.camera, b.first.pixel, b.first.pass);
+			mo.m_attributes.m_name = name;
+			++path_count;
+		}
+		b.pl.Empty();
+	};
+
+	CaptureChunkHeader ch;
+	std::vector<PathRecord> records;
+	while (std::fread(&ch, sizeof(ch), 1, in.get()) == 1) {
+		if (ch.ring >= h.ring_count) {
+			std::fprintf(stderr, "%s is broken.\n", capture_filename);
+			return false;
+		}
+		records.resize(ch.count);
+		if (std::fread(records.data(), sizeof(PathRecord), ch.count, in.get()) != ch.count) {
+			std::fprintf(stderr, "%s is truncated.\n", capture_filename);
+			break;
+		}
+		Building &b = building[ch.ring];
+		for (size_t i = 0; i < records.size(); ++i) {
+			const PathRecord &r = records[i];
+			if (r.bounce == 0) {
+				finish(b);
+				b.first = r;
+			}
+			b.pl.Append(ON_3dPoint(r.pt[0], r.pt[1], r.pt[2]));
+		}
+	}
+	for (size_t i = 0; i < building.size(); ++i) finish(building[i]);
+
+	model.Polish();
+	if (!model.Write(model_filename, 5, "Polygon_RayTrace path capture")) {
+		std::fprintf(stderr, "cannot write %s\n", model_filename);
+		return false;
+	}
+	std::fprintf(stderr, "%d paths written to %s.\n", path_count, model_filename);
+	return true;
+}
@@ -0,0 +1,115 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#ifndef PATHCAPTURE_H_
+#define PATHCAPTURE_H_
+
+#include <stdint.h>
+#include <cstdio>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <string>
+#include <memory>
+
+#include "nlohmann/json.hpp"
+
+// 経路の頂点 1 つ分の記録。ファイルにもこのまま書き出す。
+struct PathRecord {
+	uint32_t pixel;    ///< 画素番号
+	uint32_t pass;     ///< パス番号
+	uint16_t camera;   ///< カメラ番号
+	uint16_t bounce;   ///< 経路の何番目の頂点か。0 が始点で、0 の記録から次の経路になる。
+	int32_t material;  ///< 頂点で当たった材質の番号。始点・終端は -1
+	float pt[3];
+	float power[3];    ///< 頂点を出た後の RGB の重み
+};
+
+// 経路の記録。ワーカー毎に固定長のリングバッファ (書き込みはワーカー、読み出しは書き出し用スレッドのみ) を持ち、
+// 書き出し用スレッドが一定間隔でファイルに追記する。バッファが一杯の時は待たずに捨て、捨てた数を数える。
+// 例: "path_capture": { "path": "paths.bin", "rate": 0.001, "buffer_records": 65536, "flush_interval_ms": 50 }
+struct PathCapture {
+	struct alignas(64) Ring {
+		std::unique_ptr<PathRecord[]> records;
+		uint64_t mask;
+		std::atomic<uint64_t> head; ///< ワーカーが書き込んだ数
+		alignas(64) std::atomic<uint64_t> tail; ///< 書き出し済みの数
+		std::atomic<uint64_t> dropped;
+		Ring() : mask(0), head(0), tail(0), dropped(0) {}
+		bool Push(const PathRecord &r) {
+			uint64_t h = head.load(std::memory_order_relaxed);
+			if (h - tail.load(std::memory_order_acquire) > mask) {
+				dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				return false;
+			}
+			records[h & mask] = r;
+			head.store(h + 1, std::memory_order_release);
+			return true;
+		}
+	};
+
+	PathCapture();
+	~PathCapture();
+
+	// 設定が無い時は記録しない (Enabled() が false)。
+	bool Open(nlohmann::json &jcap, int num_rings);
+	// 残りを書き出してファイルを閉じる。
+	void Close();
+	bool Enabled() const {
+		return fp != nullptr;
+	}
+
+	// この経路を記録するか。乱数列を変えないよう、番号のハッシュで決める。
+	bool Sample(int camera, int pixel, int pass) const;
+	Ring &ring(int idx) {
+		return rings[idx];
+	}
+	uint64_t DroppedCount() const;
+
+	// 記録ファイルを経路毎のポリラインにして 3dm に書き出す。
+	static bool ConvertTo3dm(const char *capture_filename, const char *model_filename);
+
+private:
+	void FlushMain();
+	void Flush();
+
+	FILE *fp;
+	std::unique_ptr<Ring[]> rings;
+	int num_rings;
+	uint64_t threshold;
+	int flush_interval_ms;
+	std::thread flusher;
+	std::mutex mtx;
+	std::condition_variable cv;
+	bool stop;
+};
+
+// 1 本の経路を記録する。RayTrace に渡し、頂点毎に Append を呼ぶ。
+struct PathTrace {
+	PathCapture::Ring *ring;
+	PathRecord rec;
+	bool dropping; ///< 途中で溢れた経路は残りも捨てる
+
+	void Begin(PathCapture::Ring *ring_, int camera, int pixel, int pass) {
+		ring = ring_, dropping = false;
+		rec.pixel = static_cast<uint32_t>(pixel);
+		rec.pass = static_cast<uint32_t>(pass);
+		rec.camera = static_cast<uint16_t>(camera);
+		rec.bounce = 0;
+	}
+	void Append(double x, double y, double z, int material, const double power[3]) {
+		if (dropping) return;
+		rec.pt[0] = static_cast<float>(x), rec.pt[1] = static_cast<float>(y), rec.pt[2] = static_cast<float>(z);
+		rec.material = material;
+		for (int h = 0; h < 3; ++h) rec.power[h] = static_cast<float>(power[h]);
+		if (!ring->Push(rec)) dropping = true;
+		++rec.bounce;
+	}
+};
+
+#endif // PATHCAPTURE_H_
@@ -0,0 +1,389 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#include "pathguide.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include "randomizer.h"
+#include "profiler.h"
+
+PathGuideOptions::PathGuideOptions() : enabled(false), training_passes(15), fraction(0.5), spatial_threshold(12000), flux_threshold(0.01), max_depth(20) {
+}
+
+void PathGuideOptions::Parse(nlohmann::json &jpg) {
+	if (!jpg.is_object()) return;
+	enabled = true;
+	if (jpg["training_passes"].is_number()) training_passes = std::max(jpg["training_passes"].get<int>(), 0);
+	if (jpg["fraction"].is_number()) fraction = std::min(std::max(jpg["fraction"].get<double>(), 0.0), 0.95);
+	if (jpg["spatial_threshold"].is_number()) spatial_threshold = std::max(jpg["spatial_threshold"].get<double>(), 1.0);
+	if (jpg["flux_threshold"].is_number()) flux_threshold = std::min(std::max(jpg["flux_threshold"].get<double>(), 1e-6), 1.0);
+	if (jpg["max_depth"].is_number()) max_depth = std::min(std::max(jpg["max_depth"].get<int>(), 1), 30);
+	if (jpg["load"].is_string()) load = jpg["load"].get<std::string>();
+	if (jpg["save"].is_string()) save = jpg["save"].get<std::string>();
+}
+
+namespace {
+
+const double PI = 3.14159265358979323846;
+
+// 方向を (cosθ, φ) の単位正方形に写す。面積が保たれるので、正方形上の密度を 4π で割ると球面上の密度になる。
+void ToSquare(const double dir[3], double &u, double &v) {
+	const double below_one = 1.0 - 1e-9;
+	u = std::min(std::max((dir[2] + 1.0) * 0.5, 0.0), below_one);
+	double phi = std::atan2(dir[1], dir[0]);
+	if (phi < 0) phi += 2.0 * PI;
+	v = std::min(std::max(phi / (2.0 * PI), 0.0), below_one);
+}
+
+void FromSquare(double u, double v, double dir[3]) {
+	double z = u * 2.0 - 1.0, r = std::sqrt(std::max(0.0, 1.0 - z * z)), phi = v * 2.0 * PI;
+	dir[0] = r * std::cos(phi), dir[1] = r * std::sin(phi), dir[2] = z;
+}
+
+inline int Quadrant(double &u, double &v) {
+	int c = (u >= 0.5 ? 1 : 0) | (v >= 0.5 ? 2 : 0);
+	u = u * 2.0 - (c & 1), v = v * 2.0 - (c >> 1);
+	return c;
+}
+
+inline void AtomicAdd(std::atomic<float> &a, float value) {
+	float cur = a.load(std::memory_order_relaxed);
+	while (!a.compare_exchange_weak(cur, cur + value, std::memory_order_relaxed)) {
+	}
+}
+
+// 学習した和から次の四分木を作る。葉全体に対する割合が threshold を超える区画は分け、下回る節はまとめる。
+// 学習した木で分かれていなかった区画を分ける時は、和を 4 等分して子に配る。
+struct TreeBuilder {
+	const std::vector<int32_t> &child;
+	const std::vector<float> &energy;
+	float limit;
+	int max_depth;
+	std::vector<DirectionTree::Node> &out;
+
+	int Build(int src, const float e[4], int depth) {
+		int idx = static_cast<int>(out.size());
+		out.push_back(DirectionTree::Node());
+		for (int c = 0; c < 4; ++c) out[idx].sum[c] = e[c], out[idx].child[c] = 0;
+		for (int c = 0; c < 4; ++c) {
+			if (depth >= max_depth || e[c] <= limit) continue;
+			int csrc = (src >= 0 && child[src * 4 + c]) ? child[src * 4 + c] : -1;
+			float ce[4];
+			for (int k = 0; k < 4; ++k) ce[k] = (csrc >= 0) ? energy[csrc * 4 + k] : e[c] * 0.25f;
+			int ci = Build(csrc, ce, depth + 1);
+			out[idx].child[c] = ci;
+		}
+		return idx;
+	}
+};
+
+bool BuildTree(const std::vector<int32_t> &child, const std::atomic<float> *sum, double threshold, int max_depth, DirectionTree &out) {
+	// 子は親より後ろに並ぶので、後ろから辿ると区画の和が求まる
+	size_t count = child.size() / 4;
+	std::vector<float> energy(child.size());
+	for (size_t i = count; i-- > 0;) {
+		for (int c = 0; c < 4; ++c) {
+			int ch = child[i * 4 + c];
+			energy[i * 4 + c] = ch ? energy[ch * 4] + energy[ch * 4 + 1] + energy[ch * 4 + 2] + energy[ch * 4 + 3] : sum[i * 4 + c].load(std::memory_order_relaxed);
+		}
+	}
+	float total = energy[0] + energy[1] + energy[2] + energy[3];
+	if (!(total > 0) || !std::isfinite(total)) return false;
+	out.nodes.clear();
+	TreeBuilder builder = { child, energy, static_cast<float>(total * threshold), max_depth, out.nodes };
+	builder.Build(0, &energy[0], 1);
+	return true;
+}
+
+}
+
+DirectionTree::DirectionTree() : nodes(1) {
+	for (int c = 0; c < 4; ++c) nodes[0].sum[c] = 0, nodes[0].child[c] = 0;
+}
+
+float DirectionTree::Total() const {
+	const Node &root = nodes[0];
+	return root.sum[0] + root.sum[1] + root.sum[2] + root.sum[3];
+}
+
+double DirectionTree::Pdf(const double dir[3]) const {
+	double u, v;
+	ToSquare(dir, u, v);
+	double pdf = 1.0;
+	for (int n = 0;;) {
+		const Node &node = nodes[n];
+		float total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+		if (!(total > 0)) break; // 和が無い節の下は一様
+		int c = Quadrant(u, v);
+		pdf *= 4.0 * node.sum[c] / total;
+		if (!node.child[c]) break;
+		n = node.child[c];
+	}
+	return pdf / (4.0 * PI);
+}
+
+void DirectionTree::Sample(xorshift_rnd_32bit &rnd, double dir[3]) const {
+	double ox = 0, oy = 0, size = 1.0;
+	for (int n = 0;;) {
+		const Node &node = nodes[n];
+		float total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+		int c = 0;
+		if (total > 0) {
+			// 丸め誤差で末尾を越えた時は、和のある最後の区画にする
+			double r = rnd() * total;
+			int last = 0;
+			for (c = 0; c < 4; ++c) {
+				if (node.sum[c] <= 0) continue;
+				last = c;
+				if (r < node.sum[c]) break;
+				r -= node.sum[c];
+			}
+			if (c == 4) c = last;
+		} else {
+			c = std::min(static_cast<int>(rnd() * 4.0), 3);
+		}
+		size *= 0.5;
+		ox += (c & 1) * size, oy += (c >> 1) * size;
+		if (total <= 0 || !node.child[c]) break;
+		n = node.child[c];
+	}
+	FromSquare(ox + rnd() * size, oy + rnd() * size, dir);
+}
+
+struct PathGuide::Leaf {
+	DirectionTree sampling;
+	// 学習用の和。構造は sampling と同じで、子の無い区画にだけ足し込む
+	std::vector<int32_t> rec_child;
+	std::unique_ptr<std::atomic<float>[]> rec_sum;
+	std::atomic<uint64_t> samples;
+
+	Leaf() : samples(0) {
+		ResetRecorder();
+	}
+	void ResetRecorder() {
+		size_t count = sampling.nodes.size();
+		rec_child.resize(count * 4);
+		for (size_t i = 0; i < count; ++i) {
+			for (int c = 0; c < 4; ++c) rec_child[i * 4 + c] = sampling.nodes[i].child[c];
+		}
+		rec_sum.reset(new std::atomic<float>[count * 4]);
+		for (size_t i = 0; i < count * 4; ++i) rec_sum[i].store(0.0f, std::memory_order_relaxed);
+		samples.store(0, std::memory_order_relaxed);
+	}
+};
+
+PathGuide::PathGuide(const PathGuideOptions &opt_) : opt(opt_), training(false), trained(false), iteration(0) {
+	const double lo[3] = { -1, -1, -1 }, hi[3] = { 1, 1, 1 };
+	Reset(lo, hi);
+}
+
+PathGuide::~PathGuide() {
+}
+
+void PathGuide::Reset(const double lo[3], const double hi[3], uint64_t scene_key_) {
+	scene_key = scene_key_;
+	// 分割を軸毎に偏らせないよう立方体にする
+	double half = 0;
+	for (int a = 0; a < 3; ++a) half = std::max(half, (hi[a] - lo[a]) * 0.5);
+	half = half * 1.01 + 1e-6;
+	for (int a = 0; a < 3; ++a) {
+		double center = (lo[a] + hi[a]) * 0.5;
+		bmin[a] = center - half, bmax[a] = center + half;
+	}
+	spatial.assign(1, SpatialNode());
+	spatial[0].child[0] = spatial[0].child[1] = 0;
+	spatial[0].leaf = 0, spatial[0].axis = 0;
+	leaves.clear();
+	leaves.emplace_back(new Leaf());
+	training = trained = false;
+	iteration = 0;
+}
+
+int PathGuide::LeafAt(const double pos[3]) const {
+	double lo[3] = { bmin[0], bmin[1], bmin[2] }, hi[3] = { bmax[0], bmax[1], bmax[2] };
+	int n = 0;
+	while (spatial[n].child[0]) {
+		int a = spatial[n].axis;
+		double mid = (lo[a] + hi[a]) * 0.5;
+		if (pos[a] < mid) {
+			hi[a] = mid, n = spatial[n].child[0];
+		} else {
+			lo[a] = mid, n = spatial[n].child[1];
+		}
+	}
+	return spatial[n].leaf;
+}
+
+const DirectionTree *PathGuide::Distribution(int leaf) const {
+	if (!trained) return nullptr;
+	const DirectionTree &tree = leaves[leaf]->sampling;
+	return (tree.Total() > 0) ? &tree : nullptr;
+}
+
+void PathGuide::Record(int leaf, const double dir[3], double value) {
+	Leaf &l = *leaves[leaf];
+	l.samples.fetch_add(1, std::memory_order_relaxed);
+	if (!(value > 0) || !std::isfinite(value)) return;
+	double u, v;
+	ToSquare(dir, u, v);
+	for (int n = 0;;) {
+		int c = Quadrant(u, v);
+		int ch = l.rec_child[n * 4 + c];
+		if (!ch) {
+			AtomicAdd(l.rec_sum[n * 4 + c], static_cast<float>(value));
+			return;
+		}
+		n = ch;
+	}
+}
+
+void PathGuide::BeginIteration() {
+	training = true;
+}
+
+// 標本数が threshold を超える葉を中央で 2 つに分ける。子は親の分布を引き継ぎ、標本数は半分ずつとみなす。
+void PathGuide::Split(int node, uint64_t samples, double threshold) {
+	if (static_cast<double>(samples) <= threshold) return;
+	int axis = spatial[node].axis;
+	int leaf0 = spatial[node].leaf, leaf1 = static_cast<int>(leaves.size());
+	leaves.emplace_back(new Leaf());
+	leaves[leaf1]->sampling = leaves[leaf0]->sampling;
+	int child0 = static_cast<int>(spatial.size()), child1 = child0 + 1;
+	for (int k = 0; k < 2; ++k) {
+		SpatialNode sn;
+		sn.child[0] = sn.child[1] = 0;
+		sn.leaf = k ? leaf1 : leaf0;
+		sn.axis = (axis + 1) % 3;
+		spatial.push_back(sn);
+	}
+	spatial[node].child[0] = child0, spatial[node].child[1] = child1;
+	spatial[node].leaf = -1;
+	Split(child0, samples / 2, threshold);
+	Split(child1, samples / 2, threshold);
+}
+
+void PathGuide::EndIteration(int passes) {
+	PROFILE_ZONE("guide_update");
+	training = false;
+	// 葉毎に方向の四分木を作り直す。放射輝度が届かなかった葉は前の分布のままにする。
+	for (size_t i = 0; i < leaves.size(); ++i) {
+		Leaf &l = *leaves[i];
+		DirectionTree next;
+		if (BuildTree(l.rec_child, l.rec_sum.get(), opt.flux_threshold, opt.max_depth, next)) l.sampling = next;
+	}
+	// 標本の多い空間の葉を分ける
+	double threshold = opt.spatial_threshold * std::sqrt(static_cast<double>(std::max(passes, 1)));
+	size_t count = spatial.size();
+	for (size_t n = 0; n < count; ++n) {
+		if (spatial[n].child[0]) continue;
+		Split(static_cast<int>(n), leaves[spatial[n].leaf]->samples.load(), threshold);
+	}
+	size_t nodes = 0;
+	for (size_t i = 0; i < leaves.size(); ++i) {
+		leaves[i]->ResetRecorder();
+		nodes += leaves[i]->sampling.nodes.size();
+	}
+	trained = true;
+	++iteration;
+	std::fprintf(stderr, "path_guiding: iteration %d (%d passes), %d spatial leaves, %d directional nodes.\n", iteration, passes, static_cast<int>(leaves.size()), static_cast<int>(nodes));
+}
+
+namespace {
+
+const char GUIDE_FILE_MAGIC[8] = { 'P', 'R', 'T', 'G', 'U', 'I', 'D', '2' };
+
+struct GuideFileHeader {
+	char magic[8];
+	uint64_t scene_key;
+	double bmin[3], bmax[3];
+	int32_t spatial_count, leaf_count;
+};
+
+}
+
+bool PathGuide::Save(const char *filename) const {
+	std::unique_ptr<FILE, decltype(&std::fclose)> fp(std::fopen(filename, "wb"), std::fclose);
+	if (!fp) {
+		std::fprintf(stderr, "cannot open %s\n", filename);
+		return false;
+	}
+	GuideFileHeader h;
+	std::memset(&h, 0, sizeof(h));
+	std::memcpy(h.magic, GUIDE_FILE_MAGIC, sizeof(h.magic));
+	h.scene_key = scene_key;
+	for (int a = 0; a < 3; ++a) h.bmin[a] = bmin[a], h.bmax[a] = bmax[a];
+	h.spatial_count = static_cast<int32_t>(spatial.size());
+	h.leaf_count = static_cast<int32_t>(leaves.size());
+	bool ok = std::fwrite(&h, sizeof(h), 1, fp.get()) == 1;
+	ok = ok && std::fwrite(spatial.data(), sizeof(SpatialNode), spatial.size(), fp.get()) == spatial.size();
+	for (size_t i = 0; ok && i < leaves.size(); ++i) {
+		const std::vector<DirectionTree::Node> &nodes = leaves[i]->sampling.nodes;
+		int32_t count = static_cast<int32_t>(nodes.size());
+		ok = std::fwrite(&count, sizeof(count), 1, fp.get()) == 1 && std::fwrite(nodes.data(), sizeof(DirectionTree::Node), nodes.size(), fp.get()) == nodes.size();
+	}
+	if (!ok) std::fprintf(stderr, "cannot write %s\n", filename);
+	return ok;
+}
+
+bool PathGuide::Load(const char *filename) {
+	std::unique_ptr<FILE, decltype(&std::fclose)> fp(std::fopen(filename, "rb"), std::fclose);
+	if (!fp) {
+		std::fprintf(stderr, "cannot open %s\n", filename);
+		return false;
+	}
+	GuideFileHeader h;
+	if (std::fread(&h, sizeof(h), 1, fp.get()) != 1 || std::memcmp(h.magic, GUIDE_FILE_MAGIC, sizeof(h.magic)) != 0 || h.spatial_count <= 0 || h.leaf_count <= 0) {
+		std::fprintf(stderr, "%s is not a path guide file.\n", filename);
+		return false;
+	}
+	// 別のシーンで学習した分布は使わない
+	bool same_scene = h.scene_key == scene_key;
+	for (int a = 0; a < 3; ++a) {
+		double tol = (bmax[a] - bmin[a]) * 1e-9;
+		same_scene = same_scene && std::fabs(h.bmin[a] - bmin[a]) <= tol && std::fabs(h.bmax[a] - bmax[a]) <= tol;
+	}
+	if (!same_scene) {
+		std::fprintf(stderr, "%s was trained on a different scene; retraining.\n", filename);
+		return false;
+	}
+	std::vector<SpatialNode> sp(h.spatial_count);
+	std::vector<std::unique_ptr<Leaf> > lv(h.leaf_count);
+	bool ok = std::fread(sp.data(), sizeof(SpatialNode), sp.size(), fp.get()) == sp.size();
+	for (size_t i = 0; ok && i < lv.size(); ++i) {
+		int32_t count;
+		ok = std::fread(&count, sizeof(count), 1, fp.get()) == 1 && count > 0;
+		if (!ok) break;
+		lv[i].reset(new Leaf());
+		std::vector<DirectionTree::Node> &nodes = lv[i]->sampling.nodes;
+		nodes.resize(count);
+		ok = std::fread(nodes.data(), sizeof(DirectionTree::Node), nodes.size(), fp.get()) == nodes.size();
+		for (size_t k = 0; ok && k < nodes.size(); ++k) {
+			// 子は親より後ろに並ぶ
+			for (int c = 0; c < 4; ++c) ok = ok && (nodes[k].child[c] == 0 || (nodes[k].child[c] > static_cast<int32_t>(k) && nodes[k].child[c] < count));
+		}
+		if (ok) lv[i]->ResetRecorder();
+	}
+	for (size_t n = 0; ok && n < sp.size(); ++n) {
+		int32_t self = static_cast<int32_t>(n);
+		if (sp[n].child[0]) ok = sp[n].child[0] > self && sp[n].child[0] < h.spatial_count && sp[n].child[1] > self && sp[n].child[1] < h.spatial_count && sp[n].axis >= 0 && sp[n].axis < 3;
+		else ok = sp[n].leaf >= 0 && sp[n].leaf < h.leaf_count && sp[n].axis >= 0 && sp[n].axis < 3;
+	}
+	if (!ok) {
+		std::fprintf(stderr, "cannot read %s\n", filename);
+		return false;
+	}
+	for (int a = 0; a < 3; ++a) bmin[a] = h.bmin[a], bmax[a] = h.bmax[a];
+	spatial.swap(sp);
+	leaves.swap(lv);
+	training = false;
+	trained = true;
+	return true;
+}
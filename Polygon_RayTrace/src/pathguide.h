@@ -0,0 +1,112 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#ifndef PATHGUIDE_H_
+#define PATHGUIDE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+struct xorshift_rnd_32bit;
+
+// 経路案内の設定。設定ファイルの "path_guiding" で指定する。
+// 例: "path_guiding": { "training_passes": 15, "fraction": 0.5, "spatial_threshold": 12000, "flux_threshold": 0.01, "max_depth": 20, "load": "scene.guide", "save": "scene.guide" }
+struct PathGuideOptions {
+	bool enabled;
+	int training_passes;      ///< 学習に使う先頭のパス数。反復毎に 1, 2, 4, ... パスずつ計算する
+	double fraction;          ///< 拡散反射で学習した分布から方向を選ぶ確率
+	double spatial_threshold; ///< 空間の葉を分ける標本数 (反復のパス数の平方根倍する)
+	double flux_threshold;    ///< 方向の節を分ける、葉全体に対する放射輝度の割合
+	int max_depth;            ///< 方向の四分木の深さの上限
+	std::string load;         ///< 空でない時、学習済みの分布を読み込んで学習を省く
+	std::string save;         ///< 空でない時、描画後に分布を書き出す
+	PathGuideOptions();
+	void Parse(nlohmann::json &jpg);
+};
+
+// 方向の四分木。方向は (cosθ, φ) の正方形に面積を保って写し、各節は 4 つの区画の放射輝度の和を持つ。
+struct DirectionTree {
+	struct Node {
+		float sum[4];
+		int32_t child[4]; ///< 0 は葉 (根が 0 番なので子に 0 は現れない)
+	};
+	std::vector<Node> nodes;
+	DirectionTree(); ///< 区画 4 つの一様な分布
+	float Total() const;
+	// 単位球面上の確率密度
+	double Pdf(const double dir[3]) const;
+	void Sample(xorshift_rnd_32bit &rnd, double dir[3]) const;
+};
+
+// 拡散反射の方向を選ぶ時に Materials::CalcBSDF へ渡す。
+struct GuidedSample {
+	const DirectionTree *dist; ///< 入力: 衝突点の分布。nullptr の時は BSDF だけで選ぶ
+	double fraction;           ///< 入力: dist から選ぶ確率
+	bool diffuse;              ///< 出力: 拡散反射の方向を選んだ時 true
+	double pdf;                ///< 出力: 選んだ方向の (混合) 確率密度
+	GuidedSample() : dist(nullptr), fraction(0), diffuse(false), pdf(0) {}
+};
+
+// 空間の二分木の葉毎に方向の四分木を持つ分布 (SD-tree)。
+// 学習中はワーカーが Record でロックを取らずに放射輝度を足し込み、反復の終わりに EndIteration で
+// 空間の葉を分け、方向の四分木を作り直す。描画中は前の反復で作った分布から方向を選ぶ。
+struct PathGuide {
+	explicit PathGuide(const PathGuideOptions &opt);
+	~PathGuide();
+	const PathGuideOptions &Options() const {
+		return opt;
+	}
+	// シーンを囲む箱を設定し、葉 1 つの状態に戻す。
+	// scene_key はシーン (形状・材質・光源などの設定) のハッシュで、保存したファイルに記録し、読み込む時に照合する。
+	void Reset(const double bmin[3], const double bmax[3], uint64_t scene_key = 0);
+
+	// pos を含む空間の葉の番号
+	int LeafAt(const double pos[3]) const;
+	// 葉の分布。まだ学習していない、または放射輝度が無い時は nullptr。
+	const DirectionTree *Distribution(int leaf) const;
+	// 学習中に、葉 leaf で方向 dir から来る放射輝度をその方向の確率密度で割った値を足す。
+	void Record(int leaf, const double dir[3], double value);
+
+	bool Training() const {
+		return training;
+	}
+	bool Trained() const {
+		return trained;
+	}
+	void BeginIteration();
+	// passes はこの反復で計算したパス数
+	void EndIteration(int passes);
+
+	bool Save(const char *filename) const;
+	// Reset で設定したシーンの箱と scene_key が一致しないファイルは読み込まない (学習し直す)。
+	bool Load(const char *filename);
+
+private:
+	struct SpatialNode {
+		int32_t child[2]; ///< 0 は葉
+		int32_t leaf;
+		int32_t axis;
+	};
+	struct Leaf;
+
+	void Split(int node, uint64_t samples, double threshold);
+
+	PathGuideOptions opt;
+	double bmin[3], bmax[3];
+	uint64_t scene_key;
+	std::vector<SpatialNode> spatial;
+	std::vector<std::unique_ptr<Leaf> > leaves;
+	bool training, trained;
+	int iteration;
+};
+
+#endif // PATHGUIDE_H_
@@ -0,0 +1,202 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#include "profiler.h"
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <chrono>
+#include <map>
+
+#include "nlohmann/json.hpp"
+
+namespace {
+	struct Registry {
+		std::mutex mtx;
+		std::vector<std::string> zone_names;
+		std::map<std::string, int> zone_ids;
+		std::vector<std::unique_ptr<Profiler::ThreadLog> > logs;
+		std::atomic<bool> enabled;
+		int sampling_interval;
+		size_t trace_events;
+		// Now() の値を秒に換算するための基準点
+		uint64_t tick_start;
+		std::chrono::steady_clock::time_point clock_start;
+		Registry() : enabled(false), sampling_interval(1), trace_events(0) {
+			tick_start = Profiler::Now();
+			clock_start = std::chrono::steady_clock::now();
+		}
+		double SecondsPerTick() {
+#ifdef PROFILER_USE_RDTSC
+			uint64_t ticks = Profiler::Now() - tick_start;
+			double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - clock_start).count();
+			return (ticks > 0) ? sec / static_cast<double>(ticks) : 0;
+#else
+			return static_cast<double>(std::chrono::steady_clock::period::num) / static_cast<double>(std::chrono::steady_clock::period::den);
+#endif
+		}
+	};
+	Registry &registry() {
+		static Registry r;
+		return r;
+	}
+
+	// 全スレッドの木を、ルートからのゾーン名の経路が同じノード同士でまとめたもの。
+	struct MergedNode {
+		uint64_t ticks, count;
+		bool sampled;
+		std::map<int, MergedNode> children;
+		MergedNode() : ticks(0), count(0), sampled(false) {}
+	};
+	void merge(const Profiler::ThreadLog &log, int idx, MergedNode &dest) {
+		for (int c = log.nodes[idx].first_child; c >= 0; c = log.nodes[c].next_sibling) {
+			const Profiler::Node &n = log.nodes[c];
+			MergedNode &m = dest.children[n.zone];
+			m.ticks += n.ticks;
+			m.count += n.count;
+			m.sampled |= n.sampled;
+			merge(log, c, m);
+		}
+	}
+	void merge_all(MergedNode &root) {
+		Registry &r = registry();
+		for (size_t i = 0; i < r.logs.size(); ++i) merge(*r.logs[i], 0, root);
+	}
+	nlohmann::json to_json(const MergedNode &m, const std::string &name, double msec_per_tick, int sampling_interval) {
+		nlohmann::json j;
+		double total = static_cast<double>(m.ticks) * msec_per_tick;
+		double children_total = 0;
+		for (auto iter = m.children.begin(); iter != m.children.end(); ++iter) {
+			children_total += static_cast<double>(iter->second.ticks) * msec_per_tick;
+		}
+		j["name"] = name;
+		j["total_ms"] = total;
+		j["self_ms"] = total - children_total;
+		j["count"] = m.count;
+		j["sampled"] = m.sampled;
+		// 間引き計測の場合は全数計測したときの推定値も出す
+		double scale = m.sampled ? static_cast<double>(sampling_interval) : 1.0;
+		j["estimated_total_ms"] = total * scale;
+		j["estimated_count"] = static_cast<double>(m.count) * scale;
+		j["children"] = nlohmann::json::array();
+		for (auto iter = m.children.begin(); iter != m.children.end(); ++iter) {
+			j["children"].push_back(to_json(iter->second, registry().zone_names[iter->first], msec_per_tick, sampling_interval));
+		}
+		return j;
+	}
+	void print(FILE *fp, const MergedNode &m, int depth, double msec_per_tick, int sampling_interval) {
+		for (auto iter = m.children.begin(); iter != m.children.end(); ++iter) {
+			const MergedNode &c = iter->second;
+			double total = static_cast<double>(c.ticks) * msec_per_tick;
+			double scale = c.sampled ? static_cast<double>(sampling_interval) : 1.0;
+			std::fprintf(fp, "%*s%-*s %12.3f msec %12llu times%s\n", depth * 2, "", 32 - depth * 2, registry().zone_names[iter->first].c_str(),
+				total * scale, static_cast<unsigned long long>(static_cast<double>(c.count) * scale), c.sampled ? " (estimated)" : "");
+			print(fp, c, depth + 1, msec_per_tick, sampling_interval);
+		}
+	}
+}
+
+int Profiler::RegisterZone(const char *name) {
+	Registry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mtx);
+	auto iter = r.zone_ids.find(name);
+	if (iter != r.zone_ids.end()) return iter->second;
+	int id = static_cast<int>(r.zone_names.size());
+	r.zone_names.push_back(name);
+	r.zone_ids.insert(std::make_pair(std::string(name), id));
+	return id;
+}
+
+void Profiler::Start(int sampling_interval, size_t trace_events) {
+	Registry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mtx);
+	r.sampling_interval = (sampling_interval > 0) ? sampling_interval : 1;
+	r.trace_events = trace_events;
+	for (size_t i = 0; i < r.logs.size(); ++i) r.logs[i]->events.reserve(trace_events);
+	r.enabled.store(true, std::memory_order_release);
+}
+
+bool Profiler::Enabled() {
+	return registry().enabled.load(std::memory_order_relaxed);
+}
+
+int Profiler::SamplingInterval() {
+	return registry().sampling_interval;
+}
+
+size_t Profiler::TraceEventCapacity() {
+	return registry().trace_events;
+}
+
+Profiler::ThreadLog *Profiler::RegisterThread() {
+	Registry &r = registry();
+	std::lock_guard<std::mutex> lock(r.mtx);
+	std::unique_ptr<ThreadLog> log(new ThreadLog());
+	log->index = static_cast<int>(r.logs.size());
+	log->current = 0;
+	log->suppressed = false;
+	log->sample_counter = 0;
+	log->events_dropped = 0;
+	Node root = { -1, -1, -1, -1, false, 0, 0 };
+	log->nodes.reserve(64);
+	log->nodes.push_back(root);
+	log->events.reserve(r.trace_events);
+	r.logs.push_back(std::move(log));
+	return r.logs.back().get();
+}
+
+void Profiler::PrintSummary(FILE *fp) {
+	MergedNode root;
+	merge_all(root);
+	Registry &r = registry();
+	std::fprintf(fp, "profile (%d threads, sampling 1/%d):\n", static_cast<int>(r.logs.size()), r.sampling_interval);
+	print(fp, root, 1, r.SecondsPerTick() * 1000.0, r.sampling_interval);
+}
+
+bool Profiler::DumpJSON(const char *filename) {
+	MergedNode root;
+	merge_all(root);
+	Registry &r = registry();
+	double msec_per_tick = r.SecondsPerTick() * 1000.0;
+	nlohmann::json j;
+	j["threads"] = r.logs.size();
+	j["sampling_interval"] = r.sampling_interval;
+	j["zones"] = nlohmann::json::array();
+	for (auto iter = root.children.begin(); iter != root.children.end(); ++iter) {
+		j["zones"].push_back(to_json(iter->second, r.zone_names[iter->first], msec_per_tick, r.sampling_interval));
+	}
+	std::unique_ptr<FILE, decltype(&std::fclose)> fp(std::fopen(filename, "wb"), std::fclose);
+	if (!fp.get()) return false;
+	std::string s = j.dump(1, '\t');
+	return std::fwrite(s.c_str(), 1, s.size(), fp.get()) == s.size();
+}
+
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+bool Profiler::DumpChromeTrace(const char *filename) {
+	Registry &r = registry();
+	double usec_per_tick = r.SecondsPerTick() * 1000000.0;
+	std::unique_ptr<FILE, decltype(&std::fclose)> fp(std::fopen(filename, "wb"), std::fclose);
+	if (!fp.get()) return false;
+	std::fprintf(fp.get(), "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	size_t dropped = 0;
+	for (size_t i = 0; i < r.logs.size(); ++i) {
+		const ThreadLog &log = *r.logs[i];
+		dropped += log.events_dropped;
+		for (size_t k = 0; k < log.events.size(); ++k) {
+			const Event &e = log.events[k];
+			double ts = static_cast<double>(e.begin - r.tick_start) * usec_per_tick;
+			double dur = static_cast<double>(e.end - e.begin) * usec_per_tick;
+			std::fprintf(fp.get(), "%s{\"name\":%s,\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				first ? "" : ",\n", nlohmann::json(r.zone_names[e.zone]).dump().c_str(), log.index, ts, dur);
+			first = false;
+		}
+	}
+	std::fprintf(fp.get(), "\n],\"otherData\":{\"events_dropped\":%llu}}\n", static_cast<unsigned long long>(dropped));
+	return true;
+}
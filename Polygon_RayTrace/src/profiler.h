@@ -0,0 +1,173 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+// 無効にする場合はコメントアウトする。無効時は PROFILE_ZONE 等が空になる。
+#define USE_PROFILER
+
+#include <stdint.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define PROFILER_USE_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILER_USE_RDTSC
+#else
+#include <chrono>
+#endif
+
+// スレッド毎の階層別集計を行うプロファイラ。
+// 計測中の書き込みは各スレッドの領域のみで行い、ロックは取らない。
+// 集計結果の出力 (Dump*) は計測スレッドが停止している時に呼ぶこと。
+struct Profiler {
+	static inline uint64_t Now() {
+#ifdef PROFILER_USE_RDTSC
+		return __rdtsc();
+#else
+		return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+	}
+
+	struct Node {
+		int zone, parent, first_child, next_sibling;
+		bool sampled; // 間引き計測されるゾーンの配下かどうか
+		uint64_t ticks, count;
+	};
+	struct Event {
+		int zone;
+		uint64_t begin, end;
+	};
+	struct ThreadLog {
+		int index;
+		int current;       // 現在のノード (0 はルート)
+		bool suppressed;   // 間引きにより計測しない区間かどうか
+		uint64_t sample_counter;
+		std::vector<Node> nodes;
+		std::vector<Event> events;
+		size_t events_dropped;
+
+		// zone を current の子として探し、無ければ追加する。
+		inline int Enter(int zone, bool sampled) {
+			int prev = -1;
+			for (int c = nodes[current].first_child; c >= 0; prev = c, c = nodes[c].next_sibling) {
+				if (nodes[c].zone == zone) return current = c;
+			}
+			Node n = { zone, current, -1, -1, sampled || nodes[current].sampled, 0, 0 };
+			int idx = static_cast<int>(nodes.size());
+			nodes.push_back(n);
+			if (prev < 0) nodes[current].first_child = idx;
+			else nodes[prev].next_sibling = idx;
+			return current = idx;
+		}
+	};
+
+	// ゾーン名を登録して ID を返す。同じ名前は同じ ID になる。
+	static int RegisterZone(const char *name);
+
+	// 計測開始。trace_events が 0 より大きい場合、スレッド毎にその数までイベントを記録する (Chrome trace 用)。
+	// sampling_interval 回に 1 回だけ PROFILE_SAMPLED_ZONE の区間を計測する。
+	// Start を呼ぶまではゾーンを計測しない。
+	static void Start(int sampling_interval, size_t trace_events);
+	static bool Enabled();
+
+	static inline ThreadLog *Log() {
+		static thread_local ThreadLog *log = nullptr;
+		if (!log) log = RegisterThread();
+		return log;
+	}
+	static int SamplingInterval();
+	static size_t TraceEventCapacity();
+
+	// 全スレッドの集計を階層ごとにまとめて出力する。
+	static void PrintSummary(FILE *fp);
+	static bool DumpJSON(const char *filename);
+	static bool DumpChromeTrace(const char *filename);
+
+private:
+	static ThreadLog *RegisterThread();
+};
+
+struct ProfileScope {
+	Profiler::ThreadLog *log;
+	uint64_t t0;
+	int prev;
+	bool prev_suppressed;
+	ProfileScope(int zone) {
+		if (!Profiler::Enabled()) {
+			log = nullptr;
+			return;
+		}
+		log = Profiler::Log();
+		if (log->suppressed) {
+			log = nullptr;
+			return;
+		}
+		prev = log->current;
+		log->Enter(zone, false);
+		t0 = Profiler::Now();
+	}
+	// 間引き計測用。sampling_interval 回に 1 回だけ計測し、それ以外は配下のゾーンも含めて計測しない。
+	ProfileScope(int zone, bool) {
+		if (!Profiler::Enabled()) {
+			log = nullptr;
+			return;
+		}
+		log = Profiler::Log();
+		prev_suppressed = log->suppressed;
+		if (log->suppressed || (++log->sample_counter % Profiler::SamplingInterval()) != 0) {
+			log->suppressed = true;
+			t0 = 0;
+			return;
+		}
+		prev = log->current;
+		log->Enter(zone, true);
+		t0 = Profiler::Now();
+	}
+	~ProfileScope() {
+		if (!log) return;
+		if (t0 == 0) {
+			log->suppressed = prev_suppressed;
+			return;
+		}
+		uint64_t t1 = Profiler::Now();
+		Profiler::Node &n = log->nodes[log->current];
+		n.ticks += t1 - t0;
+		++n.count;
+		if (log->events.capacity() > 0) {
+			if (log->events.size() < log->events.capacity()) {
+				Profiler::Event e = { n.zone, t0, t1 };
+				log->events.push_back(e);
+			} else ++log->events_dropped;
+		}
+		log->current = prev;
+	}
+	ProfileScope(const ProfileScope &) = delete;
+	ProfileScope &operator =(const ProfileScope &) = delete;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#ifdef USE_PROFILER
+#define PROFILE_ZONE(name) \
+	static const int PROFILE_CONCAT(profile_zone_id_, __LINE__) = Profiler::RegisterZone(name); \
+	ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(PROFILE_CONCAT(profile_zone_id_, __LINE__))
+#define PROFILE_SAMPLED_ZONE(name) \
+	static const int PROFILE_CONCAT(profile_zone_id_, __LINE__) = Profiler::RegisterZone(name); \
+	ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(PROFILE_CONCAT(profile_zone_id_, __LINE__), true)
+#else
+#define PROFILE_ZONE(name)
+#define PROFILE_SAMPLED_ZONE(name)
+#endif
+
+#endif // PROFILER_H_
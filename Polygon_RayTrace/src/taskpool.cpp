@@ -0,0 +1,389 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#include "taskpool.h"
+
+#include <cstdio>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+	thread_local int worker_index = -1;
+	thread_local int worker_node = -1;
+	// SpawnOnNode で投入したタスクを実行中かどうか。実行中に投入したタスクは同じノードへ回す。
+	thread_local bool in_node_scope = false;
+
+	// 論理コア番号は Windows ではプロセッサグループ * 64 + グループ内の番号とする。
+	void pin_current_thread(const std::vector<int> &cpus) {
+		if (cpus.empty()) return;
+#if defined(_WIN32)
+		GROUP_AFFINITY ga;
+		std::memset(&ga, 0, sizeof(ga));
+		ga.Group = static_cast<WORD>(cpus[0] / 64);
+		for (size_t i = 0; i < cpus.size(); ++i) {
+			if (cpus[i] / 64 == ga.Group) ga.Mask |= static_cast<KAFFINITY>(1) << (cpus[i] % 64);
+		}
+		::SetThreadGroupAffinity(::GetCurrentThread(), &ga, nullptr);
+#elif defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (size_t i = 0; i < cpus.size(); ++i) CPU_SET(cpus[i] % CPU_SETSIZE, &set);
+		::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+#endif
+	}
+
+	// NUMA ノード毎の論理コア番号の一覧。取得できない時は空。
+	void numa_node_cpus(std::vector<std::vector<int> > &nodes) {
+		nodes.clear();
+#if defined(_WIN32)
+		ULONG highest;
+		if (!::GetNumaHighestNodeNumber(&highest)) return;
+		for (ULONG n = 0; n <= highest; ++n) {
+			GROUP_AFFINITY ga;
+			nodes.push_back(std::vector<int>());
+			if (!::GetNumaNodeProcessorMaskEx(static_cast<USHORT>(n), &ga)) continue;
+			for (int b = 0; b < 64; ++b) {
+				if (ga.Mask & (static_cast<KAFFINITY>(1) << b)) nodes.back().push_back(ga.Group * 64 + b);
+			}
+		}
+#elif defined(__linux__)
+		for (int n = 0; ; ++n) {
+			char path[128];
+			std::snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+			FILE *fp = std::fopen(path, "r");
+			if (!fp) break;
+			nodes.push_back(std::vector<int>());
+			// "0-7,16-23" の形式
+			int a, b;
+			char sep;
+			while (std::fscanf(fp, "%d", &a) == 1) {
+				b = a;
+				if (std::fscanf(fp, "%c", &sep) == 1 && sep == '-') {
+					if (std::fscanf(fp, "%d", &b) != 1) break;
+					if (std::fscanf(fp, "%c", &sep) != 1) sep = 0;
+				}
+				for (int c = a; c <= b; ++c) nodes.back().push_back(c);
+				if (sep != ',') break;
+			}
+			std::fclose(fp);
+		}
+#endif
+		// コアの無いノード (メモリのみのノード) は除く
+		for (size_t n = nodes.size(); n-- > 0;) {
+			if (nodes[n].empty()) nodes.erase(nodes.begin() + n);
+		}
+	}
+
+	inline uint32_t next_victim(uint32_t &seed) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return seed;
+	}
+}
+
+bool TaskPool::WorkDeque::Push(Task *task) {
+	int64_t b = bottom.load(std::memory_order_relaxed);
+	int64_t t = top.load(std::memory_order_acquire);
+	if (b - t >= CAPACITY) return false;
+	buffer[b & (CAPACITY - 1)].store(task, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	bottom.store(b + 1, std::memory_order_relaxed);
+	return true;
+}
+
+TaskPool::Task *TaskPool::WorkDeque::Pop() {
+	int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+	bottom.store(b, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t t = top.load(std::memory_order_relaxed);
+	if (t > b) {
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	Task *task = buffer[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+	if (t == b) {
+		// 最後の 1 つは Steal と取り合いになる
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) task = nullptr;
+		bottom.store(b + 1, std::memory_order_relaxed);
+	}
+	return task;
+}
+
+TaskPool::Task *TaskPool::WorkDeque::Steal() {
+	int64_t t = top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int64_t b = bottom.load(std::memory_order_acquire);
+	if (t >= b) return nullptr;
+	Task *task = buffer[t & (CAPACITY - 1)].load(std::memory_order_relaxed);
+	if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) return nullptr;
+	return task;
+}
+
+TaskPool::TaskPool(int num_threads, bool pin_threads, int numa_nodes) : worker_count(0), pending(0), sleepers(0), stop(false) {
+	std::vector<std::vector<int> > nodes;
+	if (numa_nodes > 0) {
+		numa_node_cpus(nodes);
+		if (static_cast<int>(nodes.size()) > numa_nodes) nodes.resize(numa_nodes);
+	}
+	if (nodes.empty()) {
+		// NUMA を使わない時は全体を 1 つのノードとして扱う
+		nodes.push_back(std::vector<int>());
+		for (int c = 0; c < HardwareConcurrency(); ++c) nodes.back().push_back(c);
+		numa_nodes = 0;
+	}
+	if (num_threads <= 0) {
+		num_threads = 0;
+		for (size_t n = 0; n < nodes.size(); ++n) num_threads += static_cast<int>(nodes[n].size());
+	}
+	node_count = static_cast<int>(nodes.size());
+	node_workers.assign(node_count, 0);
+	node_queues.resize(node_count);
+	node_pending.reset(new std::atomic<int64_t>[node_count]);
+	for (int n = 0; n < node_count; ++n) node_pending[n] = 0;
+
+	// 起動したワーカーがすぐに他のワーカーから盗めるよう、数は先に決めておく
+	worker_count = num_threads;
+	for (int i = 0; i < num_threads; ++i) ++node_workers[i % node_count];
+	deques.reset(new WorkDeque[num_threads]);
+	workers.reserve(num_threads);
+	for (int i = 0; i < num_threads; ++i) {
+		// ノードへは順番に割り当てる
+		int node = i % node_count;
+		const std::vector<int> &node_cpus = nodes[node];
+		std::vector<int> cpus;
+		if (pin_threads) cpus.push_back(node_cpus[(i / node_count) % node_cpus.size()]);
+		else if (numa_nodes > 0) cpus = node_cpus;
+		workers.emplace_back([this, i, node, cpus]() { WorkerMain(i, node, cpus); });
+	}
+}
+
+TaskPool::~TaskPool() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	cv.notify_all();
+	for (size_t i = 0; i < workers.size(); ++i) workers[i].join();
+}
+
+int TaskPool::WorkerIndex() {
+	return worker_index;
+}
+
+int TaskPool::WorkerNode() {
+	return worker_node;
+}
+
+int TaskPool::NumaNodeCount() {
+	std::vector<std::vector<int> > nodes;
+	numa_node_cpus(nodes);
+	return nodes.empty() ? 1 : static_cast<int>(nodes.size());
+}
+
+int TaskPool::LocalWorkerCount() const {
+	return (in_node_scope && worker_node >= 0) ? node_workers[worker_node] : Count();
+}
+
+int TaskPool::HardwareConcurrency() {
+	unsigned int n = std::thread::hardware_concurrency();
+	return (n > 0) ? static_cast<int>(n) : 1;
+}
+
+void TaskPool::Spawn(Task task) {
+	if (in_node_scope && worker_node >= 0) {
+		SpawnOnNode(worker_node, std::move(task));
+		return;
+	}
+	Task *t = new Task(std::move(task));
+	pending.fetch_add(1);
+	int idx = worker_index;
+	if (idx < 0 || !deques[idx].Push(t)) {
+		std::lock_guard<std::mutex> lock(mtx);
+		shared_queue.push_back(t);
+	}
+	// 寝ているワーカーがいる時だけ起こす。
+	// sleepers と pending は互いに逆順で更新・参照するので、取りこぼしは起きない。
+	if (sleepers.load() > 0) {
+		std::lock_guard<std::mutex> lock(mtx);
+		cv.notify_one();
+	}
+}
+
+void TaskPool::SpawnShared(Task task) {
+	Task *t = new Task(std::move(task));
+	pending.fetch_add(1);
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		shared_queue.push_back(t);
+	}
+	if (sleepers.load() > 0) {
+		std::lock_guard<std::mutex> lock(mtx);
+		cv.notify_one();
+	}
+}
+
+void TaskPool::SpawnUrgent(Task task) {
+	Task *t = new Task(std::move(task));
+	pending.fetch_add(1);
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		shared_queue.push_front(t);
+	}
+	if (sleepers.load() > 0) {
+		std::lock_guard<std::mutex> lock(mtx);
+		cv.notify_one();
+	}
+}
+
+void TaskPool::SpawnOnNode(int node, Task task) {
+	Task *t = new Task([task]() {
+		bool prev = in_node_scope;
+		in_node_scope = true;
+		task();
+		in_node_scope = prev;
+	});
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		node_queues[node].push_back(t);
+	}
+	node_pending[node].fetch_add(1);
+	// どのワーカーが起きるか選べないので、全員起こす
+	if (sleepers.load() > 0) {
+		std::lock_guard<std::mutex> lock(mtx);
+		cv.notify_all();
+	}
+}
+
+TaskPool::Task *TaskPool::Acquire(int self, uint32_t &seed) {
+	Task *task = nullptr;
+	if (self >= 0) task = deques[self].Pop();
+	if (!task && worker_node >= 0 && node_pending[worker_node].load() > 0) {
+		std::lock_guard<std::mutex> lock(mtx);
+		auto &q = node_queues[worker_node];
+		if (!q.empty()) {
+			task = q.front();
+			q.pop_front();
+			node_pending[worker_node].fetch_sub(1);
+			return task;
+		}
+	}
+	if (!task) {
+		std::lock_guard<std::mutex> lock(mtx);
+		if (!shared_queue.empty()) {
+			task = shared_queue.front();
+			shared_queue.pop_front();
+		}
+	}
+	if (!task) {
+		int n = Count();
+		int start = static_cast<int>(next_victim(seed) % static_cast<uint32_t>(n));
+		for (int i = 0; i < n && !task; ++i) {
+			int victim = (start + i) % n;
+			if (victim == self) continue;
+			task = deques[victim].Steal();
+		}
+	}
+	if (task) pending.fetch_sub(1);
+	return task;
+}
+
+void TaskPool::Run(Task *task) {
+	// ノード指定のタスクは自分でフラグを立て直す
+	bool prev = in_node_scope;
+	in_node_scope = false;
+	(*task)();
+	in_node_scope = prev;
+	delete task;
+}
+
+void TaskPool::WorkerMain(int idx, int node, std::vector<int> cpus) {
+	worker_index = idx;
+	worker_node = node;
+	pin_current_thread(cpus);
+	uint32_t seed = static_cast<uint32_t>(idx) * 2654435761u + 1;
+	for (;;) {
+		Task *task = Acquire(idx, seed);
+		if (task) {
+			Run(task);
+			continue;
+		}
+		sleepers.fetch_add(1);
+		bool quit;
+		{
+			std::unique_lock<std::mutex> lock(mtx);
+			cv.wait(lock, [this, node]() { return stop || pending.load() > 0 || node_pending[node].load() > 0; });
+			quit = stop && pending.load() == 0 && node_pending[node].load() == 0;
+		}
+		sleepers.fetch_sub(1);
+		if (quit) break;
+	}
+}
+
+void TaskPool::Wait(Latch &latch) {
+	int self = worker_index;
+	if (self < 0) {
+		latch.Wait();
+		return;
+	}
+	uint32_t seed = static_cast<uint32_t>(self) * 2654435761u + 7;
+	while (!latch.IsReady()) {
+		Task *task = Acquire(self, seed);
+		if (task) Run(task);
+		else std::this_thread::yield();
+	}
+	// 最後の CountDown がロックを手放すまで待つ
+	latch.Wait();
+}
+
+SerialQueue::SerialQueue() : busy(false), stop(false) {
+	thread = std::thread([this]() { Main(); });
+}
+
+SerialQueue::~SerialQueue() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	cv.notify_all();
+	thread.join();
+}
+
+void SerialQueue::Post(TaskPool::Task task) {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		queue.push_back(std::move(task));
+	}
+	cv.notify_one();
+}
+
+void SerialQueue::Drain() {
+	std::unique_lock<std::mutex> lock(mtx);
+	cv_idle.wait(lock, [this]() { return queue.empty() && !busy; });
+}
+
+void SerialQueue::Main() {
+	std::unique_lock<std::mutex> lock(mtx);
+	for (;;) {
+		cv.wait(lock, [this]() { return stop || !queue.empty(); });
+		if (queue.empty()) break;
+		TaskPool::Task task = std::move(queue.front());
+		queue.pop_front();
+		busy = true;
+		lock.unlock();
+		task();
+		lock.lock();
+		busy = false;
+		if (queue.empty()) cv_idle.notify_all();
+	}
+}
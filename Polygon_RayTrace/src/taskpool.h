@@ -0,0 +1,202 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#ifndef TASKPOOL_H_
+#define TASKPOOL_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+#include <deque>
+
+// ワークスティーリング方式のスレッドプール。
+// ワーカー毎に lock-free の deque を持ち、ワーカー自身が投入したタスクは自分の deque の末尾から取り出し、
+// 手が空いたワーカーは他のワーカーの deque の先頭から盗む。ワーカー以外から投入したタスクは共有キューに入る。
+// NUMA ノードを指定した場合、ワーカーはノード毎に分けて配置され、SpawnOnNode で特定ノードのワーカーだけが
+// 実行するタスクを投入できる。ノード指定のタスクの中から投入したタスクも同じノードで実行される (first-touch 用)。
+struct TaskPool {
+	typedef std::function<void()> Task;
+
+	// 完了待ち用のカウンタ。CountDown が count 回呼ばれると Wait が戻る。
+	struct Latch {
+		explicit Latch(int count_) : count(count_) {}
+		// 待っている側が Wait を抜けた直後に破棄しても良いように、ロックを取ってから減らす。
+		void CountDown() {
+			std::lock_guard<std::mutex> lock(mtx);
+			if (count.fetch_sub(1, std::memory_order_acq_rel) == 1) cv.notify_all();
+		}
+		bool IsReady() const {
+			return count.load(std::memory_order_acquire) <= 0;
+		}
+		void Wait() {
+			std::unique_lock<std::mutex> lock(mtx);
+			cv.wait(lock, [this]() { return IsReady(); });
+		}
+	private:
+		std::atomic<int> count;
+		std::mutex mtx;
+		std::condition_variable cv;
+	};
+
+	// num_threads が 0 以下の時はハードウェアのスレッド数 (numa_nodes 指定時は使うノードの論理コア数の合計) にする。
+	// pin_threads が true の時は、ワーカーを 1 つの論理コアに固定する。
+	// numa_nodes が 1 以上の時は、先頭から numa_nodes 個のノードにワーカーを均等に割り当て、そのノードのコアに固定する。
+	TaskPool(int num_threads, bool pin_threads, int numa_nodes = 0);
+	~TaskPool();
+
+	int Count() const {
+		return worker_count;
+	}
+	// ワーカーを配置したノードの数。NUMA を使わない時は 1。
+	int NodeCount() const {
+		return node_count;
+	}
+	int NodeWorkerCount(int node) const {
+		return node_workers[node];
+	}
+	// 呼び出し元から ParallelFor した時に使われるワーカーの数
+	int LocalWorkerCount() const;
+
+	// 呼び出し元のワーカー番号 (0 ～ Count()-1)。ワーカー以外から呼んだ時は -1。
+	static int WorkerIndex();
+	// 呼び出し元のワーカーのノード番号。ワーカー以外から呼んだ時は -1。
+	static int WorkerNode();
+	static int HardwareConcurrency();
+	// システムの NUMA ノード数
+	static int NumaNodeCount();
+
+	void Spawn(Task task);
+	void SpawnOnNode(int node, Task task);
+	// ワーカーから呼んでも自分の deque ではなく共有キューの末尾に入れる。
+	// 投入済みのタスクが一巡してから実行させたい時 (タイル毎に段階的に描画する時の続き等) に使う。
+	void SpawnShared(Task task);
+	// 共有キューの先頭に入れ、投入済みのタスクより先に実行させる。
+	void SpawnUrgent(Task task);
+
+	template <typename F> auto Submit(F f) -> std::future<decltype(f())> {
+		typedef decltype(f()) R;
+		auto pt = std::make_shared<std::packaged_task<R()> >(std::move(f));
+		std::future<R> fut = pt->get_future();
+		Spawn([pt]() { (*pt)(); });
+		return fut;
+	}
+	template <typename F> auto SubmitOnNode(int node, F f) -> std::future<decltype(f())> {
+		typedef decltype(f()) R;
+		auto pt = std::make_shared<std::packaged_task<R()> >(std::move(f));
+		std::future<R> fut = pt->get_future();
+		SpawnOnNode(node, [pt]() { (*pt)(); });
+		return fut;
+	}
+
+	// latch の完了を待つ。ワーカーから呼んだ時は、待っている間も他のタスクを実行する。
+	void Wait(Latch &latch);
+
+	// [begin, end) の各 i について f(i) を並列に実行し、全て終わるまで待つ。
+	template <typename F> void ParallelFor(int begin, int end, const F &f) {
+		if (end <= begin) return;
+		Latch latch(end - begin);
+		for (int i = begin; i < end; ++i) {
+			Spawn([&f, &latch, i]() {
+				f(i);
+				latch.CountDown();
+			});
+		}
+		Wait(latch);
+	}
+	// ParallelFor と同じだが、手伝いのタスクを共有キューの先頭に入れ、呼び出し元も同じ範囲を分担する。
+	// 描画中に I/O スレッドから画像を作る時のように、投入済みのタスクが捌けるのを待たずに進めたい時に使う。
+	// 手伝いのワーカーが来なくても、呼び出し元だけで全て処理できる。
+	template <typename F> void ParallelForUrgent(int begin, int end, const F &f) {
+		if (end <= begin) return;
+		std::atomic<int> next(begin);
+		auto run = [&f, &next, end]() {
+			for (int i = next.fetch_add(1); i < end; i = next.fetch_add(1)) f(i);
+		};
+		int helpers = ((end - begin < Count()) ? end - begin : Count()) - 1;
+		Latch latch(helpers);
+		for (int h = 0; h < helpers; ++h) {
+			SpawnUrgent([&run, &latch]() {
+				run();
+				latch.CountDown();
+			});
+		}
+		run();
+		Wait(latch);
+	}
+
+private:
+	// Chase-Lev deque (Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models", 2013)
+	// 容量は固定で、溢れた時は共有キューへ回す。
+	struct alignas(64) WorkDeque {
+		static const int64_t CAPACITY = 4096;
+		std::atomic<int64_t> top, bottom;
+		std::atomic<Task *> buffer[CAPACITY];
+		WorkDeque() : top(0), bottom(0) {}
+		bool Push(Task *task);
+		Task *Pop();
+		Task *Steal();
+	};
+
+	Task *Acquire(int self, uint32_t &seed);
+	void Run(Task *task);
+	void WorkerMain(int idx, int node, std::vector<int> cpus);
+
+	std::vector<std::thread> workers;
+	int worker_count; // ワーカーの起動前に決める
+	std::unique_ptr<WorkDeque[]> deques;
+	int node_count;
+	std::vector<int> node_workers;
+
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<Task *> shared_queue;             // mtx で保護
+	std::vector<std::deque<Task *> > node_queues; // mtx で保護
+	std::atomic<int64_t> pending;                // deque と共有キューに投入済みで、まだ取り出されていないタスクの数
+	std::unique_ptr<std::atomic<int64_t>[]> node_pending;
+	std::atomic<int> sleepers;
+	bool stop;
+};
+
+// 専用のスレッド 1 本で、投入された順にタスクを実行するキュー。
+// 画像の書き出しのように、ワーカーを止めずに裏で進めたい処理に使う。
+struct SerialQueue {
+	SerialQueue();
+	// 投入済みのタスクを全て実行してから終了する。
+	~SerialQueue();
+	void Post(TaskPool::Task task);
+	// 投入済みのタスクが全て終わるまで待つ。
+	void Drain();
+
+private:
+	void Main();
+
+	std::thread thread;
+	std::mutex mtx;
+	std::condition_variable cv, cv_idle;
+	std::deque<TaskPool::Task> queue;
+	bool busy, stop;
+};
+
+// pool が nullptr の時は呼び出し元のスレッドで順に実行する。
+// ワーカー以外 (I/O スレッド等) から呼んだ時は、描画のタスクの後ろに並ばないよう ParallelForUrgent で実行する。
+template <typename F> void ParallelFor(TaskPool *pool, int begin, int end, const F &f) {
+	if (pool && TaskPool::WorkerIndex() < 0) {
+		pool->ParallelForUrgent(begin, end, f);
+	} else if (pool) {
+		pool->ParallelFor(begin, end, f);
+	} else {
+		for (int i = begin; i < end; ++i) f(i);
+	}
+}
+
+#endif // TASKPOOL_H_
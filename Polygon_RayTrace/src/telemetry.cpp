@@ -0,0 +1,129 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#include "telemetry.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "nlohmann/json.hpp"
+
+RenderTelemetry::RenderTelemetry(FILE *out_, int camera_idx_, int num_slots_, int64_t total_passes_, int64_t units_per_pass_, double interval_sec_, int64_t total_units_) :
+	slots(new Slot[num_slots_]), num_slots(num_slots_), camera_idx(camera_idx_), out(out_),
+	interval_sec(interval_sec_ > 0 ? interval_sec_ : 2.0), total_passes(total_passes_), units_per_pass(units_per_pass_ > 0 ? units_per_pass_ : 1), time_budget_sec(0), units_done(0) {
+	total_units = (total_units_ >= 0) ? total_units_ : total_passes * units_per_pass;
+	start_ticks = 0;
+}
+
+double RenderTelemetry::ElapsedSec() const {
+	int64_t t0 = start_ticks.load(std::memory_order_relaxed);
+	if (t0 == 0) return 0.0;
+	std::chrono::steady_clock::time_point start(std::chrono::steady_clock::duration(static_cast<std::chrono::steady_clock::rep>(t0)));
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+const char *RenderTelemetry::ErrorName(TraceError err) {
+	switch (err) {
+		case TraceError::NONE: return "none";
+		case TraceError::BSDF: return "bsdf";
+		case TraceError::SIDE_MISMATCH: return "side_mismatch";
+		case TraceError::MAX_INTERSECTION: return "max_intersection";
+		default: return "unknown";
+	}
+}
+
+void RenderTelemetry::SetTimeBudget(double budget_sec) {
+	time_budget_sec = budget_sec;
+	total_units = std::numeric_limits<int64_t>::max();
+}
+
+void RenderTelemetry::Finish() {
+	std::lock_guard<std::mutex> lock(mtx);
+	total_units = units_done.load(std::memory_order_acquire);
+	cv.notify_all();
+}
+
+void RenderTelemetry::WaitForCompletion() {
+	std::unique_lock<std::mutex> lock(mtx);
+	auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval_sec));
+	auto next = std::chrono::steady_clock::now() + interval;
+	for (;;) {
+		bool completed = cv.wait_until(lock, next, [this]() { return units_done.load(std::memory_order_acquire) >= total_units; });
+		if (completed) break;
+		lock.unlock();
+		EmitProgress("progress");
+		lock.lock();
+		next += interval;
+	}
+}
+
+void RenderTelemetry::Sum(Totals &totals) const {
+	totals.paths = totals.intersections = 0;
+	for (int h = 0; h < static_cast<int>(TraceError::COUNT); ++h) totals.errors[h] = 0;
+	for (int h = 0; h < HISTOGRAM_BINS; ++h) totals.histogram[h] = 0;
+	for (int i = 0; i < num_slots; ++i) {
+		const Slot &s = slots[i];
+		totals.paths += s.paths.load(std::memory_order_relaxed);
+		totals.intersections += s.intersections.load(std::memory_order_relaxed);
+		for (int h = 0; h < static_cast<int>(TraceError::COUNT); ++h) totals.errors[h] += s.errors[h].load(std::memory_order_relaxed);
+		for (int h = 0; h < HISTOGRAM_BINS; ++h) totals.histogram[h] += s.histogram[h].load(std::memory_order_relaxed);
+	}
+}
+
+void RenderTelemetry::EmitProgress(const char *event) {
+	if (!out) return;
+	Totals totals;
+	Sum(totals);
+	double elapsed = ElapsedSec();
+	int64_t done_units = units_done.load();
+	int64_t done = (time_budget_sec > 0) ? done_units / units_per_pass : std::min(done_units / units_per_pass, total_passes);
+	int64_t all_units = total_units.load(std::memory_order_acquire);
+	double ratio = (all_units > 0) ? static_cast<double>(done_units) / static_cast<double>(all_units) : 1.0;
+	if (time_budget_sec > 0 && done_units < all_units) ratio = std::min(elapsed / time_budget_sec, 1.0);
+
+	nlohmann::json j;
+	j["event"] = event;
+	j["camera"] = camera_idx;
+	j["passes_done"] = done;
+	j["passes_total"] = total_passes;
+	j["progress"] = ratio;
+	j["elapsed_sec"] = elapsed;
+	j["eta_sec"] = (ratio > 0 && ratio < 1) ? elapsed * (1.0 - ratio) / ratio : 0.0;
+	j["paths"] = totals.paths;
+	j["intersections"] = totals.intersections;
+	j["rays_per_sec"] = (elapsed > 0) ? static_cast<double>(totals.intersections) / elapsed : 0.0;
+	j["paths_per_sec"] = (elapsed > 0) ? static_cast<double>(totals.paths) / elapsed : 0.0;
+	nlohmann::json jerr;
+	for (int h = 1; h < static_cast<int>(TraceError::COUNT); ++h) jerr[ErrorName(static_cast<TraceError>(h))] = totals.errors[h];
+	j["errors"] = jerr;
+	std::string s = j.dump();
+	std::fprintf(out, "%s\n", s.c_str());
+	std::fflush(out);
+}
+
+void RenderTelemetry::EmitSummary() {
+	EmitProgress("camera_done");
+	if (!out) return;
+	Totals totals;
+	Sum(totals);
+	nlohmann::json j;
+	j["event"] = "path_length_histogram";
+	j["camera"] = camera_idx;
+	nlohmann::json bins = nlohmann::json::array();
+	for (int h = 0; h < HISTOGRAM_BINS; ++h) {
+		if (totals.histogram[h] == 0) continue;
+		nlohmann::json b;
+		b["min_length"] = HistogramBinLower(h);
+		b["max_length"] = HistogramBinLower(h + 1) - 1;
+		b["count"] = totals.histogram[h];
+		bins.push_back(b);
+	}
+	j["bins"] = bins;
+	std::string s = j.dump();
+	std::fprintf(out, "%s\n", s.c_str());
+	std::fflush(out);
+}
@@ -0,0 +1,134 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdint.h>
+#include <cstdio>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+
+// 光線追跡が途中で打ち切られた理由
+enum class TraceError {
+	NONE,
+	BSDF,             ///< CalcBSDF が失敗した
+	SIDE_MISMATCH,    ///< 反射なのに突き抜けた、または透過なのに同じ媒質内にとどまった
+	MAX_INTERSECTION, ///< MAX_INTERSECTION_COUNT に達した
+	COUNT
+};
+
+// カメラ毎の進捗・統計情報。
+// 各ワーカーは自分の Slot にのみ書き込み、メインスレッドは WaitForCompletion で完了を待ちながら
+// 一定間隔で集計して JSON Lines 形式で出力する。
+struct RenderTelemetry {
+	// 経路長のヒストグラム。32 未満は 1 刻み、それ以降は 2 の冪毎にまとめる。
+	static const int HISTOGRAM_LINEAR = 32;
+	static const int HISTOGRAM_BINS = HISTOGRAM_LINEAR + 16;
+	static inline int HistogramBin(int length) {
+		if (length < HISTOGRAM_LINEAR) return (length < 0) ? 0 : length;
+		int bin = HISTOGRAM_LINEAR;
+		for (int l = length / HISTOGRAM_LINEAR; l > 1 && bin < HISTOGRAM_BINS - 1; l >>= 1) ++bin;
+		return bin;
+	}
+	static inline int HistogramBinLower(int bin) {
+		return (bin < HISTOGRAM_LINEAR) ? bin : (HISTOGRAM_LINEAR << (bin - HISTOGRAM_LINEAR));
+	}
+
+	struct alignas(64) Slot {
+		std::atomic<uint64_t> paths, intersections;
+		std::atomic<uint64_t> errors[static_cast<int>(TraceError::COUNT)];
+		std::atomic<uint64_t> histogram[HISTOGRAM_BINS];
+		Slot() {
+			Reset();
+		}
+		void Reset() {
+			paths = 0, intersections = 0;
+			for (int i = 0; i < static_cast<int>(TraceError::COUNT); ++i) errors[i] = 0;
+			for (int i = 0; i < HISTOGRAM_BINS; ++i) histogram[i] = 0;
+		}
+		// 書き込みは所有スレッドのみなので、ロック付きの加算は使わない。
+		static inline void Add(std::atomic<uint64_t> &a, uint64_t v) {
+			a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+		}
+		inline void RecordPath(int length, TraceError err) {
+			Add(paths, 1);
+			Add(intersections, static_cast<uint64_t>(length));
+			Add(histogram[HistogramBin(length)], 1);
+			if (err != TraceError::NONE) Add(errors[static_cast<int>(err)], 1);
+		}
+	};
+
+	struct Totals {
+		uint64_t paths, intersections;
+		uint64_t errors[static_cast<int>(TraceError::COUNT)];
+		uint64_t histogram[HISTOGRAM_BINS];
+		uint64_t ErrorCount() const {
+			uint64_t c = 0;
+			for (int i = 1; i < static_cast<int>(TraceError::COUNT); ++i) c += errors[i];
+			return c;
+		}
+	};
+
+	// out が nullptr の場合は出力しない。
+	// 1 パス (全画素 1 サンプル分) を units_per_pass 個の作業単位 (タイル) に分けて数える。
+	// タイル毎にパス数が異なる時は、作業単位の総数を total_units で指定する (省略時は total_passes * units_per_pass)。
+	RenderTelemetry(FILE *out, int camera_idx, int num_slots, int64_t total_passes, int64_t units_per_pass, double interval_sec, int64_t total_units = -1);
+
+	Slot &slot(int idx) {
+		return slots[idx];
+	}
+
+	// 経過時間の計測を始める。カメラの最初のタイルが動き出した時に呼び、2 回目以降は何もしない。
+	// 複数カメラをまとめて投入した時、後のカメラが順番待ちの時間を含めないようにする。
+	void Begin() {
+		if (start_ticks.load(std::memory_order_relaxed) != 0) return;
+		int64_t expected = 0;
+		start_ticks.compare_exchange_strong(expected, static_cast<int64_t>(std::chrono::steady_clock::now().time_since_epoch().count()));
+	}
+
+	// 作業単位 1 つ分の完了を通知する。全て完了すると WaitForCompletion が戻る。
+	void UnitDone() {
+		if (units_done.fetch_add(1, std::memory_order_acq_rel) + 1 == total_units.load(std::memory_order_acquire)) {
+			std::lock_guard<std::mutex> lock(mtx);
+			cv.notify_all();
+		}
+	}
+	// 時間指定の描画。作業単位の総数は事前に分からないため、進捗は経過時間の比で出し、全て終わったら Finish を呼ぶ。
+	void SetTimeBudget(double budget_sec);
+	void Finish();
+	// 全作業単位の完了まで待つ。待っている間、interval_sec 毎に進捗を出力する。
+	void WaitForCompletion();
+	void Sum(Totals &totals) const;
+	void EmitSummary();
+
+	static const char *ErrorName(TraceError err);
+
+private:
+	void EmitProgress(const char *event);
+	double ElapsedSec() const;
+
+	std::unique_ptr<Slot[]> slots;
+	int num_slots;
+	int camera_idx;
+	FILE *out;
+	double interval_sec;
+	int64_t total_passes, units_per_pass;
+	std::atomic<int64_t> total_units;
+	double time_budget_sec;
+	std::atomic<int64_t> units_done;
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::atomic<int64_t> start_ticks; ///< steady_clock の値。0 はまだ始まっていない
+};
+
+#endif // TELEMETRY_H_
@@ -0,0 +1,443 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#include "tessellate.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include <filesystem>
+#if defined(_WIN32)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "opennurbs.h"
+#include "taskpool.h"
+#include "profiler.h"
+
+TessellateOptions::TessellateOptions() : chord_tolerance(0.01), angle_tolerance_deg(15.0), trim_grid(32), max_grid(256), use_render_mesh(true) {
+}
+
+void TessellateOptions::Parse(nlohmann::json &jtes) {
+	if (!jtes.is_object()) return;
+	if (jtes["chord_tolerance"].is_number()) chord_tolerance = jtes["chord_tolerance"];
+	if (jtes["angle_tolerance_deg"].is_number()) angle_tolerance_deg = jtes["angle_tolerance_deg"];
+	if (jtes["trim_grid"].is_number()) trim_grid = jtes["trim_grid"];
+	if (jtes["max_grid"].is_number()) max_grid = jtes["max_grid"];
+	if (jtes["use_render_mesh"].is_boolean()) use_render_mesh = jtes["use_render_mesh"];
+	if (jtes["cache_dir"].is_string()) cache_dir = jtes["cache_dir"].get<std::string>();
+}
+
+namespace {
+
+const char CACHE_FILE_MAGIC[8] = { 'P', 'R', 'T', 'M', 'E', 'S', 'H', '2' };
+
+struct CacheFileHeader {
+	char magic[8];
+	uint64_t key;
+	uint32_t vertex_count, face_count;
+	uint32_t has_normals, reserved;
+};
+
+// 一時ファイルの名前をプロセス間で重ならないようにするための番号
+unsigned long ProcessId() {
+#if defined(_WIN32)
+	return static_cast<unsigned long>(_getpid());
+#else
+	return static_cast<unsigned long>(getpid());
+#endif
+}
+
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const size_t HASH_BLOCK = 4 << 20;
+
+uint64_t fnv1a(const void *data, size_t size, uint64_t h) {
+	const uint8_t *p = static_cast<const uint8_t *>(data);
+	for (size_t i = 0; i < size; ++i) h = (h ^ p[i]) * 1099511628211ULL;
+	return h;
+}
+
+bool ReadWholeFile(const char *filename, std::vector<uint8_t> &data) {
+	std::unique_ptr<FILE, decltype(&std::fclose)> fp(std::fopen(filename, "rb"), std::fclose);
+	if (!fp) return false;
+	const size_t READ_BLOCK = 16 << 20;
+	size_t size = 0;
+	for (;;) {
+		data.resize(size + READ_BLOCK);
+		size_t n = std::fread(&data[size], 1, READ_BLOCK, fp.get());
+		size += n;
+		if (n < READ_BLOCK) break;
+	}
+	data.resize(size);
+	return true;
+}
+
+typedef std::vector<ON_2dPoint> Polygon2d;
+
+// 外周がパラメータ領域の四辺そのままの面はトリムの判定を省く
+bool IsTrimmed(const ON_BrepFace &face) {
+	if (face.m_li.Count() != 1) return true;
+	const ON_Brep *brep = face.Brep();
+	const ON_BrepLoop &loop = brep->m_L[face.m_li[0]];
+	for (int t = 0; t < loop.m_ti.Count(); ++t) {
+		ON_Surface::ISO iso = brep->m_T[loop.m_ti[t]].m_iso;
+		if (iso != ON_Surface::W_iso && iso != ON_Surface::S_iso && iso != ON_Surface::E_iso && iso != ON_Surface::N_iso) return true;
+	}
+	return false;
+}
+
+// 面のトリムループを (u, v) の多角形にする
+void TrimPolygons(const ON_BrepFace &face, std::vector<Polygon2d> &loops) {
+	const ON_Brep *brep = face.Brep();
+	for (int l = 0; l < face.m_li.Count(); ++l) {
+		const ON_BrepLoop &loop = brep->m_L[face.m_li[l]];
+		Polygon2d poly;
+		for (int t = 0; t < loop.m_ti.Count(); ++t) {
+			const ON_BrepTrim &trim = brep->m_T[loop.m_ti[t]];
+			ON_Interval d = trim.Domain();
+			int n = std::max(8, trim.SpanCount() * 4);
+			for (int k = 0; k < n; ++k) {
+				ON_3dPoint p = trim.PointAt(d.ParameterAt(static_cast<double>(k) / n));
+				poly.push_back(ON_2dPoint(p.x, p.y));
+			}
+		}
+		if (poly.size() >= 3) loops.push_back(poly);
+	}
+}
+
+// v の水平線とトリムループの交点の u を昇順に並べる。u より小さい交点の数が奇数なら面の内側。
+void Crossings(const std::vector<Polygon2d> &loops, double v, std::vector<double> &xs) {
+	xs.clear();
+	for (size_t l = 0; l < loops.size(); ++l) {
+		const Polygon2d &poly = loops[l];
+		for (size_t i = 0, j = poly.size() - 1; i < poly.size(); j = i++) {
+			const ON_2dPoint &a = poly[i], &b = poly[j];
+			if ((a.y > v) != (b.y > v)) xs.push_back(a.x + (b.x - a.x) * (v - a.y) / (b.y - a.y));
+		}
+	}
+	std::sort(xs.begin(), xs.end());
+}
+
+inline bool Inside(const std::vector<double> &xs, double u) {
+	return ((std::lower_bound(xs.begin(), xs.end(), u) - xs.begin()) & 1) != 0;
+}
+
+// 長さ length、法線の回転角 angle の曲線を、弦の誤差と角度の許容値に収まるよう分ける数
+int Divisions(double length, double angle, const TessellateOptions &opt) {
+	int n = 1;
+	double angle_tol = opt.angle_tolerance_deg * ON_PI / 180.0;
+	if (angle_tol > 0) n = std::max(n, static_cast<int>(std::ceil(angle / angle_tol)));
+	if (opt.chord_tolerance > 0 && angle > ON_ZERO_TOLERANCE) {
+		// 半径 r の円弧を角度 a 毎に区切ると、弦との距離は r (1 - cos(a / 2))
+		double r = length / angle;
+		if (r > opt.chord_tolerance) {
+			double a = 2.0 * std::acos(1.0 - opt.chord_tolerance / r);
+			n = std::max(n, static_cast<int>(std::ceil(angle / a)));
+		}
+	}
+	return n;
+}
+
+struct Grid {
+	ON_Interval du, dv;
+	int nu, nv;
+	double U(double i) const {
+		return du.ParameterAt(i / nu);
+	}
+	double V(double j) const {
+		return dv.ParameterAt(j / nv);
+	}
+};
+
+// 粗い格子で u, v 各方向の長さと法線の回転角を測り、分割数を決める。
+void GridSize(const ON_Surface &srf, const TessellateOptions &opt, int min_div, Grid &g) {
+	const int S = 8;
+	g.du = srf.Domain(0), g.dv = srf.Domain(1);
+	ON_3dPoint P[S + 1][S + 1];
+	ON_3dVector N[S + 1][S + 1];
+	for (int i = 0; i <= S; ++i) {
+		double u = g.du.ParameterAt(static_cast<double>(i) / S);
+		for (int j = 0; j <= S; ++j) {
+			double v = g.dv.ParameterAt(static_cast<double>(j) / S);
+			P[i][j] = srf.PointAt(u, v);
+			N[i][j] = srf.NormalAt(u, v);
+		}
+	}
+	int div[2] = { 1, 1 };
+	for (int dir = 0; dir < 2; ++dir) {
+		for (int k = 0; k <= S; ++k) {
+			double length = 0, angle = 0;
+			for (int m = 0; m < S; ++m) {
+				const ON_3dPoint &p0 = dir ? P[k][m] : P[m][k], &p1 = dir ? P[k][m + 1] : P[m + 1][k];
+				const ON_3dVector &n0 = dir ? N[k][m] : N[m][k], &n1 = dir ? N[k][m + 1] : N[m + 1][k];
+				length += p0.DistanceTo(p1);
+				// 特異点では法線が求まらないので、その区間は角度に含めない
+				if (n0.Length() > 0.5 && n1.Length() > 0.5) angle += std::acos(std::min(std::max(n0 * n1, -1.0), 1.0));
+			}
+			div[dir] = std::max(div[dir], Divisions(length, angle, opt));
+		}
+		div[dir] = std::max(div[dir], std::max(srf.SpanCount(dir), min_div));
+		div[dir] = std::min(div[dir], std::max(opt.max_grid, 1));
+	}
+	g.nu = div[0], g.nv = div[1];
+}
+
+// 曲面 srf を格子に分けてメッシュにする。face が nullptr でない時は、そのトリムの内側の三角形だけを残す。
+void TessellateSurface(const ON_Surface &srf, const ON_BrepFace *face, const TessellateOptions &opt, ON_Mesh &mesh) {
+	std::vector<Polygon2d> loops;
+	bool trimmed = face && IsTrimmed(*face);
+	if (trimmed) TrimPolygons(*face, loops);
+	bool rev = face && face->m_bRev;
+	Grid g;
+	GridSize(srf, opt, trimmed ? opt.trim_grid : 1, g);
+
+	// 格子 1 つを (i,j)-(i+1,j)-(i+1,j+1) と (i,j)-(i+1,j+1)-(i,j+1) の 2 つの三角形に分け、重心がトリムの内側のものを残す
+	std::vector<uint8_t> keep(static_cast<size_t>(g.nu) * g.nv * 2, 1);
+	if (trimmed) {
+		std::vector<double> xs;
+		for (int j = 0; j < g.nv; ++j) {
+			for (int t = 0; t < 2; ++t) {
+				Crossings(loops, g.V(j + (t ? 2.0 : 1.0) / 3.0), xs);
+				for (int i = 0; i < g.nu; ++i) {
+					keep[(static_cast<size_t>(j) * g.nu + i) * 2 + t] = Inside(xs, g.U(i + (t ? 1.0 : 2.0) / 3.0));
+				}
+			}
+		}
+	}
+
+	// 残す三角形の頂点だけを評価する
+	std::vector<int> vidx(static_cast<size_t>(g.nu + 1) * (g.nv + 1), -1);
+	ON_2dPoint center(g.du.Mid(), g.dv.Mid());
+	auto vertex = [&](int i, int j) -> int {
+		int &idx = vidx[static_cast<size_t>(j) * (g.nu + 1) + i];
+		if (idx >= 0) return idx;
+		double u = g.U(i), v = g.V(j);
+		ON_3dVector n = srf.NormalAt(u, v);
+		if (!n.Unitize()) {
+			// 球の極のような特異点では、領域の中心側に少しずらして求める
+			n = srf.NormalAt(u + (center.x - u) * 1e-6, v + (center.y - v) * 1e-6);
+			n.Unitize();
+		}
+		if (rev) n = -n;
+		idx = mesh.m_V.Count();
+		mesh.m_V.Append(ON_3fPoint(srf.PointAt(u, v)));
+		mesh.m_N.Append(ON_3fVector(n));
+		return idx;
+	};
+	for (int j = 0; j < g.nv; ++j) {
+		for (int i = 0; i < g.nu; ++i) {
+			for (int t = 0; t < 2; ++t) {
+				if (!keep[(static_cast<size_t>(j) * g.nu + i) * 2 + t]) continue;
+				int vi[3] = { vertex(i, j), vertex(i + 1, j + 1), t ? vertex(i, j + 1) : vertex(i + 1, j) };
+				if (!t) std::swap(vi[1], vi[2]);
+				// 特異点に接する辺は潰れるので、面積の無い三角形は捨てる
+				const ON_3fPoint &a = mesh.m_V[vi[0]], &b = mesh.m_V[vi[1]], &c = mesh.m_V[vi[2]];
+				if (a == b || b == c || c == a) continue;
+				if (rev) std::swap(vi[1], vi[2]);
+				ON_MeshFace &f = mesh.m_F.AppendNew();
+				f.vi[0] = vi[0], f.vi[1] = vi[1], f.vi[2] = vi[2], f.vi[3] = vi[2];
+			}
+		}
+	}
+}
+
+// メッシュにする単位。オブジェクトのメッシュ・トリムの無い曲面・Brep の面のいずれか 1 つを指す。
+struct TessellateJob {
+	const ON_Mesh *mesh;
+	const ON_Surface *surface;
+	const ON_BrepFace *face;
+};
+
+void AppendBrepJobs(const ON_Brep &brep, const TessellateOptions &opt, std::vector<TessellateJob> &jobs) {
+	for (int f = 0; f < brep.m_F.Count(); ++f) {
+		const ON_BrepFace &face = brep.m_F[f];
+		TessellateJob job = { nullptr, nullptr, &face };
+		if (opt.use_render_mesh) job.mesh = face.Mesh(ON::render_mesh);
+		jobs.push_back(job);
+	}
+}
+
+}
+
+uint64_t MeshCache::ContentHash(const void *data, size_t size, TaskPool &pool) {
+	const uint8_t *p = static_cast<const uint8_t *>(data);
+	int blocks = static_cast<int>((size + HASH_BLOCK - 1) / HASH_BLOCK);
+	std::vector<uint64_t> hashes(blocks);
+	pool.ParallelFor(0, blocks, [&](int i) {
+		size_t begin = static_cast<size_t>(i) * HASH_BLOCK;
+		hashes[i] = fnv1a(p + begin, std::min(HASH_BLOCK, size - begin), FNV_OFFSET);
+	});
+	uint64_t size64 = size;
+	return fnv1a(hashes.data(), hashes.size() * sizeof(uint64_t), fnv1a(&size64, sizeof(size64), FNV_OFFSET));
+}
+
+uint64_t MeshCache::Mix(uint64_t key, const void *value, size_t size) {
+	return fnv1a(value, size, key);
+}
+
+std::string MeshCache::Path(const std::string &dir, uint64_t key, const char *ext) {
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+	return dir + "/" + name + ext;
+}
+
+bool MeshCache::Read(const std::string &path, uint64_t key, ON_Mesh &mesh) {
+	std::unique_ptr<FILE, decltype(&std::fclose)> fp(std::fopen(path.c_str(), "rb"), std::fclose);
+	if (!fp) return false;
+	CacheFileHeader h;
+	if (std::fread(&h, sizeof(h), 1, fp.get()) != 1 || std::memcmp(h.magic, CACHE_FILE_MAGIC, sizeof(h.magic)) != 0 || h.key != key) return false;
+	mesh.m_V.SetCapacity(h.vertex_count);
+	mesh.m_V.SetCount(h.vertex_count);
+	bool ok = std::fread(mesh.m_V.Array(), sizeof(ON_3fPoint), h.vertex_count, fp.get()) == h.vertex_count;
+	if (ok && h.has_normals) {
+		mesh.m_N.SetCapacity(h.vertex_count);
+		mesh.m_N.SetCount(h.vertex_count);
+		ok = std::fread(mesh.m_N.Array(), sizeof(ON_3fVector), h.vertex_count, fp.get()) == h.vertex_count;
+	}
+	if (ok) {
+		mesh.m_F.SetCapacity(h.face_count);
+		mesh.m_F.SetCount(h.face_count);
+		ok = std::fread(mesh.m_F.Array(), sizeof(ON_MeshFace), h.face_count, fp.get()) == h.face_count;
+	}
+	if (!ok) {
+		std::fprintf(stderr, "mesh cache %s is truncated.\n", path.c_str());
+		mesh.Destroy();
+		return false;
+	}
+	// 壊れたファイルで範囲外の頂点を参照しないよう、面の頂点番号を確かめる
+	for (uint32_t i = 0; i < h.face_count; ++i) {
+		const int *vi = mesh.m_F[static_cast<int>(i)].vi;
+		for (int k = 0; k < 4; ++k) {
+			if (vi[k] >= 0 && static_cast<uint32_t>(vi[k]) < h.vertex_count) continue;
+			std::fprintf(stderr, "mesh cache %s has an invalid face.\n", path.c_str());
+			mesh.Destroy();
+			return false;
+		}
+	}
+	return true;
+}
+
+bool MeshCache::Write(const std::string &path, uint64_t key, const ON_Mesh &mesh) {
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+	// 同じ cache_dir を使う他のプロセス (分散描画のシャード等) と重ならないよう、プロセス番号とワーカー番号を付ける
+	std::string tmp = path + "." + std::to_string(ProcessId()) + "-" + std::to_string(TaskPool::WorkerIndex() + 1) + ".tmp";
+	{
+		std::unique_ptr<FILE, decltype(&std::fclose)> fp(std::fopen(tmp.c_str(), "wb"), std::fclose);
+		if (!fp) {
+			std::fprintf(stderr, "cannot write mesh cache %s\n", tmp.c_str());
+			return false;
+		}
+		CacheFileHeader h;
+		std::memcpy(h.magic, CACHE_FILE_MAGIC, sizeof(h.magic));
+		h.key = key;
+		h.vertex_count = static_cast<uint32_t>(mesh.m_V.Count());
+		h.face_count = static_cast<uint32_t>(mesh.m_F.Count());
+		h.has_normals = mesh.HasVertexNormals() ? 1 : 0;
+		h.reserved = 0;
+		std::fwrite(&h, sizeof(h), 1, fp.get());
+		std::fwrite(mesh.m_V.Array(), sizeof(ON_3fPoint), mesh.m_V.Count(), fp.get());
+		if (h.has_normals) std::fwrite(mesh.m_N.Array(), sizeof(ON_3fVector), mesh.m_N.Count(), fp.get());
+		std::fwrite(mesh.m_F.Array(), sizeof(ON_MeshFace), mesh.m_F.Count(), fp.get());
+		if (std::ferror(fp.get())) {
+			std::fprintf(stderr, "cannot write mesh cache %s\n", tmp.c_str());
+			fp.reset();
+			std::remove(tmp.c_str());
+			return false;
+		}
+	}
+	// 他のプロセスが先に同じキーで書いた時は rename が失敗するが、中身は同じなのでそのまま使う
+	if (std::rename(tmp.c_str(), path.c_str()) != 0) std::remove(tmp.c_str());
+	return true;
+}
+
+bool Load3dmMesh(const char *filename, const TessellateOptions &opt, TaskPool &pool, ON_Mesh &mesh) {
+	PROFILE_ZONE("load_3dm");
+	std::string cache_path;
+	uint64_t key = 0;
+	// キャッシュを使う時は読み込んだ内容をそのまま解析にも使い、ファイルは 1 回だけ読む
+	std::vector<uint8_t> data;
+	bool data_read = false;
+	if (!opt.cache_dir.empty()) {
+		data_read = ReadWholeFile(filename, data);
+		if (data_read) {
+			key = MeshCache::ContentHash(data.data(), data.size(), pool);
+			uint8_t use_render_mesh = opt.use_render_mesh ? 1 : 0;
+			key = MeshCache::Mix(key, &opt.chord_tolerance, sizeof(opt.chord_tolerance));
+			key = MeshCache::Mix(key, &opt.angle_tolerance_deg, sizeof(opt.angle_tolerance_deg));
+			key = MeshCache::Mix(key, &opt.trim_grid, sizeof(opt.trim_grid));
+			key = MeshCache::Mix(key, &opt.max_grid, sizeof(opt.max_grid));
+			key = MeshCache::Mix(key, &use_render_mesh, sizeof(use_render_mesh));
+			cache_path = MeshCache::Path(opt.cache_dir, key, ".mesh");
+			if (MeshCache::Read(cache_path, key, mesh)) {
+				std::fprintf(stderr, "  %s: cached mesh %s\n", filename, cache_path.c_str());
+				return true;
+			}
+		}
+	}
+
+	ONX_Model model;
+	if (data_read) {
+		ON_Read3dmBufferArchive archive(data.size(), data.data(), false, 0, 0);
+		if (!model.Read(archive)) return false;
+		std::vector<uint8_t>().swap(data);
+	} else if (!model.Read(filename)) {
+		return false;
+	}
+	std::vector<TessellateJob> jobs;
+	std::vector<std::unique_ptr<ON_Brep> > brep_forms;
+	for (int i = 0; i < model.m_object_table.Count(); ++i) {
+		const ON_Object *obj = model.m_object_table[i].m_object;
+		if (const ON_Mesh *m = ON_Mesh::Cast(obj)) {
+			TessellateJob job = { m, nullptr, nullptr };
+			jobs.push_back(job);
+		} else if (const ON_Brep *brep = ON_Brep::Cast(obj)) {
+			AppendBrepJobs(*brep, opt, jobs);
+		} else if (const ON_Surface *srf = ON_Surface::Cast(obj)) {
+			TessellateJob job = { nullptr, srf, nullptr };
+			jobs.push_back(job);
+		} else if (const ON_Geometry *geom = ON_Geometry::Cast(obj)) {
+			// 押し出し等は Brep にしてから面毎に分ける
+			if (geom->HasBrepForm()) {
+				brep_forms.push_back(std::unique_ptr<ON_Brep>(geom->BrepForm()));
+				if (brep_forms.back()) AppendBrepJobs(*brep_forms.back(), opt, jobs);
+			}
+		}
+	}
+
+	int generated = 0;
+	for (size_t j = 0; j < jobs.size(); ++j) {
+		if (!jobs[j].mesh) ++generated;
+	}
+	if (generated > 0) {
+		std::fprintf(stderr, "  %s: %d faces have no render mesh; using preview-quality tessellation (trim edges follow the grid and may leave cracks).\n", filename, generated);
+	}
+
+	std::vector<ON_Mesh> parts(jobs.size());
+	pool.ParallelFor(0, static_cast<int>(jobs.size()), [&](int j) {
+		const TessellateJob &job = jobs[j];
+		if (job.mesh) {
+			parts[j] = *job.mesh;
+		} else if (job.face) {
+			TessellateSurface(*job.face, job.face, opt, parts[j]);
+		} else {
+			TessellateSurface(*job.surface, nullptr, opt, parts[j]);
+		}
+		// 交差判定は三角形 (vi[0..2]) のみ扱うため、四角形はキャッシュに書く前に 2 つの三角形に分ける
+		if (parts[j].QuadCount() > 0) parts[j].ConvertQuadsToTriangles();
+	});
+	std::vector<const ON_Mesh *> part_ptrs(parts.size());
+	for (size_t j = 0; j < parts.size(); ++j) part_ptrs[j] = &parts[j];
+	if (part_ptrs.size()) mesh.Append(static_cast<int>(part_ptrs.size()), part_ptrs.data());
+
+	if (!cache_path.empty()) MeshCache::Write(cache_path, key, mesh);
+	return true;
+}
@@ -0,0 +1,53 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#ifndef TESSELLATE_H_
+#define TESSELLATE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+class ON_Mesh;
+struct TaskPool;
+
+// .3dm の Brep・曲面をメッシュにする時の設定。設定ファイルの "tessellation" で指定し、形状毎の "tessellation" で上書きできる。
+// ここで作るメッシュは下見用の品質で、トリム境界は格子の三角形単位の階段状になり、隣の面とは頂点を共有しないため継ぎ目に隙間が出ることがある。
+// 最終的な描画には、描画用メッシュを保存した .3dm を use_render_mesh (既定で true) で使うこと。
+// 例: "tessellation": { "chord_tolerance": 0.01, "angle_tolerance_deg": 15, "trim_grid": 32, "max_grid": 256, "use_render_mesh": true, "cache_dir": "mesh_cache" }
+struct TessellateOptions {
+	double chord_tolerance;     ///< 曲面と三角形の距離の上限 (モデルの単位)。0 以下の時は使わない
+	double angle_tolerance_deg; ///< 隣り合う格子点の法線のなす角の上限
+	int trim_grid;              ///< トリムされた面の u, v 方向の最小の分割数。トリム境界は格子の三角形単位で近似する
+	int max_grid;               ///< 面 1 枚の u, v 方向の分割数の上限
+	bool use_render_mesh;       ///< ファイルに描画用メッシュが保存されていればそれを使う
+	std::string cache_dir;      ///< 空でない時、メッシュにした結果をファイルの内容のハッシュで保存・再利用する
+	TessellateOptions();
+	void Parse(nlohmann::json &jtes);
+};
+
+// 形状のメッシュのキャッシュ。ファイル名はキーの 16 進表記で、キーが一致した時だけ読み込む。
+struct MeshCache {
+	// data のハッシュ。大きなファイルはブロック毎に pool で並列に求めてから合わせる。
+	static uint64_t ContentHash(const void *data, size_t size, TaskPool &pool);
+	// key に結果に影響する設定値を混ぜる。
+	static uint64_t Mix(uint64_t key, const void *value, size_t size);
+
+	static std::string Path(const std::string &dir, uint64_t key, const char *ext);
+	// 途中で切れたファイルや、面の頂点番号が頂点数を越えるファイルは読み込まない。
+	static bool Read(const std::string &path, uint64_t key, ON_Mesh &mesh);
+	// 一時ファイルに書いてから置き換えるので、読み込み中の他のプロセスが壊れたファイルを見ることはない。
+	static bool Write(const std::string &path, uint64_t key, const ON_Mesh &mesh);
+};
+
+// .3dm の全オブジェクトを 1 つのメッシュ (ファイルの座標のまま) にまとめる。
+// メッシュはそのまま、Brep は面毎、曲面はそれぞれメッシュにし、オブジェクト・面の単位で pool で並列に処理する。
+bool Load3dmMesh(const char *filename, const TessellateOptions &opt, TaskPool &pool, ON_Mesh &mesh);
+
+#endif // TESSELLATE_H_
@@ -0,0 +1,186 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#include "tonemap.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "taskpool.h"
+#include "profiler.h"
+
+ToneMapOptions::ToneMapOptions() : op(CLAMP), exposure(0), dither(true) {
+}
+
+void ToneMapOptions::Parse(nlohmann::json &jtm) {
+	if (!jtm.is_object()) return;
+	if (jtm["operator"].is_string()) {
+		std::string name = jtm["operator"].get<std::string>();
+		if (name == "clamp") op = CLAMP;
+		else if (name == "reinhard") op = REINHARD;
+		else if (name == "aces") op = ACES;
+		else std::fprintf(stderr, "tone_mapping: unknown operator \"%s\", using clamp.\n", name.c_str());
+	}
+	if (jtm["exposure"].is_number()) exposure = jtm["exposure"].get<double>();
+	if (jtm["dither"].is_boolean()) dither = jtm["dither"].get<bool>();
+}
+
+namespace {
+
+// sRGB の符号化の表。[2^-13, 1] の値を、単精度のビット列の上位 (指数と仮数の上位 10 bit) で引き、
+// 区間の中央の値を符号化した結果を 8.8 の固定小数点で持つ。2^-13 未満は sRGB の直線部分なので表を使わない。
+const uint32_t LUT_BASE_BITS = (127 - 13) << 23;
+const int LUT_SHIFT = 13;
+const int LUT_SIZE = (13 << 10) + 1;
+const float LINEAR_SCALE = 12.92f * 255.0f * 256.0f;
+
+const uint16_t *SrgbTable() {
+	static const std::vector<uint16_t> table = []() {
+		// gather で 4 byte ずつ読むため、末尾に 1 つ余分に持つ
+		std::vector<uint16_t> t(LUT_SIZE + 1, 0);
+		for (int i = 0; i < LUT_SIZE; ++i) {
+			uint32_t bits = LUT_BASE_BITS + (static_cast<uint32_t>(i) << LUT_SHIFT) + (1u << (LUT_SHIFT - 1));
+			float v;
+			std::memcpy(&v, &bits, sizeof(v));
+			double x = std::min(static_cast<double>(v), 1.0);
+			double s = (x <= 0.0031308) ? x * 12.92 : 1.055 * std::pow(x, 1.0 / 2.4) - 0.055;
+			t[i] = static_cast<uint16_t>(s * 255.0 * 256.0 + 0.5);
+		}
+		t[LUT_SIZE] = t[LUT_SIZE - 1];
+		return t;
+	}();
+	return table.data();
+}
+
+inline float ToneMap(float x, ToneMapOptions::Operator op) {
+	x = (x > 0) ? x : 0; // NaN も 0 にする
+	switch (op) {
+	case ToneMapOptions::REINHARD:
+		x = x / (1.0f + x);
+		break;
+	case ToneMapOptions::ACES:
+		x = (x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f);
+		break;
+	default:
+		break;
+	}
+	return (x < 1.0f) ? x : 1.0f;
+}
+
+// 0..1 の値の sRGB の符号 (8.8 固定小数点)
+inline int EncodeSrgb(float v, const uint16_t *table) {
+	uint32_t bits;
+	std::memcpy(&bits, &v, sizeof(bits));
+	if (bits < LUT_BASE_BITS) return static_cast<int>(v * LINEAR_SCALE + 0.5f);
+	return table[(bits - LUT_BASE_BITS) >> LUT_SHIFT];
+}
+
+// 画素の位置とチャンネルから決まる三角分布の揺らぎ (-255..255、8.8 固定小数点で ±1 段階)
+inline int Dither(uint32_t x, uint32_t y, uint32_t c) {
+	uint32_t h = (x * 0x9E3779B1u) ^ (y * 0x85EBCA77u) ^ (c * 0xC2B2AE3Du);
+	h ^= h >> 15;
+	h *= 0x2C1B3C6Du;
+	h ^= h >> 12;
+	return static_cast<int>(h & 0xFF) - static_cast<int>((h >> 8) & 0xFF);
+}
+
+inline int ToCode(int fixed) {
+	int code = (fixed + 128) >> 8;
+	return std::min(std::max(code, 0), 255);
+}
+
+// 1 行分。src は width * 3 の値、codes は同じ並びの 8 bit の符号。
+void ToneMapRow(const float *src, int width, int y, float scale, const ToneMapOptions &opt, const uint16_t *table, uint8_t *codes) {
+	int count = width * 3, k = 0;
+#ifdef __AVX2__
+	// 値の並び (RGBRGB...) のまま 8 個ずつ処理する。24 個 (8 画素) 毎に、各レーンの画素のずれとチャンネルは決まった並びになる。
+	static const int32_t lane_pixel[3][8] = { { 0, 0, 0, 1, 1, 1, 2, 2 }, { 2, 3, 3, 3, 4, 4, 4, 5 }, { 5, 5, 6, 6, 6, 7, 7, 7 } };
+	static const int32_t lane_channel[3][8] = { { 0, 1, 2, 0, 1, 2, 0, 1 }, { 2, 0, 1, 2, 0, 1, 2, 0 }, { 1, 2, 0, 1, 2, 0, 1, 2 } };
+	const __m256 vscale = _mm256_set1_ps(scale), zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+	const __m256i base = _mm256_set1_epi32(static_cast<int>(LUT_BASE_BITS)), mask16 = _mm256_set1_epi32(0xFFFF);
+	const __m256i c128 = _mm256_set1_epi32(128), c255 = _mm256_set1_epi32(255), zeroi = _mm256_setzero_si256();
+	const __m256i hy = _mm256_set1_epi32(static_cast<int>(static_cast<uint32_t>(y) * 0x85EBCA77u));
+	__m256i pixel[3], hc[3];
+	for (int v = 0; v < 3; ++v) {
+		pixel[v] = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(lane_pixel[v]));
+		hc[v] = _mm256_mullo_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(lane_channel[v])), _mm256_set1_epi32(static_cast<int>(0xC2B2AE3Du)));
+	}
+	for (; k + 24 <= count; k += 24) {
+		const __m256i x0 = _mm256_set1_epi32(k / 3);
+		for (int v = 0; v < 3; ++v) {
+			__m256 x = _mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(src + k + v * 8), vscale), zero);
+			if (opt.op == ToneMapOptions::REINHARD) {
+				x = _mm256_div_ps(x, _mm256_add_ps(one, x));
+			} else if (opt.op == ToneMapOptions::ACES) {
+				__m256 num = _mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.51f), x), _mm256_set1_ps(0.03f)));
+				__m256 den = _mm256_add_ps(_mm256_mul_ps(x, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.43f), x), _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f));
+				x = _mm256_div_ps(num, den);
+			}
+			x = _mm256_min_ps(x, one);
+
+			// 2^-13 未満は直線部分、それ以外は表を引く
+			__m256i bits = _mm256_castps_si256(x);
+			__m256i small = _mm256_cmpgt_epi32(base, bits);
+			__m256i idx = _mm256_andnot_si256(small, _mm256_srli_epi32(_mm256_sub_epi32(bits, base), LUT_SHIFT));
+			__m256i lut = _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int *>(table), idx, 2), mask16);
+			__m256i lin = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(LINEAR_SCALE)), _mm256_set1_ps(0.5f)));
+			__m256i fixed = _mm256_blendv_epi8(lut, lin, small);
+
+			if (opt.dither) {
+				__m256i h = _mm256_mullo_epi32(_mm256_add_epi32(x0, pixel[v]), _mm256_set1_epi32(static_cast<int>(0x9E3779B1u)));
+				h = _mm256_xor_si256(_mm256_xor_si256(h, hy), hc[v]);
+				h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+				h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x2C1B3C6D));
+				h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 12));
+				__m256i d = _mm256_sub_epi32(_mm256_and_si256(h, c255), _mm256_and_si256(_mm256_srli_epi32(h, 8), c255));
+				fixed = _mm256_add_epi32(fixed, d);
+			}
+			__m256i code = _mm256_srai_epi32(_mm256_add_epi32(fixed, c128), 8);
+			code = _mm256_min_epi32(_mm256_max_epi32(code, zeroi), c255);
+			// 8 個の 32 bit を 8 bit に詰める
+			__m256i p16 = _mm256_packus_epi32(code, code);
+			__m256i p8 = _mm256_packus_epi16(p16, p16);
+			uint32_t lo = static_cast<uint32_t>(_mm256_extract_epi32(p8, 0)), hi = static_cast<uint32_t>(_mm256_extract_epi32(p8, 4));
+			std::memcpy(codes + k + v * 8, &lo, 4);
+			std::memcpy(codes + k + v * 8 + 4, &hi, 4);
+		}
+	}
+#endif
+	for (; k < count; ++k) {
+		float x = ToneMap(src[k] * scale, opt.op);
+		int fixed = EncodeSrgb(x, table);
+		if (opt.dither) fixed += Dither(static_cast<uint32_t>(k / 3), static_cast<uint32_t>(y), static_cast<uint32_t>(k % 3));
+		codes[k] = static_cast<uint8_t>(ToCode(fixed));
+	}
+}
+
+}
+
+void ToneMapToRGB8(const float *rgb, int width, int height, const ToneMapOptions &opt, int *const *rows, TaskPool *pool) {
+	PROFILE_ZONE("tone_map");
+	const uint16_t *table = SrgbTable();
+	float scale = static_cast<float>(std::pow(2.0, opt.exposure));
+	const int ROWS = 16;
+	ParallelFor(pool, 0, (height + ROWS - 1) / ROWS, [&](int band) {
+		std::vector<uint8_t> codes(static_cast<size_t>(width) * 3);
+		int y1 = std::min((band + 1) * ROWS, height);
+		for (int y = band * ROWS; y < y1; ++y) {
+			ToneMapRow(rgb + static_cast<size_t>(y) * width * 3, width, y, scale, opt, table, codes.data());
+			int *row = rows[y];
+			for (int x = 0; x < width; ++x) {
+				const uint8_t *c = &codes[x * 3];
+				row[x] = (c[0] << 16) | (c[1] << 8) | c[2];
+			}
+		}
+	});
+}
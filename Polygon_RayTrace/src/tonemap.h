@@ -0,0 +1,37 @@
+/*
+ * Polygon_RayTrace
+ * Copylight (C) 2023 mocchi
+ * mocchi_2003@yahoo.co.jp
+ * License: Boost ver.1
+ */
+
+#ifndef TONEMAP_H_
+#define TONEMAP_H_
+
+#include <stdint.h>
+
+#include "nlohmann/json.hpp"
+
+struct TaskPool;
+
+// 8 bit 画像 (PNG 等) に書き出す時の階調の圧縮。カメラの "tone_mapping" で指定する。
+// 例: "tone_mapping": { "operator": "aces", "exposure": 0.5, "dither": true }
+struct ToneMapOptions {
+	enum Operator {
+		CLAMP,    ///< 1 を越える値は 1 にする
+		REINHARD, ///< x / (1 + x)
+		ACES      ///< ACES の近似曲線 (Narkowicz 2015)
+	};
+	Operator op;
+	double exposure; ///< 露出補正 [EV]。値に 2^exposure を掛けてから圧縮する
+	bool dither;     ///< 8 bit に丸める前に ±1 段階の三角分布の揺らぎを加え、階調の縞を目立たなくする
+	ToneMapOptions();
+	void Parse(nlohmann::json &jtm);
+};
+
+// 線形の RGB (画素毎に 3 つ並ぶ) を階調を圧縮して sRGB に符号化し、rows[y][x] に 0x00RRGGBB で書く (gd の truecolor と同じ)。
+// sRGB の符号化は表を引いて行い、AVX2 が使える時は 8 画素ずつ処理する。行の帯毎に pool で並列に処理する。
+// 揺らぎは画素の位置から決めるため、並列化の仕方によらず結果は同じ。
+void ToneMapToRGB8(const float *rgb, int width, int height, const ToneMapOptions &opt, int *const *rows, TaskPool *pool);
+
+#endif // TONEMAP_H_